@@ -1,98 +1,500 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
+#include <signal.h>
+#include <execinfo.h>
 
-#define ALLOCITEMS_SIZE 8192
-struct allocitem {
-    void *p;
+// Build with -DSLABALLOC to serve allocations from the size class slab
+// allocator in lkslab.c instead of libc.
+#ifdef SLABALLOC
+void *lk_slab_alloc(size_t size);
+void *lk_slab_realloc(void *p, size_t size);
+void lk_slab_free(void *p);
+#define alloc_bytes(size) lk_slab_alloc(size)
+#define realloc_bytes(p, size) lk_slab_realloc((p), (size))
+#define free_bytes(p) lk_slab_free(p)
+#else
+#define alloc_bytes(size) malloc(size)
+#define realloc_bytes(p, size) realloc((p), (size))
+#define free_bytes(p) free(p)
+#endif
+
+// Allocation tracker.
+// One in sample_rate allocations is recorded in a hash table keyed by
+// pointer, with its size, label and call stack. Live counts and bytes
+// are kept per label and per call stack, so a snapshot shows where
+// memory is held and a diff against the previous snapshot shows what
+// grew. A realloc of a recorded allocation stays recorded.
+//
+// The tracker's own tables use libc directly.
+
+#define STACK_DEPTH 8
+#define STACK_SKIP 2                    // record_alloc() and lk_malloc()
+#define SNAPSHOT_MAX_STACKS 20
+
+typedef struct {
     char *label;
-};
-static struct allocitem allocitems[ALLOCITEMS_SIZE];
+    unsigned long count;                // live recorded allocations
+    size_t bytes;
+    unsigned long prev_count;           // at last snapshot
+    size_t prev_bytes;
+} LabelStats;
+
+typedef struct {
+    void *frames[STACK_DEPTH];
+    int nframes;
+    unsigned int hash;
+    char *label;
+    unsigned long count;
+    size_t bytes;
+    size_t prev_bytes;
+} StackStats;
+
+typedef struct {
+    void *p;                            // NULL if empty
+    size_t size;
+    unsigned int labeli;
+    unsigned int stacki;
+} AllocEntry;
+
+// Open addressing tables, sizes are powers of 2.
+static AllocEntry *allocs = NULL;
+static size_t allocs_size = 0;
+static size_t allocs_len = 0;
+
+static LabelStats *labels = NULL;
+static unsigned int *label_slots = NULL;  // index+1 into labels, 0 if empty
+static size_t labels_len = 0;
+static size_t labels_size = 0;
+
+static StackStats *stacks = NULL;
+static unsigned int *stack_slots = NULL;
+static size_t stacks_len = 0;
+static size_t stacks_size = 0;
+
+static unsigned int sample_rate = 1;
+static unsigned int sample_countdown = 1;
+static volatile sig_atomic_t snapshot_pending = 0;
+
+static void free_tables() {
+    free(allocs);
+    free(labels);
+    free(label_slots);
+    free(stacks);
+    free(stack_slots);
+    allocs = NULL;
+    labels = NULL;
+    label_slots = NULL;
+    stacks = NULL;
+    stack_slots = NULL;
+    allocs_size = allocs_len = 0;
+    labels_size = labels_len = 0;
+    stacks_size = stacks_len = 0;
+}
 
 void lk_alloc_init() {
-    memset(allocitems, 0, sizeof(allocitems));
+    free_tables();
+    allocs_size = 1024;
+    allocs = calloc(allocs_size, sizeof(AllocEntry));
+    labels_size = 64;
+    labels = calloc(labels_size, sizeof(LabelStats));
+    label_slots = calloc(labels_size*2, sizeof(unsigned int));
+    stacks_size = 256;
+    stacks = calloc(stacks_size, sizeof(StackStats));
+    stack_slots = calloc(stacks_size*2, sizeof(unsigned int));
+    sample_countdown = sample_rate;
 }
 
-// Add p to end of allocitems[].
-static void add_p(void *p, char *label) {
-    int i;
-    for (i=0; i < ALLOCITEMS_SIZE; i++) {
-        if (allocitems[i].p == NULL) {
-            allocitems[i].p = p;
-            allocitems[i].label = label;
-            break;
+// Record one in n allocations, 1 records all.
+void lk_alloc_set_sample_rate(unsigned int n) {
+    if (n == 0) {
+        n = 1;
+    }
+    sample_rate = n;
+    sample_countdown = n;
+}
+
+static unsigned int hash_ptr(void *p) {
+    uint64_t h = ((uintptr_t) p >> 4) * 0x9e3779b97f4a7c15ull;
+    return (unsigned int) (h >> 32);
+}
+
+static unsigned int hash_str(char *s) {
+    unsigned int h = 2166136261u;
+    for (unsigned char *p = (unsigned char *) s; *p; p++) {
+        h = (h ^ *p) * 16777619u;
+    }
+    return h;
+}
+
+static unsigned int hash_frames(void **frames, int nframes) {
+    unsigned int h = 2166136261u;
+    for (int i=0; i < nframes; i++) {
+        h = (h ^ hash_ptr(frames[i])) * 16777619u;
+    }
+    return h;
+}
+
+/*** Label and stack stats ***/
+
+// Double the slot table for items, reinserting item indexes by hash.
+static unsigned int *rehash_slots(unsigned int *slots, size_t nslots, size_t nitems,
+                                  unsigned int (*item_hash)(size_t i)) {
+    free(slots);
+    slots = calloc(nslots, sizeof(unsigned int));
+    for (size_t i=0; i < nitems; i++) {
+        size_t si = item_hash(i) & (nslots-1);
+        while (slots[si] != 0) {
+            si = (si+1) & (nslots-1);
         }
+        slots[si] = i+1;
     }
-    assert(i < ALLOCITEMS_SIZE);
+    return slots;
 }
 
-// Replace matching allocitems[] p with newp.
-static void replace_p(void *p, void *newp, char *label) {
-    int i;
-    for (i=0; i < ALLOCITEMS_SIZE; i++) {
-        if (allocitems[i].p ==  p) {
-            allocitems[i].p = newp;
-            allocitems[i].label = label;
-            break;
+static unsigned int label_hash(size_t i) {
+    return hash_str(labels[i].label);
+}
+
+static unsigned int stack_hash(size_t i) {
+    return stacks[i].hash;
+}
+
+static unsigned int find_label(char *label) {
+    if (label == NULL) {
+        label = "(none)";
+    }
+    unsigned int h = hash_str(label);
+    size_t mask = labels_size*2 - 1;
+    size_t si = h & mask;
+    while (label_slots[si] != 0) {
+        unsigned int li = label_slots[si]-1;
+        if (labels[li].label == label || !strcmp(labels[li].label, label)) {
+            return li;
+        }
+        si = (si+1) & mask;
+    }
+
+    if (labels_len == labels_size) {
+        labels_size *= 2;
+        labels = realloc(labels, labels_size * sizeof(LabelStats));
+        label_slots = rehash_slots(label_slots, labels_size*2, labels_len, label_hash);
+        return find_label(label);
+    }
+    unsigned int li = labels_len;
+    memset(&labels[li], 0, sizeof(LabelStats));
+    labels[li].label = label;
+    labels_len++;
+    label_slots[si] = li+1;
+    return li;
+}
+
+static unsigned int find_stack(void **frames, int nframes, char *label) {
+    unsigned int h = hash_frames(frames, nframes);
+    size_t mask = stacks_size*2 - 1;
+    size_t si = h & mask;
+    while (stack_slots[si] != 0) {
+        StackStats *st = &stacks[stack_slots[si]-1];
+        if (st->hash == h && st->nframes == nframes &&
+            !memcmp(st->frames, frames, nframes * sizeof(void*))) {
+            return stack_slots[si]-1;
         }
+        si = (si+1) & mask;
     }
-    assert(i < ALLOCITEMS_SIZE);
+
+    if (stacks_len == stacks_size) {
+        stacks_size *= 2;
+        stacks = realloc(stacks, stacks_size * sizeof(StackStats));
+        stack_slots = rehash_slots(stack_slots, stacks_size*2, stacks_len, stack_hash);
+        return find_stack(frames, nframes, label);
+    }
+    unsigned int sti = stacks_len;
+    StackStats *st = &stacks[sti];
+    memset(st, 0, sizeof(StackStats));
+    memcpy(st->frames, frames, nframes * sizeof(void*));
+    st->nframes = nframes;
+    st->hash = h;
+    st->label = label;
+    stacks_len++;
+    stack_slots[si] = sti+1;
+    return sti;
 }
 
-// Clear matching allocitems[] p.
-static void clear_p(void *p) {
-    int i;
-    for (i=0; i < ALLOCITEMS_SIZE; i++) {
-        if (allocitems[i].p == p) {
-            allocitems[i].p = NULL;
-            allocitems[i].label = NULL;
+/*** Allocation table ***/
+
+static AllocEntry *find_alloc(void *p) {
+    size_t mask = allocs_size-1;
+    size_t i = hash_ptr(p) & mask;
+    while (allocs[i].p != NULL) {
+        if (allocs[i].p == p) {
+            return &allocs[i];
+        }
+        i = (i+1) & mask;
+    }
+    return NULL;
+}
+
+static void insert_alloc(AllocEntry *e) {
+    size_t mask = allocs_size-1;
+    size_t i = hash_ptr(e->p) & mask;
+    while (allocs[i].p != NULL) {
+        i = (i+1) & mask;
+    }
+    allocs[i] = *e;
+    allocs_len++;
+}
+
+// Remove entry, shifting back later entries of the probe run so lookups
+// don't need tombstones.
+static void remove_alloc(AllocEntry *e) {
+    size_t mask = allocs_size-1;
+    size_t i = e - allocs;
+    size_t j = i;
+    while (1) {
+        j = (j+1) & mask;
+        if (allocs[j].p == NULL) {
             break;
         }
+        size_t k = hash_ptr(allocs[j].p) & mask;
+        // Move j back to i unless its home slot k lies in (i, j].
+        if ((i < j) ? (k <= i || k > j) : (k <= i && k > j)) {
+            allocs[i] = allocs[j];
+            i = j;
+        }
     }
-    if (i >= ALLOCITEMS_SIZE) {
-        printf("clear_p i: %d\n", i);
+    allocs[i].p = NULL;
+    allocs_len--;
+}
+
+static void grow_allocs() {
+    AllocEntry *old = allocs;
+    size_t old_size = allocs_size;
+    allocs_size *= 2;
+    allocs = calloc(allocs_size, sizeof(AllocEntry));
+    allocs_len = 0;
+    for (size_t i=0; i < old_size; i++) {
+        if (old[i].p != NULL) {
+            insert_alloc(&old[i]);
+        }
+    }
+    free(old);
+}
+
+static void add_entry(void *p, size_t size, unsigned int labeli, unsigned int stacki) {
+    if ((allocs_len+1)*2 > allocs_size) {
+        grow_allocs();
     }
-    assert(i < ALLOCITEMS_SIZE);
+    AllocEntry e = {p, size, labeli, stacki};
+    insert_alloc(&e);
+    labels[labeli].count++;
+    labels[labeli].bytes += size;
+    stacks[stacki].count++;
+    stacks[stacki].bytes += size;
+}
+
+static void remove_entry(AllocEntry *e) {
+    labels[e->labeli].count--;
+    labels[e->labeli].bytes -= e->size;
+    stacks[e->stacki].count--;
+    stacks[e->stacki].bytes -= e->size;
+    remove_alloc(e);
+}
+
+static int sample() {
+    if (--sample_countdown > 0) {
+        return 0;
+    }
+    sample_countdown = sample_rate;
+    return 1;
+}
+
+static void record_alloc(void *p, size_t size, char *label) {
+    if (p == NULL || allocs == NULL) {
+        return;
+    }
+    void *frames[STACK_DEPTH+STACK_SKIP];
+    int nframes = backtrace(frames, STACK_DEPTH+STACK_SKIP) - STACK_SKIP;
+    if (nframes < 0) {
+        nframes = 0;
+    }
+    unsigned int labeli = find_label(label);
+    unsigned int stacki = find_stack(frames+STACK_SKIP, nframes, labels[labeli].label);
+    add_entry(p, size, labeli, stacki);
 }
 
 void *lk_malloc(size_t size, char *label) {
-    void *p = malloc(size);
-    add_p(p, label);
+    void *p = alloc_bytes(size);
+    if (sample()) {
+        record_alloc(p, size, label);
+    }
     return p;
 }
 
 void *lk_realloc(void *p, size_t size, char *label) {
-    void *newp = realloc(p, size);
-    replace_p(p, newp, label);
+    if (p == NULL) {
+        void *newp = realloc_bytes(NULL, size);
+        if (sample()) {
+            record_alloc(newp, size, label);
+        }
+        return newp;
+    }
+
+    // Detach a recorded entry before realloc frees p.
+    AllocEntry e = {NULL, 0, 0, 0};
+    if (allocs != NULL) {
+        AllocEntry *pe = find_alloc(p);
+        if (pe != NULL) {
+            e = *pe;
+            remove_entry(pe);
+        }
+    }
+    void *newp = realloc_bytes(p, size);
+    if (e.p == NULL) {
+        return newp;
+    }
+    // Keep recording under the original stack with the new label, or
+    // under p with its old size if realloc failed.
+    if (newp == NULL) {
+        add_entry(e.p, e.size, e.labeli, e.stacki);
+        return NULL;
+    }
+    add_entry(newp, size, find_label(label), e.stacki);
     return newp;
 }
 
 void lk_free(void *p) {
-    clear_p(p);
-    free(p);
+    if (p != NULL && allocs != NULL) {
+        AllocEntry *e = find_alloc(p);
+        if (e != NULL) {
+            remove_entry(e);
+        }
+    }
+    free_bytes(p);
 }
 
-char *lk_strdup(const char *s, char *label) {
-    char *sdup = strdup(s);
-    add_p(sdup, label);
+char *lk_strndup(const char *s, size_t n, char *label) {
+    size_t len = strnlen(s, n);
+    char *sdup = alloc_bytes(len+1);
+    memcpy(sdup, s, len);
+    sdup[len] = '\0';
+    if (sample()) {
+        record_alloc(sdup, len+1, label);
+    }
     return sdup;
 }
 
-char *lk_strndup(const char *s, size_t n, char *label) {
-    char *sdup = strndup(s, n);
-    add_p(sdup, label);
-    return sdup;
+char *lk_strdup(const char *s, char *label) {
+    return lk_strndup(s, strlen(s), label);
 }
 
+// Get live recorded count and bytes of allocations with label.
+void lk_alloc_label_stats(char *label, unsigned long *count, size_t *bytes) {
+    *count = 0;
+    *bytes = 0;
+    for (size_t i=0; i < labels_len; i++) {
+        if (!strcmp(labels[i].label, label)) {
+            *count = labels[i].count;
+            *bytes = labels[i].bytes;
+            return;
+        }
+    }
+}
+
+// Print labels of live recorded allocations.
 void lk_print_allocitems() {
     printf("allocitems[] labels:\n");
-    for (int i=0; i < ALLOCITEMS_SIZE; i++) {
-        if (allocitems[i].p != NULL) {
-            printf("%s\n", allocitems[i].label);
+    for (size_t i=0; i < labels_len; i++) {
+        for (unsigned long n=0; n < labels[i].count; n++) {
+            printf("%s\n", labels[i].label);
         }
     }
 }
 
+/*** Snapshots ***/
+
+// Ask for a snapshot to be printed by the main loop.
+// Safe to call from a signal handler.
+void lk_alloc_request_snapshot() {
+    snapshot_pending = 1;
+}
+
+int lk_alloc_snapshot_pending() {
+    return snapshot_pending;
+}
+
+static int compare_label_bytes(const void *a, const void *b) {
+    const LabelStats *la = *(const LabelStats **) a;
+    const LabelStats *lb = *(const LabelStats **) b;
+    if (la->bytes == lb->bytes) {
+        return 0;
+    }
+    return la->bytes < lb->bytes ? 1 : -1;
+}
+
+static int compare_stack_bytes(const void *a, const void *b) {
+    const StackStats *sa = *(const StackStats **) a;
+    const StackStats *sb = *(const StackStats **) b;
+    if (sa->bytes == sb->bytes) {
+        return 0;
+    }
+    return sa->bytes < sb->bytes ? 1 : -1;
+}
+
+// Print live allocations per label and the top call stacks by live bytes,
+// with the change since the previous snapshot. Sampled counts are scaled
+// up by the sample rate.
+void lk_alloc_print_snapshot(FILE *f) {
+    snapshot_pending = 0;
+    if (allocs == NULL) {
+        return;
+    }
+    unsigned long r = sample_rate;
+
+    fprintf(f, "--- Allocation snapshot (sample rate 1/%u) ---\n", sample_rate);
+    fprintf(f, "%12s %12s %10s  %s\n", "bytes", "+bytes", "count", "label");
+    LabelStats **ls = malloc(labels_len * sizeof(LabelStats *));
+    for (size_t i=0; i < labels_len; i++) {
+        ls[i] = &labels[i];
+    }
+    qsort(ls, labels_len, sizeof(LabelStats *), compare_label_bytes);
+    for (size_t i=0; i < labels_len; i++) {
+        LabelStats *l = ls[i];
+        if (l->count == 0 && l->prev_count == 0) {
+            continue;
+        }
+        fprintf(f, "%12zu %+12ld %10lu  %s\n", l->bytes*r,
+                (long) (l->bytes - l->prev_bytes) * (long) r, l->count*r, l->label);
+        l->prev_count = l->count;
+        l->prev_bytes = l->bytes;
+    }
+    free(ls);
+
+    StackStats **ss = malloc(stacks_len * sizeof(StackStats *));
+    for (size_t i=0; i < stacks_len; i++) {
+        ss[i] = &stacks[i];
+    }
+    qsort(ss, stacks_len, sizeof(StackStats *), compare_stack_bytes);
+    for (size_t i=0; i < stacks_len && i < SNAPSHOT_MAX_STACKS; i++) {
+        StackStats *st = ss[i];
+        if (st->count == 0) {
+            break;
+        }
+        fprintf(f, "\n%zu bytes (%+ld) in %lu allocations, %s:\n", st->bytes*r,
+                (long) (st->bytes - st->prev_bytes) * (long) r, st->count*r, st->label);
+        char **syms = backtrace_symbols(st->frames, st->nframes);
+        for (int j=0; j < st->nframes; j++) {
+            fprintf(f, "    %s\n", syms ? syms[j] : "?");
+        }
+        free(syms);
+    }
+    for (size_t i=0; i < stacks_len; i++) {
+        stacks[i].prev_bytes = stacks[i].bytes;
+    }
+    free(ss);
+    fprintf(f, "---\n");
+    fflush(f);
+}
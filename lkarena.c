@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include "lklib.h"
+
+// Bump allocator for objects that share a lifetime, such as everything
+// belonging to one client connection. Allocations are carved out of
+// blocks in order and are never freed one by one, the whole arena is
+// freed or reset at once.
+//
+// The first block is allocated together with the arena struct so a small
+// arena costs a single lk_malloc(). Blocks are kept in one list: newer
+// blocks from head down to first, then oversized blocks after first.
+
+#define LK_ARENA_ALIGN 16
+
+static LKArenaBlock *block_new(size_t size) {
+    LKArenaBlock *block = lk_malloc(sizeof(LKArenaBlock) + size, "lk_arena_block");
+    if (block == NULL) {
+        // Give back pooled memory and retry.
+        lk_arenapool_clear();
+        lk_bufpool_clear();
+        block = lk_malloc(sizeof(LKArenaBlock) + size, "lk_arena_block");
+    }
+    assert(block != NULL);
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+LKArena *lk_arena_new(size_t block_size) {
+    if (block_size == 0) {
+        block_size = LK_ARENA_BLOCK_SIZE;
+    }
+    LKArena *arena = lk_malloc(sizeof(LKArena) + sizeof(LKArenaBlock) + block_size, "lk_arena_new");
+    arena->block_size = block_size;
+    arena->first = (LKArenaBlock *) (arena+1);
+    arena->first->next = NULL;
+    arena->first->size = block_size;
+    arena->first->used = 0;
+    arena->head = arena->first;
+    return arena;
+}
+
+// Free blocks after the first one.
+static void free_blocks(LKArena *arena) {
+    LKArenaBlock *block = arena->head;
+    while (block != arena->first) {
+        LKArenaBlock *next = block->next;
+        lk_free(block);
+        block = next;
+    }
+    block = arena->first->next;
+    while (block != NULL) {
+        LKArenaBlock *next = block->next;
+        lk_free(block);
+        block = next;
+    }
+    arena->first->next = NULL;
+}
+
+void lk_arena_free(LKArena *arena) {
+    free_blocks(arena);
+    lk_free(arena);
+}
+
+// Release all allocations, keeping the first block for reuse.
+void lk_arena_reset(LKArena *arena) {
+    free_blocks(arena);
+    arena->first->used = 0;
+    arena->head = arena->first;
+}
+
+// Return size bytes from block, or NULL if it doesn't have room.
+static void *block_alloc(LKArenaBlock *block, size_t size) {
+    uintptr_t p = (uintptr_t) (block->data + block->used);
+    size_t pad = (LK_ARENA_ALIGN - (p & (LK_ARENA_ALIGN-1))) & (LK_ARENA_ALIGN-1);
+    if (pad + size > block->size - block->used) {
+        return NULL;
+    }
+    block->used += pad + size;
+    return (void *) (p + pad);
+}
+
+// Allocate size bytes aligned for any type. Memory isn't zeroed.
+void *lk_arena_alloc(LKArena *arena, size_t size) {
+    void *p = block_alloc(arena->head, size);
+    if (p != NULL) {
+        return p;
+    }
+
+    // Allocations larger than a block get a block of their own, linked
+    // behind the head so the head's free space can still be used.
+    if (size + LK_ARENA_ALIGN > arena->block_size) {
+        LKArenaBlock *block = block_new(size + LK_ARENA_ALIGN);
+        block->next = arena->first->next;
+        arena->first->next = block;
+        return block_alloc(block, size);
+    }
+
+    LKArenaBlock *block = block_new(arena->block_size);
+    block->next = arena->head;
+    arena->head = block;
+    return block_alloc(block, size);
+}
+
+// Copy n bytes of s into arena and null terminate.
+char *lk_arena_strndup(LKArena *arena, char *s, size_t n) {
+    char *dup = lk_arena_alloc(arena, n+1);
+    memcpy(dup, s, n);
+    dup[n] = '\0';
+    return dup;
+}
+
+
+/*** Arena pool ***/
+
+static LKPool *arenapool = NULL;
+
+static void arenapool_free_item(void *p) {
+    lk_arena_free(p);
+}
+
+LKArena *lk_arenapool_get() {
+    LKArena *arena = NULL;
+    if (arenapool != NULL) {
+        arena = lk_pool_get(arenapool);
+    }
+    if (arena == NULL) {
+        arena = lk_arena_new(0);
+    }
+    return arena;
+}
+
+// Reset and recycle arena, only its first block is kept.
+void lk_arenapool_put(LKArena *arena) {
+    if (arena->block_size != LK_ARENA_BLOCK_SIZE) {
+        lk_arena_free(arena);
+        return;
+    }
+    if (arenapool == NULL) {
+        arenapool = lk_pool_new(LK_ARENAPOOL_MAX, arenapool_free_item);
+    }
+    lk_arena_reset(arena);
+    lk_pool_put(arenapool, arena);
+}
+
+// Free pooled arenas not used since the last trim.
+void lk_arenapool_trim() {
+    if (arenapool != NULL) {
+        lk_pool_trim(arenapool);
+    }
+}
+
+void lk_arenapool_clear() {
+    if (arenapool != NULL) {
+        lk_pool_free(arenapool);
+        arenapool = NULL;
+    }
+}
@@ -33,8 +33,8 @@ void lk_buffer_resize(LKBuffer *buf, size_t bytes_size) {
     if (buf->bytes_len > buf->bytes_size) {
         buf->bytes_len = buf->bytes_size;
     }
-    if (buf->bytes_cur >= buf->bytes_len) {
-        buf->bytes_cur = buf->bytes_len-1;
+    if (buf->bytes_cur > buf->bytes_len) {
+        buf->bytes_cur = buf->bytes_len;
     }
     buf->bytes = lk_realloc(buf->bytes, buf->bytes_size, "lk_buffer_resize");
 }
@@ -45,20 +45,50 @@ void lk_buffer_clear(LKBuffer *buf) {
     buf->bytes_cur = 0;
 }
 
-int lk_buffer_append(LKBuffer *buf, char *bytes, size_t len) {
-    // If not enough capacity to append bytes, expand the bytes buffer.
+static char *expand(LKBuffer *buf, size_t bytes_size) {
+    char *bs = lk_realloc(buf->bytes, bytes_size, "lk_buffer_reserve");
+    if (bs == NULL) {
+        // Give back pooled memory and retry.
+        lk_bufpool_clear();
+        lk_arenapool_clear();
+        bs = lk_realloc(buf->bytes, bytes_size, "lk_buffer_reserve");
+    }
+    return bs;
+}
+
+// Make room for at least len more bytes after bytes_len.
+// Capacity at least doubles when expanded so repeated appends are
+// amortized. Returns pointer to the free space, or NULL if out of memory.
+// Bytes written there are added with lk_buffer_commit().
+char *lk_buffer_reserve(LKBuffer *buf, size_t len) {
     if (len > buf->bytes_size - buf->bytes_len) {
-        char *bs = lk_realloc(buf->bytes, buf->bytes_size + len, "lk_buffer_append");
+        size_t bytes_size = buf->bytes_size * 2;
+        if (bytes_size < buf->bytes_len + len) {
+            bytes_size = buf->bytes_len + len;
+        }
+        char *bs = expand(buf, bytes_size);
         if (bs == NULL) {
-            return -1;
+            return NULL;
         }
         buf->bytes = bs;
-        buf->bytes_size += len;
+        buf->bytes_size = bytes_size;
     }
-    memcpy(buf->bytes + buf->bytes_len, bytes, len);
+    return buf->bytes + buf->bytes_len;
+}
+
+// Add len bytes written to the space returned by lk_buffer_reserve().
+void lk_buffer_commit(LKBuffer *buf, size_t len) {
+    assert(buf->bytes_len + len <= buf->bytes_size);
     buf->bytes_len += len;
+}
 
-    assert(buf->bytes != NULL);
+int lk_buffer_append(LKBuffer *buf, char *bytes, size_t len) {
+    char *p = lk_buffer_reserve(buf, len);
+    if (p == NULL) {
+        return -1;
+    }
+    memcpy(p, bytes, len);
+    buf->bytes_len += len;
     return 0;
 }
 
@@ -101,22 +131,283 @@ void lk_buffer_append_sprintf(LKBuffer *buf, const char *fmt, ...) {
 size_t lk_buffer_readline(LKBuffer *buf, char *dst, size_t dst_len) {
     assert(dst_len > 2); // Reserve space for \n and \0.
 
+    // Copy up to and including '\n', leaving space for null terminator.
     size_t nread = 0;
-    while (nread < dst_len-1) { // leave space for null terminator
-        if (buf->bytes_cur >= buf->bytes_len) {
-            break;
-        }
-        dst[nread] = buf->bytes[buf->bytes_cur];
-        nread++;
-        buf->bytes_cur++;
-
-        if (dst[nread-1] == '\n') {
-            break;
-        }
+    if (buf->bytes_cur < buf->bytes_len) {
+        nread = buf->bytes_len - buf->bytes_cur;
     }
+    if (nread > dst_len-1) {
+        nread = dst_len-1;
+    }
+    char *nl = lk_scan_char(buf->bytes + buf->bytes_cur, nread, '\n');
+    if (nl != NULL) {
+        nread = nl - (buf->bytes + buf->bytes_cur) + 1;
+    }
+    memcpy(dst, buf->bytes + buf->bytes_cur, nread);
+    buf->bytes_cur += nread;
 
     assert(nread <= dst_len-1);
     dst[nread] = '\0';
     return nread;
 }
 
+
+/*** LKBuffer pool ***/
+
+static LKPool *bufpool = NULL;
+
+static void bufpool_free_item(void *p) {
+    lk_buffer_free(p);
+}
+
+LKBuffer *lk_bufpool_get() {
+    LKBuffer *buf = NULL;
+    if (bufpool != NULL) {
+        buf = lk_pool_get(bufpool);
+    }
+    if (buf == NULL) {
+        buf = lk_buffer_new(LK_BUFPOOL_BUF_SIZE);
+    }
+    return buf;
+}
+
+// Recycle buf, any buffer can be put back.
+void lk_bufpool_put(LKBuffer *buf) {
+    if (buf->bytes_size < LK_BUFPOOL_BUF_SIZE || buf->bytes_size > LK_BUFPOOL_MAX_BUF_SIZE) {
+        lk_buffer_free(buf);
+        return;
+    }
+    if (bufpool == NULL) {
+        bufpool = lk_pool_new(LK_BUFPOOL_MAX, bufpool_free_item);
+    }
+    buf->bytes_len = 0;
+    buf->bytes_cur = 0;
+    lk_pool_put(bufpool, buf);
+}
+
+// Free pooled buffers not used since the last trim.
+void lk_bufpool_trim() {
+    if (bufpool != NULL) {
+        lk_pool_trim(bufpool);
+    }
+}
+
+void lk_bufpool_clear() {
+    if (bufpool != NULL) {
+        lk_pool_free(bufpool);
+        bufpool = NULL;
+    }
+}
+
+
+/*** LKRefBuffer functions ***/
+
+LKRefBuffer *lk_refbuffer_new(size_t bytes_size) {
+    LKRefBuffer *rb = lk_malloc(sizeof(LKRefBuffer), "lk_refbuffer_new");
+    rb->buf = lk_buffer_new(bytes_size);
+    rb->refcount = 1;
+    return rb;
+}
+
+LKRefBuffer *lk_refbuffer_ref(LKRefBuffer *rb) {
+    rb->refcount++;
+    return rb;
+}
+
+void lk_refbuffer_unref(LKRefBuffer *rb) {
+    assert(rb->refcount > 0);
+    rb->refcount--;
+    if (rb->refcount > 0) {
+        return;
+    }
+    lk_buffer_free(rb->buf);
+    rb->buf = NULL;
+    lk_free(rb);
+}
+
+
+/*** LKBufChain functions ***/
+
+#define N_GROW_SLICES 8
+
+LKBufChain *lk_bufchain_new() {
+    LKBufChain *bc = lk_malloc(sizeof(LKBufChain), "lk_bufchain_new");
+    bc->slices_size = N_GROW_SLICES;
+    bc->slices_len = 0;
+    bc->slices = lk_malloc(bc->slices_size * sizeof(LKBufSlice), "lk_bufchain_new_slices");
+    bc->len = 0;
+    return bc;
+}
+
+void lk_bufchain_free(LKBufChain *bc) {
+    lk_bufchain_clear(bc);
+    lk_free(bc->slices);
+    bc->slices = NULL;
+    lk_free(bc);
+}
+
+// Remove all slices, releasing their segments.
+void lk_bufchain_clear(LKBufChain *bc) {
+    for (size_t i=0; i < bc->slices_len; i++) {
+        lk_refbuffer_unref(bc->slices[i].seg);
+    }
+    bc->slices_len = 0;
+    bc->len = 0;
+}
+
+static void reserve_slices(LKBufChain *bc, size_t n) {
+    if (bc->slices_len + n <= bc->slices_size) {
+        return;
+    }
+    while (bc->slices_len + n > bc->slices_size) {
+        bc->slices_size *= 2;
+    }
+    bc->slices = lk_realloc(bc->slices, bc->slices_size * sizeof(LKBufSlice), "lk_bufchain_slices");
+}
+
+// Append slice, taking over the caller's segment reference.
+static void push_slice(LKBufChain *bc, LKRefBuffer *seg, size_t off, size_t len) {
+    reserve_slices(bc, 1);
+    LKBufSlice *slice = &bc->slices[bc->slices_len];
+    slice->seg = seg;
+    slice->off = off;
+    slice->len = len;
+    bc->slices_len++;
+    bc->len += len;
+}
+
+// Return free bytes after the last slice that can be appended to.
+// The segment bytes after the last slice aren't in any other slice if the
+// last slice ends at the segment's bytes_len.
+// A new segment is added if there's no free space.
+char *lk_bufchain_tail_space(LKBufChain *bc, size_t *space) {
+    if (bc->slices_len > 0) {
+        LKBufSlice *tail = &bc->slices[bc->slices_len-1];
+        LKBuffer *buf = tail->seg->buf;
+        if (tail->off + tail->len == buf->bytes_len && buf->bytes_len < buf->bytes_size) {
+            *space = buf->bytes_size - buf->bytes_len;
+            return buf->bytes + buf->bytes_len;
+        }
+    }
+    LKRefBuffer *seg = lk_refbuffer_new(LK_BUFSEG_SIZE);
+    push_slice(bc, seg, 0, 0);
+    *space = LK_BUFSEG_SIZE;
+    return seg->buf->bytes;
+}
+
+// Add len bytes written to the space returned by lk_bufchain_tail_space().
+void lk_bufchain_tail_commit(LKBufChain *bc, size_t len) {
+    assert(bc->slices_len > 0);
+    LKBufSlice *tail = &bc->slices[bc->slices_len-1];
+    LKBuffer *buf = tail->seg->buf;
+    assert(buf->bytes_len + len <= buf->bytes_size);
+    buf->bytes_len += len;
+    tail->len += len;
+    bc->len += len;
+}
+
+void lk_bufchain_append(LKBufChain *bc, char *bytes, size_t len) {
+    while (len > 0) {
+        size_t space;
+        char *p = lk_bufchain_tail_space(bc, &space);
+        size_t n = len < space ? len : space;
+        memcpy(p, bytes, n);
+        lk_bufchain_tail_commit(bc, n);
+        bytes += n;
+        len -= n;
+    }
+}
+
+// Append unsent buf bytes from bytes_cur without copying.
+// The chain takes ownership of buf.
+void lk_bufchain_append_buffer(LKBufChain *bc, LKBuffer *buf) {
+    LKRefBuffer *seg = lk_malloc(sizeof(LKRefBuffer), "lk_bufchain_append_buffer");
+    seg->buf = buf;
+    seg->refcount = 1;
+    if (buf->bytes_cur == buf->bytes_len) {
+        lk_refbuffer_unref(seg);
+        return;
+    }
+    push_slice(bc, seg, buf->bytes_cur, buf->bytes_len - buf->bytes_cur);
+}
+
+// Append len bytes of src starting at off to dst.
+// Segments are shared, src is unchanged.
+void lk_bufchain_slice(LKBufChain *dst, LKBufChain *src, size_t off, size_t len) {
+    assert(off + len <= src->len);
+    for (size_t i=0; i < src->slices_len && len > 0; i++) {
+        LKBufSlice *slice = &src->slices[i];
+        if (off >= slice->len) {
+            off -= slice->len;
+            continue;
+        }
+        size_t n = slice->len - off;
+        if (n > len) {
+            n = len;
+        }
+        push_slice(dst, lk_refbuffer_ref(slice->seg), slice->off + off, n);
+        len -= n;
+        off = 0;
+    }
+}
+
+// Move all src slices to the end of dst, src is left empty.
+void lk_bufchain_splice(LKBufChain *dst, LKBufChain *src) {
+    reserve_slices(dst, src->slices_len);
+    memcpy(dst->slices + dst->slices_len, src->slices, src->slices_len * sizeof(LKBufSlice));
+    dst->slices_len += src->slices_len;
+    dst->len += src->len;
+    src->slices_len = 0;
+    src->len = 0;
+}
+
+// Move all src slices to the start of dst, src is left empty.
+// Ex. prepend a response head to its body.
+void lk_bufchain_prepend(LKBufChain *dst, LKBufChain *src) {
+    reserve_slices(dst, src->slices_len);
+    memmove(dst->slices + src->slices_len, dst->slices, dst->slices_len * sizeof(LKBufSlice));
+    memcpy(dst->slices, src->slices, src->slices_len * sizeof(LKBufSlice));
+    dst->slices_len += src->slices_len;
+    dst->len += src->len;
+    src->slices_len = 0;
+    src->len = 0;
+}
+
+// Remove len bytes from the start of the chain, such as after they
+// are written. Segments no longer in any slice are freed.
+void lk_bufchain_consume(LKBufChain *bc, size_t len) {
+    assert(len <= bc->len);
+    size_t nremove = 0;
+    bc->len -= len;
+    while (len > 0) {
+        LKBufSlice *slice = &bc->slices[nremove];
+        if (len < slice->len) {
+            slice->off += len;
+            slice->len -= len;
+            break;
+        }
+        len -= slice->len;
+        lk_refbuffer_unref(slice->seg);
+        nremove++;
+    }
+    if (nremove > 0) {
+        bc->slices_len -= nremove;
+        memmove(bc->slices, bc->slices + nremove, bc->slices_len * sizeof(LKBufSlice));
+    }
+}
+
+// Fill iov with up to iov_max slices for writev().
+// Returns number of iov entries set.
+int lk_bufchain_iovec(LKBufChain *bc, struct iovec *iov, int iov_max) {
+    int n = 0;
+    for (size_t i=0; i < bc->slices_len && n < iov_max; i++) {
+        LKBufSlice *slice = &bc->slices[i];
+        if (slice->len == 0) {
+            continue;
+        }
+        iov[n].iov_base = slice->seg->buf->bytes + slice->off;
+        iov[n].iov_len = slice->len;
+        n++;
+    }
+    return n;
+}
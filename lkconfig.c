@@ -6,33 +6,54 @@
 #include <errno.h>
 #include <assert.h>
 #include <limits.h>
+#include <stdint.h>
 #include "lklib.h"
 #include "lknet.h"
 
 #define HOSTCONFIGS_INITIAL_SIZE 10
 
+// Error statuses with pre-rendered responses.
+static int lk_status_page_codes[LK_N_STATUS_PAGES] = {
+    400, 403, 404, 405, 408, 413, 417, 431, 500, 501, 502, 503
+};
+
+static void render_status_pages(LKStatusPage **pages, LKHostConfig *hc);
+static void free_status_pages(LKStatusPage **pages);
+
 LKConfig *lk_config_new() {
     LKConfig *cfg = lk_malloc(sizeof(LKConfig), "lk_config_new");
     cfg->serverhost = lk_string_new("");
     cfg->port = lk_string_new("");
+    cfg->tls_port = lk_string_new("");
+#ifdef LKTLS
+    cfg->tls_ctx = NULL;
+#endif
     cfg->hostconfigs = lk_malloc(sizeof(LKHostConfig*) * HOSTCONFIGS_INITIAL_SIZE, "lk_config_new_hostconfigs");
     cfg->hostconfigs_len = 0;
     cfg->hostconfigs_size = HOSTCONFIGS_INITIAL_SIZE;
+    cfg->max_request_line = LK_MAX_REQUEST_LINE;
+    cfg->max_header_size = LK_MAX_HEAD_SIZE;
+    cfg->max_headers = LK_MAX_HEADERS;
+    cfg->header_timeout = LK_HEADER_TIMEOUT;
+    memset(cfg->status_pages, 0, sizeof(cfg->status_pages));
     return cfg;
 }
 
 void lk_config_free(LKConfig *cfg) {
     lk_string_free(cfg->serverhost);
     lk_string_free(cfg->port);
+    lk_string_free(cfg->tls_port);
     for (int i=0; i < cfg->hostconfigs_len; i++) {
         LKHostConfig *hc = cfg->hostconfigs[i];
         lk_hostconfig_free(hc);
     }
     memset(cfg->hostconfigs, 0, sizeof(LKHostConfig*) * cfg->hostconfigs_size);
     lk_free(cfg->hostconfigs);
+    free_status_pages(cfg->status_pages);
 
     cfg->serverhost = NULL;
     cfg->port = NULL;
+    cfg->tls_port = NULL;
     cfg->hostconfigs = NULL;
     
     lk_free(cfg);
@@ -41,12 +62,22 @@ void lk_config_free(LKConfig *cfg) {
 
 #define CONFIG_LINE_SIZE 255
 
+static void split_kv(LKStrView l, LKStrView *k, LKString *v);
+static void assign_next_token(LKSplitIter *it, LKString *v);
+static int parse_size(char *s, size_t *size);
+static int parse_uint(char *s, unsigned int *n);
+
 // Read config file and set config structure.
 //
 // Config file format:
 // -------------------
 //    serverhost=127.0.0.1
 //    port=5000
+//    tls_port=5443
+//    max_request_line=8K
+//    max_header_size=32K
+//    max_headers=100
+//    header_timeout=30
 //
 //    # Matches all other hostnames
 //    hostname *
@@ -61,15 +92,25 @@ void lk_config_free(LKConfig *cfg) {
 //    hostname littlekitten.xyz
 //    homedir=/var/www/testsite
 //    cgidir=cgi-bin
+//    tls_cert=/etc/lkws/littlekitten.xyz.pem
+//    tls_key=/etc/lkws/littlekitten.xyz.key
 //    alias latest=latest.html
 //    alias about=about.html
 //    alias guestbook=cgi-bin/guestbook.pl
 //    alias blog=cgi-bin/blog.pl
+//    max_body_size=10M
 //
 //    # http://newsboard.littlekitten.xyz
 //    hostname newsboard.littlekitten.xyz
 //    proxyhost=localhost:8001
 //
+//    # http://live.littlekitten.xyz
+//    hostname live.littlekitten.xyz
+//    homedir=/var/www/testsite
+//    ssepath=/events
+//    ssesecret=change-me
+//    errorpage 404=errors/404.html
+//
 // Format description:
 // The host and port number is defined first, followed by one or more
 // host config sections. The host config section always starts with the
@@ -87,8 +128,8 @@ int lk_config_read_configfile(LKConfig *cfg, char *configfile) {
 
     char line[CONFIG_LINE_SIZE];
     ParseCfgState state = CFG_ROOT;
-    LKString *l = lk_string_new("");
-    LKString *k = lk_string_new("");
+    LKSplitIter it;
+    LKStrView l, k, aliask_sv;
     LKString *v = lk_string_new("");
     LKString *aliask = lk_string_new("");
     LKString *aliasv = lk_string_new("");
@@ -99,18 +140,21 @@ int lk_config_read_configfile(LKConfig *cfg, char *configfile) {
         if (pz == NULL) {
             break;
         }
-        lk_string_assign(l, line);
-        lk_string_trim(l);
+        l = lk_sv_trim(lk_sv(line));
 
         // Skip # comment line.
-        if (lk_string_starts_with(l, "#")) {
+        if (lk_sv_starts_with(l, "#")) {
             continue;
         }
 
         // hostname littlekitten.xyz
-        lk_string_split_assign(l, " ", k, v); // l:"k v", assign k and v
-        if (lk_string_sz_equal(k, "hostname")) {
+        lk_split_init(&it, l, " ");
+        if (!lk_split_next_token(&it, &k)) {
+            continue;
+        }
+        if (lk_sv_equal(k, "hostname")) {
             // hostname littlekitten.xyz
+            assign_next_token(&it, v);
             hc = lk_config_create_get_hostconfig(cfg, v->s);
             state = CFG_HOSTSECTION;
             continue;
@@ -121,13 +165,41 @@ int lk_config_read_configfile(LKConfig *cfg, char *configfile) {
 
             // serverhost=127.0.0.1
             // port=8000
-            lk_string_split_assign(l, "=", k, v); // l:"k=v", assign k and v
-            if (lk_string_sz_equal(k, "serverhost")) {
+            // tls_port=8443
+            // max_request_line=8K
+            // max_header_size=32K
+            // max_headers=100
+            // header_timeout=30
+            split_kv(l, &k, v); // l:"k=v", assign k and v
+            if (lk_sv_equal(k, "serverhost")) {
                 lk_string_assign(cfg->serverhost, v->s);
                 continue;
-            } else if (lk_string_sz_equal(k, "port")) {
+            } else if (lk_sv_equal(k, "port")) {
                 lk_string_assign(cfg->port, v->s);
                 continue;
+            } else if (lk_sv_equal(k, "tls_port")) {
+                lk_string_assign(cfg->tls_port, v->s);
+                continue;
+            } else if (lk_sv_equal(k, "max_request_line")) {
+                if (parse_size(v->s, &cfg->max_request_line) == -1) {
+                    fprintf(stderr, "Invalid max_request_line '%s'\n", v->s);
+                }
+                continue;
+            } else if (lk_sv_equal(k, "max_header_size")) {
+                if (parse_size(v->s, &cfg->max_header_size) == -1) {
+                    fprintf(stderr, "Invalid max_header_size '%s'\n", v->s);
+                }
+                continue;
+            } else if (lk_sv_equal(k, "max_headers")) {
+                if (parse_uint(v->s, &cfg->max_headers) == -1) {
+                    fprintf(stderr, "Invalid max_headers '%s'\n", v->s);
+                }
+                continue;
+            } else if (lk_sv_equal(k, "header_timeout")) {
+                if (parse_uint(v->s, &cfg->header_timeout) == -1) {
+                    fprintf(stderr, "Invalid header_timeout '%s'\n", v->s);
+                }
+                continue;
             }
             continue;
         }
@@ -137,21 +209,49 @@ int lk_config_read_configfile(LKConfig *cfg, char *configfile) {
             // homedir=testsite
             // cgidir=cgi-bin
             // proxyhost=localhost:8001
-            lk_string_split_assign(l, "=", k, v);
-            if (lk_string_sz_equal(k, "homedir")) {
+            // ssepath=/events
+            // ssesecret=change-me
+            // tls_cert=site.pem
+            // tls_key=site.key
+            // max_body_size=10M
+            split_kv(l, &k, v);
+            if (lk_sv_equal(k, "homedir")) {
                 lk_string_assign(hc->homedir, v->s);
                 continue;
-            } else if (lk_string_sz_equal(k, "cgidir")) {
+            } else if (lk_sv_equal(k, "cgidir")) {
                 lk_string_assign(hc->cgidir, v->s);
                 continue;
-            } else if (lk_string_sz_equal(k, "proxyhost")) {
+            } else if (lk_sv_equal(k, "proxyhost")) {
                 lk_string_assign(hc->proxyhost, v->s);
                 continue;
+            } else if (lk_sv_equal(k, "ssepath")) {
+                lk_string_assign(hc->ssepath, v->s);
+                if (!lk_string_starts_with(hc->ssepath, "/")) {
+                    lk_string_prepend(hc->ssepath, "/");
+                }
+                continue;
+            } else if (lk_sv_equal(k, "ssesecret")) {
+                lk_string_assign(hc->ssesecret, v->s);
+                continue;
+            } else if (lk_sv_equal(k, "tls_cert")) {
+                lk_string_assign(hc->tls_cert, v->s);
+                continue;
+            } else if (lk_sv_equal(k, "tls_key")) {
+                lk_string_assign(hc->tls_key, v->s);
+                continue;
+            } else if (lk_sv_equal(k, "max_body_size")) {
+                if (parse_size(v->s, &hc->max_body_size) == -1) {
+                    fprintf(stderr, "Invalid max_body_size '%s'\n", v->s);
+                }
+                continue;
             }
             // alias latest=latest.html
-            lk_string_split_assign(l, " ", k, v);
-            if (lk_string_sz_equal(k, "alias")) {
-                lk_string_split_assign(v, "=", aliask, aliasv);
+            lk_split_init(&it, l, " ");
+            lk_split_next_token(&it, &k);
+            if (lk_sv_equal(k, "alias")) {
+                assign_next_token(&it, v);
+                split_kv(lk_sv_lkstring(v), &aliask_sv, aliasv);
+                lk_string_assign_buf(aliask, aliask_sv.p, aliask_sv.len);
                 if (!lk_string_starts_with(aliask, "/")) {
                     lk_string_prepend(aliask, "/");
                 }
@@ -161,12 +261,18 @@ int lk_config_read_configfile(LKConfig *cfg, char *configfile) {
                 lk_stringtable_set(hc->aliases, aliask->s, aliasv->s);
                 continue;
             }
+            // errorpage 404=errors/404.html
+            if (lk_sv_equal(k, "errorpage")) {
+                assign_next_token(&it, v);
+                split_kv(lk_sv_lkstring(v), &aliask_sv, aliasv);
+                lk_string_assign_buf(aliask, aliask_sv.p, aliask_sv.len);
+                lk_stringtable_set(hc->errorpages, aliask->s, aliasv->s);
+                continue;
+            }
             continue;
         }
     }
 
-    lk_string_free(l);
-    lk_string_free(k);
     lk_string_free(v);
     lk_string_free(aliask);
     lk_string_free(aliasv);
@@ -175,6 +281,70 @@ int lk_config_read_configfile(LKConfig *cfg, char *configfile) {
     return 0;
 }
 
+// Split "k=v" line, assign k and v without surrounding whitespace.
+static void split_kv(LKStrView l, LKStrView *k, LKString *v) {
+    LKStrView vsv;
+    lk_sv_split2(l, "=", k, &vsv);
+    *k = lk_sv_trim(*k);
+    vsv = lk_sv_trim(vsv);
+    lk_string_assign_buf(v, vsv.p, vsv.len);
+}
+
+// Assign next space separated token to v, or "" if none.
+static void assign_next_token(LKSplitIter *it, LKString *v) {
+    LKStrView tok;
+    if (!lk_split_next_token(it, &tok)) {
+        tok = lk_sv("");
+    }
+    lk_string_assign_buf(v, tok.p, tok.len);
+}
+
+// Parse byte size with optional K, M or G suffix. Ex. "512", "64K", "10M"
+// Returns 0 for success, -1 if invalid.
+static int parse_size(char *s, size_t *size) {
+    if (*s < '0' || *s > '9') {
+        return -1;
+    }
+    errno = 0;
+    char *end;
+    unsigned long long n = strtoull(s, &end, 10);
+    if (errno == ERANGE) {
+        return -1;
+    }
+    unsigned long long mult = 1;
+    if (*end == 'K' || *end == 'k') {
+        mult = 1024;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        mult = 1024*1024;
+        end++;
+    } else if (*end == 'G' || *end == 'g') {
+        mult = 1024*1024*1024;
+        end++;
+    }
+    if (*end != '\0' || n > SIZE_MAX / mult) {
+        return -1;
+    }
+    *size = n * mult;
+    return 0;
+}
+
+// Parse unsigned int with no suffix.
+// Returns 0 for success, -1 if invalid.
+static int parse_uint(char *s, unsigned int *n) {
+    if (*s < '0' || *s > '9') {
+        return -1;
+    }
+    errno = 0;
+    char *end;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (errno == ERANGE || *end != '\0' || v > UINT_MAX) {
+        return -1;
+    }
+    *n = v;
+    return 0;
+}
+
 LKHostConfig *lk_config_add_hostconfig(LKConfig *cfg, LKHostConfig *hc) {
     assert(cfg->hostconfigs_len <= cfg->hostconfigs_size);
 
@@ -191,12 +361,19 @@ LKHostConfig *lk_config_add_hostconfig(LKConfig *cfg, LKHostConfig *hc) {
 
 // Return hostconfig matching hostname,
 // or if hostname parameter is NULL, return hostconfig matching "*".
+// Any ":port" suffix in hostname is ignored.
 // Return NULL if no matching hostconfig.
 LKHostConfig *lk_config_find_hostconfig(LKConfig *cfg, char *hostname) {
     if (hostname != NULL) {
+        size_t hostname_len = strlen(hostname);
+        char *port = strrchr(hostname, ':');
+        if (port != NULL && port[1] != '\0' && strspn(port+1, "0123456789") == strlen(port+1) &&
+            (strchr(hostname, '[') == NULL || (port > hostname && port[-1] == ']'))) {
+            hostname_len = port - hostname;
+        }
         for (int i=0; i < cfg->hostconfigs_len; i++) {
             LKHostConfig *hc = cfg->hostconfigs[i];
-            if (lk_string_sz_equal(hc->hostname, hostname)) {
+            if (hc->hostname->s_len == hostname_len && !strncmp(hc->hostname->s, hostname, hostname_len)) {
                 return hc;
             }
         }
@@ -211,6 +388,19 @@ LKHostConfig *lk_config_find_hostconfig(LKConfig *cfg, char *hostname) {
     return NULL;
 }
 
+// Return pre-rendered response for error status, from hostconfig hc or
+// the defaults if hc is NULL.
+// Return NULL if status has no pre-rendered response.
+LKStatusPage *lk_config_status_page(LKConfig *cfg, LKHostConfig *hc, int status) {
+    LKStatusPage **pages = hc != NULL ? hc->status_pages : cfg->status_pages;
+    for (int i=0; i < LK_N_STATUS_PAGES; i++) {
+        if (lk_status_page_codes[i] == status) {
+            return pages[i];
+        }
+    }
+    return NULL;
+}
+
 // Return hostconfig with hostname or NULL if not found.
 LKHostConfig *get_hostconfig(LKConfig *cfg, char *hostname) {
     for (int i=0; i < cfg->hostconfigs_len; i++) {
@@ -236,6 +426,13 @@ LKHostConfig *lk_config_create_get_hostconfig(LKConfig *cfg, char *hostname) {
 void lk_config_print(LKConfig *cfg) {
     printf("serverhost: %s\n", cfg->serverhost->s);
     printf("port: %s\n", cfg->port->s);
+    if (cfg->tls_port->s_len > 0) {
+        printf("tls_port: %s\n", cfg->tls_port->s);
+    }
+    printf("max_request_line: %zu\n", cfg->max_request_line);
+    printf("max_header_size: %zu\n", cfg->max_header_size);
+    printf("max_headers: %u\n", cfg->max_headers);
+    printf("header_timeout: %u\n", cfg->header_timeout);
 
     for (int i=0; i < cfg->hostconfigs_len; i++) {
         LKHostConfig *hc = cfg->hostconfigs[i];
@@ -249,9 +446,21 @@ void lk_config_print(LKConfig *cfg) {
         if (hc->proxyhost->s_len > 0) {
             printf("    proxyhost: %s\n", hc->proxyhost->s);
         }
+        if (hc->ssepath->s_len > 0) {
+            printf("    ssepath: %s\n", hc->ssepath->s);
+        }
+        if (hc->tls_cert->s_len > 0) {
+            printf("    tls_cert: %s\n", hc->tls_cert->s);
+        }
+        if (hc->max_body_size > 0) {
+            printf("    max_body_size: %zu\n", hc->max_body_size);
+        }
         for (int j=0; j < hc->aliases->items_len; j++) {
             printf("    alias %s=%s\n", hc->aliases->items[j].k->s, hc->aliases->items[j].v->s);
         }
+        for (int j=0; j < hc->errorpages->items_len; j++) {
+            printf("    errorpage %s=%s\n", hc->errorpages->items[j].k->s, hc->errorpages->items[j].v->s);
+        }
     }
     printf("\n");
 }
@@ -310,6 +519,14 @@ void lk_config_finalize(LKConfig *cfg) {
         }
         lk_string_assign(hc->homedir_abspath, homedir_abspath);
 
+        // Files are opened relative to homedir_fd with lk_open_beneath().
+        if (hc->homedir_abspath->s_len > 0) {
+            hc->homedir_fd = open(hc->homedir_abspath->s, O_PATH | O_DIRECTORY | O_CLOEXEC);
+            if (hc->homedir_fd == -1) {
+                lk_print_err("open() homedir");
+            }
+        }
+
         // Adjust cgidir paths.
         if (hc->cgidir->s_len > 0) {
             if (!lk_string_starts_with(hc->cgidir, "/")) {
@@ -321,12 +538,78 @@ void lk_config_finalize(LKConfig *cfg) {
 
             lk_string_assign(hc->cgidir_abspath, hc->homedir_abspath->s);
             lk_string_append(hc->cgidir_abspath, hc->cgidir->s);
+            if (hc->homedir_fd != -1) {
+                hc->cgidir_fd = openat(hc->homedir_fd, hc->cgidir->s+1, O_PATH | O_DIRECTORY | O_CLOEXEC);
+            }
         }
     }
 
+    // Render error responses once, they are sent as is.
+    render_status_pages(cfg->status_pages, NULL);
+    for (int i=0; i < cfg->hostconfigs_len; i++) {
+        LKHostConfig *hc = cfg->hostconfigs[i];
+        render_status_pages(hc->status_pages, hc);
+    }
+
     lk_string_free(current_dir);
 }
 
+// Render built-in error page for each error status, or the hostconfig's
+// errorpage file if set. Errorpage paths are relative to homedir.
+static void render_status_pages(LKStatusPage **pages, LKHostConfig *hc) {
+    static char *html_error =
+       "<!DOCTYPE html>\n"
+       "<html>\n"
+       "<head><title>%d %.*s</title></head>\n"
+       "<body><h1>%d %.*s</h1></body>\n"
+       "</html>\n";
+
+    LKBuffer *body = lk_buffer_new(0);
+    char status_str[16];
+    for (int i=0; i < LK_N_STATUS_PAGES; i++) {
+        int status = lk_status_page_codes[i];
+        lk_buffer_clear(body);
+
+        char *errorpage = NULL;
+        if (hc != NULL) {
+            snprintf(status_str, sizeof(status_str), "%d", status);
+            errorpage = lk_stringtable_get(hc->errorpages, status_str);
+        }
+        if (errorpage != NULL) {
+            LKString *filepath = lk_string_new(errorpage);
+            if (!lk_string_starts_with(filepath, "/")) {
+                lk_string_prepend(filepath, "/");
+                lk_string_prepend(filepath, hc->homedir_abspath->s);
+            }
+            if (lk_readfile(filepath->s, body) == -1) {
+                fprintf(stderr, "Error reading errorpage '%s': %s\n", filepath->s, strerror(errno));
+                errorpage = NULL;
+            }
+            lk_string_free(filepath);
+        }
+        if (errorpage == NULL) {
+            LKStrView reason = lk_http_reason(status);
+            lk_buffer_append_sprintf(body, html_error, status, (int) reason.len, reason.p,
+                                     status, (int) reason.len, reason.p);
+        }
+
+        if (pages[i] != NULL) {
+            lk_statuspage_free(pages[i]);
+        }
+        pages[i] = lk_statuspage_new(status, "text/html", body->bytes, body->bytes_len);
+    }
+    lk_buffer_free(body);
+}
+
+static void free_status_pages(LKStatusPage **pages) {
+    for (int i=0; i < LK_N_STATUS_PAGES; i++) {
+        if (pages[i] != NULL) {
+            lk_statuspage_free(pages[i]);
+            pages[i] = NULL;
+        }
+    }
+}
+
 
 LKHostConfig *lk_hostconfig_new(char *hostname) {
     LKHostConfig *hc = lk_malloc(sizeof(LKHostConfig), "lk_hostconfig_new");
@@ -336,8 +619,21 @@ LKHostConfig *lk_hostconfig_new(char *hostname) {
     hc->homedir_abspath = lk_string_new("");
     hc->cgidir = lk_string_new("");
     hc->cgidir_abspath = lk_string_new("");
+    hc->homedir_fd = -1;
+    hc->cgidir_fd = -1;
     hc->aliases = lk_stringtable_new();
     hc->proxyhost = lk_string_new("");
+    hc->ssepath = lk_string_new("");
+    hc->ssesecret = lk_string_new("");
+    hc->tls_cert = lk_string_new("");
+    hc->tls_key = lk_string_new("");
+#ifdef LKTLS
+    hc->tls_ctx = NULL;
+#endif
+    hc->max_body_size = 0;
+    hc->errorpages = lk_stringtable_new();
+    memset(hc->status_pages, 0, sizeof(hc->status_pages));
+    lk_traffic_stats_init(&hc->stats);
 
     return hc;
 }
@@ -348,8 +644,25 @@ void lk_hostconfig_free(LKHostConfig *hc) {
     lk_string_free(hc->homedir_abspath);
     lk_string_free(hc->cgidir);
     lk_string_free(hc->cgidir_abspath);
+    if (hc->homedir_fd != -1) {
+        close(hc->homedir_fd);
+    }
+    if (hc->cgidir_fd != -1) {
+        close(hc->cgidir_fd);
+    }
     lk_stringtable_free(hc->aliases);
     lk_string_free(hc->proxyhost);
+    lk_string_free(hc->ssepath);
+    lk_string_free(hc->ssesecret);
+    lk_string_free(hc->tls_cert);
+    lk_string_free(hc->tls_key);
+#ifdef LKTLS
+    if (hc->tls_ctx != NULL) {
+        SSL_CTX_free(hc->tls_ctx);
+    }
+#endif
+    lk_stringtable_free(hc->errorpages);
+    free_status_pages(hc->status_pages);
 
     hc->hostname = NULL;
     hc->homedir = NULL;
@@ -358,6 +671,11 @@ void lk_hostconfig_free(LKHostConfig *hc) {
     hc->cgidir_abspath = NULL;
     hc->aliases = NULL;
     hc->proxyhost = NULL;
+    hc->ssepath = NULL;
+    hc->ssesecret = NULL;
+    hc->tls_cert = NULL;
+    hc->tls_key = NULL;
+    hc->errorpages = NULL;
 
     lk_free(hc);
 }
@@ -23,66 +23,85 @@ LKContext *lk_context_new() {
     ctx->clientfd = 0;
     ctx->type = 0;
     ctx->next = NULL;
+    ctx->arena = NULL;
 
     ctx->client_ipaddr = NULL;
     ctx->client_port = 0;
 
-    ctx->req_line = NULL;
     ctx->req_buf = NULL;
     ctx->sr = NULL;
     ctx->reqparser = NULL;
     ctx->req = NULL;
+    ctx->req_start = 0;
+    ctx->client_tls = 0;
+    ctx->hc = NULL;
     ctx->resp = NULL;
     ctx->buflist = NULL;
 
     ctx->cgifd = 0;
     ctx->cgi_outputbuf = NULL;
-    ctx->cgi_inputbuf = NULL;
+    ctx->cgiparser = NULL;
+    ctx->cgi_eof = 0;
+    ctx->cgi_input = NULL;
 
     ctx->proxyfd = 0;
     ctx->proxy_respbuf = NULL;
+    ctx->proxy_resp = NULL;
+
+    ctx->h2 = NULL;
+
+    ctx->tunnel_up = NULL;
+    ctx->tunnel_down = NULL;
+    ctx->tunnel_peer = NULL;
+    ctx->tunnel_active = 0;
+
+    ctx->sse_queue = NULL;
+    ctx->sse_offset = 0;
+
+#ifdef LKTLS
+    ctx->tlsconn = NULL;
+    ctx->tls_peer = NULL;
+#endif
 
     return ctx;
 }
 
+// Client ctx starts without request state so that connections that
+// haven't sent anything stay small. init_request_context() allocates it
+// once request bytes arrive.
 LKContext *create_initial_context(int fd, struct sockaddr_in *sa) {
-    LKContext *ctx = lk_malloc(sizeof(LKContext), "create_initial_context");
+    LKContext *ctx = lk_context_new();
     ctx->selectfd = fd;
     ctx->clientfd = fd;
     ctx->type = CTX_READ_REQ;
-    ctx->next = NULL;
-
     ctx->client_sa = *sa;
-    ctx->client_ipaddr = lk_get_ipaddr_string((struct sockaddr *) sa);
     ctx->client_port = lk_get_sockaddr_port((struct sockaddr *) sa);
+    ctx->req_start = time(NULL);
+    return ctx;
+}
 
-    ctx->req_line = lk_string_new("");
-    ctx->req_buf = lk_buffer_new(0);
-    ctx->sr = lk_socketreader_new(fd, 0);
+// Allocate request state of client ctx.
+// Request and response objects live in the ctx arena and are released
+// together in lk_context_free().
+void init_request_context(LKContext *ctx) {
+    assert(ctx->arena == NULL);
+    LKArena *arena = lk_arenapool_get();
+    ctx->arena = arena;
+    ctx->client_ipaddr = lk_get_ipaddr_arena_string(arena, (struct sockaddr *) &ctx->client_sa);
+    ctx->req_buf = lk_bufpool_get();
+    ctx->sr = lk_socketreader_new(ctx->clientfd, 0);
     ctx->reqparser = lk_httprequestparser_new();
-    ctx->req = lk_httprequest_new();
-    ctx->resp = lk_httpresponse_new();
+    ctx->req = lk_httprequest_arena_new(arena);
+    ctx->resp = lk_httpresponse_arena_new(arena);
     ctx->buflist = lk_reflist_new();
-
-    ctx->cgifd = 0;
-    ctx->cgi_outputbuf = NULL;
-    ctx->cgi_inputbuf = NULL;
-
-    ctx->proxyfd = 0;
-    ctx->proxy_respbuf = NULL;
-
-    return ctx;
 }
 
 void lk_context_free(LKContext *ctx) {
     if (ctx->client_ipaddr) {
         lk_string_free(ctx->client_ipaddr);
     }
-    if (ctx->req_line) {
-        lk_string_free(ctx->req_line);
-    }
     if (ctx->req_buf) {
-        lk_buffer_free(ctx->req_buf);
+        lk_bufpool_put(ctx->req_buf);
     }
     if (ctx->sr) {
         lk_socketreader_free(ctx->sr);
@@ -100,21 +119,48 @@ void lk_context_free(LKContext *ctx) {
         lk_reflist_free(ctx->buflist);
     }
     if (ctx->cgi_outputbuf) {
-        lk_buffer_free(ctx->cgi_outputbuf);
+        lk_bufpool_put(ctx->cgi_outputbuf);
     }
-    if (ctx->cgi_inputbuf) {
-        lk_buffer_free(ctx->cgi_inputbuf);
+    if (ctx->cgiparser) {
+        lk_httpcgiparser_free(ctx->cgiparser);
+    }
+    if (ctx->cgi_input) {
+        lk_bufchain_free(ctx->cgi_input);
     }
     if (ctx->proxy_respbuf) {
-        lk_buffer_free(ctx->proxy_respbuf);
+        lk_bufpool_put(ctx->proxy_respbuf);
+    }
+    if (ctx->proxy_resp) {
+        lk_bufchain_free(ctx->proxy_resp);
+    }
+    if (ctx->h2) {
+        lk_http2session_free(ctx->h2);
     }
+    if (ctx->tunnel_up) {
+        lk_splicepipe_free(ctx->tunnel_up);
+    }
+    if (ctx->tunnel_down) {
+        lk_splicepipe_free(ctx->tunnel_down);
+    }
+    if (ctx->sse_queue) {
+        // Release events not yet sent.
+        LKRefList *q = ctx->sse_queue;
+        for (size_t i=q->items_cur; i < q->items_len; i++) {
+            lk_refbuffer_unref(q->items[i]);
+        }
+        lk_reflist_free(q);
+    }
+#ifdef LKTLS
+    if (ctx->tlsconn) {
+        lk_tlsconn_free(ctx->tlsconn);
+    }
+#endif
 
     ctx->selectfd = 0;
     ctx->clientfd = 0;
     ctx->next = NULL;
     memset(&ctx->client_sa, 0, sizeof(struct sockaddr_in));
     ctx->client_ipaddr = NULL;
-    ctx->req_line = NULL;
     ctx->req_buf = NULL;
     ctx->sr = NULL;
     ctx->reqparser = NULL;
@@ -123,9 +169,23 @@ void lk_context_free(LKContext *ctx) {
     ctx->buflist = NULL;
     ctx->cgifd = 0;
     ctx->cgi_outputbuf = NULL;
-    ctx->cgi_inputbuf = NULL;
+    ctx->cgiparser = NULL;
+    ctx->cgi_eof = 0;
+    ctx->cgi_input = NULL;
     ctx->proxyfd = 0;
     ctx->proxy_respbuf = NULL;
+    ctx->proxy_resp = NULL;
+    ctx->h2 = NULL;
+    ctx->tunnel_up = NULL;
+    ctx->tunnel_down = NULL;
+    ctx->tunnel_peer = NULL;
+    ctx->hc = NULL;
+    ctx->sse_queue = NULL;
+
+    if (ctx->arena) {
+        lk_arenapool_put(ctx->arena);
+        ctx->arena = NULL;
+    }
     lk_free(ctx);
 }
 
@@ -0,0 +1,328 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+#include "lklib.h"
+#include "lknet.h"
+
+// Header field table.
+// Items are kept in insertion order for serializing the head, with an
+// open addressing hash index on the lowercased name. Well-known headers
+// are also indexed by LKHeaderId in known[].
+// A table created with lk_headertable_arena_new() is freed with its arena.
+
+static char *known_names[LK_HDR_COUNT] = {
+    [LK_HDR_HOST]               = "Host",
+    [LK_HDR_CONTENT_LENGTH]     = "Content-Length",
+    [LK_HDR_CONTENT_TYPE]       = "Content-Type",
+    [LK_HDR_CONTENT_RANGE]      = "Content-Range",
+    [LK_HDR_CONNECTION]         = "Connection",
+    [LK_HDR_USER_AGENT]         = "User-Agent",
+    [LK_HDR_IF_NONE_MATCH]      = "If-None-Match",
+    [LK_HDR_IF_MODIFIED_SINCE]  = "If-Modified-Since",
+    [LK_HDR_RANGE]              = "Range",
+    [LK_HDR_IF_RANGE]           = "If-Range",
+    [LK_HDR_EXPECT]             = "Expect",
+    [LK_HDR_UPGRADE]            = "Upgrade",
+    [LK_HDR_HTTP2_SETTINGS]     = "HTTP2-Settings",
+    [LK_HDR_TRANSFER_ENCODING]  = "Transfer-Encoding",
+    [LK_HDR_LOCATION]           = "Location",
+    [LK_HDR_STATUS]             = "Status",
+    [LK_HDR_DATE]               = "Date",
+    [LK_HDR_SERVER]             = "Server",
+};
+
+// Hash index of known_names, slot holds id+1 or 0 if empty.
+#define KNOWN_SLOTS 64
+static unsigned char known_slots[KNOWN_SLOTS];
+static unsigned int known_hashes[LK_HDR_COUNT];
+static int known_init = 0;
+
+// FNV-1a hash of lowercased name.
+static unsigned int hash_name(char *k) {
+    unsigned int h = 2166136261u;
+    for (unsigned char *p = (unsigned char *) k; *p; p++) {
+        unsigned char c = *p;
+        if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+        h = (h ^ c) * 16777619u;
+    }
+    return h;
+}
+
+static void init_known_slots() {
+    for (int id=0; id < LK_HDR_COUNT; id++) {
+        unsigned int h = hash_name(known_names[id]);
+        known_hashes[id] = h;
+        size_t i = h & (KNOWN_SLOTS-1);
+        while (known_slots[i] != 0) {
+            i = (i+1) & (KNOWN_SLOTS-1);
+        }
+        known_slots[i] = id+1;
+    }
+    known_init = 1;
+}
+
+static LKHeaderId known_id(char *k, unsigned int h) {
+    if (!known_init) {
+        init_known_slots();
+    }
+    size_t i = h & (KNOWN_SLOTS-1);
+    while (known_slots[i] != 0) {
+        int id = known_slots[i]-1;
+        if (known_hashes[id] == h && !strcasecmp(known_names[id], k)) {
+            return id;
+        }
+        i = (i+1) & (KNOWN_SLOTS-1);
+    }
+    return LK_HDR_OTHER;
+}
+
+// Return id of well-known header name, or LK_HDR_OTHER.
+LKHeaderId lk_header_id(char *k) {
+    return known_id(k, hash_name(k));
+}
+
+static void *table_alloc(LKArena *arena, size_t size, char *label) {
+    if (arena != NULL) {
+        return lk_arena_alloc(arena, size);
+    }
+    return lk_malloc(size, label);
+}
+
+// Grow table array p from old_size to size bytes.
+static void *table_realloc(LKHeaderTable *ht, void *p, size_t old_size, size_t size, char *label) {
+    if (ht->arena == NULL) {
+        return lk_realloc(p, size, label);
+    }
+    void *newp = lk_arena_alloc(ht->arena, size);
+    memcpy(newp, p, old_size);
+    return newp;
+}
+
+static LKHeaderTable *table_new(LKArena *arena) {
+    LKHeaderTable *ht = table_alloc(arena, sizeof(LKHeaderTable), "lk_headertable_new");
+    ht->arena = arena;
+    ht->items_size = 8;
+    ht->items_len = 0;
+    ht->items = table_alloc(arena, ht->items_size * sizeof(LKHeaderItem), "lk_headertable_new_items");
+    memset(ht->items, 0, ht->items_size * sizeof(LKHeaderItem));
+
+    ht->slots_size = 16;
+    ht->slots = table_alloc(arena, ht->slots_size * sizeof(int), "lk_headertable_new_slots");
+    memset(ht->slots, 0xff, ht->slots_size * sizeof(int));
+
+    for (int id=0; id < LK_HDR_COUNT; id++) {
+        ht->known[id] = -1;
+    }
+    return ht;
+}
+
+LKHeaderTable *lk_headertable_new() {
+    return table_new(NULL);
+}
+
+LKHeaderTable *lk_headertable_arena_new(LKArena *arena) {
+    return table_new(arena);
+}
+
+void lk_headertable_free(LKHeaderTable *ht) {
+    assert(ht->items != NULL);
+    if (ht->arena != NULL) {
+        return;
+    }
+
+    for (int i=0; i < ht->items_len; i++) {
+        lk_string_free(ht->items[i].k);
+        lk_string_free(ht->items[i].v);
+    }
+    memset(ht->items, 0, ht->items_size * sizeof(LKHeaderItem));
+
+    lk_free(ht->items);
+    lk_free(ht->slots);
+    ht->items = NULL;
+    ht->slots = NULL;
+    lk_free(ht);
+}
+
+static void insert_slot(LKHeaderTable *ht, int itemi) {
+    size_t mask = ht->slots_size-1;
+    size_t i = ht->items[itemi].hash & mask;
+    while (ht->slots[i] != -1) {
+        i = (i+1) & mask;
+    }
+    ht->slots[i] = itemi;
+}
+
+// Rebuild slots and known[] from items.
+static void reindex(LKHeaderTable *ht) {
+    memset(ht->slots, 0xff, ht->slots_size * sizeof(int));
+    for (int id=0; id < LK_HDR_COUNT; id++) {
+        ht->known[id] = -1;
+    }
+    for (int i=0; i < ht->items_len; i++) {
+        insert_slot(ht, i);
+        if (ht->items[i].id != LK_HDR_OTHER && ht->known[ht->items[i].id] == -1) {
+            ht->known[ht->items[i].id] = i;
+        }
+    }
+}
+
+// Return index of item with name k, or -1 if not found.
+static int find_item(LKHeaderTable *ht, char *k, unsigned int h) {
+    size_t mask = ht->slots_size-1;
+    size_t i = h & mask;
+    while (ht->slots[i] != -1) {
+        LKHeaderItem *item = &ht->items[ht->slots[i]];
+        if (item->hash == h && !strcasecmp(item->k->s, k)) {
+            return ht->slots[i];
+        }
+        i = (i+1) & mask;
+    }
+    return -1;
+}
+
+static void add_item(LKHeaderTable *ht, char *k, char *v, unsigned int h);
+
+// Set header value. An existing header of the same name, in any case,
+// is overwritten and keeps its position and original name.
+void lk_headertable_set(LKHeaderTable *ht, char *k, char *v) {
+    unsigned int h = hash_name(k);
+    int itemi = find_item(ht, k, h);
+    if (itemi != -1) {
+        lk_string_assign(ht->items[itemi].v, v);
+        return;
+    }
+    add_item(ht, k, v, h);
+}
+
+// Add another value for header, even if one is already set.
+// Each value is serialized as its own header line, as needed for
+// Set-Cookie. Lookups return the first value.
+void lk_headertable_append(LKHeaderTable *ht, char *k, char *v) {
+    add_item(ht, k, v, hash_name(k));
+}
+
+// Append v to the value of header k after sep, or set it if k isn't set.
+// The value grows in place, so joining many fields stays linear.
+void lk_headertable_join(LKHeaderTable *ht, char *k, char *v, char *sep) {
+    unsigned int h = hash_name(k);
+    int itemi = find_item(ht, k, h);
+    if (itemi == -1) {
+        add_item(ht, k, v, h);
+        return;
+    }
+    lk_string_append(ht->items[itemi].v, sep);
+    lk_string_append(ht->items[itemi].v, v);
+}
+
+static void add_item(LKHeaderTable *ht, char *k, char *v, unsigned int h) {
+    int itemi;
+    if (ht->items_len == ht->items_size) {
+        ht->items_size *= 2;
+        ht->items = table_realloc(ht, ht->items, ht->items_len * sizeof(LKHeaderItem),
+                                  ht->items_size * sizeof(LKHeaderItem), "lk_headertable_set");
+        memset(ht->items + ht->items_len, 0,
+               (ht->items_size - ht->items_len) * sizeof(LKHeaderItem));
+    }
+
+    itemi = ht->items_len;
+    LKHeaderItem *item = &ht->items[itemi];
+    if (ht->arena != NULL) {
+        item->k = lk_string_arena_new(ht->arena, k);
+        item->v = lk_string_arena_new(ht->arena, v);
+    } else {
+        item->k = lk_string_new(k);
+        item->v = lk_string_new(v);
+    }
+    item->hash = h;
+    item->id = known_id(k, h);
+    ht->items_len++;
+
+    // Keep load factor at most 1/2.
+    if (ht->items_len*2 > ht->slots_size) {
+        ht->slots = table_realloc(ht, ht->slots, ht->slots_size * sizeof(int),
+                                  ht->slots_size*2 * sizeof(int), "lk_headertable_set_slots");
+        ht->slots_size *= 2;
+        reindex(ht);
+        return;
+    }
+    insert_slot(ht, itemi);
+    if (item->id != LK_HDR_OTHER && ht->known[item->id] == -1) {
+        ht->known[item->id] = itemi;
+    }
+}
+
+// Make room for n items, so that adding them doesn't grow the table.
+void lk_headertable_reserve(LKHeaderTable *ht, size_t n) {
+    if (n > ht->items_size) {
+        size_t items_size = ht->items_size;
+        while (items_size < n) {
+            items_size *= 2;
+        }
+        ht->items = table_realloc(ht, ht->items, ht->items_len * sizeof(LKHeaderItem),
+                                  items_size * sizeof(LKHeaderItem), "lk_headertable_reserve");
+        memset(ht->items + ht->items_len, 0,
+               (items_size - ht->items_len) * sizeof(LKHeaderItem));
+        ht->items_size = items_size;
+    }
+    if (n*2 > ht->slots_size) {
+        size_t slots_size = ht->slots_size;
+        while (slots_size < n*2) {
+            slots_size *= 2;
+        }
+        ht->slots = table_realloc(ht, ht->slots, ht->slots_size * sizeof(int),
+                                  slots_size * sizeof(int), "lk_headertable_reserve_slots");
+        ht->slots_size = slots_size;
+        reindex(ht);
+    }
+}
+
+char *lk_headertable_get(LKHeaderTable *ht, char *k) {
+    int itemi = find_item(ht, k, hash_name(k));
+    if (itemi == -1) {
+        return NULL;
+    }
+    return ht->items[itemi].v->s;
+}
+
+char *lk_headertable_get_id(LKHeaderTable *ht, LKHeaderId id) {
+    assert(id >= 0 && id < LK_HDR_COUNT);
+    int itemi = ht->known[id];
+    if (itemi == -1) {
+        return NULL;
+    }
+    return ht->items[itemi].v->s;
+}
+
+static void remove_item(LKHeaderTable *ht, int itemi) {
+    lk_string_free(ht->items[itemi].k);
+    lk_string_free(ht->items[itemi].v);
+
+    int num_items_after = ht->items_len-itemi-1;
+    memmove(ht->items+itemi, ht->items+itemi+1, num_items_after * sizeof(LKHeaderItem));
+    memset(ht->items+ht->items_len-1, 0, sizeof(LKHeaderItem));
+    ht->items_len--;
+
+    // Item indexes after itemi have shifted.
+    reindex(ht);
+}
+
+// Remove header, including all values added by lk_headertable_append().
+void lk_headertable_remove(LKHeaderTable *ht, char *k) {
+    unsigned int h = hash_name(k);
+    int itemi;
+    while ((itemi = find_item(ht, k, h)) != -1) {
+        remove_item(ht, itemi);
+    }
+}
+
+void lk_headertable_remove_id(LKHeaderTable *ht, LKHeaderId id) {
+    assert(id >= 0 && id < LK_HDR_COUNT);
+    while (ht->known[id] != -1) {
+        remove_item(ht, ht->known[id]);
+    }
+}
@@ -0,0 +1,1429 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <ctype.h>
+#include "lklib.h"
+#include "lknet.h"
+
+// HTTP/2 cleartext (h2c) support, RFC 9113 and RFC 7541 (HPACK).
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_FRAME_HEADER_LEN 9
+
+// Frame types
+#define H2_DATA 0x0
+#define H2_HEADERS 0x1
+#define H2_PRIORITY 0x2
+#define H2_RST_STREAM 0x3
+#define H2_SETTINGS 0x4
+#define H2_PUSH_PROMISE 0x5
+#define H2_PING 0x6
+#define H2_GOAWAY 0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION 0x9
+
+// Frame flags
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+// Settings
+#define H2_SETTINGS_HEADER_TABLE_SIZE 0x1
+#define H2_SETTINGS_ENABLE_PUSH 0x2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE 0x5
+#define H2_SETTINGS_MAX_HEADER_LIST_SIZE 0x6
+
+// Error codes
+#define H2_NO_ERROR 0x0
+#define H2_PROTOCOL_ERROR 0x1
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_STREAM_CLOSED 0x5
+#define H2_FRAME_SIZE_ERROR 0x6
+#define H2_REFUSED_STREAM 0x7
+#define H2_COMPRESSION_ERROR 0x9
+#define H2_ENHANCE_YOUR_CALM 0xb
+
+#define H2_DEFAULT_WINDOW_SIZE 65535
+#define H2_DEFAULT_FRAME_SIZE 16384
+#define H2_MAX_WINDOW_SIZE 0x7fffffff
+#define H2_MAX_CONCURRENT_STREAMS 100
+#define H2_MAX_HEADERBLOCK_SIZE (64*1024)
+#define H2_HPACK_TABLE_SIZE 4096
+
+// Stop queueing DATA frames once this many bytes are waiting to be sent.
+#define H2_OUTBUF_HIGHWATER (64*1024)
+
+static void process_frame(LKHttp2Session *h2, int type, int flags, unsigned int stream_id, unsigned char *p, size_t len);
+static void connection_error(LKHttp2Session *h2, unsigned int errcode);
+static void end_headers(LKHttp2Session *h2);
+static void send_stream_data(LKHttp2Session *h2, LKHttp2Stream *stream);
+static void end_response(LKHttp2Session *h2, LKHttp2Stream *stream);
+int parse_uri(LKString *lks_uri, LKString *lks_path, LKString *lks_filename, LKString *lks_qs);
+
+
+/*** HPACK static table (RFC 7541 Appendix A) ***/
+static char *hpack_static_tbl[][2] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+#define HPACK_STATIC_TBL_LEN (sizeof(hpack_static_tbl) / sizeof(hpack_static_tbl[0]))
+
+// Huffman code lengths for symbols 0-256 (RFC 7541 Appendix B).
+// The HPACK code is canonical, so the codes are rebuilt from the lengths.
+static unsigned char huff_lens[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+     6, 10, 10, 12, 13,  6,  8, 11, 10, 10,  8, 11,  8,  6,  6,  6,
+     5,  5,  5,  6,  6,  6,  6,  6,  6,  6,  7,  8, 15,  6, 12, 10,
+    13,  6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+     7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8, 13, 19, 13, 14,  6,
+    15,  5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,  6,  5,
+     6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+#define HUFF_EOS 256
+#define HUFF_MAX_LEN 30
+
+// Canonical decoding tables, built on first use.
+// huff_syms[] holds symbols sorted by (code length, symbol).
+static int huff_initialized = 0;
+static unsigned short huff_syms[257];
+static unsigned int huff_first_code[HUFF_MAX_LEN+1];
+static unsigned int huff_count[HUFF_MAX_LEN+1];
+static unsigned int huff_first_index[HUFF_MAX_LEN+1];
+
+static void huff_init() {
+    if (huff_initialized) {
+        return;
+    }
+    memset(huff_count, 0, sizeof(huff_count));
+    for (int sym=0; sym < 257; sym++) {
+        huff_count[huff_lens[sym]]++;
+    }
+
+    unsigned int code = 0;
+    unsigned int index = 0;
+    for (int len=1; len <= HUFF_MAX_LEN; len++) {
+        huff_first_code[len] = code;
+        huff_first_index[len] = index;
+        code = (code + huff_count[len]) << 1;
+        index += huff_count[len];
+    }
+
+    // Place symbols in canonical order.
+    unsigned int next_index[HUFF_MAX_LEN+1];
+    memcpy(next_index, huff_first_index, sizeof(next_index));
+    for (int sym=0; sym < 257; sym++) {
+        huff_syms[next_index[huff_lens[sym]]++] = sym;
+    }
+    huff_initialized = 1;
+}
+
+// Decode Huffman encoded bytes and append them to dst.
+// Returns 0 for success, -1 for invalid encoding.
+static int huff_decode(unsigned char *p, size_t len, LKString *dst) {
+    huff_init();
+
+    unsigned int code = 0;
+    int code_len = 0;
+    int ones = 1; // bits of the pending code are all 1s (EOS prefix)
+    for (size_t i=0; i < len; i++) {
+        for (int bit=7; bit >= 0; bit--) {
+            int b = (p[i] >> bit) & 1;
+            code = (code << 1) | b;
+            code_len++;
+            ones = ones && b;
+
+            if (code - huff_first_code[code_len] < huff_count[code_len]) {
+                unsigned short sym = huff_syms[huff_first_index[code_len] + code - huff_first_code[code_len]];
+                if (sym == HUFF_EOS) {
+                    return -1;
+                }
+                lk_string_append_char(dst, (char) sym);
+                code = 0;
+                code_len = 0;
+                ones = 1;
+                continue;
+            }
+            if (code_len >= HUFF_MAX_LEN) {
+                return -1;
+            }
+        }
+    }
+    // Padding must be shorter than 8 bits and consist of the EOS prefix.
+    if (code_len > 7 || !ones) {
+        return -1;
+    }
+    return 0;
+}
+
+
+/*** HPACK integer and string primitives ***/
+
+// Decode integer with N-bit prefix.
+// Returns number of bytes consumed or -1 for error.
+static int hpack_decode_int(unsigned char *p, size_t len, int prefix_bits, size_t *val) {
+    if (len == 0) {
+        return -1;
+    }
+    size_t mask = (1 << prefix_bits) - 1;
+    size_t v = p[0] & mask;
+    if (v < mask) {
+        *val = v;
+        return 1;
+    }
+
+    int shift = 0;
+    for (size_t i=1; i < len; i++) {
+        if (shift > 28) {
+            return -1;
+        }
+        v += (size_t)(p[i] & 0x7f) << shift;
+        shift += 7;
+        if ((p[i] & 0x80) == 0) {
+            *val = v;
+            return i+1;
+        }
+    }
+    return -1;
+}
+
+// Decode string literal into dst.
+// Returns number of bytes consumed or -1 for error.
+static int hpack_decode_string(unsigned char *p, size_t len, LKString *dst) {
+    size_t slen;
+    int n = hpack_decode_int(p, len, 7, &slen);
+    if (n == -1 || slen > len - n) {
+        return -1;
+    }
+
+    lk_string_assign(dst, "");
+    if (p[0] & 0x80) {
+        if (huff_decode(p+n, slen, dst) == -1) {
+            return -1;
+        }
+    } else {
+        for (size_t i=0; i < slen; i++) {
+            lk_string_append_char(dst, p[n+i]);
+        }
+    }
+    return n + slen;
+}
+
+// Encode integer with N-bit prefix. flags holds the bits above the prefix.
+static void hpack_encode_int(LKBuffer *buf, int flags, int prefix_bits, size_t val) {
+    size_t mask = (1 << prefix_bits) - 1;
+    char c;
+    if (val < mask) {
+        c = flags | val;
+        lk_buffer_append(buf, &c, 1);
+        return;
+    }
+    c = flags | mask;
+    lk_buffer_append(buf, &c, 1);
+    val -= mask;
+    while (val >= 128) {
+        c = (val & 0x7f) | 0x80;
+        lk_buffer_append(buf, &c, 1);
+        val >>= 7;
+    }
+    c = val;
+    lk_buffer_append(buf, &c, 1);
+}
+
+// Encode string literal without Huffman coding.
+static void hpack_encode_string(LKBuffer *buf, char *s) {
+    size_t slen = strlen(s);
+    hpack_encode_int(buf, 0, 7, slen);
+    lk_buffer_append(buf, s, slen);
+}
+
+
+/*** LKHpackDecoder functions ***/
+LKHpackDecoder *lk_hpackdecoder_new(size_t max_table_size) {
+    LKHpackDecoder *dec = lk_malloc(sizeof(LKHpackDecoder), "lk_hpackdecoder_new");
+    dec->items_size = 10;
+    dec->items_len = 0;
+    dec->items = lk_malloc(dec->items_size * sizeof(LKStringTableItem), "lk_hpackdecoder_new_items");
+    memset(dec->items, 0, dec->items_size * sizeof(LKStringTableItem));
+    dec->table_size = 0;
+    dec->max_table_size = max_table_size;
+    dec->settings_table_size = max_table_size;
+    dec->max_list_size = 0;
+    dec->max_fields = 0;
+    return dec;
+}
+
+void lk_hpackdecoder_free(LKHpackDecoder *dec) {
+    for (int i=0; i < dec->items_len; i++) {
+        lk_string_free(dec->items[i].k);
+        lk_string_free(dec->items[i].v);
+    }
+    memset(dec->items, 0, dec->items_size * sizeof(LKStringTableItem));
+    lk_free(dec->items);
+    dec->items = NULL;
+    lk_free(dec);
+}
+
+static size_t entry_size(LKStringTableItem *item) {
+    return item->k->s_len + item->v->s_len + 32;
+}
+
+// Evict oldest entries until table fits in max_size.
+static void hpackdecoder_evict(LKHpackDecoder *dec, size_t max_size) {
+    while (dec->items_len > 0 && dec->table_size > max_size) {
+        LKStringTableItem *item = &dec->items[dec->items_len-1];
+        dec->table_size -= entry_size(item);
+        lk_string_free(item->k);
+        lk_string_free(item->v);
+        memset(item, 0, sizeof(LKStringTableItem));
+        dec->items_len--;
+    }
+}
+
+// Insert entry at the front of the dynamic table.
+static void hpackdecoder_add(LKHpackDecoder *dec, char *k, char *v) {
+    size_t size = strlen(k) + strlen(v) + 32;
+    if (size > dec->max_table_size) {
+        // Entry larger than the table empties the table.
+        hpackdecoder_evict(dec, 0);
+        return;
+    }
+    hpackdecoder_evict(dec, dec->max_table_size - size);
+
+    if (dec->items_len == dec->items_size) {
+        dec->items_size += 10;
+        dec->items = lk_realloc(dec->items, dec->items_size * sizeof(LKStringTableItem), "hpackdecoder_add");
+    }
+    memmove(dec->items+1, dec->items, dec->items_len * sizeof(LKStringTableItem));
+    dec->items[0].k = lk_string_new(k);
+    dec->items[0].v = lk_string_new(v);
+    dec->items_len++;
+    dec->table_size += size;
+}
+
+// Look up 1-based index in static and dynamic tables.
+// Returns 0 for success, -1 for invalid index.
+static int hpackdecoder_get(LKHpackDecoder *dec, size_t index, char **k, char **v) {
+    if (index == 0) {
+        return -1;
+    }
+    if (index <= HPACK_STATIC_TBL_LEN) {
+        *k = hpack_static_tbl[index-1][0];
+        *v = hpack_static_tbl[index-1][1];
+        return 0;
+    }
+    index -= HPACK_STATIC_TBL_LEN + 1;
+    if (index >= dec->items_len) {
+        return -1;
+    }
+    *k = dec->items[index].k->s;
+    *v = dec->items[index].v->s;
+    return 0;
+}
+
+// Add decoded header field to headers, unless the header list would
+// go over the decoder limits. List size counts name, value and 32 bytes
+// per field, as SETTINGS_MAX_HEADER_LIST_SIZE does.
+// Repeated fields are combined into one comma separated value, except
+// for cookie which is joined with "; " (RFC 9113 8.2.3).
+// Returns 0 for success, -1 if over the limits.
+static int add_header_field(LKHpackDecoder *dec, LKHeaderTable *headers, char *k, char *v,
+                            size_t *list_size, size_t *nfields) {
+    *list_size += strlen(k) + strlen(v) + 32;
+    (*nfields)++;
+    if ((dec->max_list_size > 0 && *list_size > dec->max_list_size) ||
+        (dec->max_fields > 0 && *nfields > dec->max_fields)) {
+        return -1;
+    }
+    lk_headertable_join(headers, k, v, strcmp(k, "cookie") ? ", " : "; ");
+    return 0;
+}
+
+// Decode HPACK header block into headers.
+// Returns 0 for success, -1 for compression error, -2 if the header list
+// is over max_list_size or max_fields.
+int lk_hpackdecoder_decode(LKHpackDecoder *dec, char *bytes, size_t bytes_len, LKHeaderTable *headers) {
+    unsigned char *p = (unsigned char *) bytes;
+    size_t len = bytes_len;
+    LKString *k = lk_string_new("");
+    LKString *v = lk_string_new("");
+    size_t list_size = 0;
+    size_t nfields = 0;
+    int z = 0;
+
+    while (len > 0) {
+        size_t index;
+        int n;
+        char *sk, *sv;
+
+        if (p[0] & 0x80) {
+            // Indexed header field: 1xxxxxxx
+            n = hpack_decode_int(p, len, 7, &index);
+            if (n == -1 || hpackdecoder_get(dec, index, &sk, &sv) == -1) {
+                z = -1;
+                break;
+            }
+            if (add_header_field(dec, headers, sk, sv, &list_size, &nfields) == -1) {
+                z = -2;
+                break;
+            }
+            p += n;
+            len -= n;
+            continue;
+        }
+        if ((p[0] & 0xe0) == 0x20) {
+            // Dynamic table size update: 001xxxxx
+            size_t max_size;
+            n = hpack_decode_int(p, len, 5, &max_size);
+            if (n == -1 || max_size > dec->settings_table_size) {
+                z = -1;
+                break;
+            }
+            dec->max_table_size = max_size;
+            hpackdecoder_evict(dec, max_size);
+            p += n;
+            len -= n;
+            continue;
+        }
+
+        // Literal header field:
+        // 01xxxxxx with incremental indexing
+        // 0000xxxx without indexing
+        // 0001xxxx never indexed
+        int add_to_table = (p[0] & 0xc0) == 0x40;
+        int prefix_bits = add_to_table ? 6 : 4;
+        n = hpack_decode_int(p, len, prefix_bits, &index);
+        if (n == -1) {
+            z = -1;
+            break;
+        }
+        p += n;
+        len -= n;
+
+        if (index > 0) {
+            if (hpackdecoder_get(dec, index, &sk, &sv) == -1) {
+                z = -1;
+                break;
+            }
+            lk_string_assign(k, sk);
+        } else {
+            n = hpack_decode_string(p, len, k);
+            if (n == -1) {
+                z = -1;
+                break;
+            }
+            p += n;
+            len -= n;
+        }
+        n = hpack_decode_string(p, len, v);
+        if (n == -1) {
+            z = -1;
+            break;
+        }
+        p += n;
+        len -= n;
+
+        if (add_header_field(dec, headers, k->s, v->s, &list_size, &nfields) == -1) {
+            z = -2;
+            break;
+        }
+        if (add_to_table) {
+            hpackdecoder_add(dec, k->s, v->s);
+        }
+    }
+
+    lk_string_free(k);
+    lk_string_free(v);
+    return z;
+}
+
+// Append HPACK encoded header field to buf.
+// Fields are sent as literals without indexing, using the static table for
+// the name (or the whole field) where possible. The dynamic table is not
+// used for encoding, so no encoder state is kept.
+void lk_hpack_encode_header(LKBuffer *buf, char *k, char *v) {
+    size_t name_index = 0;
+    for (size_t i=0; i < HPACK_STATIC_TBL_LEN; i++) {
+        if (strcmp(hpack_static_tbl[i][0], k)) {
+            continue;
+        }
+        if (!strcmp(hpack_static_tbl[i][1], v)) {
+            hpack_encode_int(buf, 0x80, 7, i+1);
+            return;
+        }
+        if (name_index == 0) {
+            name_index = i+1;
+        }
+    }
+
+    hpack_encode_int(buf, 0x00, 4, name_index);
+    if (name_index == 0) {
+        hpack_encode_string(buf, k);
+    }
+    hpack_encode_string(buf, v);
+}
+
+
+/*** Frame helpers ***/
+
+static void append_frame_header(LKBuffer *buf, size_t len, int type, int flags, unsigned int stream_id) {
+    char hdr[H2_FRAME_HEADER_LEN];
+    hdr[0] = (len >> 16) & 0xff;
+    hdr[1] = (len >> 8) & 0xff;
+    hdr[2] = len & 0xff;
+    hdr[3] = type;
+    hdr[4] = flags;
+    hdr[5] = (stream_id >> 24) & 0x7f;
+    hdr[6] = (stream_id >> 16) & 0xff;
+    hdr[7] = (stream_id >> 8) & 0xff;
+    hdr[8] = stream_id & 0xff;
+    lk_buffer_append(buf, hdr, sizeof(hdr));
+}
+
+static void append_frame(LKBuffer *buf, int type, int flags, unsigned int stream_id, char *payload, size_t len) {
+    append_frame_header(buf, len, type, flags, stream_id);
+    if (len > 0) {
+        lk_buffer_append(buf, payload, len);
+    }
+}
+
+static void put_uint32(char *p, unsigned int v) {
+    p[0] = (v >> 24) & 0xff;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >> 8) & 0xff;
+    p[3] = v & 0xff;
+}
+
+static unsigned int get_uint32(unsigned char *p) {
+    return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void send_settings(LKHttp2Session *h2) {
+    char payload[18];
+    size_t len = 12;
+    // SETTINGS_MAX_CONCURRENT_STREAMS
+    payload[0] = 0;
+    payload[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    put_uint32(payload+2, H2_MAX_CONCURRENT_STREAMS);
+    // SETTINGS_HEADER_TABLE_SIZE
+    payload[6] = 0;
+    payload[7] = H2_SETTINGS_HEADER_TABLE_SIZE;
+    put_uint32(payload+8, H2_HPACK_TABLE_SIZE);
+    // SETTINGS_MAX_HEADER_LIST_SIZE
+    if (h2->decoder->max_list_size > 0) {
+        payload[12] = 0;
+        payload[13] = H2_SETTINGS_MAX_HEADER_LIST_SIZE;
+        put_uint32(payload+14, h2->decoder->max_list_size);
+        len = 18;
+    }
+    append_frame(h2->outbuf, H2_SETTINGS, 0, 0, payload, len);
+    h2->settings_sent = 1;
+}
+
+static void send_window_update(LKHttp2Session *h2, unsigned int stream_id, unsigned int increment) {
+    char payload[4];
+    put_uint32(payload, increment & 0x7fffffff);
+    append_frame(h2->outbuf, H2_WINDOW_UPDATE, 0, stream_id, payload, sizeof(payload));
+}
+
+static void send_rst_stream(LKHttp2Session *h2, unsigned int stream_id, unsigned int errcode) {
+    char payload[4];
+    put_uint32(payload, errcode);
+    append_frame(h2->outbuf, H2_RST_STREAM, 0, stream_id, payload, sizeof(payload));
+}
+
+// Send GOAWAY and stop processing input. The connection is closed once
+// outbuf has been sent.
+static void connection_error(LKHttp2Session *h2, unsigned int errcode) {
+    char payload[8];
+    put_uint32(payload, h2->last_stream_id);
+    put_uint32(payload+4, errcode);
+    append_frame(h2->outbuf, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+    h2->closing = 1;
+}
+
+
+/*** LKHttp2Stream functions ***/
+static LKHttp2Stream *stream_new(unsigned int id, int send_window) {
+    LKHttp2Stream *stream = lk_malloc(sizeof(LKHttp2Stream), "stream_new");
+    stream->id = id;
+    stream->req = lk_httprequest_new();
+    stream->resp = lk_httpresponse_new();
+    stream->send_window = send_window;
+    stream->recv_window = H2_DEFAULT_WINDOW_SIZE;
+    stream->max_body_size = 0;
+    stream->body_too_large = 0;
+    stream->recv_closed = 0;
+    stream->dispatched = 0;
+    stream->resp_submitted = 0;
+    stream->send_closed = 0;
+    stream->body_sent = 0;
+    stream->next = NULL;
+    return stream;
+}
+
+static void stream_free(LKHttp2Stream *stream) {
+    lk_httprequest_free(stream->req);
+    lk_httpresponse_free(stream->resp);
+    stream->req = NULL;
+    stream->resp = NULL;
+    stream->next = NULL;
+    lk_free(stream);
+}
+
+static LKHttp2Stream *find_stream(LKHttp2Session *h2, unsigned int id) {
+    LKHttp2Stream *stream = h2->streams;
+    while (stream != NULL) {
+        if (stream->id == id) {
+            break;
+        }
+        stream = stream->next;
+    }
+    return stream;
+}
+
+// Add stream to end of streams list.
+static void add_stream(LKHttp2Session *h2, LKHttp2Stream *stream) {
+    LKHttp2Stream **pp = &h2->streams;
+    while (*pp != NULL) {
+        pp = &(*pp)->next;
+    }
+    *pp = stream;
+    h2->nstreams++;
+}
+
+// Unlink stream from streams list and free it.
+static void remove_stream(LKHttp2Session *h2, LKHttp2Stream *stream) {
+    if (h2->new_stream == stream) {
+        h2->new_stream = NULL;
+    }
+    LKHttp2Stream **pp = &h2->streams;
+    while (*pp != NULL) {
+        if (*pp == stream) {
+            *pp = stream->next;
+            h2->nstreams--;
+            break;
+        }
+        pp = &(*pp)->next;
+    }
+    stream_free(stream);
+}
+
+// Copy pseudo-header fields into req and remove them from req->headers.
+// Returns 0 for success, -1 for malformed request.
+static int set_request_pseudo_headers(LKHttpRequest *req) {
+    char *method = lk_headertable_get(req->headers, ":method");
+    char *path = lk_headertable_get(req->headers, ":path");
+    char *authority = lk_headertable_get(req->headers, ":authority");
+    if (method == NULL || path == NULL || strlen(path) == 0) {
+        return -1;
+    }
+
+    lk_string_assign(req->method, method);
+    lk_string_assign(req->uri, path);
+    lk_string_assign(req->version, "HTTP/2.0");
+    if (parse_uri(req->uri, req->path, req->filename, req->querystring) == -1) {
+        return -1;
+    }
+
+    // :authority takes the place of the Host header used for hostconfig
+    // lookup.
+    if (lk_headertable_get_id(req->headers, LK_HDR_HOST) == NULL && authority != NULL) {
+        lk_headertable_set(req->headers, "Host", authority);
+    }
+
+    lk_headertable_remove(req->headers, ":method");
+    lk_headertable_remove(req->headers, ":path");
+    lk_headertable_remove(req->headers, ":authority");
+    lk_headertable_remove(req->headers, ":scheme");
+    return 0;
+}
+
+
+/*** LKHttp2Session functions ***/
+LKHttp2Session *lk_http2session_new() {
+    LKHttp2Session *h2 = lk_malloc(sizeof(LKHttp2Session), "lk_http2session_new");
+    h2->inbuf = lk_buffer_new(0);
+    h2->outbuf = lk_buffer_new(0);
+    h2->headerblock = lk_buffer_new(0);
+    h2->decoder = lk_hpackdecoder_new(H2_HPACK_TABLE_SIZE);
+    h2->decoder->max_list_size = LK_MAX_HEAD_SIZE;
+    h2->decoder->max_fields = LK_MAX_HEADERS;
+    h2->streams = NULL;
+    h2->nstreams = 0;
+    h2->last_stream_id = 0;
+    h2->headers_stream_id = 0;
+    h2->headers_end_stream = 0;
+    h2->preface_received = 0;
+    h2->settings_sent = 0;
+    h2->send_window = H2_DEFAULT_WINDOW_SIZE;
+    h2->recv_window = H2_DEFAULT_WINDOW_SIZE;
+    h2->new_stream = NULL;
+    h2->peer_initial_window = H2_DEFAULT_WINDOW_SIZE;
+    h2->peer_max_frame_size = H2_DEFAULT_FRAME_SIZE;
+    h2->goaway_received = 0;
+    h2->closing = 0;
+    return h2;
+}
+
+void lk_http2session_free(LKHttp2Session *h2) {
+    LKHttp2Stream *stream = h2->streams;
+    while (stream != NULL) {
+        LKHttp2Stream *next = stream->next;
+        stream_free(stream);
+        stream = next;
+    }
+    lk_buffer_free(h2->inbuf);
+    lk_buffer_free(h2->outbuf);
+    lk_buffer_free(h2->headerblock);
+    lk_hpackdecoder_free(h2->decoder);
+
+    h2->inbuf = NULL;
+    h2->outbuf = NULL;
+    h2->headerblock = NULL;
+    h2->decoder = NULL;
+    h2->streams = NULL;
+    lk_free(h2);
+}
+
+// Apply SETTINGS payload sent by client.
+// Returns 0 for success or h2 error code.
+static unsigned int apply_settings(LKHttp2Session *h2, unsigned char *p, size_t len) {
+    for (size_t i=0; i+6 <= len; i += 6) {
+        int id = (p[i] << 8) | p[i+1];
+        unsigned int val = get_uint32(p+i+2);
+
+        if (id == H2_SETTINGS_ENABLE_PUSH) {
+            if (val > 1) {
+                return H2_PROTOCOL_ERROR;
+            }
+        } else if (id == H2_SETTINGS_INITIAL_WINDOW_SIZE) {
+            if (val > H2_MAX_WINDOW_SIZE) {
+                return H2_FLOW_CONTROL_ERROR;
+            }
+            // Adjust open stream windows by the difference.
+            long delta = (long) val - h2->peer_initial_window;
+            for (LKHttp2Stream *stream = h2->streams; stream != NULL; stream = stream->next) {
+                stream->send_window += delta;
+            }
+            h2->peer_initial_window = val;
+        } else if (id == H2_SETTINGS_MAX_FRAME_SIZE) {
+            if (val < H2_DEFAULT_FRAME_SIZE || val > 0xffffff) {
+                return H2_PROTOCOL_ERROR;
+            }
+            h2->peer_max_frame_size = val;
+        }
+        // Other settings don't affect us: our encoder doesn't use
+        // the dynamic table and we never push.
+    }
+    return 0;
+}
+
+// Decode base64url (RFC 4648 section 5) string without padding.
+// Returns 0 for success, -1 for invalid input.
+static int base64url_decode(char *s, LKBuffer *buf) {
+    unsigned int acc = 0;
+    int nbits = 0;
+    for (; *s != '\0'; s++) {
+        int c = *s;
+        int v;
+        if (c >= 'A' && c <= 'Z') v = c - 'A';
+        else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') v = c - '0' + 52;
+        else if (c == '-') v = 62;
+        else if (c == '_') v = 63;
+        else if (c == '=') break;
+        else return -1;
+
+        acc = (acc << 6) | v;
+        nbits += 6;
+        if (nbits >= 8) {
+            nbits -= 8;
+            char b = (acc >> nbits) & 0xff;
+            lk_buffer_append(buf, &b, 1);
+        }
+    }
+    return 0;
+}
+
+// Switch HTTP/1.1 connection to h2c after 'Upgrade: h2c' request.
+// settings is the HTTP2-Settings header value.
+// Sends 101 response and server preface. req becomes stream 1 and is
+// owned by the session afterwards.
+// Returns 0 for success, -1 if HTTP2-Settings is invalid (no upgrade).
+int lk_http2session_upgrade(LKHttp2Session *h2, LKHttpRequest *req, char *settings) {
+    LKBuffer *payload = lk_buffer_new(0);
+    int z = base64url_decode(settings, payload);
+    if (z == -1 || payload->bytes_len % 6 != 0 ||
+        apply_settings(h2, (unsigned char *) payload->bytes, payload->bytes_len) != 0) {
+        lk_buffer_free(payload);
+        return -1;
+    }
+    lk_buffer_free(payload);
+
+    lk_buffer_append_sz(h2->outbuf,
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Connection: Upgrade\r\n"
+        "Upgrade: h2c\r\n"
+        "\r\n");
+    send_settings(h2);
+
+    // Upgrade request is answered on stream 1, half-closed (remote).
+    LKHttp2Stream *stream = stream_new(1, h2->peer_initial_window);
+    lk_httprequest_free(stream->req);
+    stream->req = req;
+    stream->recv_closed = 1;
+    add_stream(h2, stream);
+    h2->last_stream_id = 1;
+    return 0;
+}
+
+// Parse complete frames in inbuf.
+// Parsing stops after the headers of a new stream, so its head can be
+// checked before any of its DATA is accepted. Call again after
+// lk_http2session_next_head() to continue.
+// Completed requests are returned by lk_http2session_next_request().
+void lk_http2session_recv(LKHttp2Session *h2) {
+    LKBuffer *buf = h2->inbuf;
+
+    if (!h2->preface_received && !h2->closing) {
+        if (buf->bytes_len - buf->bytes_cur < H2_PREFACE_LEN) {
+            return;
+        }
+        if (memcmp(buf->bytes + buf->bytes_cur, H2_PREFACE, H2_PREFACE_LEN)) {
+            connection_error(h2, H2_PROTOCOL_ERROR);
+            return;
+        }
+        buf->bytes_cur += H2_PREFACE_LEN;
+        h2->preface_received = 1;
+        if (!h2->settings_sent) {
+            send_settings(h2);
+        }
+    }
+
+    while (!h2->closing && h2->new_stream == NULL) {
+        size_t avail = buf->bytes_len - buf->bytes_cur;
+        if (avail < H2_FRAME_HEADER_LEN) {
+            break;
+        }
+        unsigned char *p = (unsigned char *) buf->bytes + buf->bytes_cur;
+        size_t len = (p[0] << 16) | (p[1] << 8) | p[2];
+        int type = p[3];
+        int flags = p[4];
+        unsigned int stream_id = get_uint32(p+5) & 0x7fffffff;
+
+        // We advertise the default SETTINGS_MAX_FRAME_SIZE.
+        if (len > H2_DEFAULT_FRAME_SIZE) {
+            connection_error(h2, H2_FRAME_SIZE_ERROR);
+            break;
+        }
+        if (avail < H2_FRAME_HEADER_LEN + len) {
+            break;
+        }
+        buf->bytes_cur += H2_FRAME_HEADER_LEN + len;
+        process_frame(h2, type, flags, stream_id, p + H2_FRAME_HEADER_LEN, len);
+    }
+
+    // Discard parsed bytes.
+    if (buf->bytes_cur >= buf->bytes_len) {
+        lk_buffer_clear(buf);
+    } else if (buf->bytes_cur > 0) {
+        size_t nremaining = buf->bytes_len - buf->bytes_cur;
+        memmove(buf->bytes, buf->bytes + buf->bytes_cur, nremaining);
+        buf->bytes_len = nremaining;
+        buf->bytes_cur = 0;
+    }
+}
+
+// Remove padding from DATA and HEADERS payload.
+// Returns 0 for success, -1 for invalid padding.
+static int strip_padding(int flags, unsigned char **pp, size_t *plen) {
+    if (!(flags & H2_FLAG_PADDED)) {
+        return 0;
+    }
+    if (*plen < 1) {
+        return -1;
+    }
+    size_t padlen = (*pp)[0];
+    (*pp)++;
+    (*plen)--;
+    if (padlen > *plen) {
+        return -1;
+    }
+    *plen -= padlen;
+    return 0;
+}
+
+// Return n bytes of connection window once the DATA holding them
+// has been stored or dropped.
+static void release_recv_window(LKHttp2Session *h2, size_t n) {
+    if (n == 0) {
+        return;
+    }
+    h2->recv_window += n;
+    send_window_update(h2, 0, n);
+}
+
+static void process_data(LKHttp2Session *h2, int flags, unsigned int stream_id, unsigned char *p, size_t len) {
+    if (stream_id == 0) {
+        connection_error(h2, H2_PROTOCOL_ERROR);
+        return;
+    }
+    if (stream_id > h2->last_stream_id) {
+        // DATA on idle stream.
+        connection_error(h2, H2_PROTOCOL_ERROR);
+        return;
+    }
+    // Whole frame counts against flow control, including padding.
+    size_t frame_len = len;
+    if ((long) frame_len > h2->recv_window) {
+        connection_error(h2, H2_FLOW_CONTROL_ERROR);
+        return;
+    }
+    h2->recv_window -= frame_len;
+
+    LKHttp2Stream *stream = find_stream(h2, stream_id);
+    if (stream == NULL || stream->recv_closed) {
+        release_recv_window(h2, frame_len);
+        send_rst_stream(h2, stream_id, H2_STREAM_CLOSED);
+        return;
+    }
+    if ((long) frame_len > stream->recv_window) {
+        release_recv_window(h2, frame_len);
+        send_rst_stream(h2, stream_id, H2_FLOW_CONTROL_ERROR);
+        remove_stream(h2, stream);
+        return;
+    }
+    stream->recv_window -= frame_len;
+    if (strip_padding(flags, &p, &len) == -1) {
+        connection_error(h2, H2_PROTOCOL_ERROR);
+        return;
+    }
+    if (flags & H2_FLAG_END_STREAM) {
+        stream->recv_closed = 1;
+    }
+
+    // Drop body over max_body_size. The stream window isn't opened
+    // again, so the client stops sending until the 413 response.
+    if (!stream->body_too_large && stream->max_body_size > 0 &&
+        stream->req->body->bytes_len + len > stream->max_body_size) {
+        stream->body_too_large = 1;
+        lk_buffer_clear(stream->req->body);
+    }
+    if (stream->body_too_large) {
+        release_recv_window(h2, frame_len);
+        return;
+    }
+
+    // Let client send more once the data is stored in the request.
+    lk_httprequest_append_body(stream->req, (char *) p, len);
+    release_recv_window(h2, frame_len);
+    if (!stream->recv_closed && frame_len > 0) {
+        stream->recv_window += frame_len;
+        send_window_update(h2, stream_id, frame_len);
+    }
+}
+
+static void process_headers(LKHttp2Session *h2, int flags, unsigned int stream_id, unsigned char *p, size_t len) {
+    if (stream_id == 0) {
+        connection_error(h2, H2_PROTOCOL_ERROR);
+        return;
+    }
+    if (strip_padding(flags, &p, &len) == -1) {
+        connection_error(h2, H2_PROTOCOL_ERROR);
+        return;
+    }
+    // Skip stream dependency and weight. Priority is not used.
+    if (flags & H2_FLAG_PRIORITY) {
+        if (len < 5) {
+            connection_error(h2, H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        p += 5;
+        len -= 5;
+    }
+
+    lk_buffer_clear(h2->headerblock);
+    lk_buffer_append(h2->headerblock, (char *) p, len);
+    h2->headers_stream_id = stream_id;
+    h2->headers_end_stream = flags & H2_FLAG_END_STREAM;
+    if (flags & H2_FLAG_END_HEADERS) {
+        end_headers(h2);
+    }
+}
+
+static void process_continuation(LKHttp2Session *h2, int flags, unsigned int stream_id, unsigned char *p, size_t len) {
+    if (h2->headers_stream_id == 0 || stream_id != h2->headers_stream_id) {
+        connection_error(h2, H2_PROTOCOL_ERROR);
+        return;
+    }
+    if (h2->headerblock->bytes_len + len > H2_MAX_HEADERBLOCK_SIZE) {
+        connection_error(h2, H2_ENHANCE_YOUR_CALM);
+        return;
+    }
+    lk_buffer_append(h2->headerblock, (char *) p, len);
+    if (flags & H2_FLAG_END_HEADERS) {
+        end_headers(h2);
+    }
+}
+
+// Complete header block received. Decode it into a new stream request,
+// or into the existing stream's headers for trailers.
+static void end_headers(LKHttp2Session *h2) {
+    unsigned int stream_id = h2->headers_stream_id;
+    int end_stream = h2->headers_end_stream;
+    h2->headers_stream_id = 0;
+    h2->headers_end_stream = 0;
+
+    LKHttp2Stream *stream = find_stream(h2, stream_id);
+    if (stream != NULL) {
+        // Trailers
+        int z = lk_hpackdecoder_decode(h2->decoder, h2->headerblock->bytes, h2->headerblock->bytes_len, stream->req->headers);
+        if (z != 0) {
+            connection_error(h2, z == -2 ? H2_ENHANCE_YOUR_CALM : H2_COMPRESSION_ERROR);
+            return;
+        }
+        if (stream->recv_closed || !end_stream) {
+            send_rst_stream(h2, stream_id, stream->recv_closed ? H2_STREAM_CLOSED : H2_PROTOCOL_ERROR);
+            remove_stream(h2, stream);
+            return;
+        }
+        stream->recv_closed = 1;
+        return;
+    }
+
+    // New streams must use increasing odd ids.
+    if (stream_id % 2 == 0 || stream_id <= h2->last_stream_id) {
+        connection_error(h2, H2_PROTOCOL_ERROR);
+        return;
+    }
+    h2->last_stream_id = stream_id;
+
+    // Always decode to keep the HPACK dynamic table in sync,
+    // even if the stream is refused.
+    stream = stream_new(stream_id, h2->peer_initial_window);
+    int z = lk_hpackdecoder_decode(h2->decoder, h2->headerblock->bytes, h2->headerblock->bytes_len, stream->req->headers);
+    if (z != 0) {
+        // Decoding stopped part way, the dynamic table is out of sync.
+        stream_free(stream);
+        connection_error(h2, z == -2 ? H2_ENHANCE_YOUR_CALM : H2_COMPRESSION_ERROR);
+        return;
+    }
+    if (h2->goaway_received || h2->nstreams >= H2_MAX_CONCURRENT_STREAMS) {
+        stream_free(stream);
+        send_rst_stream(h2, stream_id, H2_REFUSED_STREAM);
+        return;
+    }
+    if (set_request_pseudo_headers(stream->req) == -1) {
+        stream_free(stream);
+        send_rst_stream(h2, stream_id, H2_PROTOCOL_ERROR);
+        return;
+    }
+    stream->recv_closed = end_stream;
+    add_stream(h2, stream);
+    h2->new_stream = stream;
+}
+
+static void process_settings(LKHttp2Session *h2, int flags, unsigned int stream_id, unsigned char *p, size_t len) {
+    if (stream_id != 0) {
+        connection_error(h2, H2_PROTOCOL_ERROR);
+        return;
+    }
+    if (flags & H2_FLAG_ACK) {
+        if (len != 0) {
+            connection_error(h2, H2_FRAME_SIZE_ERROR);
+        }
+        return;
+    }
+    if (len % 6 != 0) {
+        connection_error(h2, H2_FRAME_SIZE_ERROR);
+        return;
+    }
+    unsigned int errcode = apply_settings(h2, p, len);
+    if (errcode != 0) {
+        connection_error(h2, errcode);
+        return;
+    }
+    append_frame(h2->outbuf, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+}
+
+static void process_window_update(LKHttp2Session *h2, unsigned int stream_id, unsigned char *p, size_t len) {
+    if (len != 4) {
+        connection_error(h2, H2_FRAME_SIZE_ERROR);
+        return;
+    }
+    unsigned int increment = get_uint32(p) & 0x7fffffff;
+
+    if (stream_id == 0) {
+        if (increment == 0 || h2->send_window + increment > H2_MAX_WINDOW_SIZE) {
+            connection_error(h2, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+            return;
+        }
+        h2->send_window += increment;
+        return;
+    }
+
+    LKHttp2Stream *stream = find_stream(h2, stream_id);
+    if (stream == NULL) {
+        return;
+    }
+    if (increment == 0 || stream->send_window + increment > H2_MAX_WINDOW_SIZE) {
+        send_rst_stream(h2, stream_id, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+        remove_stream(h2, stream);
+        return;
+    }
+    stream->send_window += increment;
+}
+
+static void process_frame(LKHttp2Session *h2, int type, int flags, unsigned int stream_id, unsigned char *p, size_t len) {
+    // A header block must be followed by its CONTINUATION frames only.
+    if (h2->headers_stream_id != 0 && type != H2_CONTINUATION) {
+        connection_error(h2, H2_PROTOCOL_ERROR);
+        return;
+    }
+
+    if (type == H2_DATA) {
+        process_data(h2, flags, stream_id, p, len);
+    } else if (type == H2_HEADERS) {
+        process_headers(h2, flags, stream_id, p, len);
+    } else if (type == H2_CONTINUATION) {
+        process_continuation(h2, flags, stream_id, p, len);
+    } else if (type == H2_PRIORITY) {
+        if (stream_id == 0) {
+            connection_error(h2, H2_PROTOCOL_ERROR);
+        } else if (len != 5) {
+            send_rst_stream(h2, stream_id, H2_FRAME_SIZE_ERROR);
+        }
+    } else if (type == H2_RST_STREAM) {
+        if (stream_id == 0 || stream_id > h2->last_stream_id) {
+            connection_error(h2, H2_PROTOCOL_ERROR);
+            return;
+        }
+        if (len != 4) {
+            connection_error(h2, H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        LKHttp2Stream *stream = find_stream(h2, stream_id);
+        if (stream != NULL) {
+            remove_stream(h2, stream);
+        }
+    } else if (type == H2_SETTINGS) {
+        process_settings(h2, flags, stream_id, p, len);
+    } else if (type == H2_PUSH_PROMISE) {
+        // Clients can't push.
+        connection_error(h2, H2_PROTOCOL_ERROR);
+    } else if (type == H2_PING) {
+        if (stream_id != 0) {
+            connection_error(h2, H2_PROTOCOL_ERROR);
+            return;
+        }
+        if (len != 8) {
+            connection_error(h2, H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        if (!(flags & H2_FLAG_ACK)) {
+            append_frame(h2->outbuf, H2_PING, H2_FLAG_ACK, 0, (char *) p, len);
+        }
+    } else if (type == H2_GOAWAY) {
+        if (stream_id != 0) {
+            connection_error(h2, H2_PROTOCOL_ERROR);
+            return;
+        }
+        h2->goaway_received = 1;
+    } else if (type == H2_WINDOW_UPDATE) {
+        process_window_update(h2, stream_id, p, len);
+    }
+    // Unknown frame types are ignored.
+}
+
+// Return stream whose headers were just received, or NULL if none.
+// Set its max_body_size, or body_too_large to answer it right away,
+// before calling lk_http2session_recv() again.
+LKHttp2Stream *lk_http2session_next_head(LKHttp2Session *h2) {
+    LKHttp2Stream *stream = h2->new_stream;
+    h2->new_stream = NULL;
+    return stream;
+}
+
+// Return next stream with a complete request that hasn't been
+// dispatched yet, or NULL if none.
+// Streams with body_too_large are returned without waiting for the
+// rest of the body.
+LKHttp2Stream *lk_http2session_next_request(LKHttp2Session *h2) {
+    if (h2->closing) {
+        return NULL;
+    }
+    for (LKHttp2Stream *stream = h2->streams; stream != NULL; stream = stream->next) {
+        if ((stream->recv_closed || stream->body_too_large) && !stream->dispatched) {
+            stream->dispatched = 1;
+            return stream;
+        }
+    }
+    return NULL;
+}
+
+// Return whether response header is left out of HTTP/2 response.
+// Connection-specific headers are not allowed and Content-Length is
+// generated from the body.
+static int skip_response_header(char *k) {
+    if (!strcasecmp(k, "Connection")        ||
+        !strcasecmp(k, "Keep-Alive")        ||
+        !strcasecmp(k, "Proxy-Connection")  ||
+        !strcasecmp(k, "Transfer-Encoding") ||
+        !strcasecmp(k, "Upgrade")           ||
+        !strcasecmp(k, "Content-Length")) {
+        return 1;
+    }
+    return 0;
+}
+
+// Return body to send in DATA frames. Pre-rendered pages are sent from
+// the shared page body.
+static LKBuffer *response_body(LKHttpResponse *resp) {
+    if (resp->page != NULL) {
+        return resp->page->body;
+    }
+    return resp->body;
+}
+
+// Queue HEADERS frame for stream->resp. Body is sent in DATA frames
+// by lk_http2session_send() as flow control allows.
+void lk_http2session_submit_response(LKHttp2Session *h2, LKHttp2Stream *stream) {
+    LKHttpRequest *req = stream->req;
+    LKHttpResponse *resp = stream->resp;
+    LKBuffer *body = response_body(resp);
+
+    // Default to 200 OK if no status set.
+    if (resp->status == 0) {
+        resp->status = 200;
+        lk_string_assign(resp->statustext, "OK");
+    }
+    lk_string_assign(resp->version, "HTTP/2.0");
+
+    // HEAD response has no DATA, but advertises the body length.
+    int head_only = lk_string_sz_equal(req->method, "HEAD");
+
+    LKBuffer *block = lk_buffer_new(0);
+    char numstr[24];
+    snprintf(numstr, sizeof(numstr), "%d", resp->status);
+    lk_hpack_encode_header(block, ":status", numstr);
+    if (resp->status != 304) {
+        snprintf(numstr, sizeof(numstr), "%ld", body->bytes_len);
+        lk_hpack_encode_header(block, "content-length", numstr);
+    }
+    // Page responses only have the page's Content-Type, as in http/1.
+    if (resp->page != NULL) {
+        lk_hpack_encode_header(block, "content-type", resp->page->content_type->s);
+    }
+
+    // Field names must be lowercase in HTTP/2.
+    LKString *k = lk_string_new("");
+    for (int i=0; resp->page == NULL && i < resp->headers->items_len; i++) {
+        LKHeaderItem *item = &resp->headers->items[i];
+        if (skip_response_header(item->k->s)) {
+            continue;
+        }
+        lk_string_assign(k, item->k->s);
+        for (int j=0; j < k->s_len; j++) {
+            k->s[j] = tolower(k->s[j]);
+        }
+        lk_hpack_encode_header(block, k->s, item->v->s);
+    }
+    lk_string_free(k);
+
+    int end_stream = head_only || body->bytes_len == 0;
+
+    // Split header block into HEADERS and CONTINUATION frames.
+    size_t sent = 0;
+    int type = H2_HEADERS;
+    while (1) {
+        size_t n = block->bytes_len - sent;
+        if (n > h2->peer_max_frame_size) {
+            n = h2->peer_max_frame_size;
+        }
+        int flags = 0;
+        if (type == H2_HEADERS && end_stream) {
+            flags |= H2_FLAG_END_STREAM;
+        }
+        if (sent + n == block->bytes_len) {
+            flags |= H2_FLAG_END_HEADERS;
+        }
+        append_frame(h2->outbuf, type, flags, stream->id, block->bytes + sent, n);
+        sent += n;
+        if (sent == block->bytes_len) {
+            break;
+        }
+        type = H2_CONTINUATION;
+    }
+    lk_buffer_free(block);
+
+    stream->resp_submitted = 1;
+    if (end_stream) {
+        end_response(h2, stream);
+    }
+}
+
+// Response fully queued, free the stream. If the client is still
+// sending a request body, ask it to stop without error.
+static void end_response(LKHttp2Session *h2, LKHttp2Stream *stream) {
+    stream->send_closed = 1;
+    if (!stream->recv_closed) {
+        send_rst_stream(h2, stream->id, H2_NO_ERROR);
+    }
+    remove_stream(h2, stream);
+}
+
+// Queue DATA frames for stream within flow control windows.
+static void send_stream_data(LKHttp2Session *h2, LKHttp2Stream *stream) {
+    LKBuffer *body = response_body(stream->resp);
+    LKBuffer *outbuf = h2->outbuf;
+
+    while (outbuf->bytes_len - outbuf->bytes_cur < H2_OUTBUF_HIGHWATER) {
+        size_t nremaining = body->bytes_len - stream->body_sent;
+        long n = nremaining;
+        if (n > h2->peer_max_frame_size) {
+            n = h2->peer_max_frame_size;
+        }
+        if (n > h2->send_window) {
+            n = h2->send_window;
+        }
+        if (n > stream->send_window) {
+            n = stream->send_window;
+        }
+        // Blocked until client sends WINDOW_UPDATE.
+        if (n <= 0) {
+            return;
+        }
+
+        int flags = (n == nremaining) ? H2_FLAG_END_STREAM : 0;
+        append_frame(outbuf, H2_DATA, flags, stream->id, body->bytes + stream->body_sent, n);
+        stream->body_sent += n;
+        stream->send_window -= n;
+        h2->send_window -= n;
+
+        if (flags & H2_FLAG_END_STREAM) {
+            end_response(h2, stream);
+            return;
+        }
+    }
+}
+
+// Send queued frames and as much response DATA as flow control allows.
+// Returns one of the following:
+//    0 (Z_EOF) for all queued bytes sent
+//   -1 (Z_ERR) for error
+//   -2 (Z_BLOCK) for blocked socket, bytes still queued
+int lk_http2session_send(LKHttp2Session *h2, int fd) {
+    LKBuffer *outbuf = h2->outbuf;
+    while (1) {
+        if (!h2->closing) {
+            LKHttp2Stream *stream = h2->streams;
+            while (stream != NULL && outbuf->bytes_len - outbuf->bytes_cur < H2_OUTBUF_HIGHWATER) {
+                LKHttp2Stream *next = stream->next;
+                if (stream->resp_submitted && !stream->send_closed) {
+                    send_stream_data(h2, stream);
+                }
+                stream = next;
+            }
+        }
+        if (outbuf->bytes_cur >= outbuf->bytes_len) {
+            lk_buffer_clear(outbuf);
+            return Z_EOF;
+        }
+        int z = lk_write_all_sock(fd, outbuf);
+        if (z != Z_EOF) {
+            return z;
+        }
+        lk_buffer_clear(outbuf);
+    }
+}
+
+// Return whether connection should be closed: a connection error
+// occured, or client sent GOAWAY and all streams are complete.
+int lk_http2session_done(LKHttp2Session *h2) {
+    if (h2->closing) {
+        return 1;
+    }
+    if (h2->goaway_received && h2->nstreams == 0) {
+        return 1;
+    }
+    return 0;
+}
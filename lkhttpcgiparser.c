@@ -3,77 +3,150 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
 #include "lklib.h"
 #include "lknet.h"
 
-void parse_cgi_header_line(char *line, LKHttpResponse *resp);
+// CGI output is a block of header lines, a blank line, then the body.
+// Header lines are parsed from the cgi output buffer as they arrive so
+// the response can be sent before the script exits. Lines aren't copied
+// and have no length limit, the body is left in place at body_pos.
 
-void parse_cgi_output(LKBuffer *buf, LKHttpResponse *resp) {
-    char cgiline[LK_BUFSIZE_MEDIUM];
-    int has_crlf = 0;
+static void parse_cgi_header_line(LKHttpCgiParser *parser, char *line, size_t line_len, LKHttpResponse *resp);
 
-    // Parse cgi_outputbuf line by line into http response.
-    while (buf->bytes_cur < buf->bytes_len) {
-        lk_buffer_readline(buf, cgiline, sizeof(cgiline));
-        lk_chomp(cgiline);
+LKHttpCgiParser *lk_httpcgiparser_new() {
+    LKHttpCgiParser *parser = lk_malloc(sizeof(LKHttpCgiParser), "lk_httpcgiparser_new");
+    parser->max_head_size = LK_MAX_HEAD_SIZE;
+    lk_httpcgiparser_reset(parser);
+    return parser;
+}
+
+void lk_httpcgiparser_free(LKHttpCgiParser *parser) {
+    lk_free(parser);
+}
+
+// Clear any pending state. Limits are kept.
+void lk_httpcgiparser_reset(LKHttpCgiParser *parser) {
+    parser->pos = 0;
+    parser->body_pos = 0;
+    parser->head_complete = 0;
+    parser->has_status = 0;
+}
+
+// Output without a head is sent as is, as text/plain.
+// Ex. an interpreter error message.
+static void set_plain_output(LKHttpCgiParser *parser, LKHttpResponse *resp) {
+    if (lk_headertable_get_id(resp->headers, LK_HDR_CONTENT_TYPE) == NULL) {
+        lk_headertable_set(resp->headers, "Content-Type", "text/plain");
+        parser->body_pos = 0;
+    } else {
+        parser->body_pos = parser->pos;
+    }
+    parser->head_complete = 1;
+}
 
-        // Empty CRLF line ends the headers section
-        if (is_empty_line(cgiline)) {
-            has_crlf = 1;
+// Parse any complete header lines in buf received since the last call.
+// Returns 1 when the blank line ending the head is found, body bytes
+// follow from parser->body_pos.
+int lk_httpcgiparser_parse(LKHttpCgiParser *parser, LKBuffer *buf, LKHttpResponse *resp) {
+    while (!parser->head_complete) {
+        char *line = buf->bytes + parser->pos;
+        size_t len = buf->bytes_len - parser->pos;
+        char *eol = lk_scan_char(line, len, '\n');
+        if (eol == NULL) {
+            if (len > parser->max_head_size) {
+                set_plain_output(parser, resp);
+            }
             break;
         }
-        parse_cgi_header_line(cgiline, resp);
-    }
-    if (buf->bytes_cur < buf->bytes_len) {
-        lk_buffer_append(
-            resp->body,
-            buf->bytes + buf->bytes_cur,
-            buf->bytes_len - buf->bytes_cur
-        );
-    }
+        size_t line_len = eol - line;
+        parser->pos += line_len+1;
+        if (line_len > 0 && line[line_len-1] == '\r') {
+            line_len--;
+        }
 
-    char *content_type = lk_stringtable_get(resp->headers, "Content-Type");
+        // Empty line ends the headers section
+        if (line_len == 0) {
+            parser->body_pos = parser->pos;
+            parser->head_complete = 1;
+            break;
+        }
+        parse_cgi_header_line(parser, line, line_len, resp);
 
-    // If cgi error
-    // copy cgi output as is to display the error messages.
-    if (!has_crlf && content_type == NULL) {
-        lk_stringtable_set(resp->headers, "Content-Type", "text/plain");
-        lk_buffer_clear(resp->body);
-        lk_buffer_append(resp->body, buf->bytes, buf->bytes_len);
+        if (parser->pos > parser->max_head_size) {
+            set_plain_output(parser, resp);
+        }
     }
+    return parser->head_complete;
 }
 
-// Parse header line in the format Ex. User-Agent: browser
-void parse_cgi_header_line(char *line, LKHttpResponse *resp) {
-    char *saveptr;
-    char *delim = ":";
-
-    char *linetmp = lk_strdup(line, "parse_cgi_header_line");
-    lk_chomp(linetmp);
-    char *k = strtok_r(linetmp, delim, &saveptr);
-    if (k == NULL) {
-        lk_free(linetmp);
+// Complete the head at cgi output EOF.
+// A last line without newline is parsed as a header, output that ends
+// before a blank line is sent as is.
+void lk_httpcgiparser_finish(LKHttpCgiParser *parser, LKBuffer *buf, LKHttpResponse *resp) {
+    if (lk_httpcgiparser_parse(parser, buf, resp)) {
         return;
     }
-    char *v = strtok_r(NULL, delim, &saveptr);
-    if (v == NULL) {
-        v = "";
+    if (parser->pos < buf->bytes_len) {
+        char *line = buf->bytes + parser->pos;
+        size_t line_len = buf->bytes_len - parser->pos;
+        parser->pos = buf->bytes_len;
+        // Room for the terminator written after the line.
+        if (buf->bytes_size == buf->bytes_len) {
+            lk_buffer_resize(buf, buf->bytes_size+1);
+            line = buf->bytes + buf->bytes_len - line_len;
+        }
+        if (line[line_len-1] == '\r') {
+            line_len--;
+        }
+        parse_cgi_header_line(parser, line, line_len, resp);
     }
+    set_plain_output(parser, resp);
+}
 
-    // skip over leading whitespace
-    while (*v == ' ' || *v == '\t') {
-        v++;
+// Parse header line in the format Ex. User-Agent: browser
+// Value is everything after the first ':'
+// Ex. "Location: http://localhost/index.html"
+//
+// Status sets the response status line and isn't passed on as a header.
+// Ex. "Status: 404 Not Found"
+// Location without Status is a redirect to the client.
+static void parse_cgi_header_line(LKHttpCgiParser *parser, char *line, size_t line_len, LKHttpResponse *resp) {
+    LKStrView k, v;
+    if (!lk_sv_split2(lk_sv_buf(line, line_len), ":", &k, &v) || k.len == 0) {
+        return;
     }
-    lk_httpresponse_add_header(resp, k, v);
+    v = lk_sv_trim(v);
 
-    if (!strcasecmp(k, "Status")) {
-        int status = atoi(v);
-        resp->status = status;
+    // Null terminate k and v in place for the header table, the line
+    // bytes are restored after as they may still be sent as output.
+    char k_end = k.p[k.len];
+    char v_end = v.p[v.len];
+    k.p[k.len] = '\0';
+    v.p[v.len] = '\0';
+
+    LKHeaderId id = lk_header_id(k.p);
+    if (id == LK_HDR_STATUS) {
+        char *text = NULL;
+        resp->status = strtol(v.p, &text, 10);
+        while (*text == ' ' || *text == '\t') {
+            text++;
+        }
+        lk_string_assign(resp->statustext, text);
+        parser->has_status = 1;
+    } else {
+        // Repeated headers such as Set-Cookie are each kept.
+        lk_headertable_append(resp->headers, k.p, v.p);
+        if (id == LK_HDR_LOCATION && !parser->has_status) {
+            resp->status = 302;
+            lk_string_assign(resp->statustext, "Found");
+        }
     }
 
-    lk_free(linetmp);
+    k.p[k.len] = k_end;
+    v.p[v.len] = v_end;
 }
 
@@ -1,6 +1,7 @@
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
@@ -9,193 +10,319 @@
 #include "lklib.h"
 #include "lknet.h"
 
-void parse_line(LKHttpRequestParser *parser, char *line, LKHttpRequest *req);
-void parse_request_line(char *line, LKHttpRequest *req);
-static void parse_header_line(LKHttpRequestParser *parser, char *line, LKHttpRequest *req);
-void parse_uri(LKString *lks_uri, LKString *lks_path, LKString *lks_filename, LKString *lks_qs);
+static void parse_request_line(LKHttpRequestParser *parser, char *p, size_t off, size_t len, LKHttpRequest *req);
+static void parse_header_line(LKHttpRequestParser *parser, char *p, size_t off, size_t len);
+static int parse_content_length(char *v, size_t *content_length);
+static LKHeaderSpan *add_header_span(LKHttpRequestParser *parser);
+int parse_uri(LKString *lks_uri, LKString *lks_path, LKString *lks_filename, LKString *lks_qs);
 
 /*** LKHttpRequestParser functions ***/
 LKHttpRequestParser *lk_httprequestparser_new() {
     LKHttpRequestParser *parser = lk_malloc(sizeof(LKHttpRequestParser), "lk_httprequest_parser_new");
-    parser->partial_line = lk_string_new("");
     parser->nlinesread = 0;
     parser->content_length = 0;
+    parser->error_status = 0;
+    parser->head_len = 0;
+    parser->nheaders = 0;
+    parser->max_request_line = LK_MAX_REQUEST_LINE;
+    parser->max_head_size = LK_MAX_HEAD_SIZE;
+    parser->max_headers = LK_MAX_HEADERS;
     parser->head_complete = 0;
     parser->body_complete = 0;
+    memset(&parser->method, 0, sizeof(LKSpan));
+    memset(&parser->uri, 0, sizeof(LKSpan));
+    memset(&parser->version, 0, sizeof(LKSpan));
+    parser->header_spans = parser->inline_header_spans;
+    parser->header_spans_size = LK_INLINE_HEADER_SPANS;
     return parser;
 }
 
 void lk_httprequestparser_free(LKHttpRequestParser *parser) {
-    lk_string_free(parser->partial_line);
-    parser->partial_line = NULL;
+    if (parser->header_spans != parser->inline_header_spans) {
+        lk_free(parser->header_spans);
+    }
+    parser->header_spans = NULL;
     lk_free(parser);
 }
 
-// Clear any pending state.
+// Clear any pending state. Limits are kept.
 void lk_httprequestparser_reset(LKHttpRequestParser *parser) {
-    lk_string_assign(parser->partial_line, "");
     parser->nlinesread = 0;
     parser->content_length = 0;
+    parser->error_status = 0;
+    parser->head_len = 0;
+    parser->nheaders = 0;
     parser->head_complete = 0;
     parser->body_complete = 0;
 }
 
-// Parse one line and cumulatively compile results into req.
+// Parse request head in place from p[0..len), the bytes received so far.
+// When more bytes arrive, call again with them appended after the same
+// start. Parsing resumes after the last complete line, and nothing is
+// copied or concatenated.
+// Line terminators and token delimiters are overwritten with '\0', and
+// tokens are recorded as spans (offsets from p), so p may be moved between
+// calls. The request line is set into req as soon as it is parsed, the
+// headers when the head is complete.
 // You can check the state of the parser through the following fields:
 // parser->head_complete   Request Line and Headers complete
 // parser->body_complete   httprequest is complete
-void lk_httprequestparser_parse_line(LKHttpRequestParser *parser, LKString *line, LKHttpRequest *req) {
-    // If there's a previous partial line, combine it with current line.
-    if (parser->partial_line->s_len > 0) {
-        lk_string_append(parser->partial_line, line->s);
-        if (lk_string_ends_with(parser->partial_line, "\n")) {
-            parse_line(parser, parser->partial_line->s, req);
-            lk_string_assign(parser->partial_line, "");
-        }
-        return;
+// parser->error_status    nonzero if request is malformed or exceeds limits
+// Returns number of head bytes once head is complete, 0 otherwise.
+size_t lk_httprequestparser_parse_head(LKHttpRequestParser *parser, char *p, size_t len, LKHttpRequest *req) {
+    if (parser->head_complete) {
+        return parser->head_len;
     }
-
-    // If current line is only partial line (not newline terminated), remember it for
-    // next read.
-    if (!lk_string_ends_with(line, "\n")) {
-        lk_string_assign(parser->partial_line, line->s);
-        return;
+    if (parser->error_status) {
+        return 0;
     }
 
-    parse_line(parser, line->s, req);
-}
+    while (parser->head_len < len) {
+        size_t off = parser->head_len;
+        char *line = p + off;
+        char *nl = lk_scan_char(line, len - off, '\n');
+        size_t line_len = (nl != NULL) ? (size_t)(nl - line) + 1 : len - off;
 
-void parse_line(LKHttpRequestParser *parser, char *line, LKHttpRequest *req) {
-    // First line: parse initial request line.
-    if (parser->nlinesread == 0) {
-        parse_request_line(line, req);
+        // Check limits before waiting for the rest of a partial line.
+        if (parser->nlinesread == 0 && parser->max_request_line > 0 && line_len > parser->max_request_line) {
+            parser->error_status = 400;
+            return 0;
+        }
+        if (parser->max_head_size > 0 && off + line_len > parser->max_head_size) {
+            parser->error_status = 431;
+            return 0;
+        }
+        if (nl == NULL) {
+            return 0;
+        }
+
+        parser->head_len += line_len;
         parser->nlinesread++;
-        return;
-    }
 
-    parser->nlinesread++;
+        // Strip "\n" or "\r\n" line ending.
+        size_t n = line_len - 1;
+        if (n > 0 && line[n-1] == '\r') {
+            n--;
+        }
+        line[n] = '\0';
+
+        // First line: parse initial request line.
+        if (parser->nlinesread == 1) {
+            parse_request_line(parser, p, off, n, req);
+
+            // HTTP/2 preface "PRI * HTTP/2.0" is not followed by an http/1
+            // head. Stop here so the caller can switch protocols.
+            if (lk_string_sz_equal(req->method, "PRI") &&
+                lk_string_sz_equal(req->uri, "*") &&
+                lk_string_sz_equal(req->version, "HTTP/2.0")) {
+                parser->error_status = 0;
+                return 0;
+            }
+            // Any other HTTP/2+ request line can't be followed by an
+            // http/1 head either.
+            if (lk_string_starts_with(req->version, "HTTP/") &&
+                !lk_string_starts_with(req->version, "HTTP/1.")) {
+                parser->error_status = 505;
+                return 0;
+            }
+            continue;
+        }
 
-    // Header lines
-    if (!parser->head_complete) {
-        // Empty CRLF line ends the headers section
-        if (is_empty_line(line)) {
+        // Empty line ends the headers section
+        if (n == 0) {
             parser->head_complete = 1;
 
             // No body to read (Content-Length: 0)
             if (parser->content_length == 0) {
                 parser->body_complete = 1;
             }
-            return;
+            lk_headertable_reserve(req->headers, parser->nheaders);
+            for (int i=0; i < parser->nheaders; i++) {
+                LKHeaderSpan *h = &parser->header_spans[i];
+                lk_httprequest_add_header(req, p + h->name.off, p + h->value.off);
+            }
+            return parser->head_len;
         }
-        parse_header_line(parser, line, req);
-        return;
+
+        if (parser->max_headers > 0 && parser->nheaders >= parser->max_headers) {
+            parser->error_status = 431;
+            return 0;
+        }
+        parse_header_line(parser, p, off, n);
     }
+    return 0;
 }
 
 // Parse initial request line in the format:
 // GET /path/to/index.html HTTP/1.0
-void parse_request_line(char *line, LKHttpRequest *req) {
-    char *toks[3];
-    int ntoksread = 0;
-
-    char *saveptr;
-    char *delim = " \t";
-    char *linetmp = lk_strdup(line, "parse_request_line");
-    lk_chomp(linetmp);
-    char *p = linetmp;
-    while (ntoksread < 3) {
-        toks[ntoksread] = strtok_r(p, delim, &saveptr);
-        if (toks[ntoksread] == NULL) {
-            break;
+static void parse_request_line(LKHttpRequestParser *parser, char *p, size_t off, size_t len, LKHttpRequest *req) {
+    LKSpan *toks[3] = {&parser->method, &parser->uri, &parser->version};
+    size_t i = off;
+    size_t end = off + len;
+
+    // Missing tokens are left as empty spans at the line terminator.
+    for (int t=0; t < 3; t++) {
+        while (i < end && (p[i] == ' ' || p[i] == '\t')) {
+            i++;
+        }
+        toks[t]->off = i;
+        char *ws = lk_scan_ws(p + i, end - i);
+        i = (ws != NULL) ? (size_t)(ws - p) : end;
+        toks[t]->len = i - toks[t]->off;
+        if (i < end) {
+            p[i] = '\0';
+            i++;
         }
-        ntoksread++;
-        p = NULL; // for the next call to strtok_r()
     }
 
-    char *method = "";
-    char *uri = "";
-    char *version = "";
+    lk_string_assign(req->method, p + parser->method.off);
+    lk_string_assign(req->uri, p + parser->uri.off);
+    lk_string_assign(req->version, p + parser->version.off);
 
-    if (ntoksread > 0) method = toks[0];
-    if (ntoksread > 1) uri = toks[1];
-    if (ntoksread > 2) version = toks[2];
-
-    lk_string_assign(req->method, method);
-    lk_string_assign(req->uri, uri);
-    lk_string_assign(req->version, version);
-
-    parse_uri(req->uri, req->path, req->filename, req->querystring);
-
-    lk_free(linetmp);
+    if (parse_uri(req->uri, req->path, req->filename, req->querystring) == -1) {
+        parser->error_status = 400;
+    }
 }
 
 // Parse uri into its components.
-// Given: lks_uri   = "/path/blog/file1.html?a=1&b=2"
-// lks_path         = "/path/blog/file1.html"
-// lks_filename     = "file1.html"
+// The path is percent-decoded and normalized.
+// Given: lks_uri   = "/path/blog/../blog/file%201.html?a=1&b=2"
+// lks_path         = "/path/blog/file 1.html"
+// lks_filename     = "file 1.html"
 // lks_qs           = "a=1&b=2"
-void parse_uri(LKString *lks_uri, LKString *lks_path, LKString *lks_filename, LKString *lks_qs) { 
+// Returns 0 for success, -1 if path doesn't start with '/' or has invalid
+// percent-encoding.
+int parse_uri(LKString *lks_uri, LKString *lks_path, LKString *lks_filename, LKString *lks_qs) { 
     // Get path and querystring
     // "/path/blog/file1.html?a=1&b=2" ==> "/path/blog/file1.html" and "a=1&b=2"
-    LKStringList *uri_ss = lk_string_split(lks_uri, "?");
-    lk_string_assign(lks_path, uri_ss->items[0]->s);
-    if (uri_ss->items_len > 1) {
-        lk_string_assign(lks_qs, uri_ss->items[1]->s);
-    } else {
-        lk_string_assign(lks_qs, "");
+    LKStrView path, qs;
+    lk_sv_split2(lk_sv_lkstring(lks_uri), "?", &path, &qs);
+    lk_string_assign_buf(lks_qs, qs.p, qs.len);
+
+    // Only origin-form "/path" targets are served, others could
+    // start with ".." that normalizing doesn't remove.
+    if (path.len == 0 || path.p[0] != '/') {
+        lk_string_assign(lks_path, "");
+        lk_string_assign(lks_filename, "");
+        return -1;
     }
 
-    // Remove any trailing slash from uri. "/path/blog/" ==> "/path/blog"
-    lk_string_chop_end(lks_path, "/");
+    // Decode and normalize path in place, which also removes any
+    // trailing slash. "/path/./blog/" ==> "/path/blog"
+    lk_string_assign_buf(lks_path, path.p, path.len);
+    ssize_t len = lk_percent_decode(lks_path->s, lks_path->s_len);
+    if (len == -1) {
+        lk_string_assign(lks_path, "");
+        lk_string_assign(lks_filename, "");
+        return -1;
+    }
+    len = lk_normalize_path(lks_path->s, len);
+    lks_path->s_len = len;
+    lks_path->s[len] = '\0';
 
     // Extract filename from path. "/path/blog/file1.html" ==> "file1.html"
-    LKStringList *path_ss = lk_string_split(lks_path, "/");
-    assert(path_ss->items_len > 0);
-    lk_string_assign(lks_filename, path_ss->items[path_ss->items_len-1]->s);
-
-    lk_stringlist_free(uri_ss);
-    lk_stringlist_free(path_ss);
+    LKStrView filename = lk_sv_lkstring(lks_path);
+    char *slash = memrchr(filename.p, '/', filename.len);
+    if (slash != NULL) {
+        filename = lk_sv_buf(slash+1, filename.p + filename.len - slash - 1);
+    }
+    lk_string_assign_buf(lks_filename, filename.p, filename.len);
+    return 0;
 }
 
 
 // Parse header line in the format Ex. User-Agent: browser
-static void parse_header_line(LKHttpRequestParser *parser, char *line, LKHttpRequest *req) {
-    char *saveptr;
-    char *delim = ":";
-
-    char *linetmp = lk_strdup(line, "parse_header_line");
-    lk_chomp(linetmp);
-    char *k = strtok_r(linetmp, delim, &saveptr);
-    if (k == NULL) {
-        lk_free(linetmp);
+// Value is everything after the first ':' without surrounding whitespace.
+// Ex. "If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT"
+static void parse_header_line(LKHttpRequestParser *parser, char *p, size_t off, size_t len) {
+    char *line = p + off;
+    char *colon = lk_scan_char(line, len, ':');
+    if (colon == line) {
         return;
     }
-    char *v = strtok_r(NULL, delim, &saveptr);
-    if (v == NULL) {
-        v = "";
-    }
 
-    // skip over leading whitespace
-    while (*v == ' ' || *v == '\t') {
-        v++;
+    LKHeaderSpan *h = add_header_span(parser);
+    if (h == NULL) {
+        return;
+    }
+    if (colon == NULL) {
+        // No value, point it to the line terminator.
+        h->name.off = off;
+        h->name.len = len;
+        h->value.off = off + len;
+        h->value.len = 0;
+        return;
     }
-    lk_httprequest_add_header(req, k, v);
+    *colon = '\0';
+    h->name.off = off;
+    h->name.len = colon - line;
+
+    size_t vstart = h->name.off + h->name.len + 1;
+    size_t vend = off + len;
+    while (vstart < vend && (p[vstart] == ' ' || p[vstart] == '\t')) {
+        vstart++;
+    }
+    while (vend > vstart && (p[vend-1] == ' ' || p[vend-1] == '\t')) {
+        vend--;
+    }
+    p[vend] = '\0';
+    h->value.off = vstart;
+    h->value.len = vend - vstart;
 
-    if (!strcasecmp(k, "Content-Length")) {
-        int content_length = atoi(v);
-        parser->content_length = content_length;
+    if (!strcasecmp(p + h->name.off, "Content-Length")) {
+        if (parse_content_length(p + h->value.off, &parser->content_length) == -1) {
+            parser->error_status = 400;
+        }
     }
+}
 
-    lk_free(linetmp);
+// Add header span, growing the header spans array past the inline
+// spans if needed. Returns NULL if out of memory.
+static LKHeaderSpan *add_header_span(LKHttpRequestParser *parser) {
+    size_t i = parser->nheaders;
+    if (i >= parser->header_spans_size) {
+        size_t new_size = parser->header_spans_size * 2;
+        LKHeaderSpan *spans;
+        if (parser->header_spans == parser->inline_header_spans) {
+            spans = lk_malloc(sizeof(LKHeaderSpan) * new_size, "add_header_span");
+            if (spans != NULL) {
+                memcpy(spans, parser->inline_header_spans, sizeof(parser->inline_header_spans));
+            }
+        } else {
+            spans = lk_realloc(parser->header_spans, sizeof(LKHeaderSpan) * new_size, "add_header_span");
+        }
+        if (spans == NULL) {
+            return NULL;
+        }
+        parser->header_spans = spans;
+        parser->header_spans_size = new_size;
+    }
+    parser->nheaders++;
+    return &parser->header_spans[i];
 }
 
+// Parse Content-Length value, which must be all digits.
+// Returns 0 for success, -1 if invalid or out of range.
+static int parse_content_length(char *v, size_t *content_length) {
+    if (*v < '0' || *v > '9') {
+        return -1;
+    }
+    errno = 0;
+    char *end;
+    unsigned long long n = strtoull(v, &end, 10);
+    if (errno == ERANGE || n > SIZE_MAX || *end != '\0') {
+        return -1;
+    }
+    *content_length = n;
+    return 0;
+}
 
 // Parse sequence of bytes into request body. Compile results into req.
 // You can check the state of the parser through the following fields:
 // parser->head_complete   Request Line and Headers complete
 // parser->body_complete   httprequest is complete
 void lk_httprequestparser_parse_bytes(LKHttpRequestParser *parser, LKBuffer *buf, LKHttpRequest *req) {
-    // Head should be parsed line by line. Call parse_line() instead.
+    // Head should be parsed first. Call parse_head() instead.
     if (!parser->head_complete) {
         return;
     }
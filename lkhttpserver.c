@@ -8,12 +8,13 @@
 #include <assert.h>
 #include <limits.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/wait.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
@@ -22,28 +23,51 @@
 #include "lklib.h"
 #include "lknet.h"
 
+#define TUNNEL_IDLE_TIMEOUT 300     // close tunnels idle for this many seconds
+#define SWEEP_INTERVAL 5            // seconds between idle tunnel and slow client checks
+#define SSE_MAX_QUEUE 64            // drop subscribers with more unsent events
+#define MAX_BYTERANGES 16           // ignore Range header with more ranges
+#define MAX_EVENTS 256              // ready fds handled per epoll_wait()
+
+#define WATCH_READ 1
+#define WATCH_WRITE 2
+
 // local functions
 void FD_SET_READ(int fd, LKHttpServer *server);
 void FD_SET_WRITE(int fd, LKHttpServer *server);
 void FD_CLR_READ(int fd, LKHttpServer *server);
 void FD_CLR_WRITE(int fd, LKHttpServer *server);
+void watch_fd(int fd, unsigned char watch, LKHttpServer *server);
 
+void start_request(LKHttpServer *server, LKContext *ctx);
+void read_first_bytes(LKHttpServer *server, LKContext *ctx);
 void read_request(LKHttpServer *server, LKContext *ctx);
+int process_request_head(LKHttpServer *server, LKContext *ctx);
 void read_cgi_output(LKHttpServer *server, LKContext *ctx);
+void start_cgi_response(LKHttpServer *server, LKContext *ctx);
+void write_cgi_response(LKHttpServer *server, LKContext *ctx);
 void write_cgi_input(LKHttpServer *server, LKContext *ctx);
 void process_request(LKHttpServer *server, LKContext *ctx);
 
-void serve_files(LKHttpServer *server, LKContext *ctx, LKHostConfig *hc);
+void serve_files(LKHttpServer *server, LKHttpRequest *req, LKHttpResponse *resp, LKHostConfig *hc);
 void serve_cgi(LKHttpServer *server, LKContext *ctx, LKHostConfig *hc);
 void process_response(LKHttpServer *server, LKContext *ctx);
 void process_error_response(LKHttpServer *server, LKContext *ctx, int status, char *msg);
+void set_status_page(LKHttpServer *server, LKHttpResponse *resp, LKHostConfig *hc, int status);
+void print_access_log(LKContext *ctx, LKHttpRequest *req, LKHttpResponse *resp);
 
 void set_cgi_env1(LKHttpServer *server);
 void set_cgi_env2(LKHttpServer *server, LKContext *ctx, LKHostConfig *hc);
 
 void get_localtime_string(char *time_str, size_t time_str_len);
-int open_path_file(char *home_dir, char *path);
-int read_path_file(char *home_dir, char *path, LKBuffer *buf);
+int open_path_file(int dirfd, char *path, struct stat *st);
+int serve_path_file(LKHttpRequest *req, LKHttpResponse *resp, int fd, struct stat *st);
+int etag_list_match(char *etags, char *etag);
+int if_range_match(char *if_range, char *etag, time_t mtime);
+int parse_ranges(char *range, off_t size, off_t *starts, off_t *ends, int max_ranges);
+int serve_file_ranges(LKHttpResponse *resp, int fd, struct stat *st, char *range);
+int pread_extent(int fd, off_t offset, size_t len, LKBuffer *buf);
+int load_bodyfd(LKHttpResponse *resp);
 char *fileext(char *filepath);
 
 void write_response(LKHttpServer *server, LKContext *ctx);
@@ -54,6 +78,47 @@ void serve_proxy(LKHttpServer *server, LKContext *ctx, char *targethost);
 void write_proxy_request(LKHttpServer *server, LKContext *ctx);
 void pipe_proxy_response(LKHttpServer *server, LKContext *ctx);
 
+int is_upgrade_request(LKHttpRequest *req);
+void read_proxy_upgrade_response(LKHttpServer *server, LKContext *ctx);
+void start_tunnel(LKHttpServer *server, LKContext *ctx);
+void pipe_tunnel(LKHttpServer *server, LKContext *ctx);
+void set_tunnel_fds(LKHttpServer *server, LKSplicePipe *sp);
+void terminate_tunnel(LKHttpServer *server, LKContext *ctx, char *reason);
+void sweep_idle_contexts(LKHttpServer *server);
+
+size_t buffer_size_hint(LKSizeHist *h);
+void record_request_stats(LKHttpServer *server, LKContext *ctx);
+void record_response_size(LKHttpServer *server, LKContext *ctx, size_t size);
+void print_stats_line(FILE *f, char *name, LKTrafficStats *st);
+void print_traffic_stats(LKHttpServer *server, FILE *f);
+
+void serve_sse(LKHttpServer *server, LKContext *ctx, LKHostConfig *hc);
+void subscribe_sse(LKHttpServer *server, LKContext *ctx, LKHostConfig *hc);
+void publish_sse(LKHttpServer *server, LKContext *ctx, LKHostConfig *hc);
+int is_sse_publisher(LKHostConfig *hc, LKHttpRequest *req);
+LKRefBuffer *encode_sse_event(unsigned long id, LKString *event, LKBuffer *data);
+void read_sse(LKHttpServer *server, LKContext *ctx);
+void write_sse(LKHttpServer *server, LKContext *ctx);
+
+int is_http2_preface(LKHttpRequest *req);
+int is_h2c_upgrade(LKHttpRequest *req);
+int is_file_request(LKHttpServer *server, LKHttpRequest *req);
+int start_http2(LKHttpServer *server, LKContext *ctx, int upgrade);
+void read_http2(LKHttpServer *server, LKContext *ctx);
+void write_http2(LKHttpServer *server, LKContext *ctx);
+void process_http2(LKHttpServer *server, LKContext *ctx);
+void process_http2_head(LKHttpServer *server, LKHttp2Stream *stream);
+void process_http2_request(LKHttpServer *server, LKContext *ctx, LKHttp2Stream *stream);
+
+#ifdef LKTLS
+void start_tls(LKHttpServer *server, int fd, struct sockaddr_in *sa);
+void relay_tls(LKHttpServer *server, LKContext *ctx);
+int start_tls_relay(LKHttpServer *server, LKContext *ctx);
+void handoff_ktls(LKHttpServer *server, LKContext *ctx);
+void set_tls_fds(LKHttpServer *server, LKTlsConn *tc);
+void terminate_tls(LKHttpServer *server, LKContext *ctx);
+#endif
+
 
 /*** LKHttpServer functions ***/
 
@@ -61,7 +126,16 @@ LKHttpServer *lk_httpserver_new(LKConfig *cfg) {
     LKHttpServer *server = lk_malloc(sizeof(LKHttpServer), "lk_httpserver_new");
     server->cfg = cfg;
     server->ctxhead = NULL;
-    server->maxfd = 0;
+    server->epfd = -1;
+    server->fdwatch = NULL;
+    server->fdwatch_size = 0;
+    server->events = NULL;
+    server->ntunnels = 0;
+    server->sweep_time = 0;
+    server->sse_lastid = 0;
+    server->tlsfd = -1;
+    server->scratch = lk_bufpool_get();
+    lk_traffic_stats_init(&server->stats);
     return server;
 }
 
@@ -75,28 +149,89 @@ void lk_httpserver_free(LKHttpServer *server) {
         ctx = ctx->next;
         lk_context_free(ptmp);
     }
+    lk_bufpool_put(server->scratch);
+
+    if (server->tlsfd != -1) {
+        close(server->tlsfd);
+    }
+    if (server->epfd != -1) {
+        close(server->epfd);
+    }
+    if (server->fdwatch != NULL) {
+        lk_free(server->fdwatch);
+    }
+    if (server->events != NULL) {
+        lk_free(server->events);
+    }
 
     memset(server, 0, sizeof(LKHttpServer));
     lk_free(server);
 }
 
 void FD_SET_READ(int fd, LKHttpServer *server) {
-    FD_SET(fd, &server->readfds);
-    if (fd > server->maxfd) {
-        server->maxfd = fd;
-    }
+    watch_fd(fd, fd < (int)server->fdwatch_size ? server->fdwatch[fd] | WATCH_READ : WATCH_READ, server);
 }
 void FD_SET_WRITE(int fd, LKHttpServer *server) {
-    FD_SET(fd, &server->writefds);
-    if (fd > server->maxfd) {
-        server->maxfd = fd;
-    }
+    watch_fd(fd, fd < (int)server->fdwatch_size ? server->fdwatch[fd] | WATCH_WRITE : WATCH_WRITE, server);
 }
 void FD_CLR_READ(int fd, LKHttpServer *server) {
-    FD_CLR(fd, &server->readfds);
+    if (fd < (int)server->fdwatch_size) {
+        watch_fd(fd, server->fdwatch[fd] & ~WATCH_READ, server);
+    }
 }
 void FD_CLR_WRITE(int fd, LKHttpServer *server) {
-    FD_CLR(fd, &server->writefds);
+    if (fd < (int)server->fdwatch_size) {
+        watch_fd(fd, server->fdwatch[fd] & ~WATCH_WRITE, server);
+    }
+}
+
+// Set the events epoll watches for fd, 0 to stop watching it.
+// fds are level triggered, so they behave like select() sets.
+void watch_fd(int fd, unsigned char watch, LKHttpServer *server) {
+    if (fd < 0) {
+        return;
+    }
+    if ((size_t)fd >= server->fdwatch_size) {
+        size_t size = server->fdwatch_size > 0 ? server->fdwatch_size : 1024;
+        while (size <= (size_t)fd) {
+            size *= 2;
+        }
+        server->fdwatch = lk_realloc(server->fdwatch, size, "watch_fd");
+        memset(server->fdwatch + server->fdwatch_size, 0, size - server->fdwatch_size);
+        server->fdwatch_size = size;
+    }
+    unsigned char old = server->fdwatch[fd];
+    if (watch == old) {
+        return;
+    }
+    server->fdwatch[fd] = watch;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.data.fd = fd;
+    if (watch & WATCH_READ) {
+        ev.events |= EPOLLIN;
+    }
+    if (watch & WATCH_WRITE) {
+        ev.events |= EPOLLOUT;
+    }
+
+    int z;
+    if (watch == 0) {
+        z = epoll_ctl(server->epfd, EPOLL_CTL_DEL, fd, NULL);
+    } else if (old == 0) {
+        z = epoll_ctl(server->epfd, EPOLL_CTL_ADD, fd, &ev);
+    } else {
+        z = epoll_ctl(server->epfd, EPOLL_CTL_MOD, fd, &ev);
+        // fd was closed and reused without being cleared first.
+        if (z == -1 && errno == ENOENT) {
+            z = epoll_ctl(server->epfd, EPOLL_CTL_ADD, fd, &ev);
+        }
+    }
+    // Closed fds are already removed from epoll.
+    if (z == -1 && !(watch == 0 && (errno == ENOENT || errno == EBADF))) {
+        lk_print_err("epoll_ctl()");
+    }
 }
 
 int lk_httpserver_serve(LKHttpServer *server) {
@@ -114,44 +249,119 @@ int lk_httpserver_serve(LKHttpServer *server) {
 
     LKString *server_ipaddr_str = lk_get_ipaddr_string(&sa);
     printf("Serving HTTP on %s port %s...\n", server_ipaddr_str->s, cfg->port->s);
+
+    if (cfg->tls_port->s_len > 0) {
+#ifdef LKTLS
+        if (lk_tls_init(cfg) == -1) {
+            lk_string_free(server_ipaddr_str);
+            return -1;
+        }
+        server->tlsfd = lk_open_listen_socket(cfg->serverhost->s, cfg->tls_port->s, backlog, NULL);
+        if (server->tlsfd == -1) {
+            lk_print_err("lk_open_listen_socket() failed");
+            lk_string_free(server_ipaddr_str);
+            return -1;
+        }
+        printf("Serving HTTPS on %s port %s...\n", server_ipaddr_str->s, cfg->tls_port->s);
+#else
+        fprintf(stderr, "tls_port %s ignored, build with make LKTLS=1 for TLS\n", cfg->tls_port->s);
+#endif
+    }
     lk_string_free(server_ipaddr_str);
 
     clearenv();
     set_cgi_env1(server);
 
-    FD_ZERO(&server->readfds);
-    FD_ZERO(&server->writefds);
+    server->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (server->epfd == -1) {
+        lk_print_err("epoll_create1()");
+        return -1;
+    }
+    server->events = lk_malloc(sizeof(struct epoll_event) * MAX_EVENTS, "lk_httpserver_serve events");
     FD_SET_READ(s0, server);
+    if (server->tlsfd != -1) {
+        FD_SET_READ(server->tlsfd, server);
+    }
+    time_t accept_paused = 0;       // time accepts stopped for lack of fds
 
     while (1) {
-        // readfds contain the master list of read sockets
-        fd_set cur_readfds = server->readfds;
-        fd_set cur_writefds = server->writefds;
-        z = select(server->maxfd+1, &cur_readfds, &cur_writefds, NULL, NULL);
+        // Wake up periodically to close idle tunnels and slow clients.
+        int sweep_interval = SWEEP_INTERVAL;
+        if (cfg->header_timeout > 0 && cfg->header_timeout < sweep_interval) {
+            sweep_interval = cfg->header_timeout;
+        }
+        int timeout_ms = -1;
+        if (server->ctxhead != NULL || accept_paused) {
+            timeout_ms = sweep_interval * 1000;
+        }
+        int nevents = epoll_wait(server->epfd, server->events, MAX_EVENTS, timeout_ms);
+        z = nevents;
+        if (lk_alloc_snapshot_pending()) {
+            print_traffic_stats(server, stdout);
+            lk_alloc_print_snapshot(stdout);
+        }
         if (z == -1 && errno == EINTR) {
             continue;
         }
         if (z == -1) {
-            lk_print_err("select()");
+            lk_print_err("epoll_wait()");
             return z;
         }
+        time_t now = time(NULL);
+        lk_httpresponse_update_date(now);
+        if (server->ctxhead != NULL && now - server->sweep_time >= sweep_interval) {
+            sweep_idle_contexts(server);
+        }
+        if (accept_paused && now > accept_paused) {
+            FD_SET_READ(s0, server);
+            if (server->tlsfd != -1) {
+                FD_SET_READ(server->tlsfd, server);
+            }
+            accept_paused = 0;
+        }
         if (z == 0) {
             // timeout returned
             continue;
         }
 
-        // fds now contain list of clients with data available to be read.
-        for (int i=0; i <= server->maxfd; i++) {
-            if (FD_ISSET(i, &cur_readfds)) {
+        // events now contain fds ready to be read or written.
+        for (int k=0; k < nevents; k++) {
+            int i = server->events[k].data.fd;
+            uint32_t events = server->events[k].events;
+            // Skip fds that were closed while handling earlier fds.
+            unsigned char watch = server->fdwatch[i];
+            if (watch == 0) {
+                continue;
+            }
+            // Errors and hangups are reported to the read or write handler,
+            // as select() does.
+            if ((watch & WATCH_READ) && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
                 // New client connection
-                if (i == s0) {
+                if (i == s0 || i == server->tlsfd) {
                     socklen_t sa_len = sizeof(struct sockaddr_in);
                     struct sockaddr_in sa;
-                    int clientfd = accept(s0, (struct sockaddr*)&sa, &sa_len);
+                    int clientfd = accept(i, (struct sockaddr*)&sa, &sa_len);
                     if (clientfd == -1) {
+                        int accept_errno = errno;
                         lk_print_err("accept()");
+                        // Out of fds (see ulimit -n), the pending connection
+                        // would wake us up again right away. Stop accepting
+                        // until the next second.
+                        if (accept_errno == EMFILE || accept_errno == ENFILE) {
+                            FD_CLR_READ(s0, server);
+                            if (server->tlsfd != -1) {
+                                FD_CLR_READ(server->tlsfd, server);
+                            }
+                            accept_paused = time(NULL);
+                        }
                         continue;
                     }
+#ifdef LKTLS
+                    if (i == server->tlsfd) {
+                        start_tls(server, clientfd, &sa);
+                        continue;
+                    }
+#endif
 
                     // Add new client socket to list of read sockets.
                     FD_SET_READ(clientfd, server);
@@ -170,17 +380,31 @@ int lk_httpserver_serve(LKHttpServer *server) {
                         continue;
                     }
 
-                    if (ctx->type == CTX_READ_REQ) {
+                    if (ctx->type == CTX_READ_REQ && ctx->sr == NULL) {
+                        read_first_bytes(server, ctx);
+                    } else if (ctx->type == CTX_READ_REQ) {
                         read_request(server, ctx);
                     } else if (ctx->type == CTX_READ_CGI_OUTPUT) {
                         read_cgi_output(server, ctx);
                     } else if (ctx->type == CTX_PROXY_PIPE_RESP) {
                         pipe_proxy_response(server, ctx);
+                    } else if (ctx->type == CTX_PROXY_READ_UPGRADE_RESP) {
+                        read_proxy_upgrade_response(server, ctx);
+                    } else if (ctx->type == CTX_PROXY_TUNNEL) {
+                        pipe_tunnel(server, ctx);
+                    } else if (ctx->type == CTX_SSE_SUBSCRIBER) {
+                        read_sse(server, ctx);
+                    } else if (ctx->type == CTX_HTTP2) {
+                        read_http2(server, ctx);
+#ifdef LKTLS
+                    } else if (ctx->type == CTX_TLS) {
+                        relay_tls(server, ctx);
+#endif
                     } else {
                         printf("read selectfd %d with unknown ctx type %d\n", selectfd, ctx->type);
                     }
                 }
-            } else if (FD_ISSET(i, &cur_writefds)) {
+            } else if ((watch & WATCH_WRITE) && (events & (EPOLLOUT | EPOLLHUP | EPOLLERR))) {
                 //printf("write fd %d\n", i);
 
                 int selectfd = i;
@@ -195,12 +419,24 @@ int lk_httpserver_serve(LKHttpServer *server) {
                     assert(ctx->resp != NULL);
                     assert(ctx->resp->head != NULL);
                     write_response(server, ctx);
+                } else if (ctx->type == CTX_WRITE_CGI_RESP) {
+                    write_cgi_response(server, ctx);
                 } else if (ctx->type == CTX_WRITE_CGI_INPUT) {
                     write_cgi_input(server, ctx);
                 } else if (ctx->type == CTX_PROXY_WRITE_REQ) {
                     assert(ctx->req != NULL);
                     assert(ctx->req->head != NULL);
                     write_proxy_request(server, ctx);
+                } else if (ctx->type == CTX_PROXY_TUNNEL) {
+                    pipe_tunnel(server, ctx);
+                } else if (ctx->type == CTX_SSE_SUBSCRIBER) {
+                    write_sse(server, ctx);
+                } else if (ctx->type == CTX_HTTP2) {
+                    write_http2(server, ctx);
+#ifdef LKTLS
+                } else if (ctx->type == CTX_TLS) {
+                    relay_tls(server, ctx);
+#endif
                 } else {
                     printf("write selectfd %d with unknown ctx type %d\n", selectfd, ctx->type);
                 }
@@ -237,11 +473,11 @@ void set_cgi_env2(LKHttpServer *server, LKContext *ctx, LKHostConfig *hc) {
 
     setenv("DOCUMENT_ROOT", hc->homedir_abspath->s, 1);
 
-    char *http_user_agent = lk_stringtable_get(req->headers, "User-Agent");
+    char *http_user_agent = lk_headertable_get_id(req->headers, LK_HDR_USER_AGENT);
     if (!http_user_agent) http_user_agent = "";
     setenv("HTTP_USER_AGENT", http_user_agent, 1);
 
-    char *http_host = lk_stringtable_get(req->headers, "Host");
+    char *http_host = lk_headertable_get_id(req->headers, LK_HDR_HOST);
     if (!http_host) http_host = "";
     setenv("HTTP_HOST", http_host, 1);
 
@@ -255,7 +491,7 @@ void set_cgi_env2(LKHttpServer *server, LKContext *ctx, LKHostConfig *hc) {
     setenv("REQUEST_URI", req->uri->s, 1);
     setenv("QUERY_STRING", req->querystring->s, 1);
 
-    char *content_type = lk_stringtable_get(req->headers, "Content-Type");
+    char *content_type = lk_headertable_get_id(req->headers, LK_HDR_CONTENT_TYPE);
     if (content_type == NULL) {
         content_type = "";
     }
@@ -270,6 +506,58 @@ void set_cgi_env2(LKHttpServer *server, LKContext *ctx, LKHostConfig *hc) {
     char portstr[10];
     snprintf(portstr, sizeof(portstr), "%d", ctx->client_port);
     setenv("REMOTE_PORT", portstr, 1);
+
+    if (ctx->client_tls) {
+        setenv("HTTPS", "on", 1);
+    } else {
+        unsetenv("HTTPS");
+    }
+}
+
+// Allocate request state of client ctx with parser limits from cfg.
+void start_request(LKHttpServer *server, LKContext *ctx) {
+    LKConfig *cfg = server->cfg;
+    init_request_context(ctx);
+    ctx->reqparser->max_request_line = cfg->max_request_line;
+    ctx->reqparser->max_head_size = cfg->max_header_size;
+    ctx->reqparser->max_headers = cfg->max_headers;
+}
+
+// First read of a client without request state goes to the shared
+// scratch buffer, so wakeups without data and clients that close
+// without sending anything don't allocate. Once bytes arrive the request
+// state is allocated and the scratch buffer becomes the ctx socketreader
+// buffer, swapped for the reader's empty one.
+void read_first_bytes(LKHttpServer *server, LKContext *ctx) {
+    LKBuffer *scratch = server->scratch;
+    lk_buffer_clear(scratch);
+
+    ssize_t z;
+    do {
+        z = recv(ctx->selectfd, scratch->bytes, scratch->bytes_size, MSG_DONTWAIT | MSG_NOSIGNAL);
+    } while (z == -1 && errno == EINTR);
+    if (z == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    if (z <= 0) {
+        if (z == -1) {
+            lk_print_err("recv()");
+        }
+        terminate_client_session(server, ctx);
+        return;
+    }
+    lk_buffer_commit(scratch, z);
+
+    start_request(server, ctx);
+    server->scratch = ctx->sr->buf;
+    ctx->sr->buf = scratch;
+
+    // Make room for most request heads so they're read without growing.
+    size_t hint = buffer_size_hint(&server->stats.head_sizes);
+    if (server->scratch->bytes_size < hint) {
+        lk_buffer_reserve(server->scratch, hint);
+    }
+    read_request(server, ctx);
 }
 
 void read_request(LKHttpServer *server, LKContext *ctx) {
@@ -277,12 +565,27 @@ void read_request(LKHttpServer *server, LKContext *ctx) {
 
     while (1) {
         if (!ctx->reqparser->head_complete) {
-            z = lk_socketreader_readline(ctx->sr, ctx->req_line);
+            z = lk_socketreader_fill(ctx->sr);
             if (z == Z_ERR) {
-                lk_print_err("lksocketreader_readline()");
+                lk_print_err("lk_socketreader_fill()");
                 break;
             }
-            lk_httprequestparser_parse_line(ctx->reqparser, ctx->req_line, ctx->req);
+            // Head is parsed in place in the socketreader buffer.
+            LKBuffer *srbuf = ctx->sr->buf;
+            size_t head_len = lk_httprequestparser_parse_head(ctx->reqparser,
+                srbuf->bytes + srbuf->bytes_cur, srbuf->bytes_len - srbuf->bytes_cur, ctx->req);
+            srbuf->bytes_cur += head_len;
+
+            // h2c with prior knowledge starts with "PRI * HTTP/2.0" preface.
+            if (ctx->reqparser->nlinesread == 1 && is_http2_preface(ctx->req)) {
+                srbuf->bytes_cur += ctx->reqparser->head_len;
+                start_http2(server, ctx, 0);
+                return;
+            }
+            if ((ctx->reqparser->head_complete || ctx->reqparser->error_status) &&
+                process_request_head(server, ctx) == -1) {
+                return;
+            }
         } else {
             z = lk_socketreader_recv(ctx->sr, ctx->req_buf);
             if (z == Z_ERR) {
@@ -296,26 +599,79 @@ void read_request(LKHttpServer *server, LKContext *ctx) {
             ctx->reqparser->body_complete = 1;
         }
         if (ctx->reqparser->body_complete) {
+            if (is_h2c_upgrade(ctx->req) && is_file_request(server, ctx->req) &&
+                start_http2(server, ctx, 1) == 0) {
+                return;
+            }
             FD_CLR_READ(ctx->selectfd, server);
-            shutdown(ctx->selectfd, SHUT_RD);
             process_request(server, ctx);
             break;
         }
+        // Body bytes that came in with the head are still buffered.
+        LKBuffer *srbuf = ctx->sr->buf;
+        if (z == Z_BLOCK && ctx->reqparser->head_complete && srbuf->bytes_cur < srbuf->bytes_len) {
+            continue;
+        }
         if (z != Z_OPEN) {
             break;
         }
     }
 }
 
-// Send cgi_inputbuf input bytes to cgi program stdin set in selectfd.
+// Check request head before any body bytes are read.
+// Rejects malformed requests and bodies larger than hostconfig max_body_size,
+// and answers Expect: 100-continue so the client starts sending the body.
+// Returns 0 to continue reading request, -1 if error response was started.
+int process_request_head(LKHttpServer *server, LKContext *ctx) {
+    LKHttpRequestParser *parser = ctx->reqparser;
+    LKHttpRequest *req = ctx->req;
+    int status = parser->error_status;
+    char *msg = "LittleKitten webserver: invalid request.";
+    if (status == 431) {
+        msg = "LittleKitten webserver: request header fields too large.";
+    }
+
+    if (status == 0) {
+        char *hostname = lk_headertable_get_id(req->headers, LK_HDR_HOST);
+        LKHostConfig *hc = lk_config_find_hostconfig(server->cfg, hostname);
+        if (hc != NULL && hc->max_body_size > 0 && parser->content_length > hc->max_body_size) {
+            status = 413;
+            msg = "LittleKitten webserver: request body too large.";
+        }
+    }
+
+    char *expect = lk_headertable_get_id(req->headers, LK_HDR_EXPECT);
+    if (status == 0 && expect != NULL) {
+        if (strcasecmp(expect, "100-continue")) {
+            status = 417;
+            msg = "LittleKitten webserver: unsupported expectation.";
+        } else if (!parser->body_complete && lk_string_sz_equal(req->version, "HTTP/1.1")) {
+            // Interim response is small enough to not block.
+            char *continue_resp = "HTTP/1.1 100 Continue\r\n\r\n";
+            send(ctx->selectfd, continue_resp, strlen(continue_resp), MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
+        // Expectation is met here, don't forward it to proxyhost.
+        lk_headertable_remove_id(req->headers, LK_HDR_EXPECT);
+    }
+
+    if (status != 0) {
+        FD_CLR_READ(ctx->selectfd, server);
+        shutdown(ctx->selectfd, SHUT_RD);
+        process_error_response(server, ctx, status, msg);
+        return -1;
+    }
+    return 0;
+}
+
+// Send cgi_input bytes to cgi program stdin set in selectfd.
 void write_cgi_input(LKHttpServer *server, LKContext *ctx) {
-    assert(ctx->cgi_inputbuf != NULL);
-    int z = lk_write_all_file(ctx->selectfd, ctx->cgi_inputbuf);
+    assert(ctx->cgi_input != NULL);
+    int z = lk_bufchain_write_all(ctx->selectfd, FD_FILE, ctx->cgi_input);
     if (z == Z_BLOCK) {
         return;
     }
     if (z == Z_ERR) {
-        lk_print_err("write_cgi_input lk_write_all_file()");
+        lk_print_err("write_cgi_input lk_bufchain_write_all()");
         z = terminate_fd(ctx->cgifd, FD_FILE, FD_WRITE, server);
         if (z == 0) {
             ctx->cgifd = 0;
@@ -324,50 +680,153 @@ void write_cgi_input(LKHttpServer *server, LKContext *ctx) {
         return;
     }
     if (z == Z_EOF) {
-        // Completed writing input bytes.
-        FD_CLR_WRITE(ctx->selectfd, server);
-        shutdown(ctx->selectfd, SHUT_WR);
-        remove_selectfd_context(&server->ctxhead, ctx->selectfd);
+        // Completed writing input bytes, close cgi stdin to signal EOF.
+        int selectfd = ctx->selectfd;
+        terminate_fd(selectfd, FD_FILE, FD_WRITE, server);
+        remove_selectfd_context(&server->ctxhead, selectfd);
     }
 }
 
 // Read cgi output to cgi_outputbuf.
+// The response is started as soon as the cgi head is parsed, body bytes
+// are then passed on to the client as they are read.
 void read_cgi_output(LKHttpServer *server, LKContext *ctx) {
+    LKHttpCgiParser *parser = ctx->cgiparser;
     int z = lk_read_all_file(ctx->selectfd, ctx->cgi_outputbuf);
-    if (z == Z_BLOCK) {
-        return;
-    }
     if (z == Z_ERR) {
         lk_print_err("lk_read_all_file()");
         z = terminate_fd(ctx->cgifd, FD_FILE, FD_READ, server);
         if (z == 0) {
             ctx->cgifd = 0;
         }
+        // Response head already sent.
+        if (parser->head_complete) {
+            terminate_client_session(server, ctx);
+            return;
+        }
         process_error_response(server, ctx, 500, "Error processing CGI output.");
         return;
     }
+    if (z == Z_EOF) {
+        // Remove cgi output from read list.
+        ctx->cgi_eof = 1;
+        z = terminate_fd(ctx->cgifd, FD_FILE, FD_READ, server);
+        if (z == 0) {
+            ctx->cgifd = 0;
+        }
+    }
+
+    if (!parser->head_complete) {
+        if (ctx->cgi_eof) {
+            lk_httpcgiparser_finish(parser, ctx->cgi_outputbuf, ctx->resp);
+        } else if (!lk_httpcgiparser_parse(parser, ctx->cgi_outputbuf, ctx->resp)) {
+            return;
+        }
+        start_cgi_response(server, ctx);
+        return;
+    }
 
-    // EOF - finished reading cgi output.
-    assert(z == 0);
+    // Send body bytes read so far.
+    if (ctx->cgifd) {
+        FD_CLR_READ(ctx->cgifd, server);
+    }
+    ctx->selectfd = ctx->clientfd;
+    ctx->type = CTX_WRITE_CGI_RESP;
+    FD_SET_WRITE(ctx->selectfd, server);
+    lk_reflist_clear(ctx->buflist);
+    lk_reflist_append(ctx->buflist, ctx->cgi_outputbuf);
+}
 
-    // Remove cgi output from read list.
-    z = terminate_fd(ctx->cgifd, FD_FILE, FD_READ, server);
-    if (z == 0) {
-        ctx->cgifd = 0;
+// Send response head and any body bytes following the cgi head.
+// Content-Length is only known if the cgi has exited, otherwise the body
+// ends when the connection is closed.
+void start_cgi_response(LKHttpServer *server, LKContext *ctx) {
+    LKHttpRequest *req = ctx->req;
+    LKHttpResponse *resp = ctx->resp;
+    LKBuffer *buf = ctx->cgi_outputbuf;
+
+    // Body starts after the cgi head, no need to copy it to resp->body.
+    buf->bytes_cur = ctx->cgiparser->body_pos;
+    ssize_t content_length = -1;
+    if (ctx->cgi_eof) {
+        content_length = buf->bytes_len - buf->bytes_cur;
+    }
+    lk_httpresponse_finalize_head(resp, content_length);
+    if (content_length != -1) {
+        record_response_size(server, ctx, resp->head->bytes_len + content_length);
     }
 
-    parse_cgi_output(ctx->cgi_outputbuf, ctx->resp);
-    process_response(server, ctx);
+    print_access_log(ctx, req, resp);
+
+    if (ctx->cgifd) {
+        FD_CLR_READ(ctx->cgifd, server);
+    }
+    ctx->selectfd = ctx->clientfd;
+    ctx->type = CTX_WRITE_CGI_RESP;
+    FD_SET_WRITE(ctx->selectfd, server);
+    lk_reflist_clear(ctx->buflist);
+    lk_reflist_append(ctx->buflist, resp->head);
+
+    // No body on HEAD request, session ends after the head is sent.
+    if (lk_string_sz_equal(req->method, "HEAD")) {
+        ctx->type = CTX_WRITE_RESP;
+        return;
+    }
+    lk_reflist_append(ctx->buflist, buf);
+}
+
+// Send cgi response bytes in buflist, then go back to reading cgi output
+// until the cgi exits.
+void write_cgi_response(LKHttpServer *server, LKContext *ctx) {
+    int z = lk_buflist_write_all(ctx->selectfd, FD_SOCK, ctx->buflist);
+    if (z == Z_BLOCK || z == Z_OPEN) {
+        return;
+    }
+    if (z == Z_ERR) {
+        lk_print_err("write_cgi_response lk_buflist_write_all()");
+        terminate_client_session(server, ctx);
+        return;
+    }
+
+    // EOF - sent all cgi output read so far.
+    assert(z == Z_EOF);
+    if (ctx->cgi_eof) {
+        // Completed sending cgi response.
+        terminate_client_session(server, ctx);
+        return;
+    }
+
+    lk_buffer_clear(ctx->cgi_outputbuf);
+    FD_CLR_WRITE(ctx->selectfd, server);
+    ctx->selectfd = ctx->cgifd;
+    ctx->type = CTX_READ_CGI_OUTPUT;
+    FD_SET_READ(ctx->selectfd, server);
 }
 
 void process_request(LKHttpServer *server, LKContext *ctx) {
-    char *hostname = lk_stringtable_get(ctx->req->headers, "Host");
+    char *hostname = lk_headertable_get_id(ctx->req->headers, LK_HDR_HOST);
     LKHostConfig *hc = lk_config_find_hostconfig(server->cfg, hostname);
+    ctx->hc = hc;
+    record_request_stats(server, ctx);
+
+    // Upgraded connection may be tunneled to proxyhost, and event stream
+    // subscribers are read to notice when the client goes away.
+    int sse = hc != NULL && hc->ssepath->s_len > 0 && lk_string_equal(ctx->req->path, hc->ssepath);
+    if (!sse && !is_upgrade_request(ctx->req)) {
+        shutdown(ctx->selectfd, SHUT_RD);
+    }
+
     if (hc == NULL) {
         process_error_response(server, ctx, 404, "LittleKitten webserver: hostconfig not found.");
         return;
     }
 
+    // Event stream endpoint.
+    if (sse) {
+        serve_sse(server, ctx, hc);
+        return;
+    }
+
     // Forward request to proxyhost if proxyhost specified.
     if (hc->proxyhost->s_len > 0) {
         serve_proxy(server, ctx, hc->proxyhost->s);
@@ -391,54 +850,47 @@ void process_request(LKHttpServer *server, LKContext *ctx) {
         return;
     }
 
-    serve_files(server, ctx, hc);
+    serve_files(server, ctx->req, ctx->resp, hc);
     process_response(server, ctx);
 }
 
 // Generate an http response to an http request.
 #define POSTTEST
-void serve_files(LKHttpServer *server, LKContext *ctx, LKHostConfig *hc) {
+void serve_files(LKHttpServer *server, LKHttpRequest *req, LKHttpResponse *resp, LKHostConfig *hc) {
     int z;
-    static char *html_error_start = 
-       "<!DOCTYPE html>\n"
-       "<html>\n"
-       "<head><title>Error response</title></head>\n"
-       "<body><h1>Error response</h1>\n";
-    static char *html_error_end =
-       "</body></html>\n";
 
-    LKHttpRequest *req = ctx->req;
-    LKHttpResponse *resp = ctx->resp;
     LKString *method = req->method;
     LKString *path = req->path;
 
     if (lk_string_sz_equal(method, "GET") || lk_string_sz_equal(method, "HEAD")) {
+        int fd = -1;
+        struct stat st;
+
         // For root, default to index.html, ...
         if (path->s_len == 0) {
             char *default_files[] = {"/index.html", "/index.htm", "/default.html", "/default.htm"};
             for (int i=0; i < sizeof(default_files) / sizeof(char *); i++) {
-                z = read_path_file(hc->homedir_abspath->s, default_files[i], resp->body);
-                if (z >= 0) {
+                fd = open_path_file(hc->homedir_fd, default_files[i], &st);
+                if (fd != -1) {
                     lk_httpresponse_add_header(resp, "Content-Type", "text/html");
                     break;
                 }
-                // Update path with default file for File not found error message.
-                lk_string_assign(path, default_files[i]);
             }
         } else {
-            z = read_path_file(hc->homedir_abspath->s, path->s, resp->body);
+            fd = open_path_file(hc->homedir_fd, path->s, &st);
             char *content_type = (char *) lk_lookup(mimetypes_tbl, fileext(path->s));
             if (content_type == NULL) {
                 content_type = "text/plain";
             }
             lk_httpresponse_add_header(resp, "Content-Type", content_type);
         }
+        z = -1;
+        if (fd != -1) {
+            z = serve_path_file(req, resp, fd, &st);
+        }
         if (z == -1) {
             // path not found
-            resp->status = 404;
-            lk_string_assign_sprintf(resp->statustext, "File not found '%s'", path->s);
-            lk_httpresponse_add_header(resp, "Content-Type", "text/plain");
-            lk_buffer_append_sprintf(resp->body, "File not found '%s'\n", path->s);
+            set_status_page(server, resp, hc, 404);
         }
         return;
     }
@@ -462,14 +914,7 @@ void serve_files(LKHttpServer *server, LKContext *ctx, LKHostConfig *hc) {
     }
 #endif
 
-    resp->status = 501;
-    lk_string_assign_sprintf(resp->statustext, "Unsupported method ('%s')", method);
-
-    lk_httpresponse_add_header(resp, "Content-Type", "text/html");
-    lk_buffer_append(resp->body, html_error_start, strlen(html_error_start));
-    lk_buffer_append_sprintf(resp->body, "<p>Error code %d.</p>\n", resp->status);
-    lk_buffer_append_sprintf(resp->body, "<p>Message: Unsupported method ('%s').</p>\n", resp->statustext->s);
-    lk_buffer_append(resp->body, html_error_end, strlen(html_error_end));
+    set_status_page(server, resp, hc, 501);
 }
 
 void serve_cgi(LKHttpServer *server, LKContext *ctx, LKHostConfig *hc) {
@@ -477,22 +922,19 @@ void serve_cgi(LKHttpServer *server, LKContext *ctx, LKHostConfig *hc) {
     LKHttpResponse *resp = ctx->resp;
     char *path = req->path->s;
 
-    LKString *cgifile = lk_string_new(hc->homedir_abspath->s);
-    lk_string_append(cgifile, req->path->s);
-
-    // Expand "/../", etc. into real_path.
-    char real_path[PATH_MAX];
-    char *pz = realpath(cgifile->s, real_path);
-    lk_string_free(cgifile);
-
-    // real_path should start with cgidir_abspath
-    // real_path file should exist
-    if (pz == NULL || strncmp(real_path, hc->cgidir_abspath->s, hc->cgidir_abspath->s_len) || !lk_file_exists(real_path)) {
-        resp->status = 404;
-        lk_string_assign_sprintf(resp->statustext, "File not found '%s'", path);
-        lk_httpresponse_add_header(resp, "Content-Type", "text/plain");
-        lk_buffer_append_sprintf(resp->body, "File not found '%s'\n", path);
-
+    // Path is normalized and starts with cgidir. The script must be a
+    // regular file that resolves beneath cgidir.
+    // Ex. "/cgi-bin/app/run.pl" ==> "app/run.pl"
+    char *script = path + hc->cgidir->s_len;
+    struct stat st;
+    int fd = lk_open_beneath(hc->cgidir_fd, script, O_PATH);
+    int z = -1;
+    if (fd != -1) {
+        z = fstat(fd, &st);
+        close(fd);
+    }
+    if (z == -1 || !S_ISREG(st.st_mode)) {
+        set_status_page(server, resp, hc, 404);
         process_response(server, ctx);
         return;
     }
@@ -500,25 +942,30 @@ void serve_cgi(LKHttpServer *server, LKContext *ctx, LKHostConfig *hc) {
     set_cgi_env2(server, ctx, hc);
 
     // cgi stdout and stderr are streamed to fd_out.
-    //$$todo pass any request body to fd_in.
+    // Any request body is passed to fd_in.
+    LKString *cgifile = lk_string_new(hc->cgidir_abspath->s);
+    lk_string_append(cgifile, script);
     int fd_in, fd_out;
-    int z = lk_popen3(real_path, &fd_in, &fd_out, NULL);
+    z = lk_popen3(cgifile->s, &fd_in, &fd_out, NULL);
+    lk_string_free(cgifile);
     if (z == -1) {
-        resp->status = 500;
         lk_string_assign_sprintf(resp->statustext, "Server error '%s'", strerror(errno));
-        lk_httpresponse_add_header(resp, "Content-Type", "text/plain");
-        lk_buffer_append_sprintf(resp->body, "Server error '%s'\n", strerror(errno));
+        set_status_page(server, resp, hc, 500);
         process_response(server, ctx);
         return;
     }
 
-    close(fd_in);
-
     // Read cgi output in select()
     ctx->selectfd = fd_out;
     ctx->cgifd = fd_out;
     ctx->type = CTX_READ_CGI_OUTPUT;
-    ctx->cgi_outputbuf = lk_buffer_new(0);
+    ctx->cgi_outputbuf = lk_bufpool_get();
+    size_t hint = buffer_size_hint(&hc->stats.resp_sizes);
+    if (ctx->cgi_outputbuf->bytes_size < hint) {
+        lk_buffer_reserve(ctx->cgi_outputbuf, hint);
+    }
+    ctx->cgiparser = lk_httpcgiparser_new();
+    lk_set_sock_nonblocking(fd_out);
     FD_SET_READ(ctx->selectfd, server);
 
     // If req is POST with body, pass it to cgi process stdin.
@@ -531,10 +978,16 @@ void serve_cgi(LKHttpServer *server, LKContext *ctx, LKHostConfig *hc) {
         ctx_in->clientfd = ctx->clientfd;
         ctx_in->type = CTX_WRITE_CGI_INPUT;
 
-        ctx_in->cgi_inputbuf = lk_buffer_new(0);
-        lk_buffer_append(ctx_in->cgi_inputbuf, req->body->bytes, req->body->bytes_len);
+        // Hand the request body over to the cgi input without copying.
+        ctx_in->cgi_input = lk_bufchain_new();
+        lk_bufchain_append_buffer(ctx_in->cgi_input, req->body);
+        req->body = lk_bufpool_get();
 
+        // Don't block on a full stdin pipe while cgi output is waiting to be read.
+        lk_set_sock_nonblocking(fd_in);
         FD_SET_WRITE(ctx_in->selectfd, server);
+    } else {
+        close(fd_in);
     }
 }
 
@@ -544,130 +997,473 @@ void process_response(LKHttpServer *server, LKContext *ctx) {
 
     lk_httpresponse_finalize(resp);
 
+    // Pre-rendered responses are sent from the shared page body.
+    LKBuffer *body = resp->body;
+    if (resp->page != NULL) {
+        body = &resp->page_body;
+    }
+
     // Clear response body on HEAD request.
     if (lk_string_sz_equal(req->method, "HEAD")) {
         lk_buffer_clear(resp->body);
+        resp->page_body.bytes_len = 0;
+        resp->bodyfd_len = 0;
+        resp->nparts = 0;
     }
-
-    char time_str[TIME_STRING_SIZE];
-    get_localtime_string(time_str, sizeof(time_str));
-    printf("%s [%s] \"%s %s %s\" %d\n", 
-        ctx->client_ipaddr->s, time_str,
-        req->method->s, req->uri->s, resp->version->s,
-        resp->status);
-    if (resp->status >= 500 && resp->status < 600 && resp->statustext->s_len > 0) {
-        printf("%s [%s] %d - %s\n", 
-            ctx->client_ipaddr->s, time_str,
-            resp->status, resp->statustext->s);
+    // sendfile() needs nonblocking socket.
+    if (resp->bodyfd != -1) {
+        lk_set_sock_nonblocking(ctx->clientfd);
     }
 
+    size_t body_len = (resp->page != NULL) ? body->bytes_len : lk_httpresponse_content_length(resp);
+    record_response_size(server, ctx, resp->head->bytes_len + body_len);
+    print_access_log(ctx, req, resp);
+
     ctx->selectfd = ctx->clientfd;
     ctx->type = CTX_WRITE_RESP;
     FD_SET_WRITE(ctx->selectfd, server);
     lk_reflist_clear(ctx->buflist);
     lk_reflist_append(ctx->buflist, resp->head);
-    lk_reflist_append(ctx->buflist, resp->body);
+    // Multipart parts are queued one at a time, see write_response().
+    if (lk_httpresponse_next_part(resp)) {
+        body = &resp->part_body;
+    }
+    lk_reflist_append(ctx->buflist, body);
     return;
 }
 
+// Send the pre-rendered response for error status.
+// msg is only logged, for server errors.
 void process_error_response(LKHttpServer *server, LKContext *ctx, int status, char *msg) {
-    LKHttpResponse *resp = ctx->resp;
-    resp->status = status;
-    lk_string_assign(resp->statustext, msg);
-    lk_httpresponse_add_header(resp, "Content-Type", "text/plain");
-    lk_buffer_append_sz(resp->body, msg);
-
+    char *hostname = lk_headertable_get_id(ctx->req->headers, LK_HDR_HOST);
+    LKHostConfig *hc = lk_config_find_hostconfig(server->cfg, hostname);
+    if (status >= 500) {
+        lk_string_assign(ctx->resp->statustext, msg);
+    }
+    set_status_page(server, ctx->resp, hc, status);
     process_response(server, ctx);
 }
 
-// Open <home_dir>/<uri> file in nonblocking mode.
-// Returns 0 for success, -1 for error.
-int open_path_file(char *home_dir, char *path) {
-    // full_path = home_dir + path
-    // Ex. "/path/to" + "/index.html"
-    LKString *full_path = lk_string_new(home_dir);
-    lk_string_append(full_path, path);
-
-    int z = open(full_path->s, O_RDONLY | O_NONBLOCK);
-    lk_string_free(full_path);
-    return z;
+// Set pre-rendered response of hostconfig hc for error status.
+// Statuses without one get a plain text response with the reason phrase.
+void set_status_page(LKHttpServer *server, LKHttpResponse *resp, LKHostConfig *hc, int status) {
+    LKStatusPage *page = lk_config_status_page(server->cfg, hc, status);
+    if (page == NULL) {
+        LKStrView reason = lk_http_reason(status);
+        lk_buffer_clear(resp->body);
+        lk_buffer_append(resp->body, reason.p, reason.len);
+        resp->status = status;
+        lk_string_assign_buf(resp->statustext, reason.p, reason.len);
+        lk_httpresponse_add_header(resp, "Content-Type", "text/plain");
+        return;
+    }
+    lk_httpresponse_set_page(resp, page);
 }
 
-// Read <home_dir>/<uri> file into buffer.
-// Return number of bytes read or -1 for error.
-int read_path_file(char *home_dir, char *path, LKBuffer *buf) {
-    int z;
-    // full_path = home_dir + path
-    // Ex. "/path/to" + "/index.html"
-    LKString *full_path = lk_string_new(home_dir);
-    lk_string_append(full_path, path);
-
-    // Expand "/../", etc. into real_path.
-    char real_path[PATH_MAX];
-    char *pz = realpath(full_path->s, real_path);
-    // real_path should start with home_dir
-    if (pz == NULL || strncmp(real_path, home_dir, strlen(home_dir))) {
-        lk_string_free(full_path);
-        z = -1;
-        errno = EPERM;
-        return z;
+void print_access_log(LKContext *ctx, LKHttpRequest *req, LKHttpResponse *resp) {
+    char time_str[TIME_STRING_SIZE];
+    get_localtime_string(time_str, sizeof(time_str));
+    printf("%s [%s] \"%s %s %s\" %d\n", 
+        ctx->client_ipaddr->s, time_str,
+        req->method->s, req->uri->s, resp->version->s,
+        resp->status);
+    if (resp->status >= 500 && resp->status < 600 && resp->statustext->s_len > 0) {
+        printf("%s [%s] %d - %s\n", 
+            ctx->client_ipaddr->s, time_str,
+            resp->status, resp->statustext->s);
     }
+}
 
-    z = lk_readfile(real_path, buf);
-    lk_string_free(full_path);
-    return z;
+// Open regular file path beneath directory dirfd and stat it.
+// Path must already be normalized by parse_uri().
+// Return fd or -1 for error.
+int open_path_file(int dirfd, char *path, struct stat *st) {
+    int fd = lk_open_beneath(dirfd, path, O_RDONLY | O_NONBLOCK);
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, st) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (!S_ISREG(st->st_mode)) {
+        close(fd);
+        errno = EISDIR;
+        return -1;
+    }
+    return fd;
 }
 
-int is_valid_http_method(char *method) {
-    if (method == NULL) {
+// Set file validators and answer conditional request with 304 Not Modified,
+// otherwise read file into resp body.
+// fd is closed or passed on to resp->bodyfd.
+// Return 0 for success or -1 for error.
+int serve_path_file(LKHttpRequest *req, LKHttpResponse *resp, int fd, struct stat *st) {
+    // ETag from inode, size and modification time.
+    // Ex. "1a2b3c-4d2-653f1e2a"
+    char etag[64];
+    snprintf(etag, sizeof(etag), "\"%lx-%lx-%lx\"",
+             (unsigned long) st->st_ino, (unsigned long) st->st_size, (unsigned long) st->st_mtime);
+    char last_modified[HTTP_DATE_SIZE];
+    lk_format_http_date(st->st_mtime, last_modified, sizeof(last_modified));
+    lk_httpresponse_add_header(resp, "Last-Modified", last_modified);
+    lk_httpresponse_add_header(resp, "ETag", etag);
+
+    // If-None-Match takes precedence over If-Modified-Since.
+    int not_modified = 0;
+    char *if_none_match = lk_headertable_get_id(req->headers, LK_HDR_IF_NONE_MATCH);
+    char *if_modified_since = lk_headertable_get_id(req->headers, LK_HDR_IF_MODIFIED_SINCE);
+    if (if_none_match != NULL) {
+        not_modified = etag_list_match(if_none_match, etag);
+    } else if (if_modified_since != NULL) {
+        time_t t = lk_parse_http_date(if_modified_since);
+        not_modified = t != -1 && st->st_mtime <= t;
+    }
+    if (not_modified) {
+        resp->status = 304;
+        lk_string_assign(resp->statustext, "Not Modified");
+        lk_headertable_remove_id(resp->headers, LK_HDR_CONTENT_TYPE);
+        close(fd);
         return 0;
     }
 
-    if (!strcasecmp(method, "GET")      ||
-        !strcasecmp(method, "POST")     || 
-        !strcasecmp(method, "PUT")      || 
-        !strcasecmp(method, "DELETE")   ||
-        !strcasecmp(method, "HEAD"))  {
-        return 1;
+    // Range request, unless If-Range validator doesn't match.
+    lk_httpresponse_add_header(resp, "Accept-Ranges", "bytes");
+    char *range = lk_headertable_get_id(req->headers, LK_HDR_RANGE);
+    char *if_range = lk_headertable_get_id(req->headers, LK_HDR_IF_RANGE);
+    if (range != NULL && lk_string_sz_equal(req->method, "GET") &&
+        (if_range == NULL || if_range_match(if_range, etag, st->st_mtime))) {
+        int z = serve_file_ranges(resp, fd, st, range);
+        if (resp->bodyfd == fd) {
+            return 0;
+        }
+        if (z != 0) {
+            close(fd);
+            return z == 1 ? 0 : -1;
+        }
     }
 
+    ssize_t z = lk_readfd(fd, resp->body);
+    close(fd);
+    if (z == -1) {
+        return -1;
+    }
     return 0;
 }
 
-// Return ptr to start of file extension within filepath.
-// Ex. "path/to/index.html" returns "index.html"
-char *fileext(char *filepath) {
-    int filepath_len = strlen(filepath);
-    // filepath of "" returns ext of "".
-    if (filepath_len == 0) {
-        return filepath;
+// Return whether If-Range entity-tag or HTTP-date matches the file.
+// Entity-tags use strong comparison, so weak tags never match.
+int if_range_match(char *if_range, char *etag, time_t mtime) {
+    if (if_range[0] == '"') {
+        return strcmp(if_range, etag) == 0;
     }
-
-    char *p = filepath + strlen(filepath) - 1;
-    while (p >= filepath) {
-        if (*p == '.') {
-            return p+1;
-        }
-        p--;
+    if (strncmp(if_range, "W/", 2) == 0) {
+        return 0;
     }
-    return filepath;
+    return lk_parse_http_date(if_range) == mtime;
 }
 
-void write_response(LKHttpServer *server, LKContext *ctx) {
-    int z = lk_buflist_write_all(ctx->selectfd, FD_SOCK, ctx->buflist);
-    if (z == Z_BLOCK) {
-        return;
-    }
-    if (z == Z_ERR) {
-        lk_print_err("write_response lk_buflist_write_all()");
-        terminate_client_session(server, ctx);
-        return;
-    }
-    if (z == Z_EOF) {
-        // Completed sending http response.
-        terminate_client_session(server, ctx);
+// Parse "bytes=" Range header into satisfiable ranges for file of size.
+// Ex. "bytes=0-499", "bytes=500-", "bytes=-500", "bytes=0-0,-1"
+// Ranges starting past end of file are skipped, ends are clipped to file.
+// Return number of ranges in starts/ends (0 if none satisfiable),
+// or -1 if header is invalid or has more than max_ranges ranges.
+int parse_ranges(char *range, off_t size, off_t *starts, off_t *ends, int max_ranges) {
+    if (strncmp(range, "bytes=", 6) != 0) {
+        return -1;
     }
-}
+    char *p = range + 6;
+    int nspecs = 0;
+    int nranges = 0;
+
+    while (1) {
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        nspecs++;
+        if (nspecs > max_ranges) {
+            return -1;
+        }
+
+        int has_first = 0, has_last = 0;
+        unsigned long long first = 0, last = 0;
+        while (*p >= '0' && *p <= '9') {
+            if (first > (ULLONG_MAX - 9) / 10) return -1;
+            first = first*10 + (*p - '0');
+            has_first = 1;
+            p++;
+        }
+        if (*p != '-') {
+            return -1;
+        }
+        p++;
+        while (*p >= '0' && *p <= '9') {
+            if (last > (ULLONG_MAX - 9) / 10) return -1;
+            last = last*10 + (*p - '0');
+            has_last = 1;
+            p++;
+        }
+
+        if (has_first) {
+            // first-last or first-
+            if (has_last && last < first) {
+                return -1;
+            }
+            if (first < (unsigned long long) size) {
+                starts[nranges] = first;
+                ends[nranges] = size-1;
+                if (has_last && last < (unsigned long long) size-1) {
+                    ends[nranges] = last;
+                }
+                nranges++;
+            }
+        } else {
+            // -suffix
+            if (!has_last) {
+                return -1;
+            }
+            if (last > 0 && size > 0) {
+                starts[nranges] = last < (unsigned long long) size ? size - last : 0;
+                ends[nranges] = size-1;
+                nranges++;
+            }
+        }
+
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        if (*p != ',') {
+            return -1;
+        }
+        p++;
+    }
+    return nranges;
+}
+
+// Set 206 Partial Content response for Range header.
+// Ranges are sent straight from the file with sendfile(). For multiple
+// ranges, only the multipart/byteranges part heads are kept in the body.
+// fd is passed on to resp->bodyfd if a 206 response was set, otherwise
+// left open.
+// Return 1 if response was set, 0 to ignore Range and send the whole
+// file or -1 for error.
+int serve_file_ranges(LKHttpResponse *resp, int fd, struct stat *st, char *range) {
+    off_t starts[MAX_BYTERANGES];
+    off_t ends[MAX_BYTERANGES];
+    int nranges = parse_ranges(range, st->st_size, starts, ends, MAX_BYTERANGES);
+    if (nranges == -1) {
+        return 0;
+    }
+    if (nranges == 0) {
+        char content_range[64];
+        snprintf(content_range, sizeof(content_range), "bytes */%lld", (long long) st->st_size);
+        resp->status = 416;
+        lk_string_assign(resp->statustext, "Range Not Satisfiable");
+        lk_httpresponse_add_header(resp, "Content-Type", "text/plain");
+        lk_httpresponse_add_header(resp, "Content-Range", content_range);
+        lk_buffer_append_sz(resp->body, "Range Not Satisfiable\n");
+        return 1;
+    }
+
+    // Overlapping ranges adding up to more than the file are not worth it.
+    off_t total = 0;
+    for (int i=0; i < nranges; i++) {
+        total += ends[i] - starts[i] + 1;
+    }
+    if (total > st->st_size) {
+        return 0;
+    }
+
+    resp->status = 206;
+    lk_string_assign(resp->statustext, "Partial Content");
+
+    if (nranges == 1) {
+        char content_range[128];
+        snprintf(content_range, sizeof(content_range), "bytes %lld-%lld/%lld",
+                 (long long) starts[0], (long long) ends[0], (long long) st->st_size);
+        lk_httpresponse_add_header(resp, "Content-Range", content_range);
+        resp->bodyfd = fd;
+        resp->bodyfd_offset = starts[0];
+        resp->bodyfd_len = ends[0] - starts[0] + 1;
+        return 1;
+    }
+
+    // multipart/byteranges body:
+    //   --boundary
+    //   Content-Type: video/mp4
+    //   Content-Range: bytes 0-499/1234
+    //
+    //   <bytes 0-499>
+    //   --boundary--
+    char boundary[48];
+    snprintf(boundary, sizeof(boundary), "LKWS%08lx%08lx", random(), (unsigned long) st->st_ino);
+    char *content_type = lk_headertable_get_id(resp->headers, LK_HDR_CONTENT_TYPE);
+    LKBuffer *body = resp->body;
+    LKBodyPart *parts = lk_malloc(sizeof(LKBodyPart) * nranges, "serve_file_ranges");
+    for (int i=0; i < nranges; i++) {
+        lk_buffer_append_sprintf(body, "\r\n--%s\r\n", boundary);
+        if (content_type != NULL) {
+            lk_buffer_append_sprintf(body, "Content-Type: %s\r\n", content_type);
+        }
+        lk_buffer_append_sprintf(body, "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                                 (long long) starts[i], (long long) ends[i], (long long) st->st_size);
+        parts[i].head_end = body->bytes_len;
+        parts[i].offset = starts[i];
+        parts[i].len = ends[i] - starts[i] + 1;
+    }
+    lk_buffer_append_sprintf(body, "\r\n--%s--\r\n", boundary);
+    lk_httpresponse_set_parts(resp, fd, parts, nranges);
+
+    LKString *multipart_type = lk_string_new("");
+    lk_string_assign_sprintf(multipart_type, "multipart/byteranges; boundary=%s", boundary);
+    lk_httpresponse_add_header(resp, "Content-Type", multipart_type->s);
+    lk_string_free(multipart_type);
+    return 1;
+}
+
+// Append len bytes of fd at offset to buf.
+// Return 0 for success or -1 for error.
+int pread_extent(int fd, off_t offset, size_t len, LKBuffer *buf) {
+    if (buf->bytes_size - buf->bytes_len < len) {
+        lk_buffer_resize(buf, buf->bytes_len + len);
+    }
+    while (len > 0) {
+        ssize_t nread = pread(fd, buf->bytes + buf->bytes_len, len, offset);
+        if (nread == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            return -1;
+        }
+        buf->bytes_len += nread;
+        offset += nread;
+        len -= nread;
+    }
+    return 0;
+}
+
+// Read resp bodyfd extent, or all multipart parts, into resp body for
+// responses that can't use sendfile().
+// Return 0 for success or -1 for error.
+int load_bodyfd(LKHttpResponse *resp) {
+    int z = 0;
+    if (resp->nparts > 0) {
+        // Part heads are in body, the whole body is built separately.
+        LKBuffer *partsbuf = lk_buffer_new(lk_httpresponse_content_length(resp));
+        while (z == 0 && lk_httpresponse_next_part(resp)) {
+            lk_buffer_append(partsbuf, resp->part_body.bytes, resp->part_body.bytes_len);
+            z = pread_extent(resp->bodyfd, resp->bodyfd_offset, resp->bodyfd_len, partsbuf);
+        }
+        lk_buffer_clear(resp->body);
+        lk_buffer_append(resp->body, partsbuf->bytes, partsbuf->bytes_len);
+        lk_buffer_free(partsbuf);
+        lk_free(resp->parts);
+        resp->parts = NULL;
+        resp->nparts = 0;
+    } else {
+        z = pread_extent(resp->bodyfd, resp->bodyfd_offset, resp->bodyfd_len, resp->body);
+    }
+    close(resp->bodyfd);
+    resp->bodyfd = -1;
+    resp->bodyfd_len = 0;
+    return z;
+}
+
+// Return whether etag matches an entry in If-None-Match list using
+// weak comparison.
+// Ex. etags: "*" or W/"abc", "1a2b3c-4d2-653f1e2a"
+int etag_list_match(char *etags, char *etag) {
+    size_t etag_len = strlen(etag);
+    char *p = etags;
+    while (*p != '\0') {
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+        }
+        if (*p == '*') {
+            return 1;
+        }
+        if (strncmp(p, "W/", 2) == 0) {
+            p += 2;
+        }
+        if (strncmp(p, etag, etag_len) == 0 &&
+            (p[etag_len] == '\0' || p[etag_len] == ',' || p[etag_len] == ' ' || p[etag_len] == '\t')) {
+            return 1;
+        }
+        // Skip to next entry.
+        while (*p != '\0' && *p != ',') {
+            p++;
+        }
+    }
+    return 0;
+}
+
+int is_valid_http_method(char *method) {
+    if (method == NULL) {
+        return 0;
+    }
+
+    if (!strcasecmp(method, "GET")      ||
+        !strcasecmp(method, "POST")     || 
+        !strcasecmp(method, "PUT")      || 
+        !strcasecmp(method, "DELETE")   ||
+        !strcasecmp(method, "HEAD"))  {
+        return 1;
+    }
+
+    return 0;
+}
+
+// Return ptr to start of file extension within filepath.
+// Ex. "path/to/index.html" returns "index.html"
+char *fileext(char *filepath) {
+    int filepath_len = strlen(filepath);
+    // filepath of "" returns ext of "".
+    if (filepath_len == 0) {
+        return filepath;
+    }
+
+    char *p = filepath + strlen(filepath) - 1;
+    while (p >= filepath) {
+        if (*p == '.') {
+            return p+1;
+        }
+        p--;
+    }
+    return filepath;
+}
+
+void write_response(LKHttpServer *server, LKContext *ctx) {
+    LKHttpResponse *resp = ctx->resp;
+    int z;
+    while (1) {
+        z = lk_buflist_write_all(ctx->selectfd, FD_SOCK, ctx->buflist);
+        // Send file extent after head and body.
+        if (z == Z_EOF && resp->bodyfd != -1) {
+            z = lk_sendfile_all(ctx->selectfd, resp->bodyfd, &resp->bodyfd_offset, &resp->bodyfd_len);
+        }
+        // Then the next multipart part head and extent.
+        if (z != Z_EOF || !lk_httpresponse_next_part(resp)) {
+            break;
+        }
+        lk_reflist_clear(ctx->buflist);
+        lk_reflist_append(ctx->buflist, &resp->part_body);
+    }
+    if (z == Z_BLOCK) {
+        return;
+    }
+    if (z == Z_ERR) {
+        lk_print_err("write_response lk_buflist_write_all()");
+        terminate_client_session(server, ctx);
+        return;
+    }
+    if (z == Z_EOF) {
+        // Completed sending http response.
+        terminate_client_session(server, ctx);
+    }
+}
 
 void serve_proxy(LKHttpServer *server, LKContext *ctx, char *targethost) {
     int proxyfd = lk_open_connect_socket(targethost, "", NULL);
@@ -704,17 +1500,24 @@ void write_proxy_request(LKHttpServer *server, LKContext *ctx) {
     if (z == Z_EOF) {
         // Completed sending http request.
         FD_CLR_WRITE(ctx->selectfd, server);
+        FD_SET_READ(ctx->selectfd, server);
+
+        // Keep proxy connection open in case it switches protocols.
+        if (is_upgrade_request(ctx->req)) {
+            ctx->proxy_respbuf = lk_bufpool_get();
+            ctx->type = CTX_PROXY_READ_UPGRADE_RESP;
+            return;
+        }
         shutdown(ctx->selectfd, SHUT_WR);
+        ctx->proxy_resp = lk_bufchain_new();
 
         // Pipe proxy response from ctx->proxyfd to ctx->clientfd
         ctx->type = CTX_PROXY_PIPE_RESP;
-        ctx->proxy_respbuf = lk_buffer_new(0);
-        FD_SET_READ(ctx->selectfd, server);
     }
 }
 
 void pipe_proxy_response(LKHttpServer *server, LKContext *ctx) {
-    int z = lk_pipe_all(ctx->proxyfd, ctx->clientfd, FD_SOCK, ctx->proxy_respbuf);
+    int z = lk_pipe_all(ctx->proxyfd, ctx->clientfd, FD_SOCK, ctx->proxy_resp);
     if (z == Z_OPEN || z == Z_BLOCK) {
         return;
     }
@@ -747,6 +1550,445 @@ void pipe_proxy_response(LKHttpServer *server, LKContext *ctx) {
     terminate_client_session(server, ctx);
 }
 
+// Return whether request asks to switch protocols.
+// Ex. Connection: Upgrade
+//     Upgrade: websocket
+int is_upgrade_request(LKHttpRequest *req) {
+    if (!lk_string_sz_equal(req->version, "HTTP/1.1")) {
+        return 0;
+    }
+    return lk_headertable_get_id(req->headers, LK_HDR_UPGRADE) != NULL;
+}
+
+// Read proxy response status line for an upgrade request.
+// A '101 Switching Protocols' response turns the client and proxy
+// connections into a tunnel, any other response is piped to the client.
+// Status line longer than max_header_size gets 502 Bad Gateway.
+void read_proxy_upgrade_response(LKHttpServer *server, LKContext *ctx) {
+    LKBuffer *buf = ctx->proxy_respbuf;
+    size_t max_size = server->cfg->max_header_size;
+    if (max_size == 0) {
+        max_size = LK_MAX_HEAD_SIZE;
+    }
+    size_t nbytes;
+    int z = Z_OPEN;
+    if (buf->bytes_len < max_size) {
+        z = lk_read_sock(ctx->proxyfd, buf, max_size - buf->bytes_len, &nbytes);
+    }
+    if (z == Z_ERR) {
+        lk_print_err("read_proxy_upgrade_response lk_read_sock()");
+        z = terminate_fd(ctx->proxyfd, FD_SOCK, FD_READ, server);
+        if (z == 0) {
+            ctx->proxyfd = 0;
+        }
+        process_error_response(server, ctx, 500, "Error reading proxy response.");
+        return;
+    }
+
+    // Wait for complete status line.
+    char *eol = memchr(buf->bytes, '\n', buf->bytes_len);
+    if (eol == NULL && buf->bytes_len >= max_size) {
+        z = terminate_fd(ctx->proxyfd, FD_SOCK, FD_READWRITE, server);
+        if (z == 0) {
+            ctx->proxyfd = 0;
+        }
+        process_error_response(server, ctx, 502, "Proxy response status line too long.");
+        return;
+    }
+    if (eol == NULL && z == Z_BLOCK) {
+        return;
+    }
+
+    // "HTTP/1.1 101 Switching Protocols"
+    if (eol != NULL && buf->bytes_len > 12 &&
+        strncmp(buf->bytes, "HTTP/1.", 7) == 0 &&
+        strncmp(buf->bytes+8, " 101 ", 5) == 0) {
+        start_tunnel(server, ctx);
+        return;
+    }
+
+    // Not switching, the bytes read so far start the piped response.
+    shutdown(ctx->proxyfd, SHUT_WR);
+    ctx->proxy_resp = lk_bufchain_new();
+    lk_bufchain_append_buffer(ctx->proxy_resp, buf);
+    ctx->proxy_respbuf = NULL;
+    ctx->type = CTX_PROXY_PIPE_RESP;
+    pipe_proxy_response(server, ctx);
+}
+
+// Start passing bytes both ways between clientfd and proxyfd.
+// ctx keeps selecting proxyfd and owns the tunnel, a second ctx is
+// added to select clientfd.
+void start_tunnel(LKHttpServer *server, LKContext *ctx) {
+    LKSplicePipe *up = lk_splicepipe_new(ctx->clientfd, ctx->proxyfd);
+    LKSplicePipe *down = lk_splicepipe_new(ctx->proxyfd, ctx->clientfd);
+    if (up == NULL || down == NULL) {
+        lk_print_err("lk_splicepipe_new()");
+        if (up) {
+            lk_splicepipe_free(up);
+        }
+        if (down) {
+            lk_splicepipe_free(down);
+        }
+        terminate_client_session(server, ctx);
+        return;
+    }
+    lk_set_sock_nonblocking(ctx->clientfd);
+    lk_set_sock_nonblocking(ctx->proxyfd);
+
+    // Send proxy response bytes read so far to client first.
+    lk_bufpool_put(down->buf);
+    down->buf = ctx->proxy_respbuf;
+    ctx->proxy_respbuf = NULL;
+
+    // Client bytes past the request, if any, go to proxy first.
+    LKBuffer *srbuf = ctx->sr->buf;
+    if (srbuf->bytes_cur < srbuf->bytes_len) {
+        lk_buffer_append(up->buf, srbuf->bytes + srbuf->bytes_cur, srbuf->bytes_len - srbuf->bytes_cur);
+        srbuf->bytes_cur = srbuf->bytes_len;
+    }
+
+    LKContext *peer = lk_context_new();
+    peer->selectfd = ctx->clientfd;
+    peer->clientfd = ctx->clientfd;
+    peer->type = CTX_PROXY_TUNNEL;
+    peer->tunnel_peer = ctx;
+    add_context(&server->ctxhead, peer);
+
+    ctx->type = CTX_PROXY_TUNNEL;
+    ctx->tunnel_up = up;
+    ctx->tunnel_down = down;
+    ctx->tunnel_peer = peer;
+    ctx->tunnel_active = time(NULL);
+    server->ntunnels++;
+
+    LKHttpRequest *req = ctx->req;
+    char time_str[TIME_STRING_SIZE];
+    get_localtime_string(time_str, sizeof(time_str));
+    printf("%s [%s] \"%s %s\" --> proxyhost tunnel\n",
+        ctx->client_ipaddr->s, time_str, req->method->s, req->uri->s);
+
+    pipe_tunnel(server, ctx);
+}
+
+// Move available bytes in both tunnel directions.
+// ctx can be either the tunnel owner or its peer.
+void pipe_tunnel(LKHttpServer *server, LKContext *ctx) {
+    if (ctx->tunnel_up == NULL) {
+        ctx = ctx->tunnel_peer;
+    }
+    LKSplicePipe *up = ctx->tunnel_up;
+    LKSplicePipe *down = ctx->tunnel_down;
+    size_t nbytes = up->nbytes + down->nbytes;
+
+    int upz = lk_splice_all(up);
+    int downz = lk_splice_all(down);
+    if (upz == Z_ERR || downz == Z_ERR) {
+        terminate_tunnel(server, ctx, "error");
+        return;
+    }
+    if (upz == Z_EOF && downz == Z_EOF) {
+        terminate_tunnel(server, ctx, "closed");
+        return;
+    }
+
+    // Pass on half-close when one side is done sending.
+    if (upz == Z_EOF) {
+        shutdown(ctx->proxyfd, SHUT_WR);
+    }
+    if (downz == Z_EOF) {
+        shutdown(ctx->clientfd, SHUT_WR);
+    }
+
+    if (up->nbytes + down->nbytes != nbytes) {
+        ctx->tunnel_active = time(NULL);
+    }
+    set_tunnel_fds(server, up);
+    set_tunnel_fds(server, down);
+}
+
+// Select readfd when pipe is empty, writefd when bytes are waiting.
+void set_tunnel_fds(LKHttpServer *server, LKSplicePipe *sp) {
+    int pending = lk_splicepipe_pending(sp);
+    if (!sp->read_eof && !pending) {
+        FD_SET_READ(sp->readfd, server);
+    } else {
+        FD_CLR_READ(sp->readfd, server);
+    }
+    if (pending) {
+        FD_SET_WRITE(sp->writefd, server);
+    } else {
+        FD_CLR_WRITE(sp->writefd, server);
+    }
+}
+
+// Close both tunnel connections and remove the tunnel ctx's.
+void terminate_tunnel(LKHttpServer *server, LKContext *ctx, char *reason) {
+    LKHttpRequest *req = ctx->req;
+    char time_str[TIME_STRING_SIZE];
+    get_localtime_string(time_str, sizeof(time_str));
+    printf("%s [%s] \"%s %s\" --> tunnel %s, %zu bytes sent, %zu bytes received\n",
+        ctx->client_ipaddr->s, time_str, req->method->s, req->uri->s, reason,
+        ctx->tunnel_up->nbytes, ctx->tunnel_down->nbytes);
+
+    int clientfd = ctx->clientfd;
+    int proxyfd = ctx->proxyfd;
+    terminate_fd(clientfd, FD_SOCK, FD_READWRITE, server);
+    terminate_fd(proxyfd, FD_SOCK, FD_READWRITE, server);
+
+    remove_selectfd_context(&server->ctxhead, clientfd);
+    remove_selectfd_context(&server->ctxhead, proxyfd);
+    server->ntunnels--;
+}
+
+// Close tunnels without traffic for TUNNEL_IDLE_TIMEOUT seconds, and
+// answer 408 to clients that haven't sent the request head within
+// header_timeout seconds. TLS clients that haven't finished the
+// handshake by then are closed. Pools are trimmed here too.
+void sweep_idle_contexts(LKHttpServer *server) {
+    time_t now = time(NULL);
+    server->sweep_time = now;
+    unsigned int header_timeout = server->cfg->header_timeout;
+
+    // Release pooled objects that weren't needed since the last sweep.
+    lk_bufpool_trim();
+    lk_arenapool_trim();
+
+    LKContext *ctx = server->ctxhead;
+    while (ctx != NULL) {
+        if (ctx->type == CTX_PROXY_TUNNEL && ctx->tunnel_up != NULL &&
+            now - ctx->tunnel_active >= TUNNEL_IDLE_TIMEOUT) {
+            terminate_tunnel(server, ctx, "idle timeout");
+            // ctx list changed, start over.
+            ctx = server->ctxhead;
+            continue;
+        }
+#ifdef LKTLS
+        if (ctx->type == CTX_TLS && ctx->tlsconn != NULL && !ctx->tlsconn->handshake_done &&
+            header_timeout > 0 && now - ctx->req_start >= header_timeout) {
+            terminate_tls(server, ctx);
+            ctx = server->ctxhead;
+            continue;
+        }
+#endif
+        if (ctx->type == CTX_READ_REQ && (ctx->reqparser == NULL || !ctx->reqparser->head_complete) &&
+            header_timeout > 0 && now - ctx->req_start >= header_timeout) {
+            if (ctx->reqparser == NULL) {
+                start_request(server, ctx);
+            }
+            FD_CLR_READ(ctx->selectfd, server);
+            shutdown(ctx->selectfd, SHUT_RD);
+            process_error_response(server, ctx, 408, "LittleKitten webserver: request timeout.");
+            // ctx may have been removed, start over.
+            ctx = server->ctxhead;
+            continue;
+        }
+        ctx = ctx->next;
+    }
+}
+
+// GET ssepath subscribes to the host's event stream.
+// POST ssepath with the ssesecret token publishes the request body as an
+// event to all subscribers.
+void serve_sse(LKHttpServer *server, LKContext *ctx, LKHostConfig *hc) {
+    LKHttpRequest *req = ctx->req;
+    if (lk_string_sz_equal(req->method, "GET")) {
+        subscribe_sse(server, ctx, hc);
+        return;
+    }
+    if (lk_string_sz_equal(req->method, "POST")) {
+        if (!is_sse_publisher(hc, req)) {
+            process_error_response(server, ctx, 403, "LittleKitten webserver: publish not allowed.");
+            return;
+        }
+        publish_sse(server, ctx, hc);
+        return;
+    }
+    process_error_response(server, ctx, 405, "LittleKitten webserver: method not allowed.");
+}
+
+// Return whether request has the hostconfig's ssesecret as bearer token.
+// Ex. Authorization: Bearer change-me
+// The client address isn't checked, behind a TLS terminator every client
+// connects from localhost. Without ssesecret nobody can publish.
+int is_sse_publisher(LKHostConfig *hc, LKHttpRequest *req) {
+    char *auth = lk_headertable_get(req->headers, "Authorization");
+    LKString *secret = hc->ssesecret;
+    if (secret->s_len == 0 || auth == NULL || strncmp(auth, "Bearer ", 7) != 0) {
+        return 0;
+    }
+    char *token = auth + 7;
+    if (strlen(token) != secret->s_len) {
+        return 0;
+    }
+    // Compare every byte so the time taken doesn't tell how much matched.
+    unsigned char diff = 0;
+    for (size_t i=0; i < secret->s_len; i++) {
+        diff |= token[i] ^ secret->s[i];
+    }
+    return diff == 0;
+}
+
+// Send event stream response head and keep connection open for events.
+void subscribe_sse(LKHttpServer *server, LKContext *ctx, LKHostConfig *hc) {
+    LKHttpResponse *resp = ctx->resp;
+    resp->status = 200;
+    lk_string_assign(resp->statustext, "OK");
+    lk_string_assign(resp->version, "HTTP/1.0");
+    print_access_log(ctx, ctx->req, resp);
+
+    // No Content-Length, events are sent until connection closes.
+    lk_httpresponse_add_header(resp, "Content-Type", "text/event-stream");
+    lk_httpresponse_add_header(resp, "Cache-Control", "no-cache");
+    lk_httpresponse_finalize_head(resp, -1);
+    LKRefBuffer *head = lk_refbuffer_new(resp->head->bytes_len);
+    lk_buffer_append(head->buf, resp->head->bytes, resp->head->bytes_len);
+
+    ctx->selectfd = ctx->clientfd;
+    ctx->type = CTX_SSE_SUBSCRIBER;
+    ctx->hc = hc;
+    ctx->sse_queue = lk_reflist_new();
+    ctx->sse_offset = 0;
+    lk_reflist_append(ctx->sse_queue, head);
+    FD_SET_READ(ctx->selectfd, server);
+    FD_SET_WRITE(ctx->selectfd, server);
+}
+
+// Encode request body as one event and queue it to every subscriber
+// of the host. All subscriber queues share the same event buffer.
+// Subscribers too far behind are disconnected.
+void publish_sse(LKHttpServer *server, LKContext *ctx, LKHostConfig *hc) {
+    // ?event=name sets the event type.
+    LKString *event = lk_string_new("");
+    if (lk_string_starts_with(ctx->req->querystring, "event=")) {
+        lk_string_assign(event, ctx->req->querystring->s + strlen("event="));
+    }
+    server->sse_lastid++;
+    LKRefBuffer *rb = encode_sse_event(server->sse_lastid, event, ctx->req->body);
+    lk_string_free(event);
+
+    unsigned int nsubscribers = 0;
+    LKContext *p = server->ctxhead;
+    while (p != NULL) {
+        LKContext *next = p->next;
+        if (p->type == CTX_SSE_SUBSCRIBER && p->hc == hc) {
+            LKRefList *q = p->sse_queue;
+            if (q->items_len - q->items_cur >= SSE_MAX_QUEUE) {
+                // Slow subscriber, client can reconnect with Last-Event-ID.
+                terminate_client_session(server, p);
+            } else {
+                lk_reflist_append(q, lk_refbuffer_ref(rb));
+                FD_SET_WRITE(p->selectfd, server);
+                nsubscribers++;
+            }
+        }
+        p = next;
+    }
+    lk_refbuffer_unref(rb);
+
+    LKHttpResponse *resp = ctx->resp;
+    lk_httpresponse_add_header(resp, "Content-Type", "text/plain");
+    lk_buffer_append_sprintf(resp->body, "Event %lu sent to %u subscribers.\n", server->sse_lastid, nsubscribers);
+    process_response(server, ctx);
+}
+
+// Return event in text/event-stream format:
+//   id: 1
+//   event: update
+//   data: line 1
+//   data: line 2
+//   <blank line>
+LKRefBuffer *encode_sse_event(unsigned long id, LKString *event, LKBuffer *data) {
+    LKRefBuffer *rb = lk_refbuffer_new(data->bytes_len + LK_BUFSIZE_SMALL);
+    LKBuffer *buf = rb->buf;
+    lk_buffer_append_sprintf(buf, "id: %lu\n", id);
+    if (event->s_len > 0 && strpbrk(event->s, "\r\n") == NULL) {
+        lk_buffer_append_sprintf(buf, "event: %s\n", event->s);
+    }
+
+    // Each line of data becomes a data field.
+    size_t start = 0;
+    while (start < data->bytes_len) {
+        char *eol = memchr(data->bytes + start, '\n', data->bytes_len - start);
+        size_t end = eol ? (size_t)(eol - data->bytes) : data->bytes_len;
+        size_t line_len = end - start;
+        if (line_len > 0 && data->bytes[start + line_len - 1] == '\r') {
+            line_len--;
+        }
+        lk_buffer_append_sz(buf, "data: ");
+        lk_buffer_append(buf, data->bytes + start, line_len);
+        lk_buffer_append_sz(buf, "\n");
+        start = end + 1;
+    }
+    if (data->bytes_len == 0) {
+        lk_buffer_append_sz(buf, "data: \n");
+    }
+    lk_buffer_append_sz(buf, "\n");
+    return rb;
+}
+
+// Subscribers don't send anything after the request, discard any bytes
+// and disconnect on EOF.
+void read_sse(LKHttpServer *server, LKContext *ctx) {
+    char buf[LK_BUFSIZE_SMALL];
+    while (1) {
+        ssize_t z = recv(ctx->clientfd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (z == -1 && errno == EINTR) {
+            continue;
+        }
+        if (z == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (z <= 0) {
+            // Subscriber disconnected.
+            terminate_client_session(server, ctx);
+            return;
+        }
+    }
+    // Read events are handled before write events, don't hold up
+    // queued events.
+    if (ctx->sse_queue->items_cur < ctx->sse_queue->items_len) {
+        write_sse(server, ctx);
+    }
+}
+
+// Send queued events to subscriber.
+void write_sse(LKHttpServer *server, LKContext *ctx) {
+    LKRefList *q = ctx->sse_queue;
+    while (q->items_cur < q->items_len) {
+        LKRefBuffer *rb = lk_reflist_get_cur(q);
+        LKBuffer *buf = rb->buf;
+        ssize_t z = send(ctx->clientfd, buf->bytes + ctx->sse_offset, buf->bytes_len - ctx->sse_offset,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (z == -1 && errno == EINTR) {
+            continue;
+        }
+        if (z == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // Drop sent events from front of queue.
+            while (q->items_cur > 0) {
+                lk_reflist_remove(q, 0);
+                q->items_cur--;
+            }
+            return;
+        }
+        if (z == -1) {
+            // Subscriber disconnected.
+            terminate_client_session(server, ctx);
+            return;
+        }
+        ctx->sse_offset += z;
+        if (ctx->sse_offset == buf->bytes_len) {
+            lk_refbuffer_unref(rb);
+            q->items_cur++;
+            ctx->sse_offset = 0;
+        }
+    }
+
+    // All events sent, wait for next publish.
+    lk_reflist_clear(q);
+    FD_CLR_WRITE(ctx->selectfd, server);
+}
+
 //$$ read_proxy_response() and write_response() were
 //   replaced by pipe_proxy_response().
 #if 0
@@ -803,7 +2045,214 @@ void write_proxy_response(LKHttpServer *server, LKContext *ctx) {
 }
 #endif
 
-// Clear fd from select()'s, shutdown, and close.
+// Return whether request line is the HTTP/2 connection preface.
+int is_http2_preface(LKHttpRequest *req) {
+    return lk_string_sz_equal(req->method, "PRI") &&
+           lk_string_sz_equal(req->uri, "*") &&
+           lk_string_sz_equal(req->version, "HTTP/2.0");
+}
+
+// Return whether request asks to upgrade to h2c.
+// Ex. Connection: Upgrade, HTTP2-Settings
+//     Upgrade: h2c
+//     HTTP2-Settings: <base64url SETTINGS payload>
+int is_h2c_upgrade(LKHttpRequest *req) {
+    if (!lk_string_sz_equal(req->version, "HTTP/1.1")) {
+        return 0;
+    }
+    char *upgrade = lk_headertable_get_id(req->headers, LK_HDR_UPGRADE);
+    char *settings = lk_headertable_get_id(req->headers, LK_HDR_HTTP2_SETTINGS);
+    if (upgrade == NULL || settings == NULL) {
+        return 0;
+    }
+    return strstr(upgrade, "h2c") != NULL;
+}
+
+// Return whether request is for a file served by serve_files().
+// Only those are served over HTTP/2, so other requests ignore an h2c
+// upgrade and are answered over http/1.
+int is_file_request(LKHttpServer *server, LKHttpRequest *req) {
+    char *hostname = lk_headertable_get_id(req->headers, LK_HDR_HOST);
+    LKHostConfig *hc = lk_config_find_hostconfig(server->cfg, hostname);
+    if (hc == NULL || hc->proxyhost->s_len > 0 || hc->homedir->s_len == 0) {
+        return 0;
+    }
+    if (hc->ssepath->s_len > 0 && lk_string_equal(req->path, hc->ssepath)) {
+        return 0;
+    }
+    char *path = lk_stringtable_get(hc->aliases, req->path->s);
+    if (path == NULL) {
+        path = req->path->s;
+    }
+    if (hc->cgidir->s_len > 0 && !strncmp(path, hc->cgidir->s, hc->cgidir->s_len)) {
+        return 0;
+    }
+    return 1;
+}
+
+// Switch client connection to HTTP/2.
+// For upgrade, ctx->req is answered as stream 1.
+// Returns 0 for success, -1 if upgrade not possible.
+int start_http2(LKHttpServer *server, LKContext *ctx, int upgrade) {
+    LKHttp2Session *h2 = lk_http2session_new();
+    // Same request head limits as http/1, advertised in SETTINGS.
+    h2->decoder->max_list_size = server->cfg->max_header_size;
+    h2->decoder->max_fields = server->cfg->max_headers;
+    if (upgrade) {
+        char *settings = lk_headertable_get_id(ctx->req->headers, LK_HDR_HTTP2_SETTINGS);
+        int z = lk_http2session_upgrade(h2, ctx->req, settings);
+        if (z == -1) {
+            lk_http2session_free(h2);
+            return -1;
+        }
+        // Session owns the request now.
+        ctx->req = lk_httprequest_new();
+    } else {
+        // Preface request line was already read by the http/1 parser.
+        lk_buffer_append_sz(h2->inbuf, "PRI * HTTP/2.0\r\n");
+    }
+
+    // Pass on any bytes already read by socketreader.
+    LKBuffer *srbuf = ctx->sr->buf;
+    if (srbuf->bytes_cur < srbuf->bytes_len) {
+        lk_buffer_append(h2->inbuf, srbuf->bytes + srbuf->bytes_cur, srbuf->bytes_len - srbuf->bytes_cur);
+        srbuf->bytes_cur = srbuf->bytes_len;
+    }
+
+    ctx->h2 = h2;
+    ctx->type = CTX_HTTP2;
+    process_http2(server, ctx);
+    return 0;
+}
+
+void read_http2(LKHttpServer *server, LKContext *ctx) {
+    int z = lk_read_all_sock(ctx->clientfd, ctx->h2->inbuf);
+    if (z == Z_ERR) {
+        lk_print_err("read_http2 lk_read_all_sock()");
+        terminate_client_session(server, ctx);
+        return;
+    }
+    if (z == Z_EOF) {
+        // Client closed connection.
+        terminate_client_session(server, ctx);
+        return;
+    }
+    process_http2(server, ctx);
+}
+
+void write_http2(LKHttpServer *server, LKContext *ctx) {
+    int z = lk_http2session_send(ctx->h2, ctx->clientfd);
+    if (z == Z_BLOCK) {
+        FD_SET_WRITE(ctx->clientfd, server);
+        return;
+    }
+    if (z == Z_ERR) {
+        lk_print_err("write_http2 lk_http2session_send()");
+        terminate_client_session(server, ctx);
+        return;
+    }
+    // All queued frames sent.
+    FD_CLR_WRITE(ctx->clientfd, server);
+    if (lk_http2session_done(ctx->h2)) {
+        terminate_client_session(server, ctx);
+    }
+}
+
+// Parse received frames, respond to completed stream requests
+// and send out what we can.
+void process_http2(LKHttpServer *server, LKContext *ctx) {
+    LKHttp2Stream *stream;
+    while (1) {
+        lk_http2session_recv(ctx->h2);
+        stream = lk_http2session_next_head(ctx->h2);
+        if (stream == NULL) {
+            break;
+        }
+        process_http2_head(server, stream);
+    }
+
+    while ((stream = lk_http2session_next_request(ctx->h2)) != NULL) {
+        process_http2_request(server, ctx, stream);
+    }
+    write_http2(server, ctx);
+}
+
+// Apply hostconfig max_body_size to a new stream before its DATA is
+// received. A larger content-length is answered with 413 right away.
+void process_http2_head(LKHttpServer *server, LKHttp2Stream *stream) {
+    LKHttpRequest *req = stream->req;
+    char *hostname = lk_headertable_get_id(req->headers, LK_HDR_HOST);
+    LKHostConfig *hc = lk_config_find_hostconfig(server->cfg, hostname);
+    if (hc == NULL || hc->max_body_size == 0) {
+        return;
+    }
+    stream->max_body_size = hc->max_body_size;
+
+    char *content_length = lk_headertable_get_id(req->headers, LK_HDR_CONTENT_LENGTH);
+    if (content_length != NULL && strtoull(content_length, NULL, 10) > hc->max_body_size) {
+        stream->body_too_large = 1;
+    }
+}
+
+// Generate response to HTTP/2 stream request.
+// Static files are served. CGI and proxyhost requests are answered
+// with 501 as they depend on per-connection contexts.
+void process_http2_request(LKHttpServer *server, LKContext *ctx, LKHttp2Stream *stream) {
+    LKHttpRequest *req = stream->req;
+    LKHttpResponse *resp = stream->resp;
+
+    char *hostname = lk_headertable_get_id(req->headers, LK_HDR_HOST);
+    LKHostConfig *hc = lk_config_find_hostconfig(server->cfg, hostname);
+    int status = 0;
+    char *msg = NULL;
+    if (hc == NULL) {
+        status = 404;
+    } else if (stream->body_too_large) {
+        status = 413;
+    } else if (hc->proxyhost->s_len > 0) {
+        status = 501;
+        msg = "LittleKitten webserver: proxyhost not supported over HTTP/2.";
+    } else if (hc->homedir->s_len == 0) {
+        status = 404;
+    } else {
+        // Replace path with any matching alias.
+        char *match = lk_stringtable_get(hc->aliases, req->path->s);
+        if (match != NULL) {
+            lk_string_assign(req->path, match);
+        }
+        if (hc->cgidir->s_len > 0 && lk_string_starts_with(req->path, hc->cgidir->s)) {
+            status = 501;
+            msg = "LittleKitten webserver: CGI not supported over HTTP/2.";
+        } else {
+            // DATA frames are sent from resp body, or the page body of
+            // status pages set by serve_files().
+            serve_files(server, req, resp, hc);
+            if (resp->bodyfd != -1 && load_bodyfd(resp) == -1) {
+                lk_buffer_clear(resp->body);
+                lk_headertable_remove_id(resp->headers, LK_HDR_CONTENT_RANGE);
+                status = 500;
+                msg = "LittleKitten webserver: error reading file.";
+            }
+        }
+    }
+    if (status != 0) {
+        // Like process_error_response(), msg is only logged.
+        if (msg != NULL) {
+            lk_string_assign(resp->statustext, msg);
+        }
+        set_status_page(server, resp, hc, status);
+    }
+
+    lk_string_assign(resp->version, "HTTP/2.0");
+    if (resp->status == 0) {
+        resp->status = 200;
+        lk_string_assign(resp->statustext, "OK");
+    }
+    print_access_log(ctx, req, resp);
+    lk_http2session_submit_response(ctx->h2, stream);
+}
+
+// Stop watching fd in epoll, shutdown, and close.
 int terminate_fd(int fd, FDType fd_type, FDAction fd_action, LKHttpServer *server) {
     int z;
     if (fd_action == FD_READ || fd_action == FD_READWRITE) {
@@ -848,3 +2297,235 @@ void terminate_client_session(LKHttpServer *server, LKContext *ctx) {
     remove_client_context(&server->ctxhead, ctx->clientfd);
 }
 
+
+/*** TLS termination ***/
+#ifdef LKTLS
+
+// Accept the TLS handshake of a tls_port client in a CTX_TLS ctx.
+// The http ctx is created once the handshake is done.
+void start_tls(LKHttpServer *server, int fd, struct sockaddr_in *sa) {
+    lk_set_sock_nonblocking(fd);
+    LKTlsConn *tc = lk_tlsconn_new(server->cfg->tls_ctx, fd);
+    if (tc == NULL) {
+        close(fd);
+        return;
+    }
+    LKContext *ctx = lk_context_new();
+    ctx->selectfd = fd;
+    ctx->clientfd = fd;
+    ctx->type = CTX_TLS;
+    ctx->client_sa = *sa;
+    ctx->req_start = time(NULL);
+    ctx->tlsconn = tc;
+    add_new_client_context(&server->ctxhead, ctx);
+    FD_SET_READ(fd, server);
+}
+
+// Continue the handshake, then move bytes both ways between the client
+// socket and the plaintext socketpair.
+// ctx can be either the client socket ctx or its peer.
+void relay_tls(LKHttpServer *server, LKContext *ctx) {
+    if (ctx->tlsconn == NULL) {
+        ctx = ctx->tls_peer;
+    }
+    LKTlsConn *tc = ctx->tlsconn;
+    int z;
+
+    if (!tc->handshake_done) {
+        z = lk_tlsconn_handshake(tc);
+        if (z == Z_ERR) {
+            terminate_tls(server, ctx);
+            return;
+        }
+        if (z == Z_BLOCK) {
+            set_tls_fds(server, tc);
+            return;
+        }
+        if (lk_tlsconn_ktls(tc)) {
+            handoff_ktls(server, ctx);
+            return;
+        }
+        if (start_tls_relay(server, ctx) == -1) {
+            terminate_tls(server, ctx);
+            return;
+        }
+    }
+
+    z = lk_tlsconn_relay(tc);
+    if (z == Z_ERR || z == Z_EOF) {
+        terminate_tls(server, ctx);
+        return;
+    }
+    set_tls_fds(server, tc);
+}
+
+// Serve the client through a socketpair: the http code gets one end as
+// the client socket, the other end is selected by a peer CTX_TLS ctx.
+// Returns 0 for success, -1 on error.
+int start_tls_relay(LKHttpServer *server, LKContext *ctx) {
+    int sv[2];
+    int z = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv);
+    if (z == -1) {
+        lk_print_err("socketpair()");
+        return -1;
+    }
+    lk_set_sock_nonblocking(sv[0]);
+    if (lk_tlsconn_start_relay(ctx->tlsconn, sv[0]) == -1) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+
+    LKContext *peer = lk_context_new();
+    peer->selectfd = sv[0];
+    peer->clientfd = sv[0];
+    peer->type = CTX_TLS;
+    peer->tls_peer = ctx;
+    add_context(&server->ctxhead, peer);
+    ctx->tls_peer = peer;
+
+    LKContext *httpctx = create_initial_context(sv[1], &ctx->client_sa);
+    httpctx->client_tls = 1;
+    add_new_client_context(&server->ctxhead, httpctx);
+    FD_SET_READ(sv[1], server);
+    return 0;
+}
+
+// The kernel encrypts both ways (kTLS), serve the client socket directly
+// so that sendfile() stays zero-copy.
+void handoff_ktls(LKHttpServer *server, LKContext *ctx) {
+    int fd = ctx->clientfd;
+    struct sockaddr_in sa = ctx->client_sa;
+    FD_CLR_WRITE(fd, server);
+    // Frees the TLS state, fd stays open.
+    remove_selectfd_context(&server->ctxhead, fd);
+
+    LKContext *httpctx = create_initial_context(fd, &sa);
+    httpctx->client_tls = 1;
+    add_new_client_context(&server->ctxhead, httpctx);
+    FD_SET_READ(fd, server);
+}
+
+// Select the client socket and plainfd for the events the relay waits on.
+void set_tls_fds(LKHttpServer *server, LKTlsConn *tc) {
+    if (tc->fd_want & LK_TLS_WANT_READ) {
+        FD_SET_READ(tc->fd, server);
+    } else {
+        FD_CLR_READ(tc->fd, server);
+    }
+    if (tc->fd_want & LK_TLS_WANT_WRITE) {
+        FD_SET_WRITE(tc->fd, server);
+    } else {
+        FD_CLR_WRITE(tc->fd, server);
+    }
+    if (tc->plainfd == -1) {
+        return;
+    }
+    if (tc->plainfd_want & LK_TLS_WANT_READ) {
+        FD_SET_READ(tc->plainfd, server);
+    } else {
+        FD_CLR_READ(tc->plainfd, server);
+    }
+    if (tc->plainfd_want & LK_TLS_WANT_WRITE) {
+        FD_SET_WRITE(tc->plainfd, server);
+    } else {
+        FD_CLR_WRITE(tc->plainfd, server);
+    }
+}
+
+// Close the client socket and the relay end of the socketpair, and remove
+// the CTX_TLS ctx's. The http ctx sees its end closed and cleans up.
+void terminate_tls(LKHttpServer *server, LKContext *ctx) {
+    int fd = ctx->clientfd;
+    int plainfd = ctx->tlsconn->plainfd;
+    terminate_fd(fd, FD_SOCK, FD_READWRITE, server);
+    remove_selectfd_context(&server->ctxhead, fd);
+    if (plainfd != -1) {
+        terminate_fd(plainfd, FD_SOCK, FD_READWRITE, server);
+        remove_selectfd_context(&server->ctxhead, plainfd);
+    }
+}
+
+#endif
+
+
+/*** Traffic stats ***/
+
+// Percentile of observed sizes that new buffers are sized for.
+#define SIZE_HINT_PERCENTILE 90
+
+void lk_traffic_stats_init(LKTrafficStats *st) {
+    lk_sizehist_init(&st->head_sizes);
+    lk_sizehist_init(&st->header_counts);
+    lk_sizehist_init(&st->resp_sizes);
+}
+
+// Return buffer size that fits most of the observed sizes in h.
+// Kept within the pooled buffer sizes so the buffer can be recycled.
+size_t buffer_size_hint(LKSizeHist *h) {
+    size_t size = lk_sizehist_percentile(h, SIZE_HINT_PERCENTILE);
+    if (size < LK_BUFPOOL_BUF_SIZE) {
+        size = LK_BUFPOOL_BUF_SIZE;
+    }
+    if (size > LK_BUFPOOL_MAX_BUF_SIZE) {
+        size = LK_BUFPOOL_MAX_BUF_SIZE;
+    }
+    return size;
+}
+
+// Add request head size and header count to server and ctx->hc stats.
+void record_request_stats(LKHttpServer *server, LKContext *ctx) {
+    size_t head_len = ctx->reqparser->head_len;
+    size_t nheaders = ctx->req->headers->items_len;
+    lk_sizehist_add(&server->stats.head_sizes, head_len);
+    lk_sizehist_add(&server->stats.header_counts, nheaders);
+    if (ctx->hc != NULL) {
+        lk_sizehist_add(&ctx->hc->stats.head_sizes, head_len);
+        lk_sizehist_add(&ctx->hc->stats.header_counts, nheaders);
+    }
+}
+
+// Add response size to server and ctx->hc stats.
+void record_response_size(LKHttpServer *server, LKContext *ctx, size_t size) {
+    lk_sizehist_add(&server->stats.resp_sizes, size);
+    if (ctx->hc != NULL) {
+        lk_sizehist_add(&ctx->hc->stats.resp_sizes, size);
+    }
+}
+
+void print_stats_line(FILE *f, char *name, LKTrafficStats *st) {
+    fprintf(f, "%-20s %8lu  head %zu/%zu/%zu  headers %zu/%zu/%zu  resp %zu/%zu/%zu\n",
+            name, st->head_sizes.nsamples,
+            lk_sizehist_percentile(&st->head_sizes, 50),
+            lk_sizehist_percentile(&st->head_sizes, 90),
+            lk_sizehist_percentile(&st->head_sizes, 99),
+            lk_sizehist_percentile(&st->header_counts, 50),
+            lk_sizehist_percentile(&st->header_counts, 90),
+            lk_sizehist_percentile(&st->header_counts, 99),
+            lk_sizehist_percentile(&st->resp_sizes, 50),
+            lk_sizehist_percentile(&st->resp_sizes, 90),
+            lk_sizehist_percentile(&st->resp_sizes, 99));
+}
+
+// Print request and response size percentiles (p50/p90/p99, rounded up
+// to a power of 2) per host, and the buffer sizes chosen from them.
+void print_traffic_stats(LKHttpServer *server, FILE *f) {
+    LKConfig *cfg = server->cfg;
+    fprintf(f, "--- Traffic stats (p50/p90/p99) ---\n");
+    fprintf(f, "%-20s %8s\n", "host", "requests");
+    print_stats_line(f, "(all)", &server->stats);
+    for (int i=0; i < cfg->hostconfigs_len; i++) {
+        LKHostConfig *hc = cfg->hostconfigs[i];
+        print_stats_line(f, hc->hostname->s, &hc->stats);
+    }
+    fprintf(f, "request buffer: %zu\n", buffer_size_hint(&server->stats.head_sizes));
+    for (int i=0; i < cfg->hostconfigs_len; i++) {
+        LKHostConfig *hc = cfg->hostconfigs[i];
+        if (hc->cgidir->s_len > 0) {
+            fprintf(f, "%s cgi output buffer: %zu\n", hc->hostname->s,
+                    buffer_size_hint(&hc->stats.resp_sizes));
+        }
+    }
+    fprintf(f, "---\n");
+    fflush(f);
+}
@@ -176,6 +176,152 @@ void get_localtime_string(char *time_str, size_t time_str_len) {
     }
 }
 
+static char *http_wkdays[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+static char *http_months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                              "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+void lk_format_http_date(time_t t, char *date_str, size_t date_str_len) {
+    struct tm tmtime;
+    void *pz = gmtime_r(&t, &tmtime);
+    if (pz == NULL) {
+        snprintf(date_str, date_str_len, "???");
+        return;
+    }
+    snprintf(date_str, date_str_len, "%s, %02d %s %04d %02d:%02d:%02d GMT",
+             http_wkdays[tmtime.tm_wday], tmtime.tm_mday, http_months[tmtime.tm_mon],
+             tmtime.tm_year + 1900, tmtime.tm_hour, tmtime.tm_min, tmtime.tm_sec);
+}
+
+size_t lk_utoa(unsigned long n, char *dst) {
+    char digits[20];
+    size_t i = sizeof(digits);
+    do {
+        digits[--i] = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+    memcpy(dst, digits+i, sizeof(digits)-i);
+    return sizeof(digits)-i;
+}
+
+// Parse exactly ndigits decimal digits at *ps and advance *ps.
+// Return -1 if not all digits.
+static int parse_digits(char **ps, int ndigits) {
+    int n = 0;
+    char *s = *ps;
+    for (int i=0; i < ndigits; i++) {
+        if (s[i] < '0' || s[i] > '9') {
+            return -1;
+        }
+        n = n*10 + (s[i] - '0');
+    }
+    *ps = s + ndigits;
+    return n;
+}
+
+// Parse 3 letter month name at *ps and advance *ps.
+// Return month 0-11 or -1 if not a month.
+static int parse_month(char **ps) {
+    for (int i=0; i < 12; i++) {
+        if (strncmp(*ps, http_months[i], 3) == 0) {
+            *ps += 3;
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Parse "08:49:37" into seconds since midnight, -1 if invalid.
+static long parse_hms(char **ps) {
+    int hh = parse_digits(ps, 2);
+    if (hh < 0 || hh > 23 || **ps != ':') return -1;
+    (*ps)++;
+    int mm = parse_digits(ps, 2);
+    if (mm < 0 || mm > 59 || **ps != ':') return -1;
+    (*ps)++;
+    int ss = parse_digits(ps, 2);
+    if (ss < 0 || ss > 60) return -1;
+    return hh*3600L + mm*60L + ss;
+}
+
+// Days since 1970-01-01 for year/month(1-12)/day in proleptic Gregorian calendar.
+static long days_from_civil(long y, int m, int d) {
+    y -= m <= 2;
+    long era = (y >= 0 ? y : y-399) / 400;
+    long yoe = y - era*400;
+    long doy = (153*(m + (m > 2 ? -3 : 9)) + 2)/5 + d-1;
+    long doe = yoe*365 + yoe/4 - yoe/100 + doy;
+    return era*146097 + doe - 719468;
+}
+
+// Accepted formats (RFC 7231 7.1.1.1):
+//   Sun, 06 Nov 1994 08:49:37 GMT    ; IMF-fixdate
+//   Sunday, 06-Nov-94 08:49:37 GMT   ; obsolete RFC 850 format
+//   Sun Nov  6 08:49:37 1994         ; ANSI C's asctime() format
+time_t lk_parse_http_date(char *s) {
+    int year, mon, day;
+    long secs;
+    char *p = s;
+
+    // Skip day name.
+    while ((*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z')) {
+        p++;
+    }
+    if (p == s) {
+        return -1;
+    }
+
+    if (p[0] == ',' && p[1] == ' ') {
+        p += 2;
+        day = parse_digits(&p, 2);
+        if (day < 0) {
+            return -1;
+        }
+        if (*p == ' ') {
+            // IMF-fixdate: "06 Nov 1994 08:49:37 GMT"
+            p++;
+            mon = parse_month(&p);
+            if (mon < 0 || *p++ != ' ') return -1;
+            year = parse_digits(&p, 4);
+            if (year < 0 || *p++ != ' ') return -1;
+        } else if (*p == '-') {
+            // RFC 850: "06-Nov-94 08:49:37 GMT"
+            p++;
+            mon = parse_month(&p);
+            if (mon < 0 || *p++ != '-') return -1;
+            year = parse_digits(&p, 2);
+            if (year < 0 || *p++ != ' ') return -1;
+            year += year < 70 ? 2000 : 1900;
+        } else {
+            return -1;
+        }
+        secs = parse_hms(&p);
+        if (secs < 0 || strcmp(p, " GMT") != 0) return -1;
+    } else if (p[0] == ' ') {
+        // asctime: "Nov  6 08:49:37 1994"
+        p++;
+        mon = parse_month(&p);
+        if (mon < 0 || *p++ != ' ') return -1;
+        if (*p == ' ') {
+            p++;
+            day = parse_digits(&p, 1);
+        } else {
+            day = parse_digits(&p, 2);
+        }
+        if (day < 0 || *p++ != ' ') return -1;
+        secs = parse_hms(&p);
+        if (secs < 0 || *p++ != ' ') return -1;
+        year = parse_digits(&p, 4);
+        if (year < 0 || *p != '\0') return -1;
+    } else {
+        return -1;
+    }
+
+    if (day < 1 || day > 31) {
+        return -1;
+    }
+    return (time_t) days_from_civil(year, mon+1, day) * 86400 + secs;
+}
+
 // Return matching item in lookup table given testk.
 // tbl is a null-terminated array of char* key-value pairs
 // Ex. tbl = {"key1", "val1", "key2", "val2", "key3", "val3", NULL};
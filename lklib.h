@@ -1,6 +1,10 @@
 #ifndef LKLIB_H
 #define LKLIB_H
 
+#include <stdio.h>
+#include <time.h>
+#include <sys/uio.h>
+
 // Predefined buffer sizes.
 // Sample use: char buf[LK_BUFSIZE_SMALL]
 #define LK_BUFSIZE_SMALL 512
@@ -31,6 +35,20 @@ int lk_popen3(char *cmd, int *fd_in, int *fd_out, int *fd_err);
 #define TIME_STRING_SIZE 25
 void get_localtime_string(char *time_str, size_t time_str_len);
 
+// HTTP-date in IMF-fixdate format: Sun, 06 Nov 1994 08:49:37 GMT
+// Usage:
+// char datestr[HTTP_DATE_SIZE];
+// lk_format_http_date(t, datestr, sizeof(datestr))
+#define HTTP_DATE_SIZE 30
+void lk_format_http_date(time_t t, char *date_str, size_t date_str_len);
+// Parse HTTP-date in IMF-fixdate, RFC 850 or asctime format.
+// Return -1 if not a valid date.
+time_t lk_parse_http_date(char *s);
+
+// Write decimal digits of n to dst, not null terminated.
+// dst needs room for 20 bytes. Returns number of bytes written.
+size_t lk_utoa(unsigned long n, char *dst);
+
 void lk_alloc_init();
 void *lk_malloc(size_t size, char *label);
 void *lk_realloc(void *p, size_t size, char *label);
@@ -38,8 +56,67 @@ void lk_free(void *p);
 char *lk_strdup(const char *s, char *label);
 char *lk_strndup(const char *s, size_t n, char *label);
 void lk_print_allocitems();
+
+// Allocation profiler.
+// lk_malloc() records one in n allocations with its label and call stack.
+// Snapshots list live bytes by label and by call stack, and the change
+// since the previous snapshot.
+#define LK_ALLOC_SAMPLE_RATE 64         // sample rate for long running servers
+void lk_alloc_set_sample_rate(unsigned int n);
+void lk_alloc_label_stats(char *label, unsigned long *count, size_t *bytes);
+void lk_alloc_request_snapshot();
+int lk_alloc_snapshot_pending();
+void lk_alloc_print_snapshot(FILE *f);
 // vasprintf(&ps, fmt, args); //$$ lk_vasprintf()?
 
+/*** Slab allocator - size classes, used by lk_malloc() if built with -DSLABALLOC ***/
+#define LK_SLAB_MAX_SIZE 4096           // larger allocations go to libc
+
+typedef struct {
+    size_t size;                        // slot size of class
+    size_t npages;
+    size_t nslots;
+    size_t nfree;
+    unsigned long nallocs;
+    unsigned long nfrees;
+} LKSlabStats;
+
+void *lk_slab_alloc(size_t size);
+void *lk_slab_realloc(void *p, size_t size);
+void lk_slab_free(void *p);
+int lk_slab_nclasses();
+void lk_slab_stats(int ci, LKSlabStats *st);
+void lk_slab_print_stats();
+
+/*** LKArena - bump allocator, freed all at once ***/
+#define LK_ARENA_BLOCK_SIZE 4096
+
+typedef struct lkarenablock_s {
+    struct lkarenablock_s *next;
+    size_t size;                        // bytes in data
+    size_t used;
+    char data[];
+} LKArenaBlock;
+
+typedef struct {
+    LKArenaBlock *head;                 // block allocations are made from
+    LKArenaBlock *first;                // allocated with the arena, kept on reset
+    size_t block_size;
+} LKArena;
+
+LKArena *lk_arena_new(size_t block_size);
+void lk_arena_free(LKArena *arena);
+void lk_arena_reset(LKArena *arena);
+void *lk_arena_alloc(LKArena *arena, size_t size);
+char *lk_arena_strndup(LKArena *arena, char *s, size_t n);
+
+// Recycled arenas of the default block size, reset when put back.
+#define LK_ARENAPOOL_MAX 64
+LKArena *lk_arenapool_get();
+void lk_arenapool_put(LKArena *arena);
+void lk_arenapool_trim();
+void lk_arenapool_clear();
+
 // Return matching item in lookup table given testk.
 // tbl is a null-terminated array of char* key-value pairs
 // Ex. tbl = {"key1", "val1", "key2", "val2", "key3", "val3", NULL};
@@ -47,23 +124,31 @@ void lk_print_allocitems();
 void **lk_lookup(void **tbl, char *testk);
 
 /*** LKString ***/
+// Strings shorter than this are stored inline in sbuf.
+#define LK_STRING_INLINE_SIZE 24
+
 typedef struct {
-    char *s;
+    char *s;                            // sbuf or heap allocated
     size_t s_len;
-    size_t s_size;
+    size_t s_size;                      // capacity, not counting null terminator
+    LKArena *arena;                     // allocated from arena if not NULL
+    char sbuf[LK_STRING_INLINE_SIZE];
 } LKString;
 
 typedef struct lkstringlist LKStringList;
 
 LKString *lk_string_new(char *s);
 LKString *lk_string_size_new(size_t size);
+LKString *lk_string_arena_new(LKArena *arena, char *s);
 void lk_string_free(LKString *lks); 
 void lk_string_voidp_free(void *plkstr); 
 
 void lk_string_assign(LKString *lks, char *s);
 void lk_string_assign_sprintf(LKString *lks, char *fmt, ...);
+void lk_string_assign_buf(LKString *lks, char *buf, size_t len);
 void lk_string_append(LKString *lks, char *s);
 void lk_string_append_sprintf(LKString *lks, char *fmt, ...);
+void lk_string_append_buf(LKString *lks, char *buf, size_t len);
 void lk_string_append_char(LKString *lks, char c);
 
 void lk_string_prepend(LKString *lks, char *s);
@@ -81,6 +166,41 @@ void lk_string_split_assign(LKString *s, char *delim, LKString *k, LKString *v);
 void sz_string_split_assign(char *s, char *delim, LKString *k, LKString *v);
 
 
+/*** LKStrView - string slice, points into memory it doesn't own ***/
+typedef struct {
+    char *p;
+    size_t len;
+} LKStrView;
+
+LKStrView lk_sv(char *s);
+LKStrView lk_sv_buf(char *p, size_t len);
+LKStrView lk_sv_lkstring(LKString *lks);
+LKStrView lk_sv_trim(LKStrView sv);
+int lk_sv_equal(LKStrView sv, char *s);
+int lk_sv_compare(LKStrView sv1, LKStrView sv2);
+int lk_sv_starts_with(LKStrView sv, char *s);
+int lk_sv_ends_with(LKStrView sv, char *s);
+int lk_sv_split2(LKStrView sv, char *delim, LKStrView *k, LKStrView *v);
+
+// Iterate over segments of a view separated by delim.
+// Usage:
+// LKSplitIter it;
+// LKStrView seg;
+// lk_split_init(&it, lk_sv("a,b,,c"), ",");
+// while (lk_split_next(&it, &seg)) {...}     // "a", "b", "", "c"
+// while (lk_split_next_token(&it, &seg)) {...} // "a", "b", "c"
+typedef struct {
+    LKStrView rest;         // remaining text to split
+    char *delim;
+    size_t delim_len;
+    int done;               // last segment returned
+} LKSplitIter;
+
+void lk_split_init(LKSplitIter *it, LKStrView sv, char *delim);
+int lk_split_next(LKSplitIter *it, LKStrView *seg);
+int lk_split_next_token(LKSplitIter *it, LKStrView *seg);
+
+
 /*** LKStringTable ***/
 typedef struct {
     LKString *k;
@@ -128,11 +248,70 @@ LKBuffer *lk_buffer_new(size_t bytes_size);
 void lk_buffer_free(LKBuffer *buf);
 void lk_buffer_resize(LKBuffer *buf, size_t bytes_size);
 void lk_buffer_clear(LKBuffer *buf);
+char *lk_buffer_reserve(LKBuffer *buf, size_t len);
+void lk_buffer_commit(LKBuffer *buf, size_t len);
 int lk_buffer_append(LKBuffer *buf, char *bytes, size_t len);
 int lk_buffer_append_sz(LKBuffer *buf, char *s);
 void lk_buffer_append_sprintf(LKBuffer *buf, const char *fmt, ...);
 size_t lk_buffer_readline(LKBuffer *buf, char *dst, size_t dst_len);
 
+// Recycled buffers for socket reader, head and pipe buffers.
+// New pool buffers have LK_BUFPOOL_BUF_SIZE capacity, buffers that grew
+// up to LK_BUFPOOL_MAX_BUF_SIZE are kept as is and larger ones freed.
+#define LK_BUFPOOL_BUF_SIZE LK_BUFSIZE_MEDIUM
+#define LK_BUFPOOL_MAX_BUF_SIZE 16384
+#define LK_BUFPOOL_MAX 256
+LKBuffer *lk_bufpool_get();
+void lk_bufpool_put(LKBuffer *buf);
+void lk_bufpool_trim();
+void lk_bufpool_clear();
+
+
+/*** LKRefBuffer - Reference counted LKBuffer shared by several owners ***/
+typedef struct {
+    LKBuffer *buf;
+    unsigned int refcount;
+} LKRefBuffer;
+
+// New refbuffer starts with refcount 1.
+LKRefBuffer *lk_refbuffer_new(size_t bytes_size);
+LKRefBuffer *lk_refbuffer_ref(LKRefBuffer *rb);
+// Decrement refcount, freeing rb when it reaches 0.
+void lk_refbuffer_unref(LKRefBuffer *rb);
+
+
+/*** LKBufChain - Chain of refcounted buffer segments ***/
+// Bytes are held as slices of LKRefBuffer segments. Slice, splice and
+// prepend share or move segments and never copy bytes. Appended bytes
+// are copied into fixed size segments, so appending is linear.
+#define LK_BUFSEG_SIZE 16384
+
+typedef struct {
+    LKRefBuffer *seg;
+    size_t off;         // offset of first byte in seg->buf->bytes
+    size_t len;
+} LKBufSlice;
+
+typedef struct {
+    LKBufSlice *slices;
+    size_t slices_len;
+    size_t slices_size;
+    size_t len;         // total bytes in all slices
+} LKBufChain;
+
+LKBufChain *lk_bufchain_new();
+void lk_bufchain_free(LKBufChain *bc);
+void lk_bufchain_clear(LKBufChain *bc);
+void lk_bufchain_append(LKBufChain *bc, char *bytes, size_t len);
+void lk_bufchain_append_buffer(LKBufChain *bc, LKBuffer *buf);
+char *lk_bufchain_tail_space(LKBufChain *bc, size_t *space);
+void lk_bufchain_tail_commit(LKBufChain *bc, size_t len);
+void lk_bufchain_slice(LKBufChain *dst, LKBufChain *src, size_t off, size_t len);
+void lk_bufchain_splice(LKBufChain *dst, LKBufChain *src);
+void lk_bufchain_prepend(LKBufChain *dst, LKBufChain *src);
+void lk_bufchain_consume(LKBufChain *bc, size_t len);
+int lk_bufchain_iovec(LKBufChain *bc, struct iovec *iov, int iov_max);
+
 
 /*** LKRefList ***/
 typedef struct {
@@ -150,5 +329,47 @@ void *lk_reflist_get_cur(LKRefList *l);
 void lk_reflist_remove(LKRefList *l, unsigned int i);
 void lk_reflist_clear(LKRefList *l);
 
+/*** LKPool - freelist of recycled objects ***/
+typedef struct {
+    void **items;
+    size_t items_len;
+    size_t max_items;                   // high-water mark, more are freed
+    size_t low_len;                     // fewest items held since last trim
+    void (*free_item)(void *);
+} LKPool;
+
+LKPool *lk_pool_new(size_t max_items, void (*free_item)(void *));
+void lk_pool_free(LKPool *pool);
+void *lk_pool_get(LKPool *pool);
+int lk_pool_put(LKPool *pool, void *p);
+void lk_pool_trim(LKPool *pool);
+void lk_pool_clear(LKPool *pool);
+
+/*** LKSizeHist - running percentiles of observed sizes ***/
+// Bucket i counts sizes in (2^(i-1), 2^i], bucket 0 sizes 0 and 1.
+// Counts are halved every LK_SIZEHIST_WINDOW samples so percentiles
+// follow recent traffic.
+#define LK_SIZEHIST_NBUCKETS 32
+#define LK_SIZEHIST_WINDOW 4096
+
+typedef struct {
+    unsigned long counts[LK_SIZEHIST_NBUCKETS];
+    unsigned long total;                // sum of counts
+    unsigned long nsamples;             // all samples added
+} LKSizeHist;
+
+void lk_sizehist_init(LKSizeHist *h);
+void lk_sizehist_add(LKSizeHist *h, size_t size);
+size_t lk_sizehist_percentile(LKSizeHist *h, unsigned int pct);
+
+/*** Delimiter scanning - SIMD kernels selected at runtime ***/
+// Return pointer to first byte in p[0..len) matching, or NULL if none.
+char *lk_scan2(char *p, size_t len, char a, char b);    // a or b
+char *lk_scan_char(char *p, size_t len, char c);        // c
+char *lk_scan_eol(char *p, size_t len);                 // CR or LF
+char *lk_scan_ws(char *p, size_t len);                  // space or tab
+int lk_scan_set_impl(char *name);
+char *lk_scan_impl();
+
 #endif
 
@@ -5,9 +5,15 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
 #include "lklib.h"
 #include "lknet.h"
 
@@ -67,11 +73,15 @@ int lk_open_connect_socket(char *host, char *port, struct sockaddr *psa) {
     int z;
 
     // If host is of the form "host:port", parse it.
-    LKString *lksport = lk_string_new(host);
-    LKStringList *ss = lk_string_split(lksport, ":");
-    if (ss->items_len == 2) {
-        host = ss->items[0]->s;
-        port = ss->items[1]->s;
+    char hostbuf[LK_BUFSIZE_SMALL];
+    char portbuf[LK_BUFSIZE_SMALL];
+    LKStrView hostsv, portsv;
+    if (lk_sv_split2(lk_sv(host), ":", &hostsv, &portsv) &&
+        memchr(portsv.p, ':', portsv.len) == NULL) {
+        snprintf(hostbuf, sizeof(hostbuf), "%.*s", (int) hostsv.len, hostsv.p);
+        snprintf(portbuf, sizeof(portbuf), "%.*s", (int) portsv.len, portsv.p);
+        host = hostbuf;
+        port = portbuf;
     }
 
     struct addrinfo hints, *ai;
@@ -89,9 +99,6 @@ int lk_open_connect_socket(char *host, char *port, struct sockaddr *psa) {
         memcpy(psa, ai->ai_addr, ai->ai_addrlen);
     }
 
-    lk_stringlist_free(ss);
-    lk_string_free(lksport);
-
     int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
     if (fd == -1) {
         lk_print_err("socket()");
@@ -167,12 +174,20 @@ unsigned short lk_get_sockaddr_port(struct sockaddr *sa) {
 
 // Return human readable IP address from sockaddr
 LKString *lk_get_ipaddr_string(struct sockaddr *sa) {
+    return lk_get_ipaddr_arena_string(NULL, sa);
+}
+
+// Same as lk_get_ipaddr_string(), string is allocated from arena if not NULL.
+LKString *lk_get_ipaddr_arena_string(LKArena *arena, struct sockaddr *sa) {
     char servipstr[INET6_ADDRSTRLEN];
     const char *pz = inet_ntop(sa->sa_family, sockaddr_sin_addr(sa),
                                servipstr, sizeof(servipstr));
     if (pz == NULL) {
         lk_print_err("inet_ntop()");
-        return lk_string_new("");
+        servipstr[0] = '\0';
+    }
+    if (arena != NULL) {
+        return lk_string_arena_new(arena, servipstr);
     }
     return lk_string_new(servipstr);
 }
@@ -193,18 +208,22 @@ int nonblocking_error(int z) {
 // On return, nbytes contains the number of bytes read.
 int lk_read(int fd, FDType fd_type, LKBuffer *buf, size_t count, size_t *nbytes) {
     int z;
-    char readbuf[LK_BUFSIZE_LARGE];
 
     size_t nread = 0;
     while (nread < count) {
-        // read minimum of sizeof(readbuf) and count-nread
-        int nblock = count-nread;
-        if (nblock > sizeof(readbuf)) nblock = sizeof(readbuf);
+        // Read directly into buf, up to its free space or count-nread.
+        char *p = lk_buffer_reserve(buf, LK_BUFSIZE_LARGE);
+        if (p == NULL) {
+            z = Z_ERR;
+            break;
+        }
+        size_t nblock = buf->bytes_size - buf->bytes_len;
+        if (nblock > count-nread) nblock = count-nread;
 
         if (fd_type == FD_SOCK) {
-            z = recv(fd, readbuf, nblock, MSG_DONTWAIT);
+            z = recv(fd, p, nblock, MSG_DONTWAIT);
         } else {
-            z = read(fd, readbuf, nblock);
+            z = read(fd, p, nblock);
         }
         // EOF
         if (z == 0) {
@@ -225,7 +244,7 @@ int lk_read(int fd, FDType fd_type, LKBuffer *buf, size_t count, size_t *nbytes)
             break;
         }
         assert(z > 0);
-        lk_buffer_append(buf, readbuf, z);
+        lk_buffer_commit(buf, z);
         nread += z;
     }
     if (z > 0) {
@@ -251,12 +270,27 @@ int lk_read_file(int fd, LKBuffer *buf, size_t count, size_t *nbytes) {
 // Used to cumulatively read data into buf.
 int lk_read_all(int fd, FDType fd_type, LKBuffer *buf) {
     int z;
-    char readbuf[LK_BUFSIZE_LARGE];
+
+    // Size the buffer once for the bytes already queued on fd.
+    size_t reserve = LK_BUFSIZE_LARGE;
+    int navail = 0;
+    if (ioctl(fd, FIONREAD, &navail) == 0) {
+        // +1 so the read that finds EOF or EAGAIN doesn't grow buf.
+        reserve = navail+1;
+    }
     while (1) {
+        char *p = lk_buffer_reserve(buf, reserve);
+        if (p == NULL) {
+            z = Z_ERR;
+            break;
+        }
+        size_t nblock = buf->bytes_size - buf->bytes_len;
+        // Read into any space left before growing buf again.
+        reserve = 1;
         if (fd_type == FD_SOCK) {
-            z = recv(fd, readbuf, sizeof(readbuf), MSG_DONTWAIT);
+            z = recv(fd, p, nblock, MSG_DONTWAIT);
         } else {
-            z = read(fd, readbuf, sizeof(readbuf));
+            z = read(fd, p, nblock);
         }
         // EOF
         if (z == 0) {
@@ -276,7 +310,7 @@ int lk_read_all(int fd, FDType fd_type, LKBuffer *buf) {
             break;
         }
         assert(z > 0);
-        lk_buffer_append(buf, readbuf, z);
+        lk_buffer_commit(buf, z);
     }
     assert(z <= 0);
     return z;
@@ -393,39 +427,151 @@ int lk_write_all_file(int fd, LKBuffer *buf) {
     return lk_write_all(fd, FD_FILE, buf);
 }
 
+// Max iovec entries gathered per writev() call.
+#define LK_IOV_MAX 64
+
+// Gather write iov to fd, using sendmsg() for sockets so the send
+// doesn't block or raise SIGPIPE.
+static ssize_t write_iov(int fd, FDType fd_type, struct iovec *iov, int iovcnt) {
+    if (fd_type == FD_SOCK) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        return sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    return writev(fd, iov, iovcnt);
+}
+
 // Similar to lk_write_all(), but sending buflist buf's sequentially.
+// Unsent bytes of the remaining bufs are gathered into a single writev()
+// so a head and body go out in one call.
 int lk_buflist_write_all(int fd, FDType fd_type, LKRefList *buflist) {
-    if (buflist->items_cur >= buflist->items_len) {
-        return Z_EOF;
+    struct iovec iov[LK_IOV_MAX];
+    while (1) {
+        int iovcnt = 0;
+        for (size_t i=buflist->items_cur; i < buflist->items_len && iovcnt < LK_IOV_MAX; i++) {
+            LKBuffer *buf = buflist->items[i];
+            if (buf->bytes_cur == buf->bytes_len) {
+                continue;
+            }
+            iov[iovcnt].iov_base = buf->bytes + buf->bytes_cur;
+            iov[iovcnt].iov_len = buf->bytes_len - buf->bytes_cur;
+            iovcnt++;
+        }
+        if (iovcnt == 0) {
+            buflist->items_cur = buflist->items_len;
+            return Z_EOF;
+        }
+
+        ssize_t z = write_iov(fd, fd_type, iov, iovcnt);
+        if (z == -1 && errno == EINTR) {
+            continue;
+        }
+        if (z == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return Z_BLOCK;
+        }
+        if (z == -1) {
+            return Z_ERR;
+        }
+
+        // Advance past the bytes written.
+        size_t nwrite = z;
+        while (nwrite > 0 && buflist->items_cur < buflist->items_len) {
+            LKBuffer *buf = buflist->items[buflist->items_cur];
+            size_t n = buf->bytes_len - buf->bytes_cur;
+            if (nwrite < n) {
+                buf->bytes_cur += nwrite;
+                break;
+            }
+            buf->bytes_cur = buf->bytes_len;
+            nwrite -= n;
+            buflist->items_cur++;
+        }
     }
+}
 
-    LKBuffer *buf = lk_reflist_get_cur(buflist);
-    assert(buf != NULL);
-    int z = lk_write_all(fd, fd_type, buf);
-    if (z == Z_EOF) {
-        buflist->items_cur++;
-        z = Z_OPEN;
+// Read all available nonblocking fd bytes to the end of buffer chain.
+// Bytes are read directly into the tail segment's free space.
+// Returns one of the following:
+//    0 (Z_EOF) for EOF
+//   -1 (Z_ERR) for error
+//   -2 (Z_BLOCK) for blocked socket (no data)
+int lk_bufchain_read_all(int fd, FDType fd_type, LKBufChain *bc) {
+    int z;
+    while (1) {
+        size_t space;
+        char *p = lk_bufchain_tail_space(bc, &space);
+        if (fd_type == FD_SOCK) {
+            z = recv(fd, p, space, MSG_DONTWAIT);
+        } else {
+            z = read(fd, p, space);
+        }
+        if (z == 0) {
+            z = Z_EOF;
+            break;
+        }
+        if (z == -1 && errno == EINTR) {
+            continue;
+        }
+        if (z == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            z = Z_BLOCK;
+            break;
+        }
+        if (z == -1) {
+            z = Z_ERR;
+            break;
+        }
+        assert(z > 0);
+        lk_bufchain_tail_commit(bc, z);
     }
+    assert(z <= 0);
     return z;
 }
 
+// Write buffer chain bytes to nonblocking fd with writev(), bytes
+// written are consumed from the chain.
+// Returns one of the following:
+//    0 (Z_EOF) for all chain bytes sent
+//   -1 (Z_ERR) for error
+//   -2 (Z_BLOCK) for blocked socket (no data)
+int lk_bufchain_write_all(int fd, FDType fd_type, LKBufChain *bc) {
+    struct iovec iov[LK_IOV_MAX];
+    while (bc->len > 0) {
+        int iovcnt = lk_bufchain_iovec(bc, iov, LK_IOV_MAX);
+        ssize_t z = write_iov(fd, fd_type, iov, iovcnt);
+        if (z == -1 && errno == EINTR) {
+            continue;
+        }
+        if (z == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return Z_BLOCK;
+        }
+        if (z == -1) {
+            return Z_ERR;
+        }
+        lk_bufchain_consume(bc, z);
+    }
+    return Z_EOF;
+}
+
 // Pipe all available nonblocking readfd bytes into writefd.
-// Uses buf as buffer for queued up bytes waiting to be written.
+// Uses bc as buffer for queued up bytes waiting to be written, sent
+// segments are released as the pipe goes.
 // Returns one of the following:
 //    0 (Z_EOF) for read/write complete.
 //    1 (Z_OPEN) for writefd socket open
 //   -1 (Z_ERR) for read/write error.
 //   -2 (Z_BLOCK) for blocked readfd/writefd socket
-int lk_pipe_all(int readfd, int writefd, FDType fd_type, LKBuffer *buf) {
+int lk_pipe_all(int readfd, int writefd, FDType fd_type, LKBufChain *bc) {
     int readz, writez;
 
-    readz = lk_read_all(readfd, fd_type, buf);
+    readz = lk_bufchain_read_all(readfd, fd_type, bc);
     if (readz == Z_ERR) {
         return readz;
     }
     assert(readz == Z_EOF || readz == Z_BLOCK);
 
-    writez = lk_write_all(writefd, fd_type, buf);
+    writez = lk_bufchain_write_all(writefd, fd_type, bc);
     if (writez == Z_ERR) {
         return writez;
     }
@@ -444,26 +590,139 @@ int lk_pipe_all(int readfd, int writefd, FDType fd_type, LKBuffer *buf) {
     return writez;
 }
 
+int lk_sendfile_all(int fd, int filefd, off_t *offset, size_t *count) {
+    while (*count > 0) {
+        ssize_t z = sendfile(fd, filefd, offset, *count);
+        if (z == -1 && errno == EINTR) {
+            continue;
+        }
+        if (z == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return Z_BLOCK;
+        }
+        if (z == -1) {
+            return Z_ERR;
+        }
+        // File was truncated.
+        if (z == 0) {
+            errno = EIO;
+            return Z_ERR;
+        }
+        *count -= z;
+    }
+    return Z_EOF;
+}
+
+/** lksplicepipe functions **/
+
+LKSplicePipe *lk_splicepipe_new(int readfd, int writefd) {
+    int pipefd[2];
+    int z = pipe2(pipefd, O_NONBLOCK | O_CLOEXEC);
+    if (z == -1) {
+        return NULL;
+    }
+
+    LKSplicePipe *sp = lk_malloc(sizeof(LKSplicePipe), "lk_splicepipe_new");
+    sp->readfd = readfd;
+    sp->writefd = writefd;
+    sp->pipefd[0] = pipefd[0];
+    sp->pipefd[1] = pipefd[1];
+    sp->pipe_len = 0;
+    sp->buf = lk_bufpool_get();
+    sp->read_eof = 0;
+    sp->nbytes = 0;
+    return sp;
+}
+
+void lk_splicepipe_free(LKSplicePipe *sp) {
+    close(sp->pipefd[0]);
+    close(sp->pipefd[1]);
+    lk_bufpool_put(sp->buf);
+    sp->buf = NULL;
+    lk_free(sp);
+}
+
+int lk_splicepipe_pending(LKSplicePipe *sp) {
+    return sp->pipe_len > 0 || sp->buf->bytes_cur < sp->buf->bytes_len;
+}
+
+int lk_splice_all(LKSplicePipe *sp) {
+    int z;
+
+    // Send bytes queued in buf before splicing.
+    LKBuffer *buf = sp->buf;
+    if (buf->bytes_cur < buf->bytes_len) {
+        size_t bytes_cur = buf->bytes_cur;
+        z = lk_write_all_sock(sp->writefd, buf);
+        sp->nbytes += buf->bytes_cur - bytes_cur;
+        if (z != Z_EOF) {
+            return z;
+        }
+    }
+
+    while (1) {
+        // Drain pipe into writefd before reading more.
+        if (sp->pipe_len > 0) {
+            ssize_t nwrite = splice(sp->pipefd[0], NULL, sp->writefd, NULL, sp->pipe_len,
+                                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (nwrite == -1 && errno == EINTR) {
+                continue;
+            }
+            if (nwrite == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return Z_BLOCK;
+            }
+            if (nwrite == -1) {
+                return Z_ERR;
+            }
+            sp->pipe_len -= nwrite;
+            sp->nbytes += nwrite;
+            continue;
+        }
+        if (sp->read_eof) {
+            return Z_EOF;
+        }
+
+        ssize_t nread = splice(sp->readfd, NULL, sp->pipefd[1], NULL, LK_SPLICE_SIZE,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (nread == 0) {
+            sp->read_eof = 1;
+            return Z_EOF;
+        }
+        if (nread == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nread == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return Z_BLOCK;
+        }
+        if (nread == -1) {
+            return Z_ERR;
+        }
+        sp->pipe_len += nread;
+    }
+}
+
 /** lksocketreader functions **/
 
 LKSocketReader *lk_socketreader_new(int sock, size_t buf_size) {
     LKSocketReader *sr = lk_malloc(sizeof(LKSocketReader), "lk_socketreader_new");
+    sr->sock = sock;
     if (buf_size == 0) {
-        buf_size = 1024;
+        sr->buf = lk_bufpool_get();
+    } else {
+        sr->buf = lk_buffer_new(buf_size);
     }
-    sr->sock = sock;
-    sr->buf = lk_buffer_new(buf_size);
     sr->sockclosed = 0;
     return sr;
 }
 
 void lk_socketreader_free(LKSocketReader *sr) {
-    lk_buffer_free(sr->buf);
+    lk_bufpool_put(sr->buf);
     sr->buf = NULL;
     lk_free(sr);
 }
 
 // Read one line from buffered socket including the \n char if present.
+// At most one recv() is done per call, so line may be partial (no \n)
+// and the rest of the line returned by later calls.
 // Function return values:
 // Z_OPEN (fd still open)
 // Z_EOF (end of file)
@@ -503,18 +762,21 @@ int lk_socketreader_readline(LKSocketReader *sr, LKString *line) {
         }
 
         // Copy unread buffer bytes into dst until a '\n' char.
-        while (1) {
-            if (buf->bytes_cur >= buf->bytes_len) {
-                break;
-            }
-            char ch = buf->bytes[buf->bytes_cur];
-            lk_string_append_char(line, ch);
-            buf->bytes_cur++;
-
-            if (ch == '\n') {
-                goto readline_end;
-            }
+        char *start = buf->bytes + buf->bytes_cur;
+        size_t nunread = buf->bytes_len - buf->bytes_cur;
+        char *nl = lk_scan_char(start, nunread, '\n');
+        if (nl != NULL) {
+            size_t ncopy = nl - start + 1;
+            lk_string_append_buf(line, start, ncopy);
+            buf->bytes_cur += ncopy;
+            goto readline_end;
         }
+        lk_string_append_buf(line, start, nunread);
+        buf->bytes_cur += nunread;
+
+        // Return partial line once buffer is used up so that the caller
+        // can bound the line length.
+        break;
     }
 
 readline_end:
@@ -522,6 +784,55 @@ readline_end:
     return z;
 }
 
+// Receive more bytes into sr->buf, keeping any unread bytes (from bytes_cur)
+// in front of them so that a message split across recvs stays contiguous.
+// Unread bytes are moved to the start of the buffer, or the buffer is grown,
+// when there is no room left. At most one recv() is done per call.
+// Function return values:
+// Z_OPEN (fd still open)
+// Z_EOF (end of file)
+// Z_ERR (errno set with error detail)
+// Z_BLOCK (fd blocked, no data)
+int lk_socketreader_fill(LKSocketReader *sr) {
+    if (sr->sockclosed) {
+        return Z_EOF;
+    }
+    LKBuffer *buf = sr->buf;
+
+    if (buf->bytes_cur >= buf->bytes_len) {
+        buf->bytes_cur = 0;
+        buf->bytes_len = 0;
+    }
+    if (buf->bytes_len == buf->bytes_size) {
+        if (buf->bytes_cur > 0) {
+            memmove(buf->bytes, buf->bytes + buf->bytes_cur, buf->bytes_len - buf->bytes_cur);
+            buf->bytes_len -= buf->bytes_cur;
+            buf->bytes_cur = 0;
+        } else {
+            lk_buffer_resize(buf, buf->bytes_size * 2);
+        }
+    }
+
+    while (1) {
+        ssize_t z = recv(sr->sock, buf->bytes + buf->bytes_len, buf->bytes_size - buf->bytes_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (z == 0) {
+            sr->sockclosed = 1;
+            return Z_EOF;
+        }
+        if (z == -1 && errno == EINTR) {
+            continue;
+        }
+        if (z == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return Z_BLOCK;
+        }
+        if (z == -1) {
+            return Z_ERR;
+        }
+        buf->bytes_len += z;
+        return Z_OPEN;
+    }
+}
+
 int lk_socketreader_recv(LKSocketReader *sr, LKBuffer *buf_dest) {
     lk_buffer_clear(buf_dest);
     LKBuffer *buf = sr->buf;
@@ -559,21 +870,54 @@ void lk_socketreader_debugprint(LKSocketReader *sr) {
 }
 
 
+// Request and response fields are allocated from arena when given.
+// Head and body buffers stay on the heap as they grow with the payload.
+static LKString *field_string_new(LKArena *arena) {
+    if (arena != NULL) {
+        return lk_string_arena_new(arena, "");
+    }
+    return lk_string_new("");
+}
+
+static LKHeaderTable *field_headertable_new(LKArena *arena) {
+    if (arena != NULL) {
+        return lk_headertable_arena_new(arena);
+    }
+    return lk_headertable_new();
+}
+
+
 /*** LKHttpRequest functions ***/
-LKHttpRequest *lk_httprequest_new() {
-    LKHttpRequest *req = lk_malloc(sizeof(LKHttpRequest), "lk_httprequest_new");
-    req->method = lk_string_new("");
-    req->uri = lk_string_new("");
-    req->path = lk_string_new("");
-    req->filename = lk_string_new("");
-    req->querystring = lk_string_new("");
-    req->version = lk_string_new("");
-    req->headers = lk_stringtable_new();
-    req->head = lk_buffer_new(0);
-    req->body = lk_buffer_new(0);
+static LKHttpRequest *request_new(LKArena *arena) {
+    LKHttpRequest *req;
+    if (arena != NULL) {
+        req = lk_arena_alloc(arena, sizeof(LKHttpRequest));
+    } else {
+        req = lk_malloc(sizeof(LKHttpRequest), "lk_httprequest_new");
+    }
+    req->arena = arena;
+    req->method = field_string_new(arena);
+    req->uri = field_string_new(arena);
+    req->path = field_string_new(arena);
+    req->filename = field_string_new(arena);
+    req->querystring = field_string_new(arena);
+    req->version = field_string_new(arena);
+    req->headers = field_headertable_new(arena);
+    req->head = lk_bufpool_get();
+    req->body = lk_bufpool_get();
     return req;
 }
 
+LKHttpRequest *lk_httprequest_new() {
+    return request_new(NULL);
+}
+
+// Request freed along with arena, lk_httprequest_free() only releases
+// its buffers.
+LKHttpRequest *lk_httprequest_arena_new(LKArena *arena) {
+    return request_new(arena);
+}
+
 void lk_httprequest_free(LKHttpRequest *req) {
     lk_string_free(req->method);
     lk_string_free(req->uri);
@@ -581,9 +925,9 @@ void lk_httprequest_free(LKHttpRequest *req) {
     lk_string_free(req->filename);
     lk_string_free(req->querystring);
     lk_string_free(req->version);
-    lk_stringtable_free(req->headers);
-    lk_buffer_free(req->head);
-    lk_buffer_free(req->body);
+    lk_headertable_free(req->headers);
+    lk_bufpool_put(req->head);
+    lk_bufpool_put(req->body);
 
     req->method = NULL;
     req->uri = NULL;
@@ -594,11 +938,13 @@ void lk_httprequest_free(LKHttpRequest *req) {
     req->headers = NULL;
     req->head = NULL;
     req->body = NULL;
-    lk_free(req);
+    if (req->arena == NULL) {
+        lk_free(req);
+    }
 }
 
 void lk_httprequest_add_header(LKHttpRequest *req, char *k, char *v) {
-    lk_stringtable_set(req->headers, k, v);
+    lk_headertable_set(req->headers, k, v);
 }
 
 void lk_httprequest_append_body(LKHttpRequest *req, char *bytes, int bytes_len) {
@@ -616,8 +962,13 @@ void lk_httprequest_finalize(LKHttpRequest *req) {
     if (req->body->bytes_len > 0) {
         lk_buffer_append_sprintf(req->head, "Content-Length: %ld\n", req->body->bytes_len);
     }
+    // Content-Length is generated above.
     for (int i=0; i < req->headers->items_len; i++) {
-        lk_buffer_append_sprintf(req->head, "%s: %s\n", req->headers->items[i].k->s, req->headers->items[i].v->s);
+        LKHeaderItem *item = &req->headers->items[i];
+        if (item->id == LK_HDR_CONTENT_LENGTH) {
+            continue;
+        }
+        lk_buffer_append_sprintf(req->head, "%s: %s\n", item->k->s, item->v->s);
     }
     lk_buffer_append(req->head, "\r\n", 2);
 }
@@ -652,40 +1003,206 @@ void lk_httprequest_debugprint(LKHttpRequest *req) {
 
 
 /** httpresp functions **/
-LKHttpResponse *lk_httpresponse_new() {
-    LKHttpResponse *resp = lk_malloc(sizeof(LKHttpResponse), "lk_httpresponse_new");
+static LKHttpResponse *response_new(LKArena *arena) {
+    LKHttpResponse *resp;
+    if (arena != NULL) {
+        resp = lk_arena_alloc(arena, sizeof(LKHttpResponse));
+    } else {
+        resp = lk_malloc(sizeof(LKHttpResponse), "lk_httpresponse_new");
+    }
+    resp->arena = arena;
     resp->status = 0;
-    resp->statustext = lk_string_new("");
-    resp->version = lk_string_new("");
-    resp->headers = lk_stringtable_new();
-    resp->head = lk_buffer_new(0);
-    resp->body = lk_buffer_new(0);
+    resp->statustext = field_string_new(arena);
+    resp->version = field_string_new(arena);
+    resp->headers = field_headertable_new(arena);
+    resp->head = lk_bufpool_get();
+    resp->body = lk_bufpool_get();
+    resp->bodyfd = -1;
+    resp->bodyfd_offset = 0;
+    resp->bodyfd_len = 0;
+    resp->parts = NULL;
+    resp->nparts = 0;
+    resp->parts_cur = 0;
+    memset(&resp->part_body, 0, sizeof(LKBuffer));
+    resp->page = NULL;
+    memset(&resp->page_body, 0, sizeof(LKBuffer));
     return resp;
 }
 
+LKHttpResponse *lk_httpresponse_new() {
+    return response_new(NULL);
+}
+
+// Response freed along with arena, lk_httpresponse_free() only releases
+// its buffers and bodyfd.
+LKHttpResponse *lk_httpresponse_arena_new(LKArena *arena) {
+    return response_new(arena);
+}
+
 void lk_httpresponse_free(LKHttpResponse *resp) {
     lk_string_free(resp->statustext);
     lk_string_free(resp->version);
-    lk_stringtable_free(resp->headers);
-    lk_buffer_free(resp->head);
-    lk_buffer_free(resp->body);
+    lk_headertable_free(resp->headers);
+    lk_bufpool_put(resp->head);
+    lk_bufpool_put(resp->body);
+    if (resp->bodyfd != -1) {
+        close(resp->bodyfd);
+    }
+    if (resp->parts != NULL) {
+        lk_free(resp->parts);
+    }
 
     resp->statustext = NULL;
     resp->version = NULL;
     resp->headers = NULL;
     resp->head = NULL;
     resp->body = NULL;
-    lk_free(resp);
+    resp->bodyfd = -1;
+    resp->parts = NULL;
+    if (resp->arena == NULL) {
+        lk_free(resp);
+    }
 }
 
 void lk_httpresponse_add_header(LKHttpResponse *resp, char *k, char *v) {
-    lk_stringtable_set(resp->headers, k, v);
+    lk_headertable_set(resp->headers, k, v);
 }
 
+static void finalize_page_head(LKHttpResponse *resp);
+
 // Finalize the http response by setting head buffer.
 // Writes the status line, headers and CRLF blank string to head buffer.
 void lk_httpresponse_finalize(LKHttpResponse *resp) {
-    lk_buffer_clear(resp->head);
+    if (resp->page != NULL) {
+        finalize_page_head(resp);
+        return;
+    }
+    lk_httpresponse_finalize_head(resp, lk_httpresponse_content_length(resp));
+}
+
+// Return length of body, file extent and multipart parts to send.
+size_t lk_httpresponse_content_length(LKHttpResponse *resp) {
+    size_t content_length = resp->body->bytes_len;
+    if (resp->bodyfd != -1) {
+        content_length += resp->bodyfd_len;
+    }
+    for (int i=0; i < resp->nparts; i++) {
+        content_length += resp->parts[i].len;
+    }
+    return content_length;
+}
+
+// Send body as multipart parts: each part's head from the body followed
+// by its extent of file fd. Body bytes after the last part head end the
+// response. Takes ownership of fd and the parts array.
+void lk_httpresponse_set_parts(LKHttpResponse *resp, int fd, LKBodyPart *parts, int nparts) {
+    resp->bodyfd = fd;
+    resp->bodyfd_offset = 0;
+    resp->bodyfd_len = 0;
+    resp->parts = parts;
+    resp->nparts = nparts;
+    resp->parts_cur = 0;
+}
+
+// Queue the next part to send: its head in part_body and its file
+// extent in bodyfd_offset and bodyfd_len. After the last part, part_body
+// has the rest of the body.
+// Return 1 if queued, 0 if all parts were already queued.
+int lk_httpresponse_next_part(LKHttpResponse *resp) {
+    if (resp->parts_cur > resp->nparts || resp->nparts == 0) {
+        return 0;
+    }
+    int i = resp->parts_cur;
+    size_t start = (i > 0) ? resp->parts[i-1].head_end : 0;
+    size_t end = resp->body->bytes_len;
+    resp->bodyfd_len = 0;
+    if (i < resp->nparts) {
+        end = resp->parts[i].head_end;
+        resp->bodyfd_offset = resp->parts[i].offset;
+        resp->bodyfd_len = resp->parts[i].len;
+    }
+    resp->part_body.bytes = resp->body->bytes + start;
+    resp->part_body.bytes_cur = 0;
+    resp->part_body.bytes_len = end - start;
+    resp->part_body.bytes_size = end - start;
+    resp->parts_cur++;
+    return 1;
+}
+
+// Status line after the version, for responses that use the standard
+// reason phrase.
+static char *status_lines[] = {
+    [100] = " 100 Continue\n",
+    [101] = " 101 Switching Protocols\n",
+    [200] = " 200 OK\n",
+    [201] = " 201 Created\n",
+    [204] = " 204 No Content\n",
+    [206] = " 206 Partial Content\n",
+    [301] = " 301 Moved Permanently\n",
+    [302] = " 302 Found\n",
+    [303] = " 303 See Other\n",
+    [304] = " 304 Not Modified\n",
+    [307] = " 307 Temporary Redirect\n",
+    [308] = " 308 Permanent Redirect\n",
+    [400] = " 400 Bad Request\n",
+    [401] = " 401 Unauthorized\n",
+    [403] = " 403 Forbidden\n",
+    [404] = " 404 Not Found\n",
+    [405] = " 405 Method Not Allowed\n",
+    [408] = " 408 Request Timeout\n",
+    [413] = " 413 Content Too Large\n",
+    [414] = " 414 URI Too Long\n",
+    [416] = " 416 Range Not Satisfiable\n",
+    [417] = " 417 Expectation Failed\n",
+    [431] = " 431 Request Header Fields Too Large\n",
+    [500] = " 500 Internal Server Error\n",
+    [501] = " 501 Not Implemented\n",
+    [502] = " 502 Bad Gateway\n",
+    [503] = " 503 Service Unavailable\n",
+    [504] = " 504 Gateway Timeout\n",
+    [505] = " 505 HTTP Version Not Supported\n",
+};
+#define N_STATUS_LINES (sizeof(status_lines) / sizeof(status_lines[0]))
+
+// "Date: <HTTP-date>\n" for the current second.
+static char date_line[sizeof("Date: \n") + HTTP_DATE_SIZE];
+static size_t date_line_len = 0;
+static time_t date_line_time = -1;
+
+// Regenerate the cached Date header line if now is a different second.
+// The server loop calls this once per iteration.
+void lk_httpresponse_update_date(time_t now) {
+    if (now == date_line_time) {
+        return;
+    }
+    char date_str[HTTP_DATE_SIZE];
+    lk_format_http_date(now, date_str, sizeof(date_str));
+    date_line_len = snprintf(date_line, sizeof(date_line), "Date: %s\n", date_str);
+    date_line_time = now;
+}
+
+static char *append_bytes(char *p, char *bytes, size_t len) {
+    memcpy(p, bytes, len);
+    return p + len;
+}
+
+// Return standard reason phrase of status, or empty view if not known.
+LKStrView lk_http_reason(int status) {
+    if (status <= 0 || status >= N_STATUS_LINES || status_lines[status] == NULL) {
+        return lk_sv_buf("", 0);
+    }
+    // Ex. " 200 OK\n" ==> "OK"
+    char *status_line = status_lines[status];
+    return lk_sv_buf(status_line+5, strlen(status_line)-6);
+}
+
+// Write status line and header lines to head, without the blank line.
+// Head bytes are copied directly into a head buffer sized up front,
+// Date and Server are added unless already set.
+static void write_head_lines(LKHttpResponse *resp, ssize_t content_length, int add_date, LKBuffer *head) {
+    static char server_line[] = "Server: " LK_SERVER_NAME "\n";
+    static char content_length_name[] = "Content-Length: ";
+    LKHeaderTable *headers = resp->headers;
 
     // Default to 200 OK if no status set.
     if (resp->status == 0) {
@@ -693,17 +1210,144 @@ void lk_httpresponse_finalize(LKHttpResponse *resp) {
         lk_string_assign(resp->statustext, "OK");
     }
     // Default to HTTP version.
-    if (lk_string_sz_equal(resp->version, "")) {
+    if (resp->version->s_len == 0) {
         lk_string_assign(resp->version, "HTTP/1.0");
     }
-    lk_buffer_append_sprintf(resp->head, "%s %d %s\n", resp->version->s, resp->status, resp->statustext->s);
-    lk_buffer_append_sprintf(resp->head, "Content-Length: %ld\n", resp->body->bytes_len);
-    for (int i=0; i < resp->headers->items_len; i++) {
-        lk_buffer_append_sprintf(resp->head, "%s: %s\n", resp->headers->items[i].k->s, resp->headers->items[i].v->s);
+    if (date_line_time == -1) {
+        lk_httpresponse_update_date(time(NULL));
     }
+    add_date = add_date && headers->known[LK_HDR_DATE] == -1;
+    int add_server = headers->known[LK_HDR_SERVER] == -1;
+    // 304 Not Modified has no body.
+    int add_content_length = resp->status != 304 && content_length != -1;
+
+    // Standard status line if statustext is the standard reason phrase.
+    char *status_line = NULL;
+    size_t status_line_len = 0;
+    LKStrView reason = lk_http_reason(resp->status);
+    if (reason.len > 0 && lk_sv_equal(reason, resp->statustext->s)) {
+        status_line = status_lines[resp->status];
+        status_line_len = reason.len+6;
+    }
+
+    size_t head_len = resp->version->s_len + resp->statustext->s_len + 24;
+    head_len += date_line_len + sizeof(server_line) + sizeof(content_length_name) + 24;
+    for (int i=0; i < headers->items_len; i++) {
+        head_len += headers->items[i].k->s_len + headers->items[i].v->s_len + 3;
+    }
+    lk_buffer_clear(head);
+    if (head->bytes_size < head_len) {
+        lk_buffer_resize(head, head_len);
+    }
+
+    char *p = head->bytes;
+    p = append_bytes(p, resp->version->s, resp->version->s_len);
+    if (status_line != NULL) {
+        p = append_bytes(p, status_line, status_line_len);
+    } else {
+        *p++ = ' ';
+        p += lk_utoa(resp->status, p);
+        *p++ = ' ';
+        p = append_bytes(p, resp->statustext->s, resp->statustext->s_len);
+        *p++ = '\n';
+    }
+    if (add_date) {
+        p = append_bytes(p, date_line, date_line_len);
+    }
+    if (add_server) {
+        p = append_bytes(p, server_line, sizeof(server_line)-1);
+    }
+    if (add_content_length) {
+        p = append_bytes(p, content_length_name, sizeof(content_length_name)-1);
+        p += lk_utoa(content_length, p);
+        *p++ = '\n';
+    }
+    // Content-Length is generated above.
+    for (int i=0; i < headers->items_len; i++) {
+        LKHeaderItem *item = &headers->items[i];
+        if (item->id == LK_HDR_CONTENT_LENGTH) {
+            continue;
+        }
+        p = append_bytes(p, item->k->s, item->k->s_len);
+        *p++ = ':';
+        *p++ = ' ';
+        p = append_bytes(p, item->v->s, item->v->s_len);
+        *p++ = '\n';
+    }
+    head->bytes_len = p - head->bytes;
+    assert(head->bytes_len <= head->bytes_size);
+}
+
+// Set head buffer for a body of content_length bytes.
+// A content_length of -1 leaves out Content-Length, for a body streamed
+// until the connection closes.
+void lk_httpresponse_finalize_head(LKHttpResponse *resp, ssize_t content_length) {
+    write_head_lines(resp, content_length, 1, resp->head);
     lk_buffer_append(resp->head, "\r\n", 2);
 }
 
+// Set head buffer from page head and the current Date.
+// Body is sent from page_body, which shares the page body bytes.
+static void finalize_page_head(LKHttpResponse *resp) {
+    LKStatusPage *page = resp->page;
+    LKBuffer *head = resp->head;
+    if (date_line_time == -1) {
+        lk_httpresponse_update_date(time(NULL));
+    }
+
+    size_t head_len = page->head->bytes_len + date_line_len + 2;
+    lk_buffer_clear(head);
+    if (head->bytes_size < head_len) {
+        lk_buffer_resize(head, head_len);
+    }
+    char *p = head->bytes;
+    p = append_bytes(p, page->head->bytes, page->head->bytes_len);
+    p = append_bytes(p, date_line, date_line_len);
+    p = append_bytes(p, "\r\n", 2);
+    head->bytes_len = p - head->bytes;
+
+    resp->page_body.bytes = page->body->bytes;
+    resp->page_body.bytes_cur = 0;
+    resp->page_body.bytes_len = page->body->bytes_len;
+    resp->page_body.bytes_size = page->body->bytes_size;
+}
+
+// Send pre-rendered page as the response.
+// Nothing is allocated or formatted, see finalize_page_head().
+void lk_httpresponse_set_page(LKHttpResponse *resp, LKStatusPage *page) {
+    resp->status = page->status;
+    resp->page = page;
+}
+
+LKStatusPage *lk_statuspage_new(int status, char *content_type, char *body, size_t body_len) {
+    LKStatusPage *page = lk_malloc(sizeof(LKStatusPage), "lk_statuspage_new");
+    page->status = status;
+    page->content_type = lk_string_new(content_type);
+    page->head = lk_buffer_new(0);
+    page->body = lk_buffer_new(body_len+1);
+    lk_buffer_append(page->body, body, body_len);
+
+    LKHttpResponse *resp = lk_httpresponse_new();
+    resp->status = status;
+    LKStrView reason = lk_http_reason(status);
+    lk_string_assign_buf(resp->statustext, reason.p, reason.len);
+    lk_string_assign(resp->version, "HTTP/1.0");
+    lk_httpresponse_add_header(resp, "Content-Type", content_type);
+    write_head_lines(resp, body_len, 0, page->head);
+    lk_httpresponse_free(resp);
+    return page;
+}
+
+void lk_statuspage_free(LKStatusPage *page) {
+    lk_string_free(page->content_type);
+    lk_buffer_free(page->head);
+    lk_buffer_free(page->body);
+    page->content_type = NULL;
+    page->head = NULL;
+    page->body = NULL;
+    lk_free(page);
+}
+
 void lk_httpresponse_debugprint(LKHttpResponse *resp) {
     assert(resp->statustext != NULL);
     assert(resp->version != NULL);
@@ -750,14 +1394,25 @@ ssize_t lk_readfile(char *filepath, LKBuffer *buf) {
 }
 
 // Read entire file descriptor contents into buf.
+// Regular files are read into a buffer sized from fstat() up front.
 // Return number of bytes read or -1 for error.
-#define TMPBUF_SIZE 512
 ssize_t lk_readfd(int fd, LKBuffer *buf) {
-    char tmpbuf[TMPBUF_SIZE];
+    size_t reserve = LK_BUFSIZE_LARGE;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        // +1 so the read that finds EOF doesn't grow buf.
+        reserve = st.st_size+1;
+    }
 
-    int nread = 0;
+    ssize_t nread = 0;
     while (1) {
-        int z = read(fd, tmpbuf, TMPBUF_SIZE);
+        char *p = lk_buffer_reserve(buf, reserve);
+        if (p == NULL) {
+            return -1;
+        }
+        // Read into any space left before growing buf again.
+        reserve = 1;
+        ssize_t z = read(fd, p, buf->bytes_size - buf->bytes_len);
         if (z == -1 && errno == EINTR) {
             continue;
         }
@@ -767,7 +1422,7 @@ ssize_t lk_readfd(int fd, LKBuffer *buf) {
         if (z == 0) {
             break;
         }
-        lk_buffer_append(buf, tmpbuf, z);
+        lk_buffer_commit(buf, z);
         nread += z;
     }
     return nread;
@@ -789,3 +1444,147 @@ int lk_file_exists(char *filename) {
     return !z;
 }
 
+// Open path beneath directory dirfd one component at a time, failing on
+// any ".." segment or symlink. Stricter than openat2(RESOLVE_BENEATH),
+// which allows symlinks that stay beneath dirfd.
+// Returns fd or -1 for error.
+int lk_open_beneath_nofollow(int dirfd, char *path, int flags) {
+    char buf[PATH_MAX];
+    if (strlen(path) >= sizeof(buf)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(buf, path);
+
+    int fd = dirfd;
+    char *seg = buf;
+    while (1) {
+        while (*seg == '/') {
+            seg++;
+        }
+        char *slash = strchr(seg, '/');
+        if (slash != NULL) {
+            *slash = '\0';
+        }
+        if (!strcmp(seg, "..")) {
+            if (fd != dirfd) {
+                close(fd);
+            }
+            errno = EXDEV;
+            return -1;
+        }
+        if (slash == NULL || slash[1] == '\0') {
+            if (*seg == '\0') {
+                seg = ".";
+            }
+            int z = openat(fd, seg, flags | O_CLOEXEC | O_NOFOLLOW);
+            if (fd != dirfd) {
+                close(fd);
+            }
+            return z;
+        }
+        int next = openat(fd, seg, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd != dirfd) {
+            close(fd);
+        }
+        if (next == -1) {
+            return -1;
+        }
+        fd = next;
+        seg = slash+1;
+    }
+}
+
+// Open path beneath directory dirfd, path can't resolve to a file
+// outside dirfd through "..", absolute paths or symlinks.
+// Uses openat2(RESOLVE_BENEATH), falling back to
+// lk_open_beneath_nofollow() on kernels without openat2().
+// Returns fd or -1 for error.
+int lk_open_beneath(int dirfd, char *path, int flags) {
+    // Path is relative to dirfd. "/index.html" ==> "index.html"
+    while (*path == '/') {
+        path++;
+    }
+    if (*path == '\0') {
+        path = ".";
+    }
+
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = flags | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    int fd = syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+    if (fd == -1 && errno == ENOSYS) {
+        fd = lk_open_beneath_nofollow(dirfd, path, flags);
+    }
+    return fd;
+}
+
+static int hexval(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Decode %XX escapes in s in place. "/a%20b" ==> "/a b"
+// Returns decoded length, or -1 for malformed escape or encoded NUL.
+ssize_t lk_percent_decode(char *s, size_t len) {
+    size_t j = 0;
+    for (size_t i=0; i < len; i++) {
+        if (s[i] != '%') {
+            s[j++] = s[i];
+            continue;
+        }
+        if (i+2 >= len) {
+            return -1;
+        }
+        int hi = hexval(s[i+1]);
+        int lo = hexval(s[i+2]);
+        if (hi == -1 || lo == -1 || (hi == 0 && lo == 0)) {
+            return -1;
+        }
+        s[j++] = (char) (hi << 4 | lo);
+        i += 2;
+    }
+    return j;
+}
+
+// Normalize absolute path s in place, removing "." segments, empty
+// segments and trailing slash, and resolving ".." segments. ".." at the
+// root stays at the root. "/a/./b/../../c//d/" ==> "/c/d", "/" ==> ""
+// Returns normalized length. Relative paths are left as is.
+size_t lk_normalize_path(char *s, size_t len) {
+    if (len == 0 || s[0] != '/') {
+        return len;
+    }
+    size_t j = 0;
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && s[i] == '/') {
+            i++;
+        }
+        size_t seg = i;
+        while (i < len && s[i] != '/') {
+            i++;
+        }
+        size_t seg_len = i - seg;
+        if (seg_len == 0 || (seg_len == 1 && s[seg] == '.')) {
+            continue;
+        }
+        if (seg_len == 2 && s[seg] == '.' && s[seg+1] == '.') {
+            // Remove last segment written.
+            while (j > 0 && s[j-1] != '/') {
+                j--;
+            }
+            if (j > 0) {
+                j--;
+            }
+            continue;
+        }
+        s[j++] = '/';
+        memmove(s+j, s+seg, seg_len);
+        j += seg_len;
+    }
+    return j;
+}
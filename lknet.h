@@ -9,6 +9,62 @@
 #include <fcntl.h>
 #include "lklib.h"
 
+/*** LKHeaderTable - HTTP header fields, case-insensitive names ***/
+// Well-known header names, interned so lookups are an array index.
+typedef enum {
+    LK_HDR_OTHER = -1,
+    LK_HDR_HOST,
+    LK_HDR_CONTENT_LENGTH,
+    LK_HDR_CONTENT_TYPE,
+    LK_HDR_CONTENT_RANGE,
+    LK_HDR_CONNECTION,
+    LK_HDR_USER_AGENT,
+    LK_HDR_IF_NONE_MATCH,
+    LK_HDR_IF_MODIFIED_SINCE,
+    LK_HDR_RANGE,
+    LK_HDR_IF_RANGE,
+    LK_HDR_EXPECT,
+    LK_HDR_UPGRADE,
+    LK_HDR_HTTP2_SETTINGS,
+    LK_HDR_TRANSFER_ENCODING,
+    LK_HDR_LOCATION,
+    LK_HDR_STATUS,
+    LK_HDR_DATE,
+    LK_HDR_SERVER,
+    LK_HDR_COUNT
+} LKHeaderId;
+
+typedef struct {
+    LKString *k;
+    LKString *v;
+    unsigned int hash;      // hash of lowercased name
+    LKHeaderId id;          // LK_HDR_OTHER if not well-known
+} LKHeaderItem;
+
+typedef struct {
+    LKHeaderItem *items;    // in insertion order
+    size_t items_len;
+    size_t items_size;
+    int *slots;             // open addressing index into items, -1 if empty
+    size_t slots_size;      // power of 2, at least twice items_len
+    int known[LK_HDR_COUNT];// index into items by header id, -1 if not set
+    LKArena *arena;         // table, items and strings allocated from arena if set
+} LKHeaderTable;
+
+LKHeaderTable *lk_headertable_new();
+LKHeaderTable *lk_headertable_arena_new(LKArena *arena);
+void lk_headertable_free(LKHeaderTable *ht);
+void lk_headertable_reserve(LKHeaderTable *ht, size_t n);
+void lk_headertable_set(LKHeaderTable *ht, char *k, char *v);
+void lk_headertable_append(LKHeaderTable *ht, char *k, char *v);
+void lk_headertable_join(LKHeaderTable *ht, char *k, char *v, char *sep);
+char *lk_headertable_get(LKHeaderTable *ht, char *k);
+char *lk_headertable_get_id(LKHeaderTable *ht, LKHeaderId id);
+void lk_headertable_remove(LKHeaderTable *ht, char *k);
+void lk_headertable_remove_id(LKHeaderTable *ht, LKHeaderId id);
+LKHeaderId lk_header_id(char *k);
+
+
 /*** LKHttpRequest - HTTP Request struct ***/
 typedef struct {
     LKString *method;       // GET
@@ -17,12 +73,14 @@ typedef struct {
     LKString *filename;     // "index.html"
     LKString *querystring;  // "p=1&start=5"
     LKString *version;      // HTTP/1.0
-    LKStringTable *headers;
+    LKHeaderTable *headers;
     LKBuffer *head;
     LKBuffer *body;
+    LKArena *arena;         // struct, strings and headers from arena if set
 } LKHttpRequest;
 
 LKHttpRequest *lk_httprequest_new();
+LKHttpRequest *lk_httprequest_arena_new(LKArena *arena);
 void lk_httprequest_free(LKHttpRequest *req);
 void lk_httprequest_add_header(LKHttpRequest *req, char *k, char *v);
 void lk_httprequest_append_body(LKHttpRequest *req, char *bytes, int bytes_len);
@@ -31,19 +89,59 @@ void lk_httprequest_debugprint(LKHttpRequest *req);
 
 
 /*** LKHttpResponse - HTTP Response struct ***/
+#define LK_SERVER_NAME "LittleKitten/0.9"
+
+// Pre-rendered response shared by all responses with the same status.
+// Rendered once at startup and not modified after, Date is the only
+// head line generated per response.
+typedef struct {
+    int status;
+    LKString *content_type;
+    LKBuffer *head;         // status line and headers, no Date or blank line
+    LKBuffer *body;
+} LKStatusPage;
+
+LKStatusPage *lk_statuspage_new(int status, char *content_type, char *body, size_t body_len);
+void lk_statuspage_free(LKStatusPage *page);
+LKStrView lk_http_reason(int status);
+
+// multipart/byteranges part, its head is in the response body.
+typedef struct {
+    size_t head_end;        // end of part head in body
+    off_t offset;           // file extent sent from bodyfd after the head
+    size_t len;
+} LKBodyPart;
+
 typedef struct {
     int status;             // 404
     LKString *statustext;    // File not found
     LKString *version;       // HTTP/1.0
-    LKStringTable *headers;
+    LKHeaderTable *headers;
     LKBuffer *head;
     LKBuffer *body;
+    int bodyfd;             // file sent after body with sendfile(), -1 if none
+    off_t bodyfd_offset;    // file offset of next byte to send
+    size_t bodyfd_len;      // file bytes left to send
+    LKBodyPart *parts;      // multipart body parts sent from bodyfd, NULL if none
+    int nparts;
+    int parts_cur;          // next part to queue
+    LKBuffer part_body;     // view of body bytes sent before current part's extent
+    LKStatusPage *page;     // pre-rendered response sent instead, NULL if none
+    LKBuffer page_body;     // view of page body bytes with its own write cursor
+    LKArena *arena;         // struct, strings and headers from arena if set
 } LKHttpResponse;
 
 LKHttpResponse *lk_httpresponse_new();
+LKHttpResponse *lk_httpresponse_arena_new(LKArena *arena);
 void lk_httpresponse_free(LKHttpResponse *resp);
 void lk_httpresponse_add_header(LKHttpResponse *resp, char *k, char *v);
+void lk_httpresponse_set_page(LKHttpResponse *resp, LKStatusPage *page);
 void lk_httpresponse_finalize(LKHttpResponse *resp);
+size_t lk_httpresponse_content_length(LKHttpResponse *resp);
+void lk_httpresponse_set_parts(LKHttpResponse *resp, int fd, LKBodyPart *parts, int nparts);
+int lk_httpresponse_next_part(LKHttpResponse *resp);
+void lk_httpresponse_finalize_head(LKHttpResponse *resp, ssize_t content_length);
+void lk_httpresponse_update_date(time_t now);
 void lk_httpresponse_debugprint(LKHttpResponse *resp);
 
 
@@ -57,27 +155,196 @@ typedef struct {
 LKSocketReader *lk_socketreader_new(int sock, size_t initial_size);
 void lk_socketreader_free(LKSocketReader *sr);
 int lk_socketreader_readline(LKSocketReader *sr, LKString *line);
+int lk_socketreader_fill(LKSocketReader *sr);
 int lk_socketreader_recv(LKSocketReader *sr, LKBuffer *buf);
 void lk_socketreader_debugprint(LKSocketReader *sr);
 
 
 /*** LKHttpRequestParser ***/
+// Default request head limits, 0 for no limit.
+#define LK_MAX_REQUEST_LINE 8192
+#define LK_MAX_HEAD_SIZE 32768
+#define LK_MAX_HEADERS 100
+#define LK_HEADER_TIMEOUT 30
+
+// Byte range of a request head token, as offset from start of head.
+typedef struct {
+    size_t off;
+    size_t len;
+} LKSpan;
+
+typedef struct {
+    LKSpan name;
+    LKSpan value;
+} LKHeaderSpan;
+
+// Header spans kept in the parser before heap allocating more.
+#define LK_INLINE_HEADER_SPANS 32
+
 typedef struct {
-    LKString *partial_line;
     unsigned int nlinesread;
     int head_complete;              // flag indicating header lines complete
     int body_complete;              // flag indicating request body complete
-    unsigned int content_length;    // value of Content-Length header
+    size_t content_length;          // value of Content-Length header
+    int error_status;               // http status for malformed request, 0 if none
+    size_t head_len;                // bytes of request line and headers parsed
+    unsigned int nheaders;          // number of header spans
+    size_t max_request_line;        // request line limit, 400 if exceeded
+    size_t max_head_size;           // head bytes limit, 431 if exceeded
+    unsigned int max_headers;       // header count limit, 431 if exceeded
+    LKSpan method;
+    LKSpan uri;
+    LKSpan version;
+    LKHeaderSpan *header_spans;     // inline_header_spans or heap allocated
+    size_t header_spans_size;
+    LKHeaderSpan inline_header_spans[LK_INLINE_HEADER_SPANS];
 } LKHttpRequestParser;
 
 LKHttpRequestParser *lk_httprequestparser_new();
 void lk_httprequestparser_free(LKHttpRequestParser *parser);
 void lk_httprequestparser_reset(LKHttpRequestParser *parser);
-void lk_httprequestparser_parse_line(LKHttpRequestParser *parser, LKString *line, LKHttpRequest *req);
+size_t lk_httprequestparser_parse_head(LKHttpRequestParser *parser, char *p, size_t len, LKHttpRequest *req);
 void lk_httprequestparser_parse_bytes(LKHttpRequestParser *parser, LKBuffer *buf, LKHttpRequest *req);
 
-/*** CGI Parser ***/
-void parse_cgi_output(LKBuffer *buf, LKHttpResponse *resp);
+/*** LKHttpCgiParser - Incremental CGI output parser ***/
+// Header lines are parsed in place as they arrive in the cgi output
+// buffer. The body isn't copied, it starts at body_pos in the buffer.
+typedef struct {
+    size_t pos;                     // offset of next unparsed line
+    size_t body_pos;                // offset of body, set when head_complete
+    int head_complete;              // flag indicating header lines complete
+    int has_status;                 // Status header seen
+    size_t max_head_size;           // head without blank line is output as is
+} LKHttpCgiParser;
+
+LKHttpCgiParser *lk_httpcgiparser_new();
+void lk_httpcgiparser_free(LKHttpCgiParser *parser);
+void lk_httpcgiparser_reset(LKHttpCgiParser *parser);
+int lk_httpcgiparser_parse(LKHttpCgiParser *parser, LKBuffer *buf, LKHttpResponse *resp);
+void lk_httpcgiparser_finish(LKHttpCgiParser *parser, LKBuffer *buf, LKHttpResponse *resp);
+
+
+/*** LKHpackDecoder - HTTP/2 header decompression (RFC 7541) ***/
+typedef struct {
+    LKStringTableItem *items;       // dynamic table, items[0] is newest entry
+    size_t items_len;
+    size_t items_size;
+    size_t table_size;              // sum of entry sizes (name + value + 32)
+    size_t max_table_size;          // limit set by dynamic table size update
+    size_t settings_table_size;     // limit advertised in SETTINGS
+    size_t max_list_size;           // decoded header list limit, 0 for no limit
+    size_t max_fields;              // decoded header field limit, 0 for no limit
+} LKHpackDecoder;
+
+LKHpackDecoder *lk_hpackdecoder_new(size_t max_table_size);
+void lk_hpackdecoder_free(LKHpackDecoder *dec);
+int lk_hpackdecoder_decode(LKHpackDecoder *dec, char *bytes, size_t bytes_len, LKHeaderTable *headers);
+void lk_hpack_encode_header(LKBuffer *buf, char *k, char *v);
+
+
+/*** LKHttp2Session - HTTP/2 cleartext (h2c) connection ***/
+typedef struct lkhttp2stream_s {
+    unsigned int id;
+    LKHttpRequest *req;
+    LKHttpResponse *resp;
+    long send_window;               // flow control window for sending DATA
+    long recv_window;               // flow control window for receiving DATA
+    size_t max_body_size;           // request body limit, 0 for no limit
+    int body_too_large;             // request body over max_body_size, dropped
+    int recv_closed;                // END_STREAM received, request complete
+    int dispatched;                 // request handed over for processing
+    int resp_submitted;             // response HEADERS queued
+    int send_closed;                // END_STREAM sent
+    size_t body_sent;               // resp->body bytes sent in DATA frames
+    struct lkhttp2stream_s *next;
+} LKHttp2Stream;
+
+typedef struct {
+    LKBuffer *inbuf;                // received bytes not yet parsed
+    LKBuffer *outbuf;               // frames waiting to be sent
+    LKBuffer *headerblock;          // HEADERS + CONTINUATION fragments
+    LKHpackDecoder *decoder;
+    LKHttp2Stream *streams;
+    unsigned int nstreams;
+    unsigned int last_stream_id;    // highest stream id opened by client
+    unsigned int headers_stream_id; // stream of pending header block, or 0
+    int headers_end_stream;         // END_STREAM flag of pending header block
+    int preface_received;
+    int settings_sent;
+    long send_window;               // connection flow control window
+    long recv_window;               // connection window for receiving DATA
+    LKHttp2Stream *new_stream;      // stream with head not yet checked
+    long peer_initial_window;       // client SETTINGS_INITIAL_WINDOW_SIZE
+    unsigned int peer_max_frame_size;
+    int goaway_received;
+    int closing;                    // connection error, GOAWAY sent
+} LKHttp2Session;
+
+LKHttp2Session *lk_http2session_new();
+void lk_http2session_free(LKHttp2Session *h2);
+int lk_http2session_upgrade(LKHttp2Session *h2, LKHttpRequest *req, char *settings);
+void lk_http2session_recv(LKHttp2Session *h2);
+LKHttp2Stream *lk_http2session_next_head(LKHttp2Session *h2);
+LKHttp2Stream *lk_http2session_next_request(LKHttp2Session *h2);
+void lk_http2session_submit_response(LKHttp2Session *h2, LKHttp2Stream *stream);
+int lk_http2session_send(LKHttp2Session *h2, int fd);
+int lk_http2session_done(LKHttp2Session *h2);
+
+
+/*** LKSplicePipe - One direction of a socket tunnel ***/
+#define LK_SPLICE_SIZE 65536    // max bytes moved per splice() call
+
+// Bytes are moved from readfd to writefd with splice() through a kernel
+// pipe without copying into userspace.
+typedef struct {
+    int readfd;
+    int writefd;
+    int pipefd[2];
+    size_t pipe_len;        // bytes in pipe waiting to be written
+    LKBuffer *buf;          // bytes read before splicing started, sent first
+    int read_eof;           // readfd returned EOF
+    size_t nbytes;          // total bytes written to writefd
+} LKSplicePipe;
+
+LKSplicePipe *lk_splicepipe_new(int readfd, int writefd);
+void lk_splicepipe_free(LKSplicePipe *sp);
+// Return whether there are bytes waiting to be written to writefd.
+int lk_splicepipe_pending(LKSplicePipe *sp);
+
+
+/*** LKTlsConn - TLS client connection relayed to a plaintext socket ***/
+// Built with make LKTLS=1 only.
+#ifdef LKTLS
+#include <openssl/ssl.h>
+
+#define LK_TLS_WANT_READ 1
+#define LK_TLS_WANT_WRITE 2
+
+// Client bytes are decrypted from fd and written to plainfd, bytes read
+// from plainfd are encrypted and sent to fd. The http code serves the
+// other end of the plainfd socketpair like any client socket.
+typedef struct {
+    SSL *ssl;
+    int fd;                 // client socket
+    int plainfd;            // relay end of plaintext socketpair, -1 if none
+    LKBuffer *inbuf;        // decrypted client bytes waiting for plainfd
+    LKBuffer *outbuf;       // plainfd bytes waiting for SSL_write()
+    int handshake_done;
+    int fd_want;            // LK_TLS_WANT_READ/WRITE events fd waits for
+    int plainfd_want;       // LK_TLS_WANT_READ/WRITE events plainfd waits for
+    int tls_eof;            // client closed its side
+    int plain_eof;          // server side done sending
+    int plain_closed;       // server side stopped reading, client bytes dropped
+} LKTlsConn;
+
+SSL_CTX *lk_tls_ctx_new(char *certfile, char *keyfile);
+LKTlsConn *lk_tlsconn_new(SSL_CTX *ctx, int fd);
+void lk_tlsconn_free(LKTlsConn *tc);
+int lk_tlsconn_handshake(LKTlsConn *tc);
+int lk_tlsconn_ktls(LKTlsConn *tc);
+int lk_tlsconn_start_relay(LKTlsConn *tc, int plainfd);
+int lk_tlsconn_relay(LKTlsConn *tc);
+#endif
 
 
 /*** LKContext ***/
@@ -86,8 +353,14 @@ typedef enum {
     CTX_READ_CGI_OUTPUT,
     CTX_WRITE_CGI_INPUT,
     CTX_WRITE_RESP,
+    CTX_WRITE_CGI_RESP,
     CTX_PROXY_WRITE_REQ,
     CTX_PROXY_PIPE_RESP,
+    CTX_HTTP2,
+    CTX_PROXY_READ_UPGRADE_RESP,
+    CTX_PROXY_TUNNEL,
+    CTX_SSE_SUBSCRIBER,
+    CTX_TLS,
 } LKContextType;
 
 typedef struct lkcontext_s {
@@ -95,16 +368,19 @@ typedef struct lkcontext_s {
     int clientfd;
     LKContextType type;
     struct lkcontext_s *next;         // link to next ctx
+    LKArena *arena;                   // ctx and client request lifetime objects
 
     // Used by CTX_READ_REQ:
     struct sockaddr_in client_sa;     // client address
     LKString *client_ipaddr;          // client ip address string
     unsigned short client_port;       // client port number
-    LKString *req_line;               // current request line
     LKBuffer *req_buf;                // current request bytes buffer
     LKSocketReader *sr;               // input buffer for reading lines
     LKHttpRequestParser *reqparser;   // parser for httprequest
     LKHttpRequest *req;               // http request in process
+    time_t req_start;                 // time client connected, for header timeout
+    int client_tls;                   // client connected through tls_port
+    struct lkhostconfig_s *hc;        // hostconfig matching request
 
     // Used by CTX_WRITE_REQ:
     LKHttpResponse *resp;             // http response to be sent
@@ -113,15 +389,38 @@ typedef struct lkcontext_s {
     // Used by CTX_READ_CGI:
     int cgifd;
     LKBuffer *cgi_outputbuf;          // receive cgi stdout bytes here
-    LKBuffer *cgi_inputbuf;           // input bytes to pass to cgi stdin
+    LKHttpCgiParser *cgiparser;       // parser for cgi_outputbuf head
+    int cgi_eof;                      // cgi stdout reached EOF
+    LKBufChain *cgi_input;            // input bytes to pass to cgi stdin
 
     // Used by CTX_PROXY_WRITE_REQ:
     int proxyfd;
-    LKBuffer *proxy_respbuf;
+    LKBuffer *proxy_respbuf;          // upgrade response status line
+    LKBufChain *proxy_resp;           // proxy response bytes to pipe to client
+
+    // Used by CTX_HTTP2:
+    LKHttp2Session *h2;
+
+    // Used by CTX_PROXY_TUNNEL:
+    LKSplicePipe *tunnel_up;          // clientfd to proxyfd
+    LKSplicePipe *tunnel_down;        // proxyfd to clientfd
+    struct lkcontext_s *tunnel_peer;  // ctx selecting the other tunnel fd
+    time_t tunnel_active;             // time of last tunnel traffic
+
+    // Used by CTX_SSE_SUBSCRIBER, hc is the subscribed event stream:
+    LKRefList *sse_queue;             // LKRefBuffer events waiting to be sent
+    size_t sse_offset;                // bytes of current event already sent
+
+#ifdef LKTLS
+    // Used by CTX_TLS, req_start is the handshake start:
+    LKTlsConn *tlsconn;               // set in the ctx selecting the client socket
+    struct lkcontext_s *tls_peer;     // ctx selecting the other tls fd
+#endif
 } LKContext;
 
 LKContext *lk_context_new();
 LKContext *create_initial_context(int fd, struct sockaddr_in *sa);
+void init_request_context(LKContext *ctx);
 void lk_context_free(LKContext *ctx);
 
 void add_new_client_context(LKContext **pphead, LKContext *ctx);
@@ -133,22 +432,56 @@ int remove_selectfd_context(LKContext **pphead, int selectfd);
 
 
 /*** LKConfig ***/
+// Error statuses with pre-rendered responses, see lk_status_page_codes.
+#define LK_N_STATUS_PAGES 12
+
+// Request and response sizes seen by a host, for sizing new buffers.
 typedef struct {
+    LKSizeHist head_sizes;          // request line and header bytes
+    LKSizeHist header_counts;       // request headers
+    LKSizeHist resp_sizes;          // response head and body bytes
+} LKTrafficStats;
+
+void lk_traffic_stats_init(LKTrafficStats *st);
+
+typedef struct lkhostconfig_s {
     LKString *hostname;
     LKString *homedir;
     LKString *homedir_abspath;
     LKString *cgidir;
     LKString *cgidir_abspath;
+    int homedir_fd;                 // O_PATH fd of homedir_abspath, -1 if none
+    int cgidir_fd;                  // O_PATH fd of cgidir_abspath, -1 if none
     LKStringTable *aliases;
     LKString *proxyhost;
+    LKString *ssepath;              // Server-Sent Events endpoint path
+    LKString *ssesecret;            // bearer token for publishing, none if empty
+    LKString *tls_cert;             // PEM certificate chain served for hostname
+    LKString *tls_key;              // PEM private key, tls_cert file if empty
+#ifdef LKTLS
+    SSL_CTX *tls_ctx;               // tls_cert context, NULL if none
+#endif
+    size_t max_body_size;           // max request body bytes, 0 for no limit
+    LKStringTable *errorpages;      // status code to custom error page file
+    LKStatusPage *status_pages[LK_N_STATUS_PAGES];
+    LKTrafficStats stats;
 } LKHostConfig;
 
 typedef struct {
     LKString *serverhost;
     LKString *port;
+    LKString *tls_port;             // https port, none if empty
+#ifdef LKTLS
+    SSL_CTX *tls_ctx;               // default context, owned by its hostconfig
+#endif
     LKHostConfig **hostconfigs;
     size_t hostconfigs_len;
     size_t hostconfigs_size;
+    size_t max_request_line;        // request line bytes, 0 for no limit
+    size_t max_header_size;         // request line and header bytes, 0 for no limit
+    unsigned int max_headers;       // header count, 0 for no limit
+    unsigned int header_timeout;    // secs to receive request head, 0 for no limit
+    LKStatusPage *status_pages[LK_N_STATUS_PAGES];  // used when no hostconfig matches
 } LKConfig;
 
 LKConfig *lk_config_new();
@@ -157,19 +490,31 @@ int lk_config_read_configfile(LKConfig *cfg, char *configfile);
 void lk_config_print(LKConfig *cfg);
 LKHostConfig *lk_config_add_hostconfig(LKConfig *cfg, LKHostConfig *hc);
 LKHostConfig *lk_config_find_hostconfig(LKConfig *cfg, char *hostname);
+LKStatusPage *lk_config_status_page(LKConfig *cfg, LKHostConfig *hc, int status);
 LKHostConfig *lk_config_create_get_hostconfig(LKConfig *cfg, char *hostname);
 void lk_config_finalize(LKConfig *cfg);
 
 LKHostConfig *lk_hostconfig_new(char *hostname);
 void lk_hostconfig_free(LKHostConfig *hc);
 
+#ifdef LKTLS
+int lk_tls_init(LKConfig *cfg);
+#endif
+
 
 typedef struct {
     LKConfig *cfg;
     LKContext *ctxhead;
-    fd_set readfds;
-    fd_set writefds;
-    int maxfd;
+    int epfd;                       // epoll instance watching all fds
+    unsigned char *fdwatch;         // read/write events watched per fd
+    size_t fdwatch_size;
+    struct epoll_event *events;     // ready events returned by epoll_wait()
+    unsigned int ntunnels;          // open proxy tunnels
+    time_t sweep_time;              // last check for idle tunnels and slow clients
+    unsigned long sse_lastid;       // id of last published event
+    int tlsfd;                      // tls_port listening socket, -1 if none
+    LKBuffer *scratch;              // first read of clients without request state
+    LKTrafficStats stats;           // all hosts, request stats are known before the host
 } LKHttpServer;
 
 typedef enum {
@@ -193,6 +538,7 @@ int lk_open_connect_socket(char *host, char *port, struct sockaddr *psa);
 void lk_set_sock_timeout(int sock, int nsecs, int ms);
 void lk_set_sock_nonblocking(int sock);
 LKString *lk_get_ipaddr_string(struct sockaddr *sa);
+LKString *lk_get_ipaddr_arena_string(LKArena *arena, struct sockaddr *sa);
 unsigned short lk_get_sockaddr_port(struct sockaddr *sa);
 int nonblocking_error(int z);
 
@@ -255,16 +601,40 @@ int lk_write_all_sock(int fd, LKBuffer *buf);
 int lk_write_all_file(int fd, LKBuffer *buf);
 
 // Similar to lk_write_all(), but sending buflist buf's sequentially.
+// Remaining bufs are gathered into a single writev().
 int lk_buflist_write_all(int fd, FDType fd_type, LKRefList *buflist);
 
+// Read all available nonblocking fd bytes to the end of buffer chain.
+// Returns Z_EOF, Z_ERR or Z_BLOCK same as lk_read_all().
+int lk_bufchain_read_all(int fd, FDType fd_type, LKBufChain *bc);
+
+// Write buffer chain bytes to nonblocking fd, consuming bytes written.
+// Returns Z_EOF when all bytes sent, Z_ERR or Z_BLOCK.
+int lk_bufchain_write_all(int fd, FDType fd_type, LKBufChain *bc);
+
 // Pipe all available nonblocking readfd bytes into writefd.
-// Uses buf as buffer for queued up bytes waiting to be written.
+// Uses bc as buffer for queued up bytes waiting to be written.
 // Returns one of the following:
 //    0 (Z_EOF) for read/write complete.
 //    1 (Z_OPEN) for writefd socket open
 //   -1 (Z_ERR) for read/write error.
 //   -2 (Z_BLOCK) for blocked readfd/writefd socket
-int lk_pipe_all(int readfd, int writefd, FDType fd_type, LKBuffer *buf);
+int lk_pipe_all(int readfd, int writefd, FDType fd_type, LKBufChain *bc);
+
+// Send *count bytes of filefd starting at *offset to nonblocking socket fd.
+// *offset and *count are updated with the bytes sent.
+// Returns one of the following:
+//    0 (Z_EOF) for all bytes sent.
+//   -1 (Z_ERR) for error
+//   -2 (Z_BLOCK) for blocked socket
+int lk_sendfile_all(int fd, int filefd, off_t *offset, size_t *count);
+
+// Splice all available nonblocking sp->readfd bytes into sp->writefd.
+// Returns one of the following:
+//    0 (Z_EOF) for readfd EOF and all bytes written.
+//   -1 (Z_ERR) for read/write error.
+//   -2 (Z_BLOCK) for blocked readfd/writefd socket
+int lk_splice_all(LKSplicePipe *sp);
 
 // Remove trailing CRLF or LF (\n) from string.
 void lk_chomp(char* s);
@@ -277,6 +647,15 @@ ssize_t lk_readfd(int fd, LKBuffer *buf);
 char *lk_astrncat(char *dest, char *src, size_t src_len);
 // Return whether file exists.
 int lk_file_exists(char *filename);
+// Open path beneath directory dirfd, no escaping it through "..",
+// absolute paths or symlinks. Return fd or -1 for error.
+int lk_open_beneath(int dirfd, char *path, int flags);
+// Same, but fails on any ".." segment or symlink, for kernels without openat2().
+int lk_open_beneath_nofollow(int dirfd, char *path, int flags);
+// Decode %XX escapes in place. Return new length or -1 if invalid.
+ssize_t lk_percent_decode(char *s, size_t len);
+// Normalize "/./", "/../", "//" and trailing "/" in place. Return new length.
+size_t lk_normalize_path(char *s, size_t len);
 
 #endif
 
@@ -0,0 +1,74 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include "lklib.h"
+
+// Freelist of recycled objects of one kind.
+// Up to max_items objects are kept, more are freed when put back.
+// low_len tracks the fewest items held since the last trim, those
+// objects weren't needed in that time and lk_pool_trim() frees them.
+
+LKPool *lk_pool_new(size_t max_items, void (*free_item)(void *)) {
+    LKPool *pool = lk_malloc(sizeof(LKPool), "lk_pool_new");
+    pool->items = lk_malloc(max_items * sizeof(void*), "lk_pool_new_items");
+    pool->items_len = 0;
+    pool->max_items = max_items;
+    pool->low_len = 0;
+    pool->free_item = free_item;
+    return pool;
+}
+
+void lk_pool_free(LKPool *pool) {
+    lk_pool_clear(pool);
+    lk_free(pool->items);
+    pool->items = NULL;
+    lk_free(pool);
+}
+
+// Return recycled object, or NULL if none.
+void *lk_pool_get(LKPool *pool) {
+    if (pool->items_len == 0) {
+        return NULL;
+    }
+    pool->items_len--;
+    if (pool->items_len < pool->low_len) {
+        pool->low_len = pool->items_len;
+    }
+    return pool->items[pool->items_len];
+}
+
+// Keep p for reuse. Returns 0 if pool is full and p was freed.
+int lk_pool_put(LKPool *pool, void *p) {
+    if (pool->items_len == pool->max_items) {
+        pool->free_item(p);
+        return 0;
+    }
+    pool->items[pool->items_len] = p;
+    pool->items_len++;
+    return 1;
+}
+
+// Free objects that weren't needed since the last trim.
+void lk_pool_trim(LKPool *pool) {
+    size_t nfree = pool->low_len;
+    for (size_t i=0; i < nfree; i++) {
+        pool->free_item(pool->items[i]);
+    }
+    memmove(pool->items, pool->items+nfree, (pool->items_len-nfree) * sizeof(void*));
+    pool->items_len -= nfree;
+    pool->low_len = pool->items_len;
+}
+
+// Free all pooled objects.
+void lk_pool_clear(LKPool *pool) {
+    for (size_t i=0; i < pool->items_len; i++) {
+        pool->free_item(pool->items[i]);
+    }
+    pool->items_len = 0;
+    pool->low_len = 0;
+}
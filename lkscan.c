@@ -0,0 +1,120 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lklib.h"
+
+// Delimiter scanning kernels.
+// scan2 finds the first byte equal to a or b. The SIMD versions compare
+// 16 (SSE2) or 32 (AVX2) bytes at a time and finish the tail with scalar
+// code, so no bytes past len are read.
+
+typedef char *(*Scan2Func)(char *p, size_t len, char a, char b);
+
+static char *scan2_scalar(char *p, size_t len, char a, char b) {
+    for (size_t i=0; i < len; i++) {
+        if (p[i] == a || p[i] == b) {
+            return p+i;
+        }
+    }
+    return NULL;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LK_SCAN_X86
+
+__attribute__((target("sse2")))
+static char *scan2_sse2(char *p, size_t len, char a, char b) {
+    __m128i va = _mm_set1_epi8(a);
+    __m128i vb = _mm_set1_epi8(b);
+    size_t i = 0;
+    for (; i+16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((__m128i *) (p+i));
+        __m128i eq = _mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb));
+        unsigned int mask = _mm_movemask_epi8(eq);
+        if (mask != 0) {
+            return p + i + __builtin_ctz(mask);
+        }
+    }
+    return scan2_scalar(p+i, len-i, a, b);
+}
+
+__attribute__((target("avx2")))
+static char *scan2_avx2(char *p, size_t len, char a, char b) {
+    __m256i va = _mm256_set1_epi8(a);
+    __m256i vb = _mm256_set1_epi8(b);
+    size_t i = 0;
+    for (; i+32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((__m256i *) (p+i));
+        __m256i eq = _mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb));
+        unsigned int mask = _mm256_movemask_epi8(eq);
+        if (mask != 0) {
+            return p + i + __builtin_ctz(mask);
+        }
+    }
+    return scan2_sse2(p+i, len-i, a, b);
+}
+#endif
+
+static char *scan2_init(char *p, size_t len, char a, char b);
+static Scan2Func scan2_impl = scan2_init;
+static char *scan_impl_name = "scalar";
+
+// Select fastest kernel supported by the cpu on first use.
+static char *scan2_init(char *p, size_t len, char a, char b) {
+    if (lk_scan_set_impl("avx2") == -1 && lk_scan_set_impl("sse2") == -1) {
+        lk_scan_set_impl("scalar");
+    }
+    return scan2_impl(p, len, a, b);
+}
+
+// Use scanning kernel "avx2", "sse2" or "scalar".
+// Returns 0 for success, -1 if not supported by the cpu.
+int lk_scan_set_impl(char *name) {
+    if (!strcmp(name, "scalar")) {
+        scan2_impl = scan2_scalar;
+        scan_impl_name = "scalar";
+        return 0;
+    }
+#ifdef LK_SCAN_X86
+    __builtin_cpu_init();
+    if (!strcmp(name, "sse2") && __builtin_cpu_supports("sse2")) {
+        scan2_impl = scan2_sse2;
+        scan_impl_name = "sse2";
+        return 0;
+    }
+    if (!strcmp(name, "avx2") && __builtin_cpu_supports("avx2")) {
+        scan2_impl = scan2_avx2;
+        scan_impl_name = "avx2";
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+// Return name of scanning kernel in use.
+char *lk_scan_impl() {
+    if (scan2_impl == scan2_init) {
+        scan2_init("", 0, 0, 0);
+    }
+    return scan_impl_name;
+}
+
+char *lk_scan2(char *p, size_t len, char a, char b) {
+    return scan2_impl(p, len, a, b);
+}
+
+char *lk_scan_char(char *p, size_t len, char c) {
+    return scan2_impl(p, len, c, c);
+}
+
+// Find CR or LF.
+char *lk_scan_eol(char *p, size_t len) {
+    return scan2_impl(p, len, '\r', '\n');
+}
+
+// Find space or tab.
+char *lk_scan_ws(char *p, size_t len) {
+    return scan2_impl(p, len, ' ', '\t');
+}
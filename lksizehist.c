@@ -0,0 +1,59 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "lklib.h"
+
+// Size histogram with power of 2 buckets.
+// Percentiles are rounded up to the bucket's upper bound, which is the
+// buffer size to allocate for them.
+
+void lk_sizehist_init(LKSizeHist *h) {
+    memset(h, 0, sizeof(LKSizeHist));
+}
+
+static int bucket_of(size_t size) {
+    if (size <= 1) {
+        return 0;
+    }
+    int i = 64 - __builtin_clzl(size-1);
+    if (i >= LK_SIZEHIST_NBUCKETS) {
+        i = LK_SIZEHIST_NBUCKETS-1;
+    }
+    return i;
+}
+
+void lk_sizehist_add(LKSizeHist *h, size_t size) {
+    if (h->total >= LK_SIZEHIST_WINDOW) {
+        h->total = 0;
+        for (int i=0; i < LK_SIZEHIST_NBUCKETS; i++) {
+            h->counts[i] /= 2;
+            h->total += h->counts[i];
+        }
+    }
+    h->counts[bucket_of(size)]++;
+    h->total++;
+    h->nsamples++;
+}
+
+// Return size that pct percent of recent samples don't exceed, rounded
+// up to a power of 2. Returns 0 if there are no samples.
+size_t lk_sizehist_percentile(LKSizeHist *h, unsigned int pct) {
+    assert(pct <= 100);
+    if (h->total == 0) {
+        return 0;
+    }
+    unsigned long target = (h->total * pct + 99) / 100;
+    if (target == 0) {
+        target = 1;
+    }
+    unsigned long n = 0;
+    for (int i=0; i < LK_SIZEHIST_NBUCKETS; i++) {
+        n += h->counts[i];
+        if (n >= target) {
+            return (size_t) 1 << i;
+        }
+    }
+    return (size_t) 1 << (LK_SIZEHIST_NBUCKETS-1);
+}
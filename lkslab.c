@@ -0,0 +1,294 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include "lklib.h"
+
+// Pages come straight from libc, even in a DEBUGALLOC build.
+#undef malloc
+#undef realloc
+#undef free
+
+// Size class slab allocator.
+// Objects up to LK_SLAB_MAX_SIZE are carved out of LK_SLAB_PAGE_SIZE
+// pages into fixed size slots of the smallest class that fits, larger
+// requests go to libc. Every object has a header with its class and
+// requested size, so lk_slab_free() and lk_slab_realloc() don't need
+// the size passed in.
+//
+// Free slots are kept in a per-thread cache for each class, moved to and
+// from the class's shared freelist in batches under the class lock.
+// A thread's cached slots go back to the classes when it exits.
+// Pages are never returned to libc, a class's memory use is its high
+// water mark.
+//
+// Build with -DSLABALLOC to use this behind lk_malloc()/lk_free().
+
+#define LK_SLAB_PAGE_SIZE 65536
+#define LK_SLAB_BATCH 32                // slots moved between cache and class
+#define LK_SLAB_CACHE_MAX 128           // cached slots before flushing a batch
+#define LK_SLAB_LARGE 0xffffffff        // class id of objects from libc
+
+typedef struct {
+    uint32_t class_id;
+    uint32_t unused;
+    size_t size;                        // requested size
+} SlabHeader;
+
+typedef struct slabslot_s {
+    struct slabslot_s *next;
+} SlabSlot;
+
+typedef struct {
+    size_t size;                        // object size, header not included
+    pthread_mutex_t lock;
+    SlabSlot *free;                     // shared freelist
+    size_t nfree;
+    size_t npages;
+    unsigned long nallocs;              // updated atomically
+    unsigned long nfrees;
+} SlabClass;
+
+typedef struct {
+    SlabSlot *free;
+    size_t nfree;
+} SlabCache;
+
+// Classes are matched to the sizes of common objects:
+// 16  LKStringTableItem, small strings
+// 32  LKBuffer, LKRefList, LKBufSlice arrays
+// 64  LKString
+// 1024 LKBuffer bytes from the buffer pool
+static SlabClass classes[] = {
+    {16}, {32}, {48}, {64}, {96}, {128}, {192}, {256},
+    {384}, {512}, {768}, {1024}, {1536}, {2048}, {3072}, {4096},
+};
+#define N_CLASSES (sizeof(classes) / sizeof(classes[0]))
+
+// Class index of every size rounded up to 16, built once.
+static unsigned char class_of[LK_SLAB_MAX_SIZE/16 + 1];
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static __thread SlabCache caches[N_CLASSES];
+static __thread int caches_registered;
+static pthread_key_t caches_key;       // flushes caches at thread exit
+
+static void flush_caches(void *arg);
+
+static void init_classes() {
+    size_t ci = 0;
+    for (size_t i=0; i < sizeof(class_of); i++) {
+        while (classes[ci].size < i*16) {
+            ci++;
+        }
+        class_of[i] = ci;
+    }
+    for (ci=0; ci < N_CLASSES; ci++) {
+        pthread_mutex_init(&classes[ci].lock, NULL);
+    }
+    pthread_key_create(&caches_key, flush_caches);
+}
+
+// Have the thread's caches flushed when it exits.
+// Key destructors only run for non-NULL values.
+static void register_caches() {
+    if (!caches_registered) {
+        pthread_setspecific(caches_key, caches);
+        caches_registered = 1;
+    }
+}
+
+static size_t slot_size(SlabClass *c) {
+    return sizeof(SlabHeader) + c->size;
+}
+
+// Add a new page of slots to the shared freelist. Call with lock held.
+static int add_page(SlabClass *c) {
+    char *page = malloc(LK_SLAB_PAGE_SIZE);
+    if (page == NULL) {
+        return -1;
+    }
+    size_t n = LK_SLAB_PAGE_SIZE / slot_size(c);
+    for (size_t i=0; i < n; i++) {
+        SlabSlot *slot = (SlabSlot *) (page + i*slot_size(c));
+        slot->next = c->free;
+        c->free = slot;
+    }
+    c->nfree += n;
+    c->npages++;
+    return 0;
+}
+
+// Move a batch of slots from the class to the thread cache.
+static void refill_cache(SlabClass *c, SlabCache *cache) {
+    pthread_mutex_lock(&c->lock);
+    if (c->free == NULL) {
+        add_page(c);
+    }
+    for (int i=0; i < LK_SLAB_BATCH && c->free != NULL; i++) {
+        SlabSlot *slot = c->free;
+        c->free = slot->next;
+        c->nfree--;
+        slot->next = cache->free;
+        cache->free = slot;
+        cache->nfree++;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+// Move a batch of slots from the thread cache back to the class.
+static void flush_cache(SlabClass *c, SlabCache *cache) {
+    pthread_mutex_lock(&c->lock);
+    for (int i=0; i < LK_SLAB_BATCH && cache->free != NULL; i++) {
+        SlabSlot *slot = cache->free;
+        cache->free = slot->next;
+        cache->nfree--;
+        slot->next = c->free;
+        c->free = slot;
+        c->nfree++;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+// Thread exit destructor, return all cached slots to their classes.
+static void flush_caches(void *arg) {
+    SlabCache *thread_caches = arg;
+    for (size_t ci=0; ci < N_CLASSES; ci++) {
+        while (thread_caches[ci].free != NULL) {
+            flush_cache(&classes[ci], &thread_caches[ci]);
+        }
+    }
+    // Objects freed by later destructors register the caches again.
+    caches_registered = 0;
+}
+
+void *lk_slab_alloc(size_t size) {
+    pthread_once(&init_once, init_classes);
+
+    if (size > LK_SLAB_MAX_SIZE) {
+        SlabHeader *h = malloc(sizeof(SlabHeader) + size);
+        if (h == NULL) {
+            return NULL;
+        }
+        h->class_id = LK_SLAB_LARGE;
+        h->size = size;
+        return h+1;
+    }
+
+    size_t ci = class_of[(size+15)/16];
+    SlabClass *c = &classes[ci];
+    SlabCache *cache = &caches[ci];
+    if (cache->free == NULL) {
+        register_caches();
+        refill_cache(c, cache);
+        if (cache->free == NULL) {
+            return NULL;
+        }
+    }
+    SlabSlot *slot = cache->free;
+    cache->free = slot->next;
+    cache->nfree--;
+    __atomic_add_fetch(&c->nallocs, 1, __ATOMIC_RELAXED);
+
+    SlabHeader *h = (SlabHeader *) slot;
+    h->class_id = ci;
+    h->size = size;
+    return h+1;
+}
+
+void lk_slab_free(void *p) {
+    if (p == NULL) {
+        return;
+    }
+    SlabHeader *h = (SlabHeader *) p - 1;
+    if (h->class_id == LK_SLAB_LARGE) {
+        free(h);
+        return;
+    }
+    assert(h->class_id < N_CLASSES);
+
+    SlabClass *c = &classes[h->class_id];
+    SlabCache *cache = &caches[h->class_id];
+    SlabSlot *slot = (SlabSlot *) h;
+    if (cache->free == NULL) {
+        register_caches();
+    }
+    slot->next = cache->free;
+    cache->free = slot;
+    cache->nfree++;
+    __atomic_add_fetch(&c->nfrees, 1, __ATOMIC_RELAXED);
+
+    if (cache->nfree > LK_SLAB_CACHE_MAX) {
+        flush_cache(c, cache);
+    }
+}
+
+// Objects that still fit their slot are resized in place.
+void *lk_slab_realloc(void *p, size_t size) {
+    if (p == NULL) {
+        return lk_slab_alloc(size);
+    }
+    SlabHeader *h = (SlabHeader *) p - 1;
+    if (h->class_id != LK_SLAB_LARGE && size <= classes[h->class_id].size) {
+        h->size = size;
+        return p;
+    }
+    if (h->class_id == LK_SLAB_LARGE && size > LK_SLAB_MAX_SIZE) {
+        SlabHeader *newh = realloc(h, sizeof(SlabHeader) + size);
+        if (newh == NULL) {
+            return NULL;
+        }
+        newh->size = size;
+        return newh+1;
+    }
+
+    void *newp = lk_slab_alloc(size);
+    if (newp == NULL) {
+        return NULL;
+    }
+    memcpy(newp, p, h->size < size ? h->size : size);
+    lk_slab_free(p);
+    return newp;
+}
+
+// Return number of size classes, for iterating lk_slab_stats().
+int lk_slab_nclasses() {
+    return N_CLASSES;
+}
+
+// Get statistics of size class ci.
+// nfree counts the shared freelist and the calling thread's cache only,
+// slots held in other running threads' caches count as in use. Caches
+// of exited threads are flushed back to the class.
+void lk_slab_stats(int ci, LKSlabStats *st) {
+    assert(ci >= 0 && ci < N_CLASSES);
+    pthread_once(&init_once, init_classes);
+
+    SlabClass *c = &classes[ci];
+    pthread_mutex_lock(&c->lock);
+    st->size = c->size;
+    st->npages = c->npages;
+    st->nslots = c->npages * (LK_SLAB_PAGE_SIZE / slot_size(c));
+    st->nfree = c->nfree + caches[ci].nfree;
+    pthread_mutex_unlock(&c->lock);
+    st->nallocs = __atomic_load_n(&c->nallocs, __ATOMIC_RELAXED);
+    st->nfrees = __atomic_load_n(&c->nfrees, __ATOMIC_RELAXED);
+}
+
+void lk_slab_print_stats() {
+    printf("size  pages  slots   free   allocs   frees\n");
+    for (int ci=0; ci < N_CLASSES; ci++) {
+        LKSlabStats st;
+        lk_slab_stats(ci, &st);
+        if (st.npages == 0) {
+            continue;
+        }
+        printf("%4zu %6zu %6zu %6zu %8lu %7lu\n",
+               st.size, st.npages, st.nslots, st.nfree, st.nallocs, st.nfrees);
+    }
+}
@@ -9,13 +9,34 @@
 #include <ctype.h>
 #include "lklib.h"
 
-// Zero out entire size
-void zero_s(LKString *lks) {
-    memset(lks->s, 0, lks->s_size+1);
-}
-// Zero out the free unused space
-void zero_unused_s(LKString *lks) {
-    memset(lks->s + lks->s_len, '\0', lks->s_size+1 - lks->s_len);
+// Strings shorter than LK_STRING_INLINE_SIZE are kept in lks->sbuf,
+// so a short string is a single allocation. lks->s points to sbuf or to
+// a heap buffer and is always null terminated at s_len.
+//
+// Strings created with lk_string_arena_new() allocate the struct and any
+// growth from the arena. lk_string_free() leaves them to the arena.
+
+// Grow capacity to at least size chars, not counting null terminator.
+static void grow_s(LKString *lks, size_t size, char *label) {
+    if (size <= lks->s_size) {
+        return;
+    }
+    // Grow by ^2 so that repeated appends are amortized O(1).
+    if (size < lks->s_size*2) {
+        size = lks->s_size*2;
+    }
+    if (lks->arena != NULL) {
+        char *s = lk_arena_alloc(lks->arena, size+1);
+        memcpy(s, lks->s, lks->s_len+1);
+        lks->s = s;
+    } else if (lks->s == lks->sbuf) {
+        char *s = lk_malloc(size+1, label);
+        memcpy(s, lks->s, lks->s_len+1);
+        lks->s = s;
+    } else {
+        lks->s = lk_realloc(lks->s, size+1, label);
+    }
+    lks->s_size = size;
 }
 
 LKString *lk_string_new(char *s) {
@@ -24,30 +45,54 @@ LKString *lk_string_new(char *s) {
     }
     size_t s_len = strlen(s);
 
-    LKString *lks = lk_malloc(sizeof(LKString), "lk_string_new");
+    LKString *lks = lk_string_size_new(s_len);
+    memcpy(lks->s, s, s_len+1);
     lks->s_len = s_len;
-    lks->s_size = s_len;
-    lks->s = lk_malloc(lks->s_size+1, "lk_string_new_s");
-    zero_s(lks);
-    strncpy(lks->s, s, s_len);
-
     return lks;
 }
 LKString *lk_string_size_new(size_t size) {
-    LKString *lks = lk_malloc(sizeof(LKString), "lk_string_size_new");
+    LKString *lks = lk_malloc(sizeof(LKString), "lk_string_new");
 
+    lks->arena = NULL;
     lks->s_len = 0;
-    lks->s_size = size;
-    lks->s = lk_malloc(lks->s_size+1, "lk_string_size_new_s");
-    zero_s(lks);
+    if (size < LK_STRING_INLINE_SIZE) {
+        lks->s_size = LK_STRING_INLINE_SIZE-1;
+        lks->s = lks->sbuf;
+    } else {
+        lks->s_size = size;
+        lks->s = lk_malloc(lks->s_size+1, "lk_string_new_s");
+    }
+    lks->s[0] = '\0';
 
     return lks;
 }
+LKString *lk_string_arena_new(LKArena *arena, char *s) {
+    if (s == NULL) {
+        s = "";
+    }
+    size_t s_len = strlen(s);
+
+    LKString *lks = lk_arena_alloc(arena, sizeof(LKString));
+    lks->arena = arena;
+    lks->s_len = 0;
+    lks->s_size = LK_STRING_INLINE_SIZE-1;
+    lks->s = lks->sbuf;
+    lks->s[0] = '\0';
+
+    grow_s(lks, s_len, "lk_string_arena_new");
+    memcpy(lks->s, s, s_len+1);
+    lks->s_len = s_len;
+    return lks;
+}
 void lk_string_free(LKString *lks) {
     assert(lks->s != NULL);
+    if (lks->arena != NULL) {
+        return;
+    }
 
-    zero_s(lks);
-    lk_free(lks->s);
+    if (lks->s != lks->sbuf) {
+        lk_free(lks->s);
+    }
     lks->s = NULL;
     lk_free(lks);
 }
@@ -56,14 +101,15 @@ void lk_string_voidp_free(void *plkstr) {
 }
 
 void lk_string_assign(LKString *lks, char *s) {
-    size_t s_len = strlen(s);
-    if (s_len > lks->s_size) {
-        lks->s_size = s_len;
-        lks->s = lk_realloc(lks->s, lks->s_size+1, "lk_string_assign");
-    }
-    zero_s(lks);
-    strncpy(lks->s, s, s_len);
-    lks->s_len = s_len;
+    lk_string_assign_buf(lks, s, strlen(s));
+}
+
+// Assign len bytes of buf, which doesn't need to be null terminated.
+void lk_string_assign_buf(LKString *lks, char *buf, size_t len) {
+    grow_s(lks, len, "lk_string_assign");
+    memmove(lks->s, buf, len);
+    lks->s_len = len;
+    lks->s[len] = '\0';
 }
 
 void lk_string_assign_sprintf(LKString *lks, char *fmt, ...) {
@@ -115,7 +161,7 @@ void lk_string_append_sprintf(LKString *lks, char *fmt, ...) {
         va_end(args);
         if (z == -1) return;
 
-        lk_string_assign(lks, ps);
+        lk_string_append(lks, ps);
         free(ps);
         return;
     }
@@ -124,25 +170,19 @@ void lk_string_append_sprintf(LKString *lks, char *fmt, ...) {
 }
 
 void lk_string_append(LKString *lks, char *s) {
-    size_t s_len = strlen(s);
-    if (lks->s_len + s_len > lks->s_size) {
-        lks->s_size = lks->s_len + s_len;
-        lks->s = lk_realloc(lks->s, lks->s_size+1, "lk_string_append");
-        zero_unused_s(lks);
-    }
+    lk_string_append_buf(lks, s, strlen(s));
+}
 
-    strncpy(lks->s + lks->s_len, s, s_len);
-    lks->s_len = lks->s_len + s_len;
+// Append len bytes of buf, which doesn't need to be null terminated.
+void lk_string_append_buf(LKString *lks, char *buf, size_t len) {
+    grow_s(lks, lks->s_len + len, "lk_string_append");
+    memcpy(lks->s + lks->s_len, buf, len);
+    lks->s_len = lks->s_len + len;
+    lks->s[lks->s_len] = '\0';
 }
 
 void lk_string_append_char(LKString *lks, char c) {
-    if (lks->s_len + 1 > lks->s_size) {
-        // Grow string by ^2
-        lks->s_size = lks->s_len + ((lks->s_len+1) * 2);
-        lks->s = lk_realloc(lks->s, lks->s_size+1, "lk_string_append_char");
-        zero_unused_s(lks);
-    }
-
+    grow_s(lks, lks->s_len + 1, "lk_string_append_char");
     lks->s[lks->s_len] = c;
     lks->s[lks->s_len+1] = '\0';
     lks->s_len++;
@@ -150,14 +190,10 @@ void lk_string_append_char(LKString *lks, char c) {
 
 void lk_string_prepend(LKString *lks, char *s) {
     size_t s_len = strlen(s);
-    if (lks->s_len + s_len > lks->s_size) {
-        lks->s_size = lks->s_len + s_len;
-        lks->s = lk_realloc(lks->s, lks->s_size+1, "lk_string_prepend");
-        zero_unused_s(lks);
-    }
+    grow_s(lks, lks->s_len + s_len, "lk_string_prepend");
 
-    memmove(lks->s + s_len, lks->s, lks->s_len); // shift string to right
-    strncpy(lks->s, s, s_len);                   // prepend s to string
+    memmove(lks->s + s_len, lks->s, lks->s_len+1); // shift string to right
+    memcpy(lks->s, s, s_len);                      // prepend s to string
     lks->s_len = lks->s_len + s_len;
 }
 
@@ -170,7 +206,7 @@ int lk_string_sz_equal(LKString *lks1, char *s2) {
 }
 
 int lk_string_equal(LKString *lks1, LKString *lks2) {
-    return lk_string_sz_equal(lks1, lks2->s);
+    return lks1->s_len == lks2->s_len && !memcmp(lks1->s, lks2->s, lks1->s_len);
 }
 
 // Return if string starts with s.
@@ -264,45 +300,43 @@ void lk_string_chop_end(LKString *lks, char *s) {
     lks->s_len = new_len;
 }
 
-// Return whether delim matches the first delim_len chars of s.
-int match_delim(char *s, char *delim, size_t delim_len) {
-    return !strncmp(s, delim, delim_len);
-}
-
 LKStringList *lk_string_split(LKString *lks, char *delim) {
     LKStringList *sl = lk_stringlist_new();
-    size_t delim_len = strlen(delim);
-
-    LKString *segment = lk_string_new("");
-    for (int i=0; i < lks->s_len; i++) {
-        if (match_delim(lks->s + i, delim, delim_len)) {
-            lk_stringlist_append_lkstring(sl, segment);
-            segment = lk_string_new("");
-            i += delim_len-1; // need to -1 to account for for loop incrementor i++
-            continue;
-        }
-
-        lk_string_append_char(segment, lks->s[i]);
+    LKSplitIter it;
+    LKStrView seg;
+    lk_split_init(&it, lk_sv_lkstring(lks), delim);
+    while (lk_split_next(&it, &seg)) {
+        LKString *segment = lk_string_size_new(seg.len);
+        lk_string_assign_buf(segment, seg.p, seg.len);
+        lk_stringlist_append_lkstring(sl, segment);
     }
-    lk_stringlist_append_lkstring(sl, segment);
-
     return sl;
 }
 
 // Given a "k<delim>v" string, assign k and v.
+// v is the second segment, text after a second delim is dropped.
 void lk_string_split_assign(LKString *s, char *delim, LKString *k, LKString *v) {
-    LKStringList *ss = lk_string_split(s, delim);
+    // Segments point into s, so split a copy if s is also k or v.
+    if (k == s || v == s) {
+        LKString *tmp = lk_string_new(s->s);
+        lk_string_split_assign(tmp, delim, k, v);
+        lk_string_free(tmp);
+        return;
+    }
+
+    LKSplitIter it;
+    LKStrView ks, vs;
+    lk_split_init(&it, lk_sv_lkstring(s), delim);
+    lk_split_next(&it, &ks);
+    if (!lk_split_next(&it, &vs)) {
+        vs = lk_sv("");
+    }
     if (k != NULL) {
-        lk_string_assign(k, ss->items[0]->s);
+        lk_string_assign_buf(k, ks.p, ks.len);
     }
     if (v != NULL) {
-        if (ss->items_len >= 2) {
-            lk_string_assign(v, ss->items[1]->s);
-        } else {
-            lk_string_assign(v, "");
-        }
+        lk_string_assign_buf(v, vs.p, vs.len);
     }
-    lk_stringlist_free(ss);
 }
 
 void sz_string_split_assign(char *s, char *delim, LKString *k, LKString *v) {
@@ -10,7 +10,7 @@
 
 LKStringTable *lk_stringtable_new() {
     LKStringTable *st = lk_malloc(sizeof(LKStringTable), "lk_stringtable_new");
-    st->items_size = 1; // start with room for n items
+    st->items_size = 4; // start with room for n items
     st->items_len = 0;
 
     st->items = lk_malloc(st->items_size * sizeof(LKStringTableItem), "lk_stringtable_new_items");
@@ -45,7 +45,8 @@ void lk_stringtable_set(LKStringTable *st, char *ks, char *v) {
 
     // If reached capacity, expand the array and add new item.
     if (st->items_len == st->items_size) {
-        st->items_size += 10;
+        // Grow by ^2 so that repeated sets are amortized O(1).
+        st->items_size *= 2;
         st->items = lk_realloc(st->items, st->items_size * sizeof(LKStringTableItem), "lk_stringtable_set");
         memset(st->items + st->items_len, 0,
                (st->items_size - st->items_len) * sizeof(LKStringTableItem));
@@ -0,0 +1,138 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "lklib.h"
+
+// String views and split iterator.
+// Views point into an existing string or buffer, nothing is allocated
+// or copied. The text isn't null terminated, use sv.len.
+
+LKStrView lk_sv(char *s) {
+    LKStrView sv = {s, strlen(s)};
+    return sv;
+}
+
+LKStrView lk_sv_buf(char *p, size_t len) {
+    LKStrView sv = {p, len};
+    return sv;
+}
+
+LKStrView lk_sv_lkstring(LKString *lks) {
+    LKStrView sv = {lks->s, lks->s_len};
+    return sv;
+}
+
+// Return view without leading and trailing whitespace.
+LKStrView lk_sv_trim(LKStrView sv) {
+    while (sv.len > 0 && isspace((unsigned char) sv.p[0])) {
+        sv.p++;
+        sv.len--;
+    }
+    while (sv.len > 0 && isspace((unsigned char) sv.p[sv.len-1])) {
+        sv.len--;
+    }
+    return sv;
+}
+
+int lk_sv_equal(LKStrView sv, char *s) {
+    size_t s_len = strlen(s);
+    return s_len == sv.len && !memcmp(sv.p, s, s_len);
+}
+
+// Compare like strcmp(), a shorter view sorts before a longer view it
+// is a prefix of.
+int lk_sv_compare(LKStrView sv1, LKStrView sv2) {
+    size_t len = sv1.len < sv2.len ? sv1.len : sv2.len;
+    int z = memcmp(sv1.p, sv2.p, len);
+    if (z != 0) {
+        return z;
+    }
+    if (sv1.len < sv2.len) {
+        return -1;
+    }
+    if (sv1.len > sv2.len) {
+        return 1;
+    }
+    return 0;
+}
+
+int lk_sv_starts_with(LKStrView sv, char *s) {
+    size_t s_len = strlen(s);
+    return s_len <= sv.len && !memcmp(sv.p, s, s_len);
+}
+
+int lk_sv_ends_with(LKStrView sv, char *s) {
+    size_t s_len = strlen(s);
+    return s_len <= sv.len && !memcmp(sv.p + sv.len - s_len, s, s_len);
+}
+
+static char *find_delim(char *p, size_t len, char *delim, size_t delim_len) {
+    if (delim_len == 1) {
+        return lk_scan_char(p, len, delim[0]);
+    }
+    return memmem(p, len, delim, delim_len);
+}
+
+// Split "k<delim>v" at the first delim.
+// Returns 1 if delim found, else 0 with k set to sv and v empty.
+int lk_sv_split2(LKStrView sv, char *delim, LKStrView *k, LKStrView *v) {
+    size_t delim_len = strlen(delim);
+    char *pdelim = NULL;
+    if (delim_len > 0) {
+        pdelim = find_delim(sv.p, sv.len, delim, delim_len);
+    }
+    if (pdelim == NULL) {
+        *k = sv;
+        *v = lk_sv_buf(sv.p + sv.len, 0);
+        return 0;
+    }
+    *k = lk_sv_buf(sv.p, pdelim - sv.p);
+    *v = lk_sv_buf(pdelim + delim_len, sv.p + sv.len - pdelim - delim_len);
+    return 1;
+}
+
+// An empty delim returns sv as a single segment.
+void lk_split_init(LKSplitIter *it, LKStrView sv, char *delim) {
+    it->rest = sv;
+    it->delim = delim;
+    it->delim_len = strlen(delim);
+    it->done = 0;
+}
+
+// Get next segment. Adjacent delims give empty segments, same as
+// lk_string_split().
+// Returns 1 if seg set, 0 if no more segments.
+int lk_split_next(LKSplitIter *it, LKStrView *seg) {
+    if (it->done) {
+        return 0;
+    }
+    char *pdelim = NULL;
+    if (it->delim_len > 0) {
+        pdelim = find_delim(it->rest.p, it->rest.len, it->delim, it->delim_len);
+    }
+    if (pdelim == NULL) {
+        *seg = it->rest;
+        it->rest.p += it->rest.len;
+        it->rest.len = 0;
+        it->done = 1;
+        return 1;
+    }
+    *seg = lk_sv_buf(it->rest.p, pdelim - it->rest.p);
+    size_t skip = seg->len + it->delim_len;
+    it->rest.p += skip;
+    it->rest.len -= skip;
+    return 1;
+}
+
+// Get next non-empty segment.
+// Returns 1 if seg set, 0 if no more segments.
+int lk_split_next_token(LKSplitIter *it, LKStrView *seg) {
+    while (lk_split_next(it, seg)) {
+        if (seg->len > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -1,29 +1,107 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include "lklib.h"
 #include "lknet.h"
+#ifdef LKTLS
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#endif
+
+int parse_ranges(char *range, off_t size, off_t *starts, off_t *ends, int max_ranges);
+int parse_uri(LKString *lks_uri, LKString *lks_path, LKString *lks_filename, LKString *lks_qs);
+void serve_sse(LKHttpServer *server, LKContext *ctx, LKHostConfig *hc);
+LKRefBuffer *encode_sse_event(unsigned long id, LKString *event, LKBuffer *data);
+void read_sse(LKHttpServer *server, LKContext *ctx);
+void write_sse(LKHttpServer *server, LKContext *ctx);
+void terminate_client_session(LKHttpServer *server, LKContext *ctx);
+void read_first_bytes(LKHttpServer *server, LKContext *ctx);
+int is_file_request(LKHttpServer *server, LKHttpRequest *req);
+int serve_path_file(LKHttpRequest *req, LKHttpResponse *resp, int fd, struct stat *st);
+int etag_list_match(char *etags, char *etag);
+int if_range_match(char *if_range, char *etag, time_t mtime);
 
 void lkstring_test();
+void lkarena_test();
+void lkstrview_test();
 void lkstringmap_test();
+void lkheadertable_test();
 void lkbuffer_test();
+void lkbufchain_test();
 void lkstringlist_test();
 void lkreflist_test();
+void lkpool_test();
+void lksizehist_test();
+void lkslab_test();
+void lkalloc_test();
 void lkconfig_test();
+void lkhpack_test();
+void lkhttp2session_test();
+void lksplicepipe_test();
+void lkhttpdate_test();
+void lkrange_test();
+void lkconditional_test();
+void lkhttprequestparser_test();
+void lkhttpcgiparser_test();
+void lkhttpresponse_test();
+void lksse_test();
+void lkh2cupgrade_test();
+void lkscan_test();
+void lkpath_test();
+#ifdef LKTLS
+void lktls_test();
+#endif
 
 int main(int argc, char *argv[]) {
     lk_alloc_init();
 
     lkstring_test();
+    lkarena_test();
+    lkstrview_test();
     lkstringmap_test();
+    lkheadertable_test();
     lkbuffer_test();
+    lkbufchain_test();
     lkstringlist_test();
     lkreflist_test();
+    lkpool_test();
+    lksizehist_test();
+    lkslab_test();
+    lkalloc_test();
     lkconfig_test();
-
+    lkhpack_test();
+    lkhttp2session_test();
+    lksplicepipe_test();
+    lkhttpdate_test();
+    lkrange_test();
+    lkconditional_test();
+    lkhttprequestparser_test();
+    lkhttpcgiparser_test();
+    lkhttpresponse_test();
+    lksse_test();
+    lkh2cupgrade_test();
+    lkscan_test();
+    lkpath_test();
+#ifdef LKTLS
+    lktls_test();
+#endif
+
+    // Pooled objects aren't leaks.
+    lk_bufpool_clear();
+    lk_arenapool_clear();
     lk_print_allocitems();
 
     return 0;
@@ -41,10 +119,44 @@ void lkstring_test() {
 
     lks = lk_string_size_new(10);
     assert(lks->s_len == 0);
-    assert(lks->s_size == 10);
+    assert(lks->s_size >= 10);
+    assert(lks->s == lks->sbuf);
     assert(strcmp(lks->s, "") == 0);
     lk_string_free(lks);
 
+    // Short strings inline, moved to heap when they outgrow sbuf.
+    char longs[LK_STRING_INLINE_SIZE*3];
+    memset(longs, 'x', sizeof(longs));
+    longs[sizeof(longs)-1] = '\0';
+    lks = lk_string_new("GET");
+    assert(lks->s == lks->sbuf);
+    lk_string_append_buf(lks, "/index.html", 6);
+    assert(lk_string_sz_equal(lks, "GET/index"));
+    assert(lks->s_len == 9);
+    lk_string_prepend(lks, longs);
+    assert(lks->s != lks->sbuf);
+    assert(lks->s_len == sizeof(longs)-1 + 9);
+    assert(!strncmp(lks->s, longs, sizeof(longs)-1));
+    assert(!strcmp(lks->s + sizeof(longs)-1, "GET/index"));
+    lk_string_assign_buf(lks, "HTTP/1.1xx", 8);
+    assert(lk_string_sz_equal(lks, "HTTP/1.1"));
+    assert(lks->s_len == 8);
+    lk_string_free(lks);
+
+    lks = lk_string_new(longs);
+    assert(lks->s != lks->sbuf);
+    assert(lks->s_len == sizeof(longs)-1);
+    lk_string_free(lks);
+
+    lks = lk_string_new("");
+    for (int i=0; i < LK_STRING_INLINE_SIZE*3; i++) {
+        lk_string_append_char(lks, 'a' + i % 26);
+        assert(lks->s_len == i+1);
+        assert(lks->s[i] == 'a' + i % 26);
+        assert(lks->s[i+1] == '\0');
+    }
+    lk_string_free(lks);
+
     // lks, lks2
     lks = lk_string_new("abc def");
     lks2 = lk_string_new("abc ");
@@ -94,6 +206,13 @@ void lkstring_test() {
         assert(lks->s[i] == 'a');
     }
 
+    lk_string_append_sprintf(lks, "%s", "b");
+    assert(lks->s_len == sizeof(sbuf));
+    assert(lks->s[lks->s_len-1] == 'b');
+    lk_string_append_sprintf(lks, "%s", sbuf);
+    assert(lks->s_len == sizeof(sbuf)*2-1);
+    assert(lks->s[sizeof(sbuf)-1] == 'b');
+
     lk_string_assign_sprintf(lks, "sbuf: %s", sbuf);
     assert(lks->s_len == sizeof(sbuf)-1 + 6);
     assert(strncmp(lks->s, "sbuf: aaaaa", 11) == 0);
@@ -257,6 +376,182 @@ void lkstring_test() {
     printf("Done.\n");
 }
 
+void lkarena_test() {
+    printf("Running LKArena tests... ");
+    LKArena *arena = lk_arena_new(256);
+
+    // Allocations are aligned and don't overlap.
+    char *p1 = lk_arena_alloc(arena, 3);
+    char *p2 = lk_arena_alloc(arena, 8);
+    assert(((uintptr_t) p1 % 16) == 0);
+    assert(((uintptr_t) p2 % 16) == 0);
+    assert(p2 >= p1+3);
+    assert(arena->head == arena->first);
+
+    // Fill first block, then continue in a new block.
+    char *p3 = lk_arena_alloc(arena, 240);
+    memset(p3, 'a', 240);
+    assert(arena->head != arena->first);
+
+    // Large allocation gets its own block, head keeps its free space.
+    LKArenaBlock *head = arena->head;
+    char *big = lk_arena_alloc(arena, 1000);
+    memset(big, 'b', 1000);
+    assert(arena->head == head);
+    assert(arena->first->next != NULL);
+
+    char *s = lk_arena_strndup(arena, "abcdef", 3);
+    assert(!strcmp(s, "abc"));
+
+    // Arena strings grow in the arena, free is left to the arena.
+    LKString *lks = lk_string_arena_new(arena, "abc");
+    assert(lks->arena == arena);
+    assert(lks->s == lks->sbuf);
+    lk_string_append(lks, " long enough to not fit inline");
+    assert(lks->s != lks->sbuf);
+    assert(!strcmp(lks->s, "abc long enough to not fit inline"));
+    lk_string_free(lks);
+
+    // Header table items and index grow in the arena.
+    LKHeaderTable *ht = lk_headertable_arena_new(arena);
+    char k[32];
+    for (int i=0; i < 20; i++) {
+        snprintf(k, sizeof(k), "X-Header-%d", i);
+        lk_headertable_set(ht, k, "value");
+    }
+    lk_headertable_set(ht, "Host", "littlekitten.xyz");
+    assert(ht->items_len == 21);
+    assert(!strcmp(lk_headertable_get(ht, "x-header-19"), "value"));
+    assert(!strcmp(lk_headertable_get_id(ht, LK_HDR_HOST), "littlekitten.xyz"));
+    lk_headertable_remove(ht, "X-Header-0");
+    assert(ht->items_len == 20);
+    lk_headertable_free(ht);
+
+    // Request and response structs and strings are in the arena, only
+    // their buffers are freed separately.
+    LKHttpRequest *req = lk_httprequest_arena_new(arena);
+    lk_string_assign(req->method, "GET");
+    lk_httprequest_add_header(req, "Host", "littlekitten.xyz");
+    lk_buffer_append_sz(req->body, "body");
+    lk_httprequest_free(req);
+    LKHttpResponse *resp = lk_httpresponse_arena_new(arena);
+    resp->status = 200;
+    lk_string_assign(resp->statustext, "OK");
+    lk_httpresponse_free(resp);
+
+    // Reset keeps only the first block.
+    lk_arena_reset(arena);
+    assert(arena->head == arena->first);
+    assert(arena->first->next == NULL);
+    assert(arena->first->used == 0);
+    p1 = lk_arena_alloc(arena, 16);
+    assert(p1 != NULL);
+    lk_arena_free(arena);
+
+    printf("Done.\n");
+}
+
+void lkstrview_test() {
+    LKStrView sv, k, v, seg;
+    LKSplitIter it;
+
+    printf("Running LKStrView tests... ");
+    sv = lk_sv("  abc def\t\n");
+    assert(sv.len == 11);
+    sv = lk_sv_trim(sv);
+    assert(sv.len == 7);
+    assert(lk_sv_equal(sv, "abc def"));
+    assert(!lk_sv_equal(sv, "abc"));
+    assert(!lk_sv_equal(sv, "abc def "));
+    assert(lk_sv_starts_with(sv, "abc"));
+    assert(lk_sv_starts_with(sv, ""));
+    assert(!lk_sv_starts_with(sv, "abc def ghi"));
+    assert(lk_sv_ends_with(sv, " def"));
+    assert(!lk_sv_ends_with(sv, "abc"));
+    assert(lk_sv_equal(lk_sv_trim(lk_sv(" \t ")), ""));
+
+    assert(lk_sv_compare(lk_sv("abc"), lk_sv("abc")) == 0);
+    assert(lk_sv_compare(lk_sv("ab"), lk_sv("abc")) < 0);
+    assert(lk_sv_compare(lk_sv("abd"), lk_sv("abc")) > 0);
+    assert(lk_sv_compare(lk_sv_buf("abcdef", 3), lk_sv("abc")) == 0);
+
+    assert(lk_sv_split2(lk_sv("k=v=w"), "=", &k, &v) == 1);
+    assert(lk_sv_equal(k, "k"));
+    assert(lk_sv_equal(v, "v=w"));
+    assert(lk_sv_split2(lk_sv("12 little 12 kitten"), "12 ", &k, &v) == 1);
+    assert(lk_sv_equal(k, ""));
+    assert(lk_sv_equal(v, "little 12 kitten"));
+    assert(lk_sv_split2(lk_sv("abc"), "=", &k, &v) == 0);
+    assert(lk_sv_equal(k, "abc"));
+    assert(lk_sv_equal(v, ""));
+
+    // Same segments as lk_string_split().
+    char *segs[] = {"", "little kitten ", "web server ", ""};
+    int n = 0;
+    lk_split_init(&it, lk_sv("12 little kitten 12 web server 12 "), "12 ");
+    while (lk_split_next(&it, &seg)) {
+        assert(n < 4);
+        assert(lk_sv_equal(seg, segs[n]));
+        n++;
+    }
+    assert(n == 4);
+    assert(!lk_split_next(&it, &seg));
+
+    n = 0;
+    lk_split_init(&it, lk_sv(""), ",");
+    while (lk_split_next(&it, &seg)) {
+        assert(seg.len == 0);
+        n++;
+    }
+    assert(n == 1);
+
+    n = 0;
+    lk_split_init(&it, lk_sv("abc"), "");
+    while (lk_split_next(&it, &seg)) {
+        assert(lk_sv_equal(seg, "abc"));
+        n++;
+    }
+    assert(n == 1);
+
+    // Tokens skip empty segments.
+    char *toks[] = {"path", "to", "file.html"};
+    n = 0;
+    lk_split_init(&it, lk_sv("//path//to/file.html/"), "/");
+    while (lk_split_next_token(&it, &seg)) {
+        assert(n < 3);
+        assert(lk_sv_equal(seg, toks[n]));
+        n++;
+    }
+    assert(n == 3);
+    lk_split_init(&it, lk_sv(",,,"), ",");
+    assert(!lk_split_next_token(&it, &seg));
+
+    LKString *uri = lk_string_new("/path/blog/file1.html?a=1&b=2?c");
+    LKString *path = lk_string_new("");
+    LKString *filename = lk_string_new("");
+    LKString *qs = lk_string_new("");
+    parse_uri(uri, path, filename, qs);
+    assert(lk_string_sz_equal(path, "/path/blog/file1.html"));
+    assert(lk_string_sz_equal(filename, "file1.html"));
+    assert(lk_string_sz_equal(qs, "a=1&b=2?c"));
+    lk_string_assign(uri, "/path/blog/");
+    parse_uri(uri, path, filename, qs);
+    assert(lk_string_sz_equal(path, "/path/blog"));
+    assert(lk_string_sz_equal(filename, "blog"));
+    assert(lk_string_sz_equal(qs, ""));
+    lk_string_assign(uri, "/?x");
+    parse_uri(uri, path, filename, qs);
+    assert(lk_string_sz_equal(path, ""));
+    assert(lk_string_sz_equal(filename, ""));
+    assert(lk_string_sz_equal(qs, "x"));
+    lk_string_free(uri);
+    lk_string_free(path);
+    lk_string_free(filename);
+    lk_string_free(qs);
+
+    printf("Done.\n");
+}
+
 void lkstringmap_test() {
     LKStringTable *st;
     void *v;
@@ -320,6 +615,119 @@ void lkstringmap_test() {
     printf("Done.\n");
 }
 
+void lkheadertable_test() {
+    LKHeaderTable *ht;
+    char *v;
+
+    printf("Running LKHeaderTable tests... ");
+    ht = lk_headertable_new();
+    assert(ht->items_len == 0);
+    assert(lk_headertable_get_id(ht, LK_HDR_HOST) == NULL);
+
+    assert(lk_header_id("Host") == LK_HDR_HOST);
+    assert(lk_header_id("content-length") == LK_HDR_CONTENT_LENGTH);
+    assert(lk_header_id("IF-NONE-MATCH") == LK_HDR_IF_NONE_MATCH);
+    assert(lk_header_id("X-Host") == LK_HDR_OTHER);
+    assert(lk_header_id("") == LK_HDR_OTHER);
+
+    // Names are case-insensitive, first name used is kept.
+    lk_headertable_set(ht, "host", "littlekitten.xyz");
+    lk_headertable_set(ht, "User-Agent", "curl");
+    lk_headertable_set(ht, "X-Custom", "1");
+    lk_headertable_set(ht, "HOST", "localhost");
+    assert(ht->items_len == 3);
+    assert(!strcmp(ht->items[0].k->s, "host"));
+    assert(!strcmp(ht->items[0].v->s, "localhost"));
+    assert(!strcmp(lk_headertable_get_id(ht, LK_HDR_HOST), "localhost"));
+    assert(!strcmp(lk_headertable_get(ht, "Host"), "localhost"));
+    assert(!strcmp(lk_headertable_get(ht, "user-agent"), "curl"));
+    assert(!strcmp(lk_headertable_get(ht, "x-CUSTOM"), "1"));
+    assert(lk_headertable_get(ht, "X-Custom ") == NULL);
+    assert(lk_headertable_get(ht, "") == NULL);
+
+    // Growing past initial size keeps order and lookups.
+    char k[16], val[16];
+    for (int i=0; i < 50; i++) {
+        snprintf(k, sizeof(k), "X-%d", i);
+        snprintf(val, sizeof(val), "%d", i);
+        lk_headertable_set(ht, k, val);
+    }
+    lk_headertable_set(ht, "Range", "bytes=0-1");
+    assert(ht->items_len == 54);
+    assert(ht->slots_size >= ht->items_len*2);
+    for (int i=0; i < 50; i++) {
+        snprintf(k, sizeof(k), "x-%d", i);
+        snprintf(val, sizeof(val), "%d", i);
+        assert(!strcmp(lk_headertable_get(ht, k), val));
+        assert(!strcmp(ht->items[i+3].v->s, val));
+    }
+    assert(!strcmp(lk_headertable_get_id(ht, LK_HDR_RANGE), "bytes=0-1"));
+
+    // Removing shifts later items and their ids.
+    lk_headertable_remove(ht, "USER-AGENT");
+    lk_headertable_remove(ht, "user-agent");
+    lk_headertable_remove(ht, "X-50");
+    assert(ht->items_len == 53);
+    assert(lk_headertable_get_id(ht, LK_HDR_USER_AGENT) == NULL);
+    assert(!strcmp(ht->items[1].k->s, "X-Custom"));
+    assert(!strcmp(lk_headertable_get_id(ht, LK_HDR_RANGE), "bytes=0-1"));
+    assert(!strcmp(lk_headertable_get(ht, "X-49"), "49"));
+    lk_headertable_remove_id(ht, LK_HDR_HOST);
+    assert(ht->items_len == 52);
+    assert(lk_headertable_get(ht, "Host") == NULL);
+    assert(!strcmp(ht->items[0].k->s, "X-Custom"));
+    assert(!strcmp(lk_headertable_get_id(ht, LK_HDR_RANGE), "bytes=0-1"));
+    lk_headertable_remove_id(ht, LK_HDR_RANGE);
+    assert(lk_headertable_get(ht, "range") == NULL);
+    assert(ht->items_len == 51);
+
+    lk_headertable_set(ht, "Content-Type", "text/html");
+    v = lk_headertable_get_id(ht, LK_HDR_CONTENT_TYPE);
+    assert(!strcmp(v, "text/html"));
+    assert(ht->items[ht->items_len-1].id == LK_HDR_CONTENT_TYPE);
+    lk_headertable_free(ht);
+
+    // Reserved items are added without growing the table.
+    ht = lk_headertable_new();
+    lk_headertable_set(ht, "Host", "example.com");
+    lk_headertable_reserve(ht, 40);
+    assert(ht->items_size >= 40);
+    assert(ht->slots_size >= 80);
+    assert(!strcmp(lk_headertable_get_id(ht, LK_HDR_HOST), "example.com"));
+    LKHeaderItem *items = ht->items;
+    int *slots = ht->slots;
+    for (int i=1; i < 40; i++) {
+        char k[16];
+        snprintf(k, sizeof(k), "X-Reserve-%d", i);
+        lk_headertable_set(ht, k, "v");
+    }
+    assert(ht->items == items);
+    assert(ht->slots == slots);
+    assert(ht->items_len == 40);
+    assert(!strcmp(lk_headertable_get(ht, "x-reserve-39"), "v"));
+    assert(!strcmp(lk_headertable_get_id(ht, LK_HDR_HOST), "example.com"));
+    lk_headertable_free(ht);
+
+    // Appended values are kept in order, lookups return the first.
+    ht = lk_headertable_new();
+    lk_headertable_append(ht, "Set-Cookie", "a=1");
+    lk_headertable_set(ht, "Location", "/a");
+    lk_headertable_append(ht, "set-cookie", "b=2");
+    lk_headertable_append(ht, "Location", "/b");
+    assert(ht->items_len == 4);
+    assert(!strcmp(ht->items[2].v->s, "b=2"));
+    assert(!strcmp(lk_headertable_get(ht, "Set-Cookie"), "a=1"));
+    assert(!strcmp(lk_headertable_get_id(ht, LK_HDR_LOCATION), "/a"));
+    lk_headertable_remove(ht, "SET-COOKIE");
+    assert(ht->items_len == 2);
+    assert(lk_headertable_get(ht, "Set-Cookie") == NULL);
+    lk_headertable_remove_id(ht, LK_HDR_LOCATION);
+    assert(ht->items_len == 0);
+    assert(lk_headertable_get_id(ht, LK_HDR_LOCATION) == NULL);
+    lk_headertable_free(ht);
+    printf("Done.\n");
+}
+
 void lkbuffer_test() {
     LKBuffer *buf;
 
@@ -389,6 +797,191 @@ void lkbuffer_test() {
     assert(buf->bytes[buf->bytes_len-3] == 'a');
     lk_buffer_free(buf);
 
+    // Reserve space and commit bytes written to it.
+    buf = lk_buffer_new(10);
+    lk_buffer_append(buf, "12345", 5);
+    char *p = lk_buffer_reserve(buf, 3);
+    assert(p == buf->bytes+5);
+    assert(buf->bytes_size == 10);
+    memcpy(p, "678", 3);
+    lk_buffer_commit(buf, 3);
+    assert(buf->bytes_len == 8);
+    assert(!strncmp(buf->bytes, "12345678", 8));
+
+    // Capacity at least doubles when expanded.
+    p = lk_buffer_reserve(buf, 4);
+    assert(buf->bytes_size == 20);
+    lk_buffer_append(buf, "90123456789012", 14);
+    assert(buf->bytes_len == 22);
+    assert(buf->bytes_size == 40);
+    p = lk_buffer_reserve(buf, 100);
+    assert(buf->bytes_size == 122);
+    assert(buf->bytes_len == 22);
+    lk_buffer_free(buf);
+
+    // Read regular file into buffer sized once from fstat().
+    char tmpfile[] = "/tmp/lktest_XXXXXX";
+    int fd = mkstemp(tmpfile);
+    assert(fd != -1);
+    int z = write(fd, sbuf, sizeof(sbuf));
+    assert(z == sizeof(sbuf));
+    close(fd);
+    buf = lk_buffer_new(0);
+    assert(lk_readfile(tmpfile, buf) == sizeof(sbuf));
+    assert(buf->bytes_len == sizeof(sbuf));
+    assert(buf->bytes_size == sizeof(sbuf)+1);
+    assert(!memcmp(buf->bytes, sbuf, sizeof(sbuf)));
+    lk_buffer_free(buf);
+    unlink(tmpfile);
+
+    // Shared buffer freed when last reference released.
+    LKRefBuffer *rb = lk_refbuffer_new(0);
+    lk_buffer_append_sz(rb->buf, "event");
+    assert(rb->refcount == 1);
+    LKRefBuffer *rb2 = lk_refbuffer_ref(rb);
+    assert(rb2 == rb);
+    assert(rb->refcount == 2);
+    lk_refbuffer_unref(rb);
+    assert(rb2->refcount == 1);
+    assert(!strncmp(rb2->buf->bytes, "event", 5));
+    lk_refbuffer_unref(rb2);
+
+    printf("Done.\n");
+}
+
+// Copy chain bytes to s for comparing.
+static void bufchain_bytes(LKBufChain *bc, char *s) {
+    struct iovec iov[16];
+    int n = lk_bufchain_iovec(bc, iov, 16);
+    for (int i=0; i < n; i++) {
+        memcpy(s, iov[i].iov_base, iov[i].iov_len);
+        s += iov[i].iov_len;
+    }
+    *s = '\0';
+}
+
+void lkbufchain_test() {
+    char s[LK_BUFSEG_SIZE*3];
+    struct iovec iov[16];
+
+    printf("Running LKBufChain tests... ");
+    LKBufChain *bc = lk_bufchain_new();
+    assert(bc->len == 0);
+    assert(lk_bufchain_iovec(bc, iov, 16) == 0);
+
+    // Small appends share the tail segment.
+    lk_bufchain_append(bc, "abc", 3);
+    lk_bufchain_append(bc, "def", 3);
+    assert(bc->len == 6);
+    assert(bc->slices_len == 1);
+    bufchain_bytes(bc, s);
+    assert(!strcmp(s, "abcdef"));
+
+    // Appends past a segment continue in a new segment.
+    char *big = lk_malloc(LK_BUFSEG_SIZE, "lkbufchain_test");
+    memset(big, 'x', LK_BUFSEG_SIZE);
+    lk_bufchain_append(bc, big, LK_BUFSEG_SIZE);
+    assert(bc->len == LK_BUFSEG_SIZE+6);
+    assert(bc->slices_len == 2);
+    assert(bc->slices[0].len == LK_BUFSEG_SIZE);
+    assert(bc->slices[1].len == 6);
+    lk_free(big);
+
+    lk_bufchain_consume(bc, LK_BUFSEG_SIZE);
+    assert(bc->len == 6);
+    assert(bc->slices_len == 1);
+    bufchain_bytes(bc, s);
+    assert(!strcmp(s, "xxxxxx"));
+    lk_bufchain_consume(bc, 6);
+    assert(bc->len == 0);
+    assert(bc->slices_len == 0);
+
+    // Slices share segments, the source is unchanged.
+    lk_bufchain_append(bc, "0123456789", 10);
+    LKBufChain *bc2 = lk_bufchain_new();
+    lk_bufchain_slice(bc2, bc, 2, 5);
+    assert(bc2->len == 5);
+    assert(bc2->slices[0].seg == bc->slices[0].seg);
+    assert(bc->slices[0].seg->refcount == 2);
+    bufchain_bytes(bc2, s);
+    assert(!strcmp(s, "23456"));
+
+    // Appending to a shared segment doesn't change the slice.
+    lk_bufchain_append(bc2, "ab", 2);
+    lk_bufchain_append(bc, "cd", 2);
+    bufchain_bytes(bc2, s);
+    assert(!strcmp(s, "23456ab"));
+    bufchain_bytes(bc, s);
+    assert(!strcmp(s, "0123456789cd"));
+
+    // Prepend and splice move slices.
+    LKBufChain *head = lk_bufchain_new();
+    lk_bufchain_append(head, "HEAD ", 5);
+    lk_bufchain_prepend(bc2, head);
+    assert(head->len == 0);
+    bufchain_bytes(bc2, s);
+    assert(!strcmp(s, "HEAD 23456ab"));
+    lk_bufchain_splice(bc2, bc);
+    assert(bc->len == 0);
+    bufchain_bytes(bc2, s);
+    assert(!strcmp(s, "HEAD 23456ab0123456789cd"));
+    lk_bufchain_consume(bc2, 7);
+    bufchain_bytes(bc2, s);
+    assert(!strcmp(s, "456ab0123456789cd"));
+    lk_bufchain_free(head);
+
+    // Adopt buffer from bytes_cur without copying.
+    LKBuffer *buf = lk_buffer_new(0);
+    lk_buffer_append_sz(buf, "skip-body");
+    buf->bytes_cur = 5;
+    lk_bufchain_clear(bc2);
+    lk_bufchain_append_buffer(bc2, buf);
+    assert(bc2->slices[0].seg->buf == buf);
+    bufchain_bytes(bc2, s);
+    assert(!strcmp(s, "body"));
+
+    // Read and write through a pipe.
+    int fds[2];
+    int z = pipe(fds);
+    assert(z == 0);
+    lk_set_sock_nonblocking(fds[0]);
+    lk_bufchain_append(bc2, "-more", 5);
+    z = lk_bufchain_write_all(fds[1], FD_FILE, bc2);
+    assert(z == Z_EOF);
+    assert(bc2->len == 0);
+    close(fds[1]);
+    z = lk_bufchain_read_all(fds[0], FD_FILE, bc);
+    assert(z == Z_EOF);
+    bufchain_bytes(bc, s);
+    assert(!strcmp(s, "body-more"));
+    close(fds[0]);
+
+    lk_bufchain_free(bc);
+    lk_bufchain_free(bc2);
+
+    // Buflist bufs are sent with one gathered write.
+    z = pipe(fds);
+    assert(z == 0);
+    LKRefList *buflist = lk_reflist_new();
+    LKBuffer *buf1 = lk_buffer_new(0);
+    LKBuffer *buf2 = lk_buffer_new(0);
+    lk_buffer_append_sz(buf1, "head\n");
+    lk_buffer_append_sz(buf2, "body");
+    lk_reflist_append(buflist, buf1);
+    lk_reflist_append(buflist, buf2);
+    z = lk_buflist_write_all(fds[1], FD_FILE, buflist);
+    assert(z == Z_EOF);
+    assert(buflist->items_cur == 2);
+    assert(buf2->bytes_cur == buf2->bytes_len);
+    z = read(fds[0], s, sizeof(s));
+    assert(z == 9);
+    assert(!strncmp(s, "head\nbody", 9));
+    close(fds[0]);
+    close(fds[1]);
+    lk_buffer_free(buf1);
+    lk_buffer_free(buf2);
+    lk_reflist_free(buflist);
+
     printf("Done.\n");
 }
 
@@ -479,6 +1072,307 @@ void lkreflist_test() {
     printf("Done.\n");
 }
 
+static int npool_freed = 0;
+static void pool_free_item(void *p) {
+    npool_freed++;
+    lk_free(p);
+}
+
+void lksizehist_test() {
+    LKSizeHist h;
+
+    printf("Running LKSizeHist tests... ");
+    lk_sizehist_init(&h);
+    assert(lk_sizehist_percentile(&h, 50) == 0);
+
+    // Percentiles are rounded up to a power of 2.
+    for (int i=0; i < 80; i++) {
+        lk_sizehist_add(&h, 300);
+    }
+    for (int i=0; i < 15; i++) {
+        lk_sizehist_add(&h, 1000);
+    }
+    for (int i=0; i < 5; i++) {
+        lk_sizehist_add(&h, 5000);
+    }
+    assert(h.nsamples == 100);
+    assert(lk_sizehist_percentile(&h, 50) == 512);
+    assert(lk_sizehist_percentile(&h, 80) == 512);
+    assert(lk_sizehist_percentile(&h, 90) == 1024);
+    assert(lk_sizehist_percentile(&h, 95) == 1024);
+    assert(lk_sizehist_percentile(&h, 99) == 8192);
+    assert(lk_sizehist_percentile(&h, 100) == 8192);
+
+    // Powers of 2 fall in their own bucket, 0 and 1 in the first.
+    lk_sizehist_init(&h);
+    lk_sizehist_add(&h, 1024);
+    assert(lk_sizehist_percentile(&h, 100) == 1024);
+    lk_sizehist_add(&h, 0);
+    assert(lk_sizehist_percentile(&h, 50) == 1);
+
+    // Old samples are decayed, percentiles follow recent sizes.
+    lk_sizehist_init(&h);
+    for (int i=0; i < LK_SIZEHIST_WINDOW; i++) {
+        lk_sizehist_add(&h, 4000);
+    }
+    assert(lk_sizehist_percentile(&h, 50) == 4096);
+    for (int i=0; i < LK_SIZEHIST_WINDOW*4; i++) {
+        lk_sizehist_add(&h, 100);
+    }
+    assert(h.total <= LK_SIZEHIST_WINDOW);
+    assert(lk_sizehist_percentile(&h, 90) == 128);
+
+    printf("Done.\n");
+}
+
+void lkpool_test() {
+    printf("Running LKPool tests... ");
+    LKPool *pool = lk_pool_new(3, pool_free_item);
+    assert(lk_pool_get(pool) == NULL);
+
+    // Objects are reused most recently put first, up to max_items kept.
+    void *p1 = lk_malloc(8, "lkpool_test");
+    void *p2 = lk_malloc(8, "lkpool_test");
+    void *p3 = lk_malloc(8, "lkpool_test");
+    void *p4 = lk_malloc(8, "lkpool_test");
+    assert(lk_pool_put(pool, p1) == 1);
+    assert(lk_pool_put(pool, p2) == 1);
+    assert(lk_pool_put(pool, p3) == 1);
+    assert(lk_pool_put(pool, p4) == 0);
+    assert(npool_freed == 1);
+    assert(lk_pool_get(pool) == p3);
+    assert(lk_pool_put(pool, p3) == 1);
+
+    // Trim frees objects not needed since the last trim.
+    lk_pool_trim(pool);
+    assert(npool_freed == 1);
+    assert(pool->low_len == 3);
+    assert(lk_pool_get(pool) == p3);
+    lk_pool_trim(pool);
+    assert(npool_freed == 3);
+    assert(pool->items_len == 0);
+    lk_pool_put(pool, p3);
+    lk_pool_trim(pool);
+    assert(npool_freed == 3);
+    assert(pool->items_len == 1);
+    lk_pool_free(pool);
+    assert(npool_freed == 4);
+
+    // Buffer pool recycles standard and grown buffers, not large ones.
+    lk_bufpool_clear();
+    LKBuffer *buf = lk_bufpool_get();
+    assert(buf->bytes_size == LK_BUFPOOL_BUF_SIZE);
+    lk_buffer_append_sz(buf, "abc");
+    lk_bufpool_put(buf);
+    LKBuffer *buf2 = lk_bufpool_get();
+    assert(buf2 == buf);
+    assert(buf2->bytes_len == 0);
+    assert(buf2->bytes_cur == 0);
+    lk_buffer_reserve(buf2, LK_BUFPOOL_MAX_BUF_SIZE+1);
+    lk_bufpool_put(buf2);
+    buf = lk_bufpool_get();
+    assert(buf->bytes_size == LK_BUFPOOL_BUF_SIZE);
+    lk_bufpool_put(buf);
+
+    // Arena pool resets arenas put back.
+    lk_arenapool_clear();
+    LKArena *arena = lk_arenapool_get();
+    lk_arena_alloc(arena, LK_ARENA_BLOCK_SIZE);
+    lk_arenapool_put(arena);
+    LKArena *arena2 = lk_arenapool_get();
+    assert(arena2 == arena);
+    assert(arena2->head == arena2->first);
+    assert(arena2->first->used == 0);
+    lk_arenapool_put(arena2);
+
+    printf("Done.\n");
+}
+
+// Return stats of the size class serving size bytes.
+static void slab_class_stats(size_t size, LKSlabStats *st) {
+    for (int ci=0; ci < lk_slab_nclasses(); ci++) {
+        lk_slab_stats(ci, st);
+        if (st->size >= size) {
+            return;
+        }
+    }
+    assert(0);
+}
+
+// Free some 64 byte objects, the slots stay in the thread's cache.
+static void *slab_thread(void *arg) {
+    void *ps[100];
+    for (int i=0; i < 100; i++) {
+        ps[i] = lk_slab_alloc(64);
+    }
+    for (int i=0; i < 100; i++) {
+        lk_slab_free(ps[i]);
+    }
+    return NULL;
+}
+
+void lkslab_test() {
+    LKSlabStats st, st2;
+
+    printf("Running slab allocator tests... ");
+
+    // Objects get the smallest class that fits.
+    slab_class_stats(sizeof(LKString), &st);
+    assert(st.size >= sizeof(LKString));
+    LKString *lks = lk_slab_alloc(sizeof(LKString));
+    assert(((uintptr_t) lks % 16) == 0);
+    slab_class_stats(sizeof(LKString), &st2);
+    assert(st2.size == st.size);
+    assert(st2.nallocs == st.nallocs+1);
+    assert(st2.npages >= 1);
+    lk_slab_free(lks);
+    slab_class_stats(sizeof(LKString), &st2);
+    assert(st2.nfrees == st.nfrees+1);
+
+    // Freed slots are reused.
+    void *p1 = lk_slab_alloc(20);
+    lk_slab_free(p1);
+    void *p2 = lk_slab_alloc(30);
+    assert(p2 == p1);
+
+    // Realloc within the class stays in place, growing past it copies.
+    memcpy(p2, "abcdefghij", 10);
+    assert(lk_slab_realloc(p2, 32) == p2);
+    char *p3 = lk_slab_realloc(p2, 100);
+    assert(p3 != p2);
+    assert(!memcmp(p3, "abcdefghij", 10));
+
+    // Large allocations go to libc and can be resized.
+    char *big = lk_slab_realloc(p3, LK_SLAB_MAX_SIZE*4);
+    assert(!memcmp(big, "abcdefghij", 10));
+    memset(big+10, 'x', LK_SLAB_MAX_SIZE*4-10);
+    big = lk_slab_realloc(big, LK_SLAB_MAX_SIZE*8);
+    assert(!memcmp(big, "abcdefghij", 10));
+    assert(big[LK_SLAB_MAX_SIZE*4-1] == 'x');
+    big = lk_slab_realloc(big, 10);
+    assert(!memcmp(big, "abcdefghij", 10));
+    lk_slab_free(big);
+
+    // Many objects span pages and are flushed back from the thread cache.
+    slab_class_stats(64, &st);
+    void *ps[2000];
+    for (int i=0; i < 2000; i++) {
+        ps[i] = lk_slab_alloc(64);
+        memset(ps[i], i, 64);
+    }
+    for (int i=0; i < 2000; i++) {
+        assert(((unsigned char *) ps[i])[63] == (unsigned char) i);
+        lk_slab_free(ps[i]);
+    }
+    slab_class_stats(64, &st2);
+    assert(st2.npages > st.npages);
+    assert(st2.nallocs - st.nallocs == 2000);
+    assert(st2.nfrees - st.nfrees == 2000);
+    assert(st2.nfree == st2.nslots);
+
+    // Cache of an exited thread is flushed back to the class.
+    pthread_t t;
+    int z = pthread_create(&t, NULL, slab_thread, NULL);
+    assert(z == 0);
+    pthread_join(t, NULL);
+    slab_class_stats(64, &st2);
+    assert(st2.nallocs - st.nallocs == 2100);
+    assert(st2.nfree == st2.nslots);
+
+    printf("Done.\n");
+}
+
+void lkalloc_test() {
+    unsigned long count;
+    size_t bytes;
+
+    printf("Running allocation profiler tests... ");
+
+    // Live count and bytes are kept per label.
+    void *p1 = lk_malloc(100, "lkalloc_test_a");
+    void *p2 = lk_malloc(50, "lkalloc_test_a");
+    char *s = lk_strdup("abc", "lkalloc_test_b");
+    lk_alloc_label_stats("lkalloc_test_a", &count, &bytes);
+    assert(count == 2);
+    assert(bytes == 150);
+    lk_alloc_label_stats("lkalloc_test_b", &count, &bytes);
+    assert(count == 1);
+    assert(bytes == 4);
+
+    // Realloc moves the allocation to the new label and size.
+    p1 = lk_realloc(p1, 1000, "lkalloc_test_b");
+    lk_alloc_label_stats("lkalloc_test_a", &count, &bytes);
+    assert(count == 1);
+    assert(bytes == 50);
+    lk_alloc_label_stats("lkalloc_test_b", &count, &bytes);
+    assert(count == 2);
+    assert(bytes == 1004);
+
+    lk_free(p1);
+    lk_free(p2);
+    lk_free(s);
+    lk_alloc_label_stats("lkalloc_test_a", &count, &bytes);
+    assert(count == 0);
+    assert(bytes == 0);
+    lk_alloc_label_stats("lkalloc_test_b", &count, &bytes);
+    assert(count == 0);
+    assert(bytes == 0);
+
+    // More live allocations than the old fixed table could hold.
+    int n = 20000;
+    void **ps = malloc(n * sizeof(void *));
+    for (int i=0; i < n; i++) {
+        ps[i] = lk_malloc(8, "lkalloc_test_many");
+    }
+    lk_alloc_label_stats("lkalloc_test_many", &count, &bytes);
+    assert(count == n);
+    assert(bytes == n*8);
+    for (int i=0; i < n; i += 2) {
+        lk_free(ps[i]);
+    }
+    lk_alloc_label_stats("lkalloc_test_many", &count, &bytes);
+    assert(count == n/2);
+    for (int i=1; i < n; i += 2) {
+        lk_free(ps[i]);
+    }
+    lk_alloc_label_stats("lkalloc_test_many", &count, &bytes);
+    assert(count == 0);
+
+    // Sampling records one in n allocations, the rest are untracked
+    // and can still be freed.
+    lk_alloc_set_sample_rate(4);
+    for (int i=0; i < 1000; i++) {
+        ps[i] = lk_malloc(16, "lkalloc_test_sampled");
+    }
+    lk_alloc_label_stats("lkalloc_test_sampled", &count, &bytes);
+    assert(count == 250);
+    assert(bytes == 250*16);
+    for (int i=0; i < 1000; i++) {
+        lk_free(ps[i]);
+    }
+    lk_alloc_label_stats("lkalloc_test_sampled", &count, &bytes);
+    assert(count == 0);
+    lk_alloc_set_sample_rate(1);
+    free(ps);
+
+    // Snapshot lists live labels and clears the pending request.
+    void *p3 = lk_malloc(300, "lkalloc_test_snapshot");
+    lk_alloc_request_snapshot();
+    assert(lk_alloc_snapshot_pending());
+    FILE *f = tmpfile();
+    lk_alloc_print_snapshot(f);
+    assert(!lk_alloc_snapshot_pending());
+    char out[LK_BUFSIZE_XL];
+    rewind(f);
+    size_t out_len = fread(out, 1, sizeof(out)-1, f);
+    out[out_len] = '\0';
+    fclose(f);
+    assert(strstr(out, "lkalloc_test_snapshot") != NULL);
+    lk_free(p3);
+
+    printf("Done.\n");
+}
+
 void lkconfig_test() {
     printf("Running LKConfig tests... \n");
 
@@ -486,8 +1380,1391 @@ void lkconfig_test() {
     lk_config_read_configfile(cfg, "lktest.conf");
     assert(cfg != NULL);
     lk_config_print(cfg);
+
+    LKHostConfig *hc = lk_config_find_hostconfig(cfg, "littlekitten.xyz:5000");
+    assert(hc != NULL);
+    assert(hc->max_body_size == 10*1024*1024);
+    hc = lk_config_find_hostconfig(cfg, "localhost");
+    assert(hc != NULL);
+    assert(hc->max_body_size == 0);
     lk_config_free(cfg);
 
     printf("Done.\n");
 }
 
+
+void lkhpack_test() {
+    printf("Running LKHpackDecoder tests... ");
+
+    // Request examples with Huffman coding from RFC 7541 C.4
+    char req1[] = "\x82\x86\x84\x41\x8c\xf1\xe3\xc2\xe5\xf2\x3a\x6b\xa0\xab\x90\xf4\xff";
+    char req2[] = "\x82\x86\x84\xbe\x58\x86\xa8\xeb\x10\x64\x9c\xbf";
+    char req3[] = "\x82\x87\x85\xbf\x40\x88\x25\xa8\x49\xe9\x5b\xa9\x7d\x7f\x89\x25\xa8\x49\xe9\x5b\xb8\xe8\xb4\xbf";
+
+    LKHpackDecoder *dec = lk_hpackdecoder_new(4096);
+    LKHeaderTable *headers = lk_headertable_new();
+    int z = lk_hpackdecoder_decode(dec, req1, sizeof(req1)-1, headers);
+    assert(z == 0);
+    assert(headers->items_len == 4);
+    assert(!strcmp(lk_headertable_get(headers, ":method"), "GET"));
+    assert(!strcmp(lk_headertable_get(headers, ":scheme"), "http"));
+    assert(!strcmp(lk_headertable_get(headers, ":path"), "/"));
+    assert(!strcmp(lk_headertable_get(headers, ":authority"), "www.example.com"));
+    assert(dec->items_len == 1);
+    assert(dec->table_size == 57);
+    lk_headertable_free(headers);
+
+    // Uses dynamic table entry added by req1.
+    headers = lk_headertable_new();
+    z = lk_hpackdecoder_decode(dec, req2, sizeof(req2)-1, headers);
+    assert(z == 0);
+    assert(headers->items_len == 5);
+    assert(!strcmp(lk_headertable_get(headers, ":authority"), "www.example.com"));
+    assert(!strcmp(lk_headertable_get(headers, "cache-control"), "no-cache"));
+    assert(dec->items_len == 2);
+    assert(dec->table_size == 110);
+    lk_headertable_free(headers);
+
+    headers = lk_headertable_new();
+    z = lk_hpackdecoder_decode(dec, req3, sizeof(req3)-1, headers);
+    assert(z == 0);
+    assert(headers->items_len == 5);
+    assert(!strcmp(lk_headertable_get(headers, ":scheme"), "https"));
+    assert(!strcmp(lk_headertable_get(headers, ":path"), "/index.html"));
+    assert(!strcmp(lk_headertable_get(headers, "custom-key"), "custom-value"));
+    assert(dec->items_len == 3);
+    assert(dec->table_size == 164);
+    lk_headertable_free(headers);
+
+    // Invalid index
+    headers = lk_headertable_new();
+    z = lk_hpackdecoder_decode(dec, "\xff\x10", 2, headers);
+    assert(z == -1);
+    lk_headertable_free(headers);
+
+    // Encoded fields decode back to the same values.
+    LKBuffer *buf = lk_buffer_new(0);
+    lk_hpack_encode_header(buf, ":status", "200");
+    lk_hpack_encode_header(buf, ":status", "302");
+    lk_hpack_encode_header(buf, "content-type", "text/html");
+    lk_hpack_encode_header(buf, "x-little-kitten", "meow");
+    assert(buf->bytes[0] == '\x88');
+    headers = lk_headertable_new();
+    z = lk_hpackdecoder_decode(dec, buf->bytes, buf->bytes_len, headers);
+    assert(z == 0);
+    assert(!strcmp(lk_headertable_get(headers, ":status"), "200, 302"));
+    assert(!strcmp(lk_headertable_get(headers, "content-type"), "text/html"));
+    assert(!strcmp(lk_headertable_get(headers, "x-little-kitten"), "meow"));
+    assert(dec->items_len == 3);
+    lk_headertable_free(headers);
+
+    // Cookie fields are joined with "; ".
+    lk_buffer_clear(buf);
+    lk_hpack_encode_header(buf, "cookie", "a=1");
+    lk_hpack_encode_header(buf, "cookie", "b=2");
+    headers = lk_headertable_new();
+    z = lk_hpackdecoder_decode(dec, buf->bytes, buf->bytes_len, headers);
+    assert(z == 0);
+    assert(!strcmp(lk_headertable_get(headers, "cookie"), "a=1; b=2"));
+    assert(headers->items_len == 1);
+    lk_headertable_free(headers);
+    lk_hpackdecoder_free(dec);
+
+    // Header list over the limits stops decoding. One 4000 byte table
+    // entry and 1 byte references to it.
+    lk_buffer_clear(buf);
+    lk_buffer_append(buf, "\x40\x01x\x7f\xa1\x1e", 6);
+    for (int i=0; i < 4000; i++) {
+        lk_buffer_append_sz(buf, i == 0 ? "v" : "w");
+    }
+    for (int i=0; i < 200; i++) {
+        lk_buffer_append_sz(buf, "\xbe");
+    }
+    dec = lk_hpackdecoder_new(8192);
+    dec->max_list_size = 3*4033 - 1;
+    headers = lk_headertable_new();
+    z = lk_hpackdecoder_decode(dec, buf->bytes, buf->bytes_len, headers);
+    assert(z == -2);
+    assert(strlen(lk_headertable_get(headers, "x")) == 4000+2+4000);
+    lk_headertable_free(headers);
+    lk_hpackdecoder_free(dec);
+
+    dec = lk_hpackdecoder_new(8192);
+    dec->max_fields = 100;
+    headers = lk_headertable_new();
+    z = lk_hpackdecoder_decode(dec, buf->bytes, buf->bytes_len, headers);
+    assert(z == -2);
+    assert(strlen(lk_headertable_get(headers, "x")) == 100*4000 + 99*2);
+    lk_headertable_free(headers);
+    lk_hpackdecoder_free(dec);
+
+    dec = lk_hpackdecoder_new(8192);
+    headers = lk_headertable_new();
+    z = lk_hpackdecoder_decode(dec, buf->bytes, buf->bytes_len, headers);
+    assert(z == 0);
+    assert(strlen(lk_headertable_get(headers, "x")) == 201*4000 + 200*2);
+    lk_headertable_free(headers);
+    lk_buffer_free(buf);
+
+    lk_hpackdecoder_free(dec);
+    printf("Done.\n");
+}
+
+static void h2_frame(LKBuffer *buf, size_t len, int type, int flags, unsigned int id, char *payload) {
+    char head[9] = {len >> 16, len >> 8, len, type, flags, id >> 24, id >> 16, id >> 8, id};
+    lk_buffer_append(buf, head, sizeof(head));
+    if (len > 0) {
+        lk_buffer_append(buf, payload, len);
+    }
+}
+
+// Return sum of WINDOW_UPDATE increments for stream id in outbuf, and the
+// error code of its last RST_STREAM in *rst (-1 if none). Clears outbuf.
+static unsigned int h2_sent_frames(LKHttp2Session *h2, unsigned int id, int *rst) {
+    LKBuffer *buf = h2->outbuf;
+    unsigned int increments = 0;
+    *rst = -1;
+    size_t i = buf->bytes_cur;
+    while (i + 9 <= buf->bytes_len) {
+        unsigned char *p = (unsigned char *) buf->bytes + i;
+        size_t len = (p[0] << 16) | (p[1] << 8) | p[2];
+        unsigned int frame_id = ((p[5] & 0x7f) << 24) | (p[6] << 16) | (p[7] << 8) | p[8];
+        unsigned int v = (p[9] << 24) | (p[10] << 16) | (p[11] << 8) | p[12];
+        if (frame_id == id && p[3] == 0x8) {
+            increments += v;
+        } else if (frame_id == id && p[3] == 0x3) {
+            *rst = v;
+        }
+        i += 9 + len;
+    }
+    lk_buffer_clear(buf);
+    return increments;
+}
+
+void lkhttp2session_test() {
+    printf("Running LKHttp2Session tests... ");
+
+    LKHttp2Session *h2 = lk_http2session_new();
+    LKBuffer *block = lk_buffer_new(0);
+    lk_hpack_encode_header(block, ":method", "POST");
+    lk_hpack_encode_header(block, ":scheme", "http");
+    lk_hpack_encode_header(block, ":path", "/upload");
+    lk_hpack_encode_header(block, ":authority", "localhost");
+    char data[16384];
+    memset(data, 'a', sizeof(data));
+    int rst;
+
+    // Parsing stops at new stream head, before its DATA.
+    lk_buffer_append(h2->inbuf, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", 24);
+    h2_frame(h2->inbuf, 0, 0x4, 0, 0, NULL);
+    h2_frame(h2->inbuf, block->bytes_len, 0x1, 0x4, 1, block->bytes);
+    h2_frame(h2->inbuf, 10, 0x0, 0, 1, data);
+    lk_http2session_recv(h2);
+    LKHttp2Stream *stream = lk_http2session_next_head(h2);
+    assert(stream != NULL && stream->id == 1);
+    assert(stream->req->body->bytes_len == 0);
+    assert(!strcmp(lk_headertable_get(stream->req->headers, "Host"), "localhost"));
+    stream->max_body_size = 20;
+
+    // Window updates are sent for stored body bytes.
+    lk_http2session_recv(h2);
+    assert(lk_http2session_next_head(h2) == NULL);
+    assert(stream->req->body->bytes_len == 10);
+    assert(h2_sent_frames(h2, 1, &rst) == 10 && rst == -1);
+    assert(lk_http2session_next_request(h2) == NULL);
+
+    // Body over max_body_size is dropped and the stream window isn't
+    // opened again. Going past the window is a flow control error.
+    for (int i=0; i < 3; i++) {
+        h2_frame(h2->inbuf, sizeof(data), 0x0, 0, 1, data);
+    }
+    lk_http2session_recv(h2);
+    assert(stream->body_too_large);
+    assert(stream->req->body->bytes_len == 0);
+    assert(stream->recv_window == 65535 - 3*16384);
+    h2_frame(h2->inbuf, sizeof(data), 0x0, 0, 1, data);
+    lk_http2session_recv(h2);
+    assert(h2_sent_frames(h2, 1, &rst) == 0 && rst == 0x3);
+    assert(h2->recv_window == 65535);
+    assert(h2->nstreams == 0);
+
+    // body_too_large stream is returned before END_STREAM, and the
+    // client is told to stop sending once the response is queued.
+    h2_frame(h2->inbuf, block->bytes_len, 0x1, 0x4, 3, block->bytes);
+    lk_http2session_recv(h2);
+    stream = lk_http2session_next_head(h2);
+    assert(stream != NULL && stream->id == 3);
+    stream->body_too_large = 1;
+    assert(lk_http2session_next_request(h2) == stream);
+    stream->resp->status = 413;
+    lk_http2session_submit_response(h2, stream);
+    assert(h2_sent_frames(h2, 3, &rst) == 0 && rst == 0x0);
+    assert(h2->nstreams == 0);
+
+    // DATA for a closed stream still returns the connection window.
+    h2_frame(h2->inbuf, 100, 0x0, 0, 3, data);
+    lk_http2session_recv(h2);
+    assert(h2_sent_frames(h2, 3, &rst) == 0 && rst == 0x5);
+    assert(h2->recv_window == 65535);
+    assert(!h2->closing);
+    lk_http2session_free(h2);
+
+    // Header list limit is advertised, going over it ends the connection.
+    h2 = lk_http2session_new();
+    h2->decoder->max_fields = 3;
+    lk_buffer_append(h2->inbuf, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", 24);
+    h2_frame(h2->inbuf, 0, 0x4, 0, 0, NULL);
+    h2_frame(h2->inbuf, block->bytes_len, 0x1, 0x4, 1, block->bytes);
+    lk_http2session_recv(h2);
+    assert(lk_http2session_next_head(h2) == NULL);
+    assert(h2->closing);
+    unsigned char *f = (unsigned char *) h2->outbuf->bytes;
+    assert(f[2] == 18 && f[3] == 0x4);
+    assert(f[9+12] == 0 && f[9+13] == 0x6);
+    assert(((f[9+16] << 8) | f[9+17]) == LK_MAX_HEAD_SIZE);
+    // SETTINGS ACK, then GOAWAY.
+    f += 9 + 18 + 9;
+    assert(f[3] == 0x7 && f[9+7] == 0xb);
+
+    lk_buffer_free(block);
+    lk_http2session_free(h2);
+    printf("Done.\n");
+}
+
+void lksplicepipe_test() {
+    printf("Running LKSplicePipe tests... ");
+
+    // src[0] --> src[1] ==splice==> dst[0] --> dst[1]
+    int src[2], dst[2];
+    int z = socketpair(AF_UNIX, SOCK_STREAM, 0, src);
+    assert(z == 0);
+    z = socketpair(AF_UNIX, SOCK_STREAM, 0, dst);
+    assert(z == 0);
+    lk_set_sock_nonblocking(src[1]);
+    lk_set_sock_nonblocking(dst[0]);
+
+    LKSplicePipe *sp = lk_splicepipe_new(src[1], dst[0]);
+    assert(sp != NULL);
+    lk_buffer_append_sz(sp->buf, "abc");
+    assert(lk_splicepipe_pending(sp));
+
+    // Nothing to read yet, buf bytes sent first.
+    z = lk_splice_all(sp);
+    assert(z == Z_BLOCK);
+    assert(sp->nbytes == 3);
+    assert(!lk_splicepipe_pending(sp));
+
+    z = write(src[0], "defgh", 5);
+    assert(z == 5);
+    z = lk_splice_all(sp);
+    assert(z == Z_BLOCK);
+    assert(sp->nbytes == 8);
+
+    shutdown(src[0], SHUT_WR);
+    z = lk_splice_all(sp);
+    assert(z == Z_EOF);
+    assert(sp->read_eof);
+
+    char readbuf[16];
+    z = read(dst[1], readbuf, sizeof(readbuf));
+    assert(z == 8);
+    assert(!strncmp(readbuf, "abcdefgh", 8));
+
+    lk_splicepipe_free(sp);
+    close(src[0]);
+    close(src[1]);
+    close(dst[0]);
+    close(dst[1]);
+    printf("Done.\n");
+}
+
+void lkhttpdate_test() {
+    printf("Running HTTP-date tests... ");
+
+    // Same date in the three formats of RFC 7231 7.1.1.1
+    assert(lk_parse_http_date("Sun, 06 Nov 1994 08:49:37 GMT") == 784111777);
+    assert(lk_parse_http_date("Sunday, 06-Nov-94 08:49:37 GMT") == 784111777);
+    assert(lk_parse_http_date("Sun Nov  6 08:49:37 1994") == 784111777);
+
+    assert(lk_parse_http_date("Thu, 01 Jan 1970 00:00:00 GMT") == 0);
+    assert(lk_parse_http_date("Tue, 29 Feb 2028 23:59:59 GMT") == 1835481599);
+    assert(lk_parse_http_date("Thursday, 01-Jan-70 00:00:00 GMT") == 0);
+    assert(lk_parse_http_date("Sat Nov 12 11:22:33 2044") == 2362562553);
+
+    assert(lk_parse_http_date("") == -1);
+    assert(lk_parse_http_date("garbage") == -1);
+    assert(lk_parse_http_date("Sun, 06 Nov 1994 08:49:37") == -1);
+    assert(lk_parse_http_date("Sun, 06 Nov 1994 08:49:37 UTC") == -1);
+    assert(lk_parse_http_date("Sun, 6 Nov 1994 08:49:37 GMT") == -1);
+    assert(lk_parse_http_date("Sun, 06 Xyz 1994 08:49:37 GMT") == -1);
+    assert(lk_parse_http_date("Sun, 06 Nov 1994 24:49:37 GMT") == -1);
+    assert(lk_parse_http_date("Sun Nov  6 08:49:37 1994 GMT") == -1);
+
+    char date_str[HTTP_DATE_SIZE];
+    lk_format_http_date(784111777, date_str, sizeof(date_str));
+    assert(!strcmp(date_str, "Sun, 06 Nov 1994 08:49:37 GMT"));
+    lk_format_http_date(0, date_str, sizeof(date_str));
+    assert(!strcmp(date_str, "Thu, 01 Jan 1970 00:00:00 GMT"));
+    assert(lk_parse_http_date(date_str) == 0);
+
+    printf("Done.\n");
+}
+
+void lkrange_test() {
+    printf("Running Range tests... ");
+    off_t starts[4], ends[4];
+
+    assert(parse_ranges("bytes=0-499", 1000, starts, ends, 4) == 1);
+    assert(starts[0] == 0 && ends[0] == 499);
+    assert(parse_ranges("bytes=500-", 1000, starts, ends, 4) == 1);
+    assert(starts[0] == 500 && ends[0] == 999);
+    assert(parse_ranges("bytes=-300", 1000, starts, ends, 4) == 1);
+    assert(starts[0] == 700 && ends[0] == 999);
+    assert(parse_ranges("bytes=-3000", 1000, starts, ends, 4) == 1);
+    assert(starts[0] == 0 && ends[0] == 999);
+    assert(parse_ranges("bytes=900-5000", 1000, starts, ends, 4) == 1);
+    assert(starts[0] == 900 && ends[0] == 999);
+
+    // Multiple ranges, unsatisfiable ones skipped.
+    assert(parse_ranges("bytes=0-0, 2000-3000 ,-1", 1000, starts, ends, 4) == 2);
+    assert(starts[0] == 0 && ends[0] == 0);
+    assert(starts[1] == 999 && ends[1] == 999);
+    assert(parse_ranges("bytes=1000-", 1000, starts, ends, 4) == 0);
+    assert(parse_ranges("bytes=-0", 1000, starts, ends, 4) == 0);
+    assert(parse_ranges("bytes=0-", 0, starts, ends, 4) == 0);
+
+    // Invalid or too many ranges.
+    assert(parse_ranges("bytes=5-1", 1000, starts, ends, 4) == -1);
+    assert(parse_ranges("bytes=-", 1000, starts, ends, 4) == -1);
+    assert(parse_ranges("bytes=a-b", 1000, starts, ends, 4) == -1);
+    assert(parse_ranges("items=0-1", 1000, starts, ends, 4) == -1);
+    assert(parse_ranges("bytes=0-1,", 1000, starts, ends, 4) == -1);
+    assert(parse_ranges("bytes=0-1,2-3,4-5,6-7,8-9", 1000, starts, ends, 4) == -1);
+    assert(parse_ranges("bytes=99999999999999999999-", 1000, starts, ends, 4) == -1);
+
+    printf("Done.\n");
+}
+
+// GET file at path with the request headers that aren't NULL.
+// Return response status, and the response ETag in etag.
+static int conditional_get(char *path, char *if_none_match, char *if_modified_since,
+                           char *range, char *if_range, char *etag) {
+    LKHttpRequest *req = lk_httprequest_new();
+    LKHttpResponse *resp = lk_httpresponse_new();
+    lk_string_assign(req->method, "GET");
+    if (if_none_match != NULL) {
+        lk_headertable_set(req->headers, "If-None-Match", if_none_match);
+    }
+    if (if_modified_since != NULL) {
+        lk_headertable_set(req->headers, "If-Modified-Since", if_modified_since);
+    }
+    if (range != NULL) {
+        lk_headertable_set(req->headers, "Range", range);
+    }
+    if (if_range != NULL) {
+        lk_headertable_set(req->headers, "If-Range", if_range);
+    }
+
+    int fd = open(path, O_RDONLY);
+    assert(fd != -1);
+    struct stat st;
+    fstat(fd, &st);
+    int z = serve_path_file(req, resp, fd, &st);
+    assert(z == 0);
+    int status = (resp->status == 0) ? 200 : resp->status;
+    if (status == 200) {
+        assert(resp->body->bytes_len == 10);
+    }
+    strcpy(etag, lk_headertable_get(resp->headers, "ETag"));
+
+    lk_httprequest_free(req);
+    lk_httpresponse_free(resp);
+    return status;
+}
+
+void lkconditional_test() {
+    printf("Running conditional request tests... ");
+
+    // If-None-Match uses weak comparison.
+    char *etag = "\"1a-a-2ebb7da1\"";
+    assert(etag_list_match("*", etag));
+    assert(etag_list_match("\"1a-a-2ebb7da1\"", etag));
+    assert(etag_list_match("W/\"1a-a-2ebb7da1\"", etag));
+    assert(etag_list_match("\"x\", W/\"1a-a-2ebb7da1\"", etag));
+    assert(etag_list_match("\"x\",\"1a-a-2ebb7da1\" , \"y\"", etag));
+    assert(!etag_list_match("\"x\", \"y\"", etag));
+    assert(!etag_list_match("\"1a-a-2ebb7da\"", etag));
+    assert(!etag_list_match("\"1a-a-2ebb7da1\"x", etag));
+    assert(!etag_list_match("", etag));
+
+    // If-Range uses strong comparison, or the exact Last-Modified date.
+    assert(if_range_match("\"1a-a-2ebb7da1\"", etag, 784111777));
+    assert(!if_range_match("W/\"1a-a-2ebb7da1\"", etag, 784111777));
+    assert(!if_range_match("\"x\"", etag, 784111777));
+    assert(if_range_match("Sun, 06 Nov 1994 08:49:37 GMT", etag, 784111777));
+    assert(!if_range_match("Sun, 06 Nov 1994 08:49:38 GMT", etag, 784111777));
+    assert(!if_range_match("garbage", etag, 784111777));
+
+    char path[] = "/tmp/lktest_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd != -1);
+    int z = write(fd, "0123456789", 10);
+    assert(z == 10);
+    struct timespec times[2] = {{784111777, 0}, {784111777, 0}};
+    futimens(fd, times);
+    close(fd);
+
+    char file_etag[64], weak_etag[70], list[160], s[64];
+    char *mtime = "Sun, 06 Nov 1994 08:49:37 GMT";
+    char *before = "Sun, 06 Nov 1994 08:49:36 GMT";
+    assert(conditional_get(path, NULL, NULL, NULL, NULL, file_etag) == 200);
+    snprintf(weak_etag, sizeof(weak_etag), "W/%s", file_etag);
+    snprintf(list, sizeof(list), "\"x\", %s", weak_etag);
+
+    assert(conditional_get(path, file_etag, NULL, NULL, NULL, s) == 304);
+    assert(conditional_get(path, weak_etag, NULL, NULL, NULL, s) == 304);
+    assert(conditional_get(path, list, NULL, NULL, NULL, s) == 304);
+    assert(conditional_get(path, "*", NULL, NULL, NULL, s) == 304);
+    assert(conditional_get(path, "\"x\"", NULL, NULL, NULL, s) == 200);
+
+    assert(conditional_get(path, NULL, mtime, NULL, NULL, s) == 304);
+    assert(conditional_get(path, NULL, before, NULL, NULL, s) == 200);
+    assert(conditional_get(path, NULL, "garbage", NULL, NULL, s) == 200);
+
+    // If-None-Match takes precedence over If-Modified-Since.
+    assert(conditional_get(path, "\"x\"", mtime, NULL, NULL, s) == 200);
+    assert(conditional_get(path, file_etag, before, NULL, NULL, s) == 304);
+
+    // Range is ignored unless If-Range matches.
+    assert(conditional_get(path, NULL, NULL, "bytes=0-3", NULL, s) == 206);
+    assert(conditional_get(path, NULL, NULL, "bytes=0-3", file_etag, s) == 206);
+    assert(conditional_get(path, NULL, NULL, "bytes=0-3", weak_etag, s) == 200);
+    assert(conditional_get(path, NULL, NULL, "bytes=0-3", mtime, s) == 206);
+    assert(conditional_get(path, NULL, NULL, "bytes=0-3", before, s) == 200);
+
+    unlink(path);
+    printf("Done.\n");
+}
+
+void lkhttprequestparser_test() {
+    printf("Running LKHttpRequestParser tests... ");
+
+    LKHttpRequestParser *parser = lk_httprequestparser_new();
+    LKHttpRequest *req = lk_httprequest_new();
+    LKBuffer *buf = lk_buffer_new(0);
+
+    // Head split across several reads, with body bytes after it.
+    char *chunks1[] = {"POST /upload?a=1 HT", "TP/1.1\r\nHost: local", "host\r\nContent-Length:  5000000000 \r\n",
+                       "X-Empty:\r\nX-No-Colon\r\n\r", "\nbody"};
+    size_t head_len = 0;
+    for (int i=0; i < 5; i++) {
+        lk_buffer_append_sz(buf, chunks1[i]);
+        head_len = lk_httprequestparser_parse_head(parser, buf->bytes, buf->bytes_len, req);
+        assert(parser->head_complete == (i == 4));
+    }
+    assert(head_len == buf->bytes_len - 4);
+    assert(!parser->body_complete);
+    assert(parser->error_status == 0);
+    assert(parser->content_length == 5000000000);
+    assert(parser->nheaders == 4);
+    assert(parser->method.off == 0 && parser->method.len == 4);
+    assert(parser->uri.off == 5 && parser->uri.len == 11);
+    assert(lk_string_sz_equal(req->method, "POST"));
+    assert(lk_string_sz_equal(req->uri, "/upload?a=1"));
+    assert(lk_string_sz_equal(req->version, "HTTP/1.1"));
+    assert(lk_string_sz_equal(req->path, "/upload"));
+    assert(lk_string_sz_equal(req->querystring, "a=1"));
+    assert(!strcmp(lk_headertable_get(req->headers, "Host"), "localhost"));
+    assert(!strcmp(lk_headertable_get(req->headers, "Content-Length"), "5000000000"));
+    assert(!strcmp(lk_headertable_get(req->headers, "X-Empty"), ""));
+    assert(!strcmp(lk_headertable_get(req->headers, "X-No-Colon"), ""));
+    lk_httprequest_free(req);
+
+    // Header spans beyond the inline spans.
+    req = lk_httprequest_new();
+    lk_httprequestparser_reset(parser);
+    lk_buffer_clear(buf);
+    lk_buffer_append_sz(buf, "GET / HTTP/1.0\n");
+    for (int i=0; i < LK_INLINE_HEADER_SPANS+8; i++) {
+        lk_buffer_append_sprintf(buf, "X-%d: %d\n", i, i);
+    }
+    lk_buffer_append_sz(buf, "\n");
+    head_len = lk_httprequestparser_parse_head(parser, buf->bytes, buf->bytes_len, req);
+    assert(head_len == buf->bytes_len);
+    assert(parser->body_complete);
+    assert(parser->nheaders == LK_INLINE_HEADER_SPANS+8);
+    assert(!strcmp(lk_headertable_get(req->headers, "X-39"), "39"));
+
+    char *badvals[] = {"-1", "12x", "", "99999999999999999999999"};
+    for (int i=0; i < 4; i++) {
+        lk_httprequestparser_reset(parser);
+        lk_buffer_clear(buf);
+        lk_buffer_append_sprintf(buf, "POST /upload HTTP/1.1\r\nContent-Length: %s\r\n", badvals[i]);
+        lk_httprequestparser_parse_head(parser, buf->bytes, buf->bytes_len, req);
+        assert(parser->error_status == 400);
+    }
+
+    // Only the h2 preface stops at the request line.
+    lk_httprequestparser_reset(parser);
+    lk_buffer_clear(buf);
+    lk_buffer_append_sz(buf, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n");
+    head_len = lk_httprequestparser_parse_head(parser, buf->bytes, buf->bytes_len, req);
+    assert(head_len == 0);
+    assert(parser->nlinesread == 1);
+    assert(parser->error_status == 0);
+    assert(!parser->head_complete);
+
+    char *h2lines[] = {"GET / HTTP/2.0\r\nHost: x\r\n\r\n", "GET / HTTP/3\r\n"};
+    for (int i=0; i < 2; i++) {
+        lk_httprequestparser_reset(parser);
+        lk_buffer_clear(buf);
+        lk_buffer_append_sz(buf, h2lines[i]);
+        lk_httprequestparser_parse_head(parser, buf->bytes, buf->bytes_len, req);
+        assert(parser->error_status == 505);
+    }
+
+    // Request line and head limits.
+    parser->max_request_line = 20;
+    parser->max_head_size = 60;
+    parser->max_headers = 2;
+
+    lk_httprequestparser_reset(parser);
+    lk_buffer_clear(buf);
+    lk_buffer_append_sz(buf, "GET /0123456789");
+    lk_httprequestparser_parse_head(parser, buf->bytes, buf->bytes_len, req);
+    assert(parser->error_status == 0);
+    lk_buffer_append_sz(buf, "0123456789");
+    lk_httprequestparser_parse_head(parser, buf->bytes, buf->bytes_len, req);
+    assert(parser->error_status == 400);
+
+    lk_httprequestparser_reset(parser);
+    assert(parser->max_headers == 2);
+    lk_buffer_clear(buf);
+    char *lines2[] = {"GET / HTTP/1.1\r\n", "A: 1\r\n", "B: 2\r\n", "C: 3\r\n"};
+    for (int i=0; i < 4; i++) {
+        lk_buffer_append_sz(buf, lines2[i]);
+        lk_httprequestparser_parse_head(parser, buf->bytes, buf->bytes_len, req);
+        assert(parser->error_status == (i < 3 ? 0 : 431));
+    }
+
+    lk_httprequestparser_reset(parser);
+    lk_buffer_clear(buf);
+    char *lines3[] = {"GET / HTTP/1.1\r\n", "A: 012345678901234567890123456789\r\n", "B: 0123456789\r\n"};
+    for (int i=0; i < 3; i++) {
+        lk_buffer_append_sz(buf, lines3[i]);
+        lk_httprequestparser_parse_head(parser, buf->bytes, buf->bytes_len, req);
+        assert(parser->error_status == (i < 2 ? 0 : 431));
+    }
+
+    lk_buffer_free(buf);
+    lk_httprequest_free(req);
+    lk_httprequestparser_free(parser);
+
+    printf("Done.\n");
+}
+
+void lkhttpcgiparser_test() {
+    printf("Running LKHttpCgiParser tests... ");
+
+    LKHttpCgiParser *parser = lk_httpcgiparser_new();
+    LKHttpResponse *resp = lk_httpresponse_new();
+    LKBuffer *buf = lk_buffer_new(0);
+
+    // Head split across several reads, long lines aren't truncated.
+    LKBuffer *cookie = lk_buffer_new(0);
+    for (int i=0; i < 3000; i++) {
+        lk_buffer_append_sz(cookie, "c");
+    }
+    lk_buffer_append(cookie, "", 1);
+    char *chunks1[] = {"Content-Ty", "pe: text/html\r\nSet-Cookie: ", cookie->bytes, "\nX-Empty:\nNo colon\n\r", "\nbody\n"};
+    for (int i=0; i < 5; i++) {
+        lk_buffer_append_sz(buf, chunks1[i]);
+        int z = lk_httpcgiparser_parse(parser, buf, resp);
+        assert(z == (i == 4));
+    }
+    assert(parser->body_pos == buf->bytes_len - 5);
+    assert(!memcmp(buf->bytes + parser->body_pos, "body\n", 5));
+    assert(resp->status == 0);
+    assert(resp->headers->items_len == 3);
+    assert(!strcmp(lk_headertable_get_id(resp->headers, LK_HDR_CONTENT_TYPE), "text/html"));
+    assert(strlen(lk_headertable_get(resp->headers, "Set-Cookie")) == 3000);
+    assert(!strcmp(lk_headertable_get(resp->headers, "X-Empty"), ""));
+    lk_buffer_free(cookie);
+
+    // Each Set-Cookie line is kept and written to the head.
+    lk_httpcgiparser_reset(parser);
+    lk_httpresponse_free(resp);
+    resp = lk_httpresponse_new();
+    lk_buffer_clear(buf);
+    lk_buffer_append_sz(buf, "Set-Cookie: a=1; Path=/\nSet-Cookie: b=2\nContent-Type: text/html\n\n");
+    assert(lk_httpcgiparser_parse(parser, buf, resp));
+    assert(resp->headers->items_len == 3);
+    lk_httpresponse_finalize_head(resp, 0);
+    lk_buffer_append(resp->head, "", 1);
+    assert(strstr(resp->head->bytes, "\nSet-Cookie: a=1; Path=/\nSet-Cookie: b=2\n") != NULL);
+
+    // Status sets status line, Location without Status redirects.
+    char *heads[] = {
+        "Status: 404 Not Found\nContent-Type: text/plain\n\n",
+        "Location: /index.html\n\n",
+        "Location: /index.html\nStatus: 301 Moved Permanently\n\n",
+    };
+    int statuses[] = {404, 302, 301};
+    char *statustexts[] = {"Not Found", "Found", "Moved Permanently"};
+    for (int i=0; i < 3; i++) {
+        lk_httpcgiparser_reset(parser);
+        lk_httpresponse_free(resp);
+        resp = lk_httpresponse_new();
+        lk_buffer_clear(buf);
+        lk_buffer_append_sz(buf, heads[i]);
+        assert(lk_httpcgiparser_parse(parser, buf, resp));
+        assert(resp->status == statuses[i]);
+        assert(!strcmp(resp->statustext->s, statustexts[i]));
+        assert(lk_headertable_get_id(resp->headers, LK_HDR_STATUS) == NULL);
+    }
+
+    // Output without blank line is sent as is.
+    lk_httpcgiparser_reset(parser);
+    lk_httpresponse_free(resp);
+    resp = lk_httpresponse_new();
+    lk_buffer_clear(buf);
+    lk_buffer_append_sz(buf, "sh: 1: error: not found\nline 2");
+    assert(!lk_httpcgiparser_parse(parser, buf, resp));
+    lk_httpcgiparser_finish(parser, buf, resp);
+    assert(parser->head_complete);
+    assert(parser->body_pos == 0);
+    assert(!memcmp(buf->bytes, "sh: 1: error: not found\nline 2", buf->bytes_len));
+    assert(!strcmp(lk_headertable_get_id(resp->headers, LK_HDR_CONTENT_TYPE), "text/plain"));
+
+    // Last header line without newline.
+    lk_httpcgiparser_reset(parser);
+    lk_httpresponse_free(resp);
+    resp = lk_httpresponse_new();
+    lk_buffer_clear(buf);
+    lk_buffer_append_sz(buf, "Content-Type: text/html");
+    lk_httpcgiparser_finish(parser, buf, resp);
+    assert(parser->body_pos == buf->bytes_len);
+    assert(!strcmp(lk_headertable_get_id(resp->headers, LK_HDR_CONTENT_TYPE), "text/html"));
+
+    // Head limit.
+    lk_httpcgiparser_reset(parser);
+    lk_httpresponse_free(resp);
+    resp = lk_httpresponse_new();
+    lk_buffer_clear(buf);
+    parser->max_head_size = 10;
+    lk_buffer_append_sz(buf, "no head in this output");
+    assert(lk_httpcgiparser_parse(parser, buf, resp));
+    assert(parser->body_pos == 0);
+
+    lk_buffer_free(buf);
+    lk_httpresponse_free(resp);
+    lk_httpcgiparser_free(parser);
+    printf("Done.\n");
+}
+
+void lkhttpresponse_test() {
+    char s[32];
+    printf("Running LKHttpResponse tests... ");
+
+    assert(lk_utoa(0, s) == 1 && !memcmp(s, "0", 1));
+    assert(lk_utoa(1234567, s) == 7 && !memcmp(s, "1234567", 7));
+    assert(lk_utoa(18446744073709551615UL, s) == 20 && !memcmp(s, "18446744073709551615", 20));
+
+    time_t t = 784111777;
+    lk_httpresponse_update_date(t);
+
+    LKHttpResponse *resp = lk_httpresponse_new();
+    lk_httpresponse_add_header(resp, "Content-Type", "text/html");
+    lk_httpresponse_add_header(resp, "Content-Length", "999");
+    lk_buffer_append_sz(resp->body, "<p>hello</p>");
+    lk_httpresponse_finalize(resp);
+    char *expected = "HTTP/1.0 200 OK\n"
+                     "Date: Sun, 06 Nov 1994 08:49:37 GMT\n"
+                     "Server: " LK_SERVER_NAME "\n"
+                     "Content-Length: 12\n"
+                     "Content-Type: text/html\n"
+                     "\r\n";
+    assert(resp->head->bytes_len == strlen(expected));
+    assert(!memcmp(resp->head->bytes, expected, strlen(expected)));
+
+    // Nonstandard reason phrase, streamed body, headers set by caller.
+    resp->status = 404;
+    lk_string_assign(resp->statustext, "File not found '/a'");
+    lk_string_assign(resp->version, "HTTP/1.1");
+    lk_httpresponse_add_header(resp, "server", "cgi");
+    lk_httpresponse_add_header(resp, "Date", "today");
+    lk_httpresponse_finalize_head(resp, -1);
+    expected = "HTTP/1.1 404 File not found '/a'\n"
+               "Content-Type: text/html\n"
+               "server: cgi\n"
+               "Date: today\n"
+               "\r\n";
+    assert(resp->head->bytes_len == strlen(expected));
+    assert(!memcmp(resp->head->bytes, expected, strlen(expected)));
+
+    lk_httpresponse_free(resp);
+
+    // Pre-rendered page is shared, each response has its own write cursor.
+    LKStatusPage *page = lk_statuspage_new(404, "text/html", "<h1>404</h1>", 12);
+    expected = "HTTP/1.0 404 Not Found\n"
+               "Server: " LK_SERVER_NAME "\n"
+               "Content-Length: 12\n"
+               "Content-Type: text/html\n";
+    assert(page->head->bytes_len == strlen(expected));
+    assert(!memcmp(page->head->bytes, expected, strlen(expected)));
+
+    LKHttpResponse *resp1 = lk_httpresponse_new();
+    LKHttpResponse *resp2 = lk_httpresponse_new();
+    lk_httpresponse_set_page(resp1, page);
+    lk_httpresponse_set_page(resp2, page);
+    lk_httpresponse_finalize(resp1);
+    lk_httpresponse_finalize(resp2);
+    assert(resp1->status == 404);
+    expected = "HTTP/1.0 404 Not Found\n"
+               "Server: " LK_SERVER_NAME "\n"
+               "Content-Length: 12\n"
+               "Content-Type: text/html\n"
+               "Date: Sun, 06 Nov 1994 08:49:37 GMT\n"
+               "\r\n";
+    assert(resp1->head->bytes_len == strlen(expected));
+    assert(!memcmp(resp1->head->bytes, expected, strlen(expected)));
+    assert(resp1->page_body.bytes == page->body->bytes);
+    assert(resp1->page_body.bytes_len == 12);
+    resp1->page_body.bytes_cur = 5;
+    assert(resp2->page_body.bytes_cur == 0);
+    assert(page->body->bytes_cur == 0);
+    lk_httpresponse_free(resp1);
+    lk_httpresponse_free(resp2);
+    lk_statuspage_free(page);
+
+    assert(lk_sv_equal(lk_http_reason(431), "Request Header Fields Too Large"));
+    assert(lk_sv_equal(lk_http_reason(505), "HTTP Version Not Supported"));
+    assert(lk_http_reason(299).len == 0);
+    assert(lk_http_reason(-1).len == 0);
+    assert(lk_http_reason(100000).len == 0);
+
+    lk_httpresponse_update_date(time(NULL));
+    printf("Done.\n");
+}
+
+// Redirect stdout to /dev/null while quiet is set, for the access log
+// lines of server functions.
+static void quiet_stdout(int quiet) {
+    static int saved_fd = -1;
+    fflush(stdout);
+    if (quiet) {
+        saved_fd = dup(1);
+        int fd = open("/dev/null", O_WRONLY);
+        dup2(fd, 1);
+        close(fd);
+    } else {
+        dup2(saved_fd, 1);
+        close(saved_fd);
+    }
+}
+
+// Return /events request ctx from localhost, connected to *peer.
+// auth is the Authorization header, NULL for none.
+static LKContext *sse_client(LKHttpServer *server, char *method, char *auth, int *peer) {
+    int sv[2];
+    int z = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    assert(z == 0);
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    LKContext *ctx = create_initial_context(sv[0], &sa);
+    init_request_context(ctx);
+    add_new_client_context(&server->ctxhead, ctx);
+    lk_string_assign(ctx->req->method, method);
+    lk_string_assign(ctx->req->path, "/events");
+    if (auth != NULL) {
+        lk_headertable_set(ctx->req->headers, "Authorization", auth);
+    }
+    *peer = sv[1];
+    return ctx;
+}
+
+static int buffer_equal(LKBuffer *buf, char *s) {
+    return buf->bytes_len == strlen(s) && !memcmp(buf->bytes, s, buf->bytes_len);
+}
+
+void lksse_test() {
+    printf("Running SSE tests... ");
+
+    // Each data line gets its own field, CRLF and LF line ends.
+    LKString *event = lk_string_new("update");
+    LKBuffer *data = lk_buffer_new(0);
+    lk_buffer_append_sz(data, "line 1\r\nline 2\n\nline 4\n");
+    LKRefBuffer *rb = encode_sse_event(7, event, data);
+    assert(buffer_equal(rb->buf, "id: 7\n"
+                                 "event: update\n"
+                                 "data: line 1\n"
+                                 "data: line 2\n"
+                                 "data: \n"
+                                 "data: line 4\n"
+                                 "\n"));
+    lk_refbuffer_unref(rb);
+
+    // Empty data is still an event, event name can't break lines.
+    lk_string_assign(event, "a\nb");
+    lk_buffer_clear(data);
+    rb = encode_sse_event(8, event, data);
+    assert(buffer_equal(rb->buf, "id: 8\ndata: \n\n"));
+    lk_refbuffer_unref(rb);
+    lk_string_free(event);
+    lk_buffer_free(data);
+
+    LKConfig *cfg = lk_config_new();
+    LKHostConfig *hc = lk_config_add_hostconfig(cfg, lk_hostconfig_new("localhost"));
+    lk_string_assign(hc->ssepath, "/events");
+    LKHttpServer *server = lk_httpserver_new(cfg);
+    server->epfd = epoll_create1(EPOLL_CLOEXEC);
+    assert(server->epfd != -1);
+    char buf[LK_BUFSIZE_MEDIUM];
+    int subfd, pubfd;
+    quiet_stdout(1);
+
+    // Subscriber is always read, and written while events are queued.
+    LKContext *sub = sse_client(server, "GET", NULL, &subfd);
+    serve_sse(server, sub, hc);
+    assert(sub->type == CTX_SSE_SUBSCRIBER);
+    assert(server->fdwatch[sub->clientfd] == 3);
+    write_sse(server, sub);
+    assert(server->fdwatch[sub->clientfd] == 1);
+    ssize_t z = read(subfd, buf, sizeof(buf)-1);
+    assert(z > 0);
+    buf[z] = '\0';
+    assert(!strncmp(buf, "HTTP/1.0 200 OK\n", 16));
+    assert(strstr(buf, "Content-Type: text/event-stream\n") != NULL);
+
+    // Publishing needs the ssesecret token, localhost isn't enough.
+    // No ssesecret disables publishing.
+    char *denied[] = {"Bearer ", NULL, "Bearer", "Bearer s3cret", "Bearer s3creT!", "Basic czNjcmV0IQ=="};
+    for (int i=0; i < 6; i++) {
+        if (i == 1) {
+            lk_string_assign(hc->ssesecret, "s3cret!");
+        }
+        LKContext *pub = sse_client(server, "POST", denied[i], &pubfd);
+        lk_buffer_append_sz(pub->req->body, "hello");
+        serve_sse(server, pub, hc);
+        assert(pub->resp->status == 403);
+        terminate_client_session(server, pub);
+        close(pubfd);
+    }
+    assert(server->sse_lastid == 0);
+    assert(sub->sse_queue->items_len == 0);
+
+    LKContext *pub = sse_client(server, "POST", "Bearer s3cret!", &pubfd);
+    lk_string_assign(pub->req->querystring, "event=news");
+    lk_buffer_append_sz(pub->req->body, "hello");
+    serve_sse(server, pub, hc);
+    assert(pub->resp->status == 200);
+    assert(buffer_equal(pub->resp->body, "Event 1 sent to 1 subscribers.\n"));
+    terminate_client_session(server, pub);
+    close(pubfd);
+    assert(server->fdwatch[sub->clientfd] == 3);
+    write_sse(server, sub);
+    z = read(subfd, buf, sizeof(buf));
+    assert(z == 31 && !memcmp(buf, "id: 1\nevent: news\ndata: hello\n\n", 31));
+
+    // Subscriber is dropped once SSE_MAX_QUEUE (64) events are unsent.
+    for (int i=0; i <= 64; i++) {
+        pub = sse_client(server, "POST", "Bearer s3cret!", &pubfd);
+        serve_sse(server, pub, hc);
+        int nsubscribers = (i < 64) ? 1 : 0;
+        snprintf(buf, sizeof(buf), "Event %d sent to %d subscribers.\n", i+2, nsubscribers);
+        assert(buffer_equal(pub->resp->body, buf));
+        terminate_client_session(server, pub);
+        close(pubfd);
+    }
+    assert(server->ctxhead == NULL);
+    assert(read(subfd, buf, sizeof(buf)) == 0);
+    close(subfd);
+
+    // Subscriber is disconnected as soon as the client closes.
+    sub = sse_client(server, "GET", NULL, &subfd);
+    serve_sse(server, sub, hc);
+    close(subfd);
+    read_sse(server, sub);
+    assert(server->ctxhead == NULL);
+
+    quiet_stdout(0);
+    lk_httpserver_free(server);
+    printf("Done.\n");
+}
+
+// Send request from a new client and read it, return the client ctx.
+static LKContext *read_client_request(LKHttpServer *server, char *request, int *peer) {
+    int sv[2];
+    int z = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    assert(z == 0);
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    LKContext *ctx = create_initial_context(sv[0], &sa);
+    add_new_client_context(&server->ctxhead, ctx);
+    z = write(sv[1], request, strlen(request));
+    assert(z == strlen(request));
+    read_first_bytes(server, ctx);
+    *peer = sv[1];
+    return ctx;
+}
+
+void lkh2cupgrade_test() {
+    printf("Running h2c upgrade tests... ");
+
+    char dir[] = "/tmp/lktestXXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/cgi-bin", dir);
+    assert(mkdir(path, 0700) == 0);
+    snprintf(path, sizeof(path), "%s/index.html", dir);
+    int fd = open(path, O_WRONLY | O_CREAT, 0600);
+    assert(fd != -1);
+    close(fd);
+
+    LKConfig *cfg = lk_config_new();
+    LKHostConfig *hc = lk_config_add_hostconfig(cfg, lk_hostconfig_new("localhost"));
+    lk_string_assign(hc->homedir, dir);
+    lk_string_assign(hc->cgidir, "cgi-bin");
+    lk_string_assign(hc->ssepath, "/events");
+    LKHostConfig *proxy_hc = lk_config_add_hostconfig(cfg, lk_hostconfig_new("proxy.local"));
+    lk_string_assign(proxy_hc->proxyhost, "localhost:8001");
+    lk_config_finalize(cfg);
+    LKHttpServer *server = lk_httpserver_new(cfg);
+    server->epfd = epoll_create1(EPOLL_CLOEXEC);
+    assert(server->epfd != -1);
+    quiet_stdout(1);
+
+    char *upgrade = "Connection: Upgrade, HTTP2-Settings\r\n"
+                    "Upgrade: h2c\r\n"
+                    "HTTP2-Settings: AAMAAABkAAQAAP__\r\n"
+                    "\r\n";
+    char request[LK_BUFSIZE_MEDIUM];
+    int peer;
+
+    // Files are served over h2.
+    snprintf(request, sizeof(request), "GET /index.html HTTP/1.1\r\nHost: localhost\r\n%s", upgrade);
+    LKContext *ctx = read_client_request(server, request, &peer);
+    assert(ctx->type == CTX_HTTP2);
+    terminate_client_session(server, ctx);
+    close(peer);
+
+    // CGI isn't, the upgrade is ignored and CGI answers over http/1.
+    snprintf(request, sizeof(request), "GET /cgi-bin/none.pl HTTP/1.1\r\nHost: localhost\r\n%s", upgrade);
+    ctx = read_client_request(server, request, &peer);
+    assert(ctx->type == CTX_WRITE_RESP);
+    assert(ctx->h2 == NULL);
+    assert(ctx->resp->status == 404);
+    assert(lk_string_sz_equal(ctx->req->path, "/cgi-bin/none.pl"));
+    terminate_client_session(server, ctx);
+    close(peer);
+
+    LKHttpRequest *req = lk_httprequest_new();
+    lk_headertable_set(req->headers, "Host", "localhost");
+    lk_string_assign(req->path, "/index.html");
+    assert(is_file_request(server, req));
+    lk_string_assign(req->path, "/events");
+    assert(!is_file_request(server, req));
+    lk_string_assign(req->path, "/cgi-bin/a.pl");
+    assert(!is_file_request(server, req));
+    lk_headertable_set(req->headers, "Host", "proxy.local");
+    lk_string_assign(req->path, "/index.html");
+    assert(!is_file_request(server, req));
+    lk_httprequest_free(req);
+
+    quiet_stdout(0);
+    lk_httpserver_free(server);
+    snprintf(path, sizeof(path), "%s/index.html", dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/cgi-bin", dir);
+    rmdir(path);
+    rmdir(dir);
+    printf("Done.\n");
+}
+
+void lkscan_test() {
+    printf("Running lk_scan tests... ");
+
+    // Every kernel must match the scalar results at all lengths and
+    // alignments, including matches in the unrolled tail.
+    char *impls[] = {"scalar", "sse2", "avx2"};
+    char *default_impl = lk_scan_impl();
+    char buf[160];
+    for (int k=0; k < 3; k++) {
+        if (lk_scan_set_impl(impls[k]) == -1) {
+            continue;
+        }
+        assert(!strcmp(lk_scan_impl(), impls[k]));
+        for (int off=0; off < 8; off++) {
+            for (int len=0; len < 140; len++) {
+                memset(buf, 'a', sizeof(buf));
+                char *p = buf + off;
+                assert(lk_scan_char(p, len, ':') == NULL);
+                for (int pos=0; pos < len; pos += 7) {
+                    memset(buf, 'a', sizeof(buf));
+                    p[len] = ':';  // past len, must not be found
+                    p[pos] = ':';
+                    assert(lk_scan_char(p, len, ':') == p+pos);
+                    p[pos] = '\t';
+                    assert(lk_scan_ws(p, len) == p+pos);
+                    assert(lk_scan_char(p, len, ':') == NULL);
+                    p[pos] = '\n';
+                    if (pos+1 < len) {
+                        p[pos+1] = '\r';
+                    }
+                    assert(lk_scan_eol(p, len) == p+pos);
+                    assert(lk_scan2(p, len, 'x', '\r') == (pos+1 < len ? p+pos+1 : NULL));
+                }
+            }
+        }
+    }
+    lk_scan_set_impl(default_impl);
+
+    char line[8];
+    LKBuffer *lb = lk_buffer_new(0);
+    lk_buffer_append_sz(lb, "ab\ncdefghijkl\n\nz");
+    assert(lk_buffer_readline(lb, line, sizeof(line)) == 3 && !strcmp(line, "ab\n"));
+    assert(lk_buffer_readline(lb, line, sizeof(line)) == 7 && !strcmp(line, "cdefghi"));
+    assert(lk_buffer_readline(lb, line, sizeof(line)) == 4 && !strcmp(line, "jkl\n"));
+    assert(lk_buffer_readline(lb, line, sizeof(line)) == 1 && !strcmp(line, "\n"));
+    assert(lk_buffer_readline(lb, line, sizeof(line)) == 1 && !strcmp(line, "z"));
+    assert(lk_buffer_readline(lb, line, sizeof(line)) == 0 && !strcmp(line, ""));
+    lk_buffer_free(lb);
+
+    printf("Done.\n");
+}
+
+void lkpath_test() {
+    printf("Running path tests... ");
+
+    char *decode_tests[][2] = {
+        {"/a%20b", "/a b"},
+        {"/%2e%2E/x", "/../x"},
+        {"/a%2Fb", "/a/b"},
+        {"/plain", "/plain"},
+        {"", ""},
+    };
+    for (int i=0; i < sizeof(decode_tests) / sizeof(decode_tests[0]); i++) {
+        char buf[32];
+        strcpy(buf, decode_tests[i][0]);
+        ssize_t len = lk_percent_decode(buf, strlen(buf));
+        assert(len == strlen(decode_tests[i][1]));
+        assert(!memcmp(buf, decode_tests[i][1], len));
+    }
+    char *bad_escapes[] = {"/a%", "/a%2", "/a%zz", "/a%00b", "/%g1"};
+    for (int i=0; i < sizeof(bad_escapes) / sizeof(bad_escapes[0]); i++) {
+        char buf[32];
+        strcpy(buf, bad_escapes[i]);
+        assert(lk_percent_decode(buf, strlen(buf)) == -1);
+    }
+
+    char *normalize_tests[][2] = {
+        {"/", ""},
+        {"/index.html", "/index.html"},
+        {"/a/b/", "/a/b"},
+        {"//a///b", "/a/b"},
+        {"/a/./b/.", "/a/b"},
+        {"/a/b/../c", "/a/c"},
+        {"/a/b/../../c//d/", "/c/d"},
+        {"/../../etc/passwd", "/etc/passwd"},
+        {"/a/..", ""},
+        {"/..a/b..", "/..a/b.."},
+        {"/.hidden", "/.hidden"},
+        {"*", "*"},
+        {"", ""},
+    };
+    for (int i=0; i < sizeof(normalize_tests) / sizeof(normalize_tests[0]); i++) {
+        char buf[32];
+        strcpy(buf, normalize_tests[i][0]);
+        size_t len = lk_normalize_path(buf, strlen(buf));
+        assert(len == strlen(normalize_tests[i][1]));
+        assert(!memcmp(buf, normalize_tests[i][1], len));
+    }
+
+    // parse_uri() decodes and normalizes path, not querystring.
+    LKString *uri = lk_string_new("/blog/%2e%2e/../docs/my%20file.txt?q=a%20b");
+    LKString *path = lk_string_new("");
+    LKString *filename = lk_string_new("");
+    LKString *qs = lk_string_new("");
+    assert(parse_uri(uri, path, filename, qs) == 0);
+    assert(lk_string_sz_equal(path, "/docs/my file.txt"));
+    assert(lk_string_sz_equal(filename, "my file.txt"));
+    assert(lk_string_sz_equal(qs, "q=a%20b"));
+    lk_string_assign(uri, "/a%00.html");
+    assert(parse_uri(uri, path, filename, qs) == -1);
+
+    // Only "/path" targets, ".." can't be left at the start.
+    char *bad_uris[] = {"../../etc/passwd", "%2e%2e/etc/passwd", "index.html", "*", "", "?a=1"};
+    for (int i=0; i < sizeof(bad_uris) / sizeof(bad_uris[0]); i++) {
+        lk_string_assign(uri, bad_uris[i]);
+        assert(parse_uri(uri, path, filename, qs) == -1);
+        assert(lk_string_sz_equal(path, ""));
+    }
+    lk_string_assign(uri, "/%2e%2e/%2e%2e/etc/passwd");
+    assert(parse_uri(uri, path, filename, qs) == 0);
+    assert(lk_string_sz_equal(path, "/etc/passwd"));
+    lk_string_free(uri);
+    lk_string_free(path);
+    lk_string_free(filename);
+    lk_string_free(qs);
+
+    // Files beneath dir open, symlinks out of dir don't.
+    char dir[] = "/tmp/lktestXXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    char p[256];
+    snprintf(p, sizeof(p), "%s/www", dir);
+    assert(mkdir(p, 0700) == 0);
+    snprintf(p, sizeof(p), "%s/www/index.html", dir);
+    int fd = open(p, O_WRONLY | O_CREAT, 0600);
+    assert(fd != -1);
+    close(fd);
+    snprintf(p, sizeof(p), "%s/secret", dir);
+    fd = open(p, O_WRONLY | O_CREAT, 0600);
+    assert(fd != -1);
+    close(fd);
+    snprintf(p, sizeof(p), "%s/www/sub", dir);
+    assert(mkdir(p, 0700) == 0);
+    snprintf(p, sizeof(p), "%s/www/sub/page.html", dir);
+    fd = open(p, O_WRONLY | O_CREAT, 0600);
+    assert(fd != -1);
+    close(fd);
+    snprintf(p, sizeof(p), "%s/www/escape", dir);
+    assert(symlink("../secret", p) == 0);
+    snprintf(p, sizeof(p), "%s/www/abs", dir);
+    assert(symlink("/etc/passwd", p) == 0);
+    snprintf(p, sizeof(p), "%s/www/inside", dir);
+    assert(symlink("index.html", p) == 0);
+
+    snprintf(p, sizeof(p), "%s/www", dir);
+    int dirfd = open(p, O_PATH | O_DIRECTORY);
+    assert(dirfd != -1);
+    char *ok_paths[] = {"/index.html", "index.html", "/inside", "/"};
+    for (int i=0; i < sizeof(ok_paths) / sizeof(ok_paths[0]); i++) {
+        fd = lk_open_beneath(dirfd, ok_paths[i], O_RDONLY);
+        assert(fd != -1);
+        close(fd);
+    }
+    char *bad_paths[] = {"/escape", "/abs", "/../secret", "/nofile"};
+    for (int i=0; i < sizeof(bad_paths) / sizeof(bad_paths[0]); i++) {
+        fd = lk_open_beneath(dirfd, bad_paths[i], O_RDONLY);
+        assert(fd == -1);
+    }
+
+    // Fallback without openat2() fails on ".." and any symlink.
+    char *nofollow_ok[] = {"/index.html", "index.html", "/", "/sub/page.html"};
+    for (int i=0; i < sizeof(nofollow_ok) / sizeof(nofollow_ok[0]); i++) {
+        fd = lk_open_beneath_nofollow(dirfd, nofollow_ok[i], O_RDONLY);
+        assert(fd != -1);
+        close(fd);
+    }
+    char *nofollow_bad[] = {"/escape", "/abs", "/inside", "/../secret", "../secret",
+                            "/index.html/..", "/nofile"};
+    for (int i=0; i < sizeof(nofollow_bad) / sizeof(nofollow_bad[0]); i++) {
+        fd = lk_open_beneath_nofollow(dirfd, nofollow_bad[i], O_RDONLY);
+        assert(fd == -1);
+    }
+    close(dirfd);
+
+    char *rm_paths[] = {"www/index.html", "www/sub/page.html", "www/escape", "www/abs", "www/inside", "secret"};
+    for (int i=0; i < sizeof(rm_paths) / sizeof(rm_paths[0]); i++) {
+        snprintf(p, sizeof(p), "%s/%s", dir, rm_paths[i]);
+        unlink(p);
+    }
+    snprintf(p, sizeof(p), "%s/www/sub", dir);
+    rmdir(p);
+    snprintf(p, sizeof(p), "%s/www", dir);
+    rmdir(p);
+    rmdir(dir);
+
+    printf("Done.\n");
+}
+
+#ifdef LKTLS
+// Write self-signed cert for cn and its key to one PEM file.
+static void write_test_cert(char *path, char *cn) {
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    assert(key != NULL);
+    X509 *x = X509_new();
+    ASN1_INTEGER_set(X509_get_serialNumber(x), 1);
+    X509_gmtime_adj(X509_getm_notBefore(x), 0);
+    X509_gmtime_adj(X509_getm_notAfter(x), 3600);
+    X509_set_pubkey(x, key);
+    X509_NAME *name = X509_get_subject_name(x);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (unsigned char *) cn, -1, -1, 0);
+    X509_set_issuer_name(x, name);
+    assert(X509_sign(x, key, EVP_sha256()) > 0);
+
+    FILE *f = fopen(path, "w");
+    assert(f != NULL);
+    PEM_write_X509(f, x);
+    PEM_write_PrivateKey(f, key, NULL, NULL, 0, NULL, NULL);
+    fclose(f);
+    X509_free(x);
+    EVP_PKEY_free(key);
+}
+
+// Handshake client over a socketpair with a server side LKTlsConn.
+// Returns client SSL, *ptc is the server side.
+static SSL *tls_client_connect(SSL_CTX *srvctx, SSL_CTX *cltctx, char *servername,
+                               SSL_SESSION *sess, LKTlsConn **ptc) {
+    int sv[2];
+    int z = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    assert(z == 0);
+    lk_set_sock_nonblocking(sv[0]);
+    lk_set_sock_nonblocking(sv[1]);
+
+    LKTlsConn *tc = lk_tlsconn_new(srvctx, sv[0]);
+    assert(tc != NULL);
+    SSL *ssl = SSL_new(cltctx);
+    SSL_set_fd(ssl, sv[1]);
+    if (servername) {
+        SSL_set_tlsext_host_name(ssl, servername);
+    }
+    if (sess) {
+        SSL_set_session(ssl, sess);
+    }
+    int client_done = 0;
+    for (int i=0; i < 20 && !(client_done && tc->handshake_done); i++) {
+        if (!client_done) {
+            client_done = SSL_connect(ssl) == 1;
+        }
+        if (!tc->handshake_done) {
+            assert(lk_tlsconn_handshake(tc) != Z_ERR);
+        }
+    }
+    assert(client_done && tc->handshake_done);
+    *ptc = tc;
+    return ssl;
+}
+
+// Return subject CN of the cert the server sent.
+static void tls_peer_cn(SSL *ssl, char *cn, size_t cn_size) {
+    X509 *x = SSL_get1_peer_certificate(ssl);
+    assert(x != NULL);
+    X509_NAME_get_text_by_NID(X509_get_subject_name(x), NID_commonName, cn, cn_size);
+    X509_free(x);
+}
+
+static void tls_client_close(SSL *ssl, LKTlsConn *tc) {
+    close(SSL_get_fd(ssl));
+    SSL_free(ssl);
+    close(tc->fd);
+    lk_tlsconn_free(tc);
+}
+
+void lktls_test() {
+    printf("Running TLS tests... ");
+
+    char dir[] = "/tmp/lktestXXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    char defaultpem[PATH_MAX], bpem[PATH_MAX];
+    snprintf(defaultpem, sizeof(defaultpem), "%s/default.pem", dir);
+    snprintf(bpem, sizeof(bpem), "%s/b.pem", dir);
+    write_test_cert(defaultpem, "default");
+    write_test_cert(bpem, "b.test");
+
+    // Hostconfigs without tls_cert have no context, '*' is the default.
+    LKConfig *cfg = lk_config_new();
+    LKHostConfig *hca = lk_config_add_hostconfig(cfg, lk_hostconfig_new("a.test"));
+    LKHostConfig *hcb = lk_config_add_hostconfig(cfg, lk_hostconfig_new("b.test"));
+    lk_string_assign(hcb->tls_cert, bpem);
+    assert(lk_tls_init(cfg) == 0);
+    assert(cfg->tls_ctx == hcb->tls_ctx);
+    LKHostConfig *hcdefault = lk_config_add_hostconfig(cfg, lk_hostconfig_new("*"));
+    lk_string_assign(hcdefault->tls_cert, defaultpem);
+    lk_string_assign(hcdefault->tls_key, defaultpem);
+    assert(lk_tls_init(cfg) == 0);
+    assert(hca->tls_ctx == NULL);
+    assert(cfg->tls_ctx == hcdefault->tls_ctx);
+
+    LKHostConfig *hcbad = lk_hostconfig_new("bad.test");
+    lk_string_assign(hcbad->tls_cert, dir);
+    LKConfig *badcfg = lk_config_new();
+    lk_config_add_hostconfig(badcfg, hcbad);
+    int errfd = dup(2);
+    int nullfd = open("/dev/null", O_WRONLY);
+    dup2(nullfd, 2);
+    int z = lk_tls_init(badcfg);
+    dup2(errfd, 2);
+    close(errfd);
+    close(nullfd);
+    assert(z == -1);
+    lk_config_free(badcfg);
+
+    SSL_CTX *cltctx = SSL_CTX_new(TLS_client_method());
+    assert(cltctx != NULL);
+
+    // SNI picks the hostconfig cert, other names get the default.
+    LKTlsConn *tc;
+    char cn[64];
+    SSL *ssl = tls_client_connect(cfg->tls_ctx, cltctx, "b.test", NULL, &tc);
+    tls_peer_cn(ssl, cn, sizeof(cn));
+    assert(strcmp(cn, "b.test") == 0);
+    tls_client_close(ssl, tc);
+    ssl = tls_client_connect(cfg->tls_ctx, cltctx, "a.test", NULL, &tc);
+    tls_peer_cn(ssl, cn, sizeof(cn));
+    assert(strcmp(cn, "default") == 0);
+    tls_client_close(ssl, tc);
+
+    // Relay request and response through the plaintext socketpair.
+    ssl = tls_client_connect(cfg->tls_ctx, cltctx, "b.test", NULL, &tc);
+    int pv[2];
+    z = socketpair(AF_UNIX, SOCK_STREAM, 0, pv);
+    assert(z == 0);
+    lk_set_sock_nonblocking(pv[0]);
+    assert(lk_tlsconn_start_relay(tc, pv[0]) == 0);
+
+    char req[] = "GET / HTTP/1.1\r\nHost: b.test\r\n\r\n";
+    assert(SSL_write(ssl, req, strlen(req)) == strlen(req));
+    assert(lk_tlsconn_relay(tc) == Z_BLOCK);
+    assert(tc->fd_want == LK_TLS_WANT_READ);
+    assert(tc->plainfd_want == LK_TLS_WANT_READ);
+    char buf[256];
+    ssize_t n = recv(pv[1], buf, sizeof(buf), MSG_DONTWAIT);
+    assert(n == strlen(req) && memcmp(buf, req, n) == 0);
+
+    // Client close_notify is passed on as half-close.
+    SSL_shutdown(ssl);
+    assert(lk_tlsconn_relay(tc) == Z_BLOCK);
+    assert(tc->tls_eof);
+    assert(recv(pv[1], buf, sizeof(buf), MSG_DONTWAIT) == 0);
+
+    // Server response and close end the TLS session.
+    char resp[] = "HTTP/1.0 200 OK\r\n\r\nhello";
+    assert(send(pv[1], resp, strlen(resp), 0) == strlen(resp));
+    close(pv[1]);
+    assert(lk_tlsconn_relay(tc) == Z_EOF);
+    n = 0;
+    while (1) {
+        z = SSL_read(ssl, buf + n, sizeof(buf) - n);
+        if (z <= 0) {
+            break;
+        }
+        n += z;
+    }
+    assert(SSL_get_error(ssl, z) == SSL_ERROR_ZERO_RETURN);
+    assert(n == strlen(resp) && memcmp(buf, resp, n) == 0);
+
+    // Session is resumed, also after switching context on SNI.
+    SSL_SESSION *sess = SSL_get1_session(ssl);
+    assert(sess != NULL);
+    close(pv[0]);
+    tls_client_close(ssl, tc);
+    ssl = tls_client_connect(cfg->tls_ctx, cltctx, "b.test", sess, &tc);
+    assert(SSL_session_reused(ssl));
+    tls_client_close(ssl, tc);
+    SSL_SESSION_free(sess);
+
+    SSL_CTX_free(cltctx);
+    lk_config_free(cfg);
+    unlink(defaultpem);
+    unlink(bpem);
+    rmdir(dir);
+    printf("Done.\n");
+}
+#endif
@@ -0,0 +1,308 @@
+#ifdef LKTLS
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "lklib.h"
+#include "lknet.h"
+
+#define TLS_READ_SIZE 16384     // one full TLS record
+
+static int select_host_cert(SSL *ssl, int *alert, void *arg);
+static void print_tls_err(char *s);
+static int ssl_want(LKTlsConn *tc, int z);
+
+/*** TLS server contexts ***/
+
+// Create SSL_CTX for each hostconfig with tls_cert and set cfg->tls_ctx
+// to the one used before SNI is known: the '*' hostconfig's if it has a
+// cert, otherwise the first one.
+// Returns 0 for success, -1 on error.
+int lk_tls_init(LKConfig *cfg) {
+    for (int i=0; i < cfg->hostconfigs_len; i++) {
+        LKHostConfig *hc = cfg->hostconfigs[i];
+        if (hc->tls_cert->s_len == 0 || hc->tls_ctx != NULL) {
+            continue;
+        }
+        char *keyfile = hc->tls_key->s_len > 0 ? hc->tls_key->s : hc->tls_cert->s;
+        hc->tls_ctx = lk_tls_ctx_new(hc->tls_cert->s, keyfile);
+        if (hc->tls_ctx == NULL) {
+            fprintf(stderr, "Can't load tls_cert of hostname %s\n", hc->hostname->s);
+            return -1;
+        }
+        if (cfg->tls_ctx == NULL || lk_string_sz_equal(hc->hostname, "*")) {
+            cfg->tls_ctx = hc->tls_ctx;
+        }
+    }
+    if (cfg->tls_ctx == NULL) {
+        fprintf(stderr, "tls_port needs a hostname with tls_cert\n");
+        return -1;
+    }
+    SSL_CTX_set_tlsext_servername_callback(cfg->tls_ctx, select_host_cert);
+    SSL_CTX_set_tlsext_servername_arg(cfg->tls_ctx, cfg);
+    return 0;
+}
+
+// Return new server context with certificate chain and private key
+// from PEM files, or NULL on error.
+SSL_CTX *lk_tls_ctx_new(char *certfile, char *keyfile) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL) {
+        print_tls_err("SSL_CTX_new()");
+        return NULL;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    // Let the kernel encrypt when the tls module is loaded (kTLS).
+    // Clients closing without close_notify aren't errors for http.
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF |
+                             SSL_OP_NO_RENEGOTIATION);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    // Sessions are resumed from the server cache by session id, or from
+    // tickets (on by default). The session id context is the same for
+    // every host so that switching context on SNI keeps them valid.
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(ctx, (unsigned char *) "lkws", 4);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, certfile) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, keyfile, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        print_tls_err(certfile);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+// Servername (SNI) callback, switch to the cert of the matching hostconfig.
+// Names without their own cert keep the default one.
+static int select_host_cert(SSL *ssl, int *alert, void *arg) {
+    LKConfig *cfg = arg;
+    const char *servername = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    if (servername == NULL) {
+        return SSL_TLSEXT_ERR_OK;
+    }
+    LKHostConfig *hc = lk_config_find_hostconfig(cfg, (char *) servername);
+    if (hc != NULL && hc->tls_ctx != NULL && hc->tls_ctx != SSL_get_SSL_CTX(ssl)) {
+        SSL_set_SSL_CTX(ssl, hc->tls_ctx);
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+static void print_tls_err(char *s) {
+    fprintf(stderr, "%s: ", s);
+    ERR_print_errors_fp(stderr);
+}
+
+
+/*** LKTlsConn functions ***/
+
+// Return new TLS connection accepting the handshake on nonblocking fd,
+// or NULL on error.
+LKTlsConn *lk_tlsconn_new(SSL_CTX *ctx, int fd) {
+    SSL *ssl = SSL_new(ctx);
+    if (ssl == NULL) {
+        print_tls_err("SSL_new()");
+        return NULL;
+    }
+    if (SSL_set_fd(ssl, fd) != 1) {
+        print_tls_err("SSL_set_fd()");
+        SSL_free(ssl);
+        return NULL;
+    }
+    SSL_set_accept_state(ssl);
+
+    LKTlsConn *tc = lk_malloc(sizeof(LKTlsConn), "lk_tlsconn_new");
+    tc->ssl = ssl;
+    tc->fd = fd;
+    tc->plainfd = -1;
+    tc->inbuf = NULL;
+    tc->outbuf = NULL;
+    tc->handshake_done = 0;
+    tc->fd_want = LK_TLS_WANT_READ;
+    tc->plainfd_want = 0;
+    tc->tls_eof = 0;
+    tc->plain_eof = 0;
+    tc->plain_closed = 0;
+    return tc;
+}
+
+// Free TLS state, fd and plainfd are left open.
+void lk_tlsconn_free(LKTlsConn *tc) {
+    SSL_free(tc->ssl);
+    if (tc->inbuf) {
+        lk_bufpool_put(tc->inbuf);
+    }
+    if (tc->outbuf) {
+        lk_bufpool_put(tc->outbuf);
+    }
+    tc->ssl = NULL;
+    tc->inbuf = NULL;
+    tc->outbuf = NULL;
+    lk_free(tc);
+}
+
+// Set fd_want from the result z of an SSL call.
+// Returns Z_BLOCK when waiting for fd, Z_ERR for any other result.
+static int ssl_want(LKTlsConn *tc, int z) {
+    int err = SSL_get_error(tc->ssl, z);
+    if (err == SSL_ERROR_WANT_READ) {
+        tc->fd_want |= LK_TLS_WANT_READ;
+        return Z_BLOCK;
+    }
+    if (err == SSL_ERROR_WANT_WRITE) {
+        tc->fd_want |= LK_TLS_WANT_WRITE;
+        return Z_BLOCK;
+    }
+    return Z_ERR;
+}
+
+// Continue the server handshake.
+// Returns one of the following:
+//    0 (Z_EOF) for handshake done
+//   -1 (Z_ERR) for failed handshake
+//   -2 (Z_BLOCK) for waiting on fd_want events
+int lk_tlsconn_handshake(LKTlsConn *tc) {
+    ERR_clear_error();
+    tc->fd_want = 0;
+    int z = SSL_do_handshake(tc->ssl);
+    if (z == 1) {
+        tc->handshake_done = 1;
+        return Z_EOF;
+    }
+    return ssl_want(tc, z);
+}
+
+// Return whether the kernel took over encryption both ways (kTLS).
+// The client socket can then be read and written as plaintext.
+int lk_tlsconn_ktls(LKTlsConn *tc) {
+    return BIO_get_ktls_send(SSL_get_wbio(tc->ssl)) && BIO_get_ktls_recv(SSL_get_rbio(tc->ssl));
+}
+
+// Start relaying bytes between fd and nonblocking plainfd after handshake.
+// Returns 0 for success, -1 if out of memory.
+int lk_tlsconn_start_relay(LKTlsConn *tc, int plainfd) {
+    assert(tc->handshake_done);
+    tc->inbuf = lk_bufpool_get();
+    tc->outbuf = lk_bufpool_get();
+    if (tc->inbuf == NULL || tc->outbuf == NULL) {
+        return -1;
+    }
+    tc->plainfd = plainfd;
+    tc->fd_want = LK_TLS_WANT_READ;
+    tc->plainfd_want = LK_TLS_WANT_READ;
+    return 0;
+}
+
+// Move available bytes both ways, fd_want and plainfd_want are set to the
+// events to wait for next.
+// Returns one of the following:
+//    0 (Z_EOF) for server side done sending, close_notify sent
+//   -1 (Z_ERR) for error
+//   -2 (Z_BLOCK) for waiting on fd_want or plainfd_want events
+int lk_tlsconn_relay(LKTlsConn *tc) {
+    LKBuffer *inbuf = tc->inbuf;
+    LKBuffer *outbuf = tc->outbuf;
+    tc->fd_want = 0;
+    tc->plainfd_want = 0;
+
+    // Client to server: decrypt into inbuf and pass it on to plainfd.
+    while (1) {
+        if (inbuf->bytes_cur < inbuf->bytes_len && !tc->plain_closed) {
+            int z = lk_write_all_sock(tc->plainfd, inbuf);
+            if (z == Z_BLOCK) {
+                tc->plainfd_want |= LK_TLS_WANT_WRITE;
+                break;
+            }
+            // Server stopped reading after the request, drop the rest.
+            if (z == Z_ERR) {
+                tc->plain_closed = 1;
+            }
+        }
+        lk_buffer_clear(inbuf);
+        if (tc->tls_eof) {
+            break;
+        }
+
+        char *p = lk_buffer_reserve(inbuf, TLS_READ_SIZE);
+        if (p == NULL) {
+            return Z_ERR;
+        }
+        ERR_clear_error();
+        int z = SSL_read(tc->ssl, p, TLS_READ_SIZE);
+        if (z > 0) {
+            lk_buffer_commit(inbuf, z);
+            continue;
+        }
+        if (SSL_get_error(tc->ssl, z) == SSL_ERROR_ZERO_RETURN) {
+            // Pass on half-close, server sees EOF after the request.
+            tc->tls_eof = 1;
+            shutdown(tc->plainfd, SHUT_WR);
+            break;
+        }
+        if (ssl_want(tc, z) == Z_ERR) {
+            return Z_ERR;
+        }
+        break;
+    }
+
+    // Server to client: encrypt plainfd bytes from outbuf.
+    while (1) {
+        if (outbuf->bytes_cur < outbuf->bytes_len) {
+            ERR_clear_error();
+            int z = SSL_write(tc->ssl, outbuf->bytes + outbuf->bytes_cur,
+                              outbuf->bytes_len - outbuf->bytes_cur);
+            if (z > 0) {
+                outbuf->bytes_cur += z;
+                continue;
+            }
+            if (ssl_want(tc, z) == Z_ERR) {
+                return Z_ERR;
+            }
+            break;
+        }
+        if (tc->plain_eof) {
+            break;
+        }
+
+        lk_buffer_clear(outbuf);
+        char *p = lk_buffer_reserve(outbuf, TLS_READ_SIZE);
+        if (p == NULL) {
+            return Z_ERR;
+        }
+        ssize_t z = recv(tc->plainfd, p, TLS_READ_SIZE, MSG_DONTWAIT);
+        if (z > 0) {
+            lk_buffer_commit(outbuf, z);
+            continue;
+        }
+        if (z == -1 && errno == EINTR) {
+            continue;
+        }
+        if (z == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            tc->plainfd_want |= LK_TLS_WANT_READ;
+            break;
+        }
+        // EOF or the http ctx closed its end.
+        tc->plain_eof = 1;
+    }
+
+    // Response fully sent and server closed, end the TLS session.
+    if (tc->plain_eof && outbuf->bytes_cur == outbuf->bytes_len) {
+        ERR_clear_error();
+        SSL_shutdown(tc->ssl);
+        return Z_EOF;
+    }
+    return Z_BLOCK;
+}
+
+#endif
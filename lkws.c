@@ -7,6 +7,7 @@
 #include <assert.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -19,7 +20,9 @@
 #include "lknet.h"
 
 void handle_sigint(int sig);
+void handle_sigusr2(int sig);
 void handle_sigchld(int sig);
+void raise_fd_limit();
 int parse_args(int argc, char *argv[], LKConfig *cfg);
 void print_help();
 void print_sample_config();
@@ -46,9 +49,11 @@ int main(int argc, char *argv[]) {
     signal(SIGPIPE, SIG_IGN);           // Don't abort on SIGPIPE
     signal(SIGINT, handle_sigint);      // exit on CTRL-C
     signal(SIGCHLD, handle_sigchld);
-
+    signal(SIGUSR2, handle_sigusr2);    // print allocation snapshot
+    raise_fd_limit();
 
     lk_alloc_init();
+    lk_alloc_set_sample_rate(LK_ALLOC_SAMPLE_RATE);
     LKConfig *cfg = lk_config_new();
     z = parse_args(argc, argv, cfg);
     if (z == 1) {
@@ -70,6 +75,24 @@ int main(int argc, char *argv[]) {
     return 0;
 }
 
+// Each client connection holds at least one fd, so the number of open
+// connections is capped by the open files limit. Raise its soft limit
+// to the hard limit.
+void raise_fd_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+        lk_print_err("getrlimit()");
+        return;
+    }
+    if (rl.rlim_cur == rl.rlim_max) {
+        return;
+    }
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+        lk_print_err("setrlimit()");
+    }
+}
+
 void handle_sigint(int sig) {
     printf("SIGINT received\n");
     fflush(stdout);
@@ -79,6 +102,11 @@ void handle_sigint(int sig) {
     exit(0);
 }
 
+// Snapshot is printed from the server loop, not the handler.
+void handle_sigusr2(int sig) {
+    lk_alloc_request_snapshot();
+}
+
 void handle_sigchld(int sig) {
     int tmp_errno = errno;
     while (waitpid(-1, NULL, WNOHANG) > 0) {